@@ -0,0 +1,238 @@
+/*
+ * arena.c - Bump allocator for short lived objects
+ *
+ * Copyright (c) 2016-2020 Peter Eriksson <pen@lysator.liu.se>
+ *
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "arena.h"
+
+
+/* Alignment of the allocations */
+#define ARENA_ALIGN 16
+
+#define ARENA_ROUND(n) (((n) + ARENA_ALIGN-1) & ~(size_t) (ARENA_ALIGN-1))
+
+
+void
+arena_init(ARENA *ap,
+	   void *buf,
+	   size_t size)
+{
+    size_t skip;
+
+    
+    memset(ap, 0, sizeof(*ap));
+    if (!buf)
+	return;
+
+    /* The allocations are aligned relative to the block */
+    skip = -(uintptr_t) buf & (ARENA_ALIGN-1);
+    if (skip >= size)
+	return;
+    
+    ap->first = ap->base = (char *) buf + skip;
+    ap->first_size = ap->size = size - skip;
+}
+
+
+/* Start a new block with room for at least 'size' bytes */
+static int
+arena_grow(ARENA *ap,
+	   size_t size)
+{
+    ARENA_BLOCK *bp;
+    size_t bsize;
+
+
+    bsize = ARENA_ROUND(sizeof(ARENA_BLOCK)) + size;
+    if (bsize < ARENA_BLOCK_SIZE)
+	bsize = ARENA_BLOCK_SIZE;
+    
+    bp = malloc(bsize);
+    if (!bp)
+	return -1;
+
+    bp->next = ap->blocks;
+    bp->size = bsize;
+    ap->blocks = bp;
+    ap->mallocs++;
+    
+    ap->base = (char *) bp + ARENA_ROUND(sizeof(ARENA_BLOCK));
+    ap->size = bsize - ARENA_ROUND(sizeof(ARENA_BLOCK));
+    ap->used = 0;
+    ap->last = NULL;
+    return 0;
+}
+
+
+static void *
+arena_bump(ARENA *ap,
+	   size_t size)
+{
+    char *p;
+
+    
+    size = ARENA_ROUND(size ? size : 1);
+    if (size > ap->size - ap->used && arena_grow(ap, size) < 0)
+	return NULL;
+
+    p = ap->base + ap->used;
+    ap->used += size;
+    ap->last = p;
+    ap->allocs++;
+    ap->bytes += size;
+    return p;
+}
+
+
+void *
+arena_alloc(ARENA *ap,
+	    size_t size)
+{
+    if (!ap)
+	return malloc(size);
+
+    ap->heap++;
+    return arena_bump(ap, size);
+}
+
+
+/*
+ * Make 'p' (of 'osize' bytes, from this arena) 'size' bytes. The last
+ * allocation grows or shrinks in place if there is room, others are
+ * copied to grow and left as they are to shrink.
+ */
+void *
+arena_realloc(ARENA *ap,
+	      void *p,
+	      size_t osize,
+	      size_t size)
+{
+    char *np;
+    size_t nused;
+
+    
+    if (!ap)
+	return realloc(p, size);
+
+    if (!p)
+	return arena_alloc(ap, size);
+
+    ap->heap++;
+    if (p == ap->last)
+    {
+	nused = ((char *) p - ap->base) + ARENA_ROUND(size);
+	if (nused <= ap->size)
+	{
+	    if (nused > ap->used)
+		ap->bytes += nused - ap->used;
+	    ap->used = nused;
+	    return p;
+	}
+    }
+
+    if (size <= osize)
+	return p;
+    
+    np = arena_bump(ap, size);
+    if (!np)
+	return NULL;
+    
+    memcpy(np, p, osize < size ? osize : size);
+    return np;
+}
+
+
+/* Only without an arena, the memory in one is freed by arena_reset() */
+void
+arena_free(ARENA *ap,
+	   void *p)
+{
+    if (!ap)
+	free(p);
+}
+
+
+char *
+arena_strndup(ARENA *ap,
+	      const char *s,
+	      size_t len)
+{
+    char *p;
+
+    
+    p = arena_alloc(ap, len+1);
+    if (!p)
+	return NULL;
+
+    memcpy(p, s, len);
+    p[len] = '\0';
+    return p;
+}
+
+
+char *
+arena_strdup(ARENA *ap,
+	     const char *s)
+{
+    if (!s)
+	return NULL;
+    
+    return arena_strndup(ap, s, strlen(s));
+}
+
+
+/* Free everything allocated, and go back to the caller's block */
+void
+arena_reset(ARENA *ap)
+{
+    ARENA_BLOCK *bp;
+
+    
+    while ((bp = ap->blocks) != NULL)
+    {
+	ap->blocks = bp->next;
+	free(bp);
+    }
+
+    ap->base = ap->first;
+    ap->size = ap->first_size;
+    ap->used = 0;
+    ap->last = NULL;
+    ap->allocs = 0;
+    ap->bytes = 0;
+    ap->mallocs = 0;
+    ap->heap = 0;
+}
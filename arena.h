@@ -0,0 +1,107 @@
+/*
+ * arena.h - Bump allocator for short lived objects
+ *
+ * Copyright (c) 2016-2020 Peter Eriksson <pen@lysator.liu.se>
+ *
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+/*
+ * Allocations that all go away together: each is a bump of a pointer
+ * in the current block, nothing is freed until arena_reset(). The
+ * first block is given by the caller (such as a buffer on the stack),
+ * more are malloc()ed when it runs out and freed by the reset.
+ *
+ * The arena_*() functions also take a NULL arena, and then use
+ * malloc(), realloc() and free(), so code can be written once for
+ * both.
+ */
+typedef struct arena_block
+{
+    struct arena_block *next;
+    size_t size;
+} ARENA_BLOCK;
+
+
+typedef struct arena
+{
+    char *base;			/* Current block */
+    size_t size;
+    size_t used;
+    char *last;			/* Last allocation, may grow in place */
+    char *first;		/* The caller's block */
+    size_t first_size;
+    ARENA_BLOCK *blocks;	/* malloc()ed blocks, newest first */
+    unsigned long allocs;	/* Since the last reset */
+    unsigned long bytes;
+    unsigned long mallocs;
+    unsigned long heap;		/* malloc()/realloc() calls without the arena */
+} ARENA;
+
+
+/* Size of the blocks malloc()ed when the first is full */
+#define ARENA_BLOCK_SIZE 4096
+
+
+extern void
+arena_init(ARENA *ap,
+	   void *buf,
+	   size_t size);
+
+extern void *
+arena_alloc(ARENA *ap,
+	    size_t size);
+
+extern void *
+arena_realloc(ARENA *ap,
+	      void *p,
+	      size_t osize,
+	      size_t size);
+
+extern void
+arena_free(ARENA *ap,
+	   void *p);
+
+extern char *
+arena_strdup(ARENA *ap,
+	     const char *s);
+
+extern char *
+arena_strndup(ARENA *ap,
+	      const char *s,
+	      size_t len);
+
+extern void
+arena_reset(ARENA *ap);
+
+#endif
@@ -39,6 +39,7 @@
 #include "argv.h"
 #include "strmisc.h"
 #include "buffer.h"
+#include "arena.h"
 
 
 char *
@@ -60,13 +61,14 @@ argv_get(char **argv,
     return argv[i];
 }
 
+/* Arguments 'start' to 'stop' (0: the last) joined by spaces, from 'ap' */
 char *
-argv_getm(char **argv,
-	  int start,
-	  int stop)
+argv_getm_arena(ARENA *ap,
+		char **argv,
+		int start,
+		int stop)
 {
     BUFFER buf;
-    char *rp;
     int i;
 
 
@@ -79,7 +81,7 @@ argv_getm(char **argv,
     if (i < start)
 	return NULL;
     
-    buf_init(&buf);
+    buf_init_arena(&buf, ap);
     for (; argv[i] && (!stop || i <= stop); i++)
     {
 	if (i != start)
@@ -87,34 +89,45 @@ argv_getm(char **argv,
 	buf_puts(&buf, argv[i]);
     }
 
-    rp = s_dup(buf_getall(&buf));
-    buf_clear(&buf);
-    
-    return rp;
+    /* The buffer is kept NUL terminated. Give back what was not used */
+    if (!buf.buf)
+	return arena_strdup(ap, "");
+    if (ap)
+	arena_realloc(ap, buf.buf, buf.size+1, buf.len+1);
+    return buf.buf;
 }
 
 
-
 char *
-argv_strtok(const char *bp,
-	    char *(*escape_handler)(const char *escape, void *xtra),
-	    void *xtra)
+argv_getm(char **argv,
+	  int start,
+	  int stop)
+{
+    return argv_getm_arena(NULL, argv, start, stop);
+}
+
+
+/*
+ * The next token from *startp, which is moved past it. Strings from
+ * the escape handler are from 'ap' too, or else are free()d here.
+ */
+static char *
+argv_token(ARENA *ap,
+	   const char **startp,
+	   char *(*escape_handler)(const char *escape, void *xtra),
+	   void *xtra)
 {
-    static const char *start = NULL;
     const char *rp;
-    char *sp, *cp, *esc;
+    char *cp, *esc;
     int delim = 0, n;
     BUFFER buf;
     
     
-    if (bp)
-	start = bp;
-
-    if (!start)
+    if (!*startp)
 	return NULL;
 
-    buf_init(&buf);
-    rp = start;
+    buf_init_arena(&buf, ap);
+    rp = *startp;
 
 
     /* Skip leading whitespace */
@@ -195,21 +208,21 @@ argv_strtok(const char *bp,
 			++rp;
 			for (n = 0; rp[n] && rp[n] != '}'; ++n)
 			    ;
-			esc = s_ndup(rp, n);
+			esc = arena_strndup(ap, rp, n);
 			rp += n;
 		    }
 		    else
-			esc = s_ndup(rp, 1);
+			esc = arena_strndup(ap, rp, 1);
 			
 		    cp = escape_handler(esc, xtra);
 		    if (cp)
 		    {
 			for (n = 0; cp[n]; ++n)
 			    buf_putc(&buf, cp[n]);
-			free(cp);
+			arena_free(ap, cp);
 		    }
 		    
-		    free(esc);
+		    arena_free(ap, esc);
 		}
 	    }
 	    else
@@ -224,41 +237,71 @@ argv_strtok(const char *bp,
 	    ++rp;
     }
     
-    start = rp;
+    *startp = rp;
+
+    /* The buffer is kept NUL terminated. Give back what was not used */
+    if (!buf.buf)
+	return arena_strdup(ap, "");
+    if (ap)
+	arena_realloc(ap, buf.buf, buf.size+1, buf.len+1);
+    return buf.buf;
+}
+
+
+char *
+argv_strtok(const char *bp,
+	    char *(*escape_handler)(const char *escape, void *xtra),
+	    void *xtra)
+{
+    static const char *start = NULL;
 
-    sp = s_dup(buf_getall(&buf));
-    buf_clear(&buf);
+    
+    if (bp)
+	start = bp;
 
-    return sp;
+    return argv_token(NULL, &start, escape_handler, xtra);
 }
 
 
+/*
+ * Split 'command' into a NULL terminated vector, all of it from 'ap'
+ * (not for argv_destroy()). Safe to call from several threads.
+ */
 char **
-argv_create(const char *command,
-	    char *(*escape_handler)(const char *escape, void *xtra),
-	    void *xtra)
+argv_create_arena(ARENA *ap,
+		  const char *command,
+		  char *(*escape_handler)(const char *escape, void *xtra),
+		  void *xtra)
 {
-    char **argv, *cp;
+    char **argv, **nargv, *cp;
+    const char *start = command;
     int argc = 0, args = 32;
 
     
-    argv = malloc(sizeof(char *) * args);
+    argv = arena_alloc(ap, sizeof(char *) * args);
     if (!argv)
 	return NULL;
 
-    cp = argv_strtok(command, escape_handler, xtra);
+    cp = argv_token(ap, &start, escape_handler, xtra);
     while (cp)
     {
 	if (argc+1 >= args)
 	{
-	    argv = realloc(argv, sizeof(char *) * (args += 32));
-	    if (!argv)
+	    nargv = arena_realloc(ap, argv, sizeof(char *) * args, sizeof(char *) * (args + 32));
+	    if (!nargv)
+	    {
+		argv[argc] = NULL;
+		if (!ap)
+		    argv_destroy(argv);
 		return NULL;
+	    }
+	    argv = nargv;
+	    args += 32;
 	}
 	
 	argv[argc++] = cp;
 	
-	cp = argv_strtok(NULL, escape_handler, xtra);
+	cp = argv_token(ap, &start, escape_handler, xtra);
     }
 
     argv[argc] = NULL;
@@ -266,6 +309,15 @@ argv_create(const char *command,
 }
 
 
+char **
+argv_create(const char *command,
+	    char *(*escape_handler)(const char *escape, void *xtra),
+	    void *xtra)
+{
+    return argv_create_arena(NULL, command, escape_handler, xtra);
+}
+
+
 void
 argv_destroy(char **argv)
 {
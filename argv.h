@@ -34,6 +34,8 @@
 #ifndef ARGV_H
 #define ARGV_H 1
 
+struct arena;
+
 extern char *
 argv_get(char **argv,
 	 int idx);
@@ -43,6 +45,12 @@ argv_getm(char **argv,
 	  int start,
 	  int stop);
 
+extern char *
+argv_getm_arena(struct arena *ap,
+		char **argv,
+		int start,
+		int stop);
+
 extern char *
 argv_strtok(const char *bp,
 	    char *(*escape_handler)(const char *escape, void *xtra),
@@ -54,6 +62,13 @@ argv_create(const char *command,
 				    void *xtra),
 	    void *xtra);
 
+extern char **
+argv_create_arena(struct arena *ap,
+		  const char *command,
+		  char *(*escape_handler)(const char *escape,
+					  void *xtra),
+		  void *xtra);
+
 extern void
 argv_destroy(char **argv);
 
@@ -0,0 +1,283 @@
+/*
+ * atparse.c - Modem response and URC dispatcher
+ *
+ * Copyright (c) 2016-2020 Peter Eriksson <pen@lysator.liu.se>
+ *
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "atparse.h"
+
+
+#define AT_MAXSLOTS 1024
+
+
+typedef struct athandler
+{
+    char *prefix;
+    int len;
+    int flags;
+    ATFUN fun;
+    void *xp;
+} ATHANDLER;
+
+struct atparser
+{
+    ATHANDLER *hv;	/* Registered handlers */
+    int hc;
+    ATHANDLER **sv;	/* Hash slots, no collisions */
+    unsigned int mask;
+};
+
+
+static unsigned int
+at_hash(const char *s,
+	int len)
+{
+    unsigned int h = 2166136261U;
+
+    while (len-- > 0)
+	h = (h ^ (unsigned char) *s++) * 16777619U;
+    return h ^ (h >> 15);
+}
+
+
+/*
+ * Length of the prefix of a line: up to the ':' for "+XXX: ..." lines,
+ * the whole line otherwise ("OK", "RING", ">"...).
+ */
+static int
+at_prefix_len(const char *line)
+{
+    const char *cp;
+
+    if (*line == '+' && (cp = strchr(line, ':')) != NULL)
+	return cp - line;
+    return strlen(line);
+}
+
+
+/* Place all handlers in distinct slots, growing the table as needed */
+static int
+at_rehash(ATPARSER *ap,
+	  unsigned int size)
+{
+    ATHANDLER **sv;
+    unsigned int i, j;
+
+
+    for (; size <= AT_MAXSLOTS; size *= 2)
+    {
+	sv = calloc(size, sizeof(*sv));
+	if (!sv)
+	    return -1;
+
+	for (i = 0; i < (unsigned int) ap->hc; i++)
+	{
+	    j = at_hash(ap->hv[i].prefix, ap->hv[i].len) & (size-1);
+	    if (sv[j])
+		break;
+	    sv[j] = &ap->hv[i];
+	}
+
+	if (i == (unsigned int) ap->hc)
+	{
+	    free(ap->sv);
+	    ap->sv = sv;
+	    ap->mask = size-1;
+	    return 0;
+	}
+	
+	free(sv);
+    }
+
+    errno = ENOSPC;
+    return -1;
+}
+
+
+ATPARSER *
+at_create(void)
+{
+    ATPARSER *ap;
+
+
+    ap = calloc(1, sizeof(*ap));
+    if (!ap)
+	return NULL;
+
+    if (at_rehash(ap, 16) < 0)
+    {
+	free(ap);
+	return NULL;
+    }
+    
+    return ap;
+}
+
+
+void
+at_destroy(ATPARSER *ap)
+{
+    int i;
+
+    if (!ap)
+	return;
+    
+    for (i = 0; i < ap->hc; i++)
+	free(ap->hv[i].prefix);
+    free(ap->hv);
+    free(ap->sv);
+    free(ap);
+}
+
+
+/* Call 'fun' for lines starting with 'prefix' (without the ':') */
+int
+at_register(ATPARSER *ap,
+	    const char *prefix,
+	    int flags,
+	    ATFUN fun,
+	    void *xp)
+{
+    ATHANDLER *nhv;
+    int i;
+
+
+    for (i = 0; i < ap->hc; i++)
+	if (strcmp(ap->hv[i].prefix, prefix) == 0)
+	{
+	    ap->hv[i].flags = flags;
+	    ap->hv[i].fun = fun;
+	    ap->hv[i].xp = xp;
+	    return 0;
+	}
+    
+    nhv = realloc(ap->hv, (ap->hc+1)*sizeof(*nhv));
+    if (!nhv)
+	return -1;
+    ap->hv = nhv;
+
+    nhv[ap->hc].prefix = strdup(prefix);
+    if (!nhv[ap->hc].prefix)
+	return -1;
+    nhv[ap->hc].len = strlen(prefix);
+    nhv[ap->hc].flags = flags;
+    nhv[ap->hc].fun = fun;
+    nhv[ap->hc].xp = xp;
+    ap->hc++;
+
+    /* The slots point into the (moved) handler array */
+    if (at_rehash(ap, ap->mask+1) < 0)
+    {
+	free(nhv[--ap->hc].prefix);
+	(void) at_rehash(ap, ap->mask+1);
+	return -1;
+    }
+    
+    return 0;
+}
+
+
+/*
+ * Split 'buf' in place on commas outside of quotes, removing the
+ * quotes. Returns the number of fields.
+ */
+int
+at_split(char *buf,
+	 char **fv,
+	 int fc)
+{
+    char *rp, *wp;
+    int n = 0, q = 0;
+
+
+    while (*buf == ' ')
+	++buf;
+    if (!*buf)
+	return 0;
+    
+    rp = wp = buf;
+    fv[n++] = wp;
+    
+    for (; *rp; rp++)
+    {
+	if (*rp == '"')
+	    q = !q;
+	else if (*rp == ',' && !q)
+	{
+	    *wp++ = '\0';
+	    if (n == fc)
+		return n;
+	    fv[n++] = wp;
+	}
+	else
+	    *wp++ = *rp;
+    }
+    *wp = '\0';
+
+    return n;
+}
+
+
+/*
+ * Call the handler registered for the prefix of 'line'. Returns 1 if
+ * there was one, 0 if not.
+ */
+int
+at_dispatch(ATPARSER *ap,
+	    char *line)
+{
+    ATHANDLER *hp;
+    ATLINE al;
+    int len;
+
+
+    len = at_prefix_len(line);
+    hp = ap->sv[at_hash(line, len) & ap->mask];
+    if (!hp || hp->len != len || memcmp(hp->prefix, line, len) != 0)
+	return 0;
+
+    al.prefix = hp->prefix;
+    al.line = line;
+    al.rest = line + len;
+    if (*al.rest == ':')
+	++al.rest;
+    al.nf = 0;
+    
+    if (!(hp->flags & AT_RAW))
+	al.nf = at_split(al.rest, al.fv, AT_MAXFIELDS);
+
+    (*hp->fun)(&al, hp->xp);
+    return 1;
+}
@@ -0,0 +1,84 @@
+/*
+ * atparse.h - Modem response and URC dispatcher
+ *
+ * Copyright (c) 2016-2020 Peter Eriksson <pen@lysator.liu.se>
+ *
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef ATPARSE_H
+#define ATPARSE_H
+
+#define AT_MAXFIELDS	16
+
+/* Handler flags */
+#define AT_RAW		0x01	/* Do not split the fields */
+
+
+/*
+ * A modem line split into its prefix ("+CMTI", "OK", "+CMS ERROR"...)
+ * and comma separated fields, with quotes removed. Points into the
+ * line, which is modified.
+ */
+typedef struct atline
+{
+    const char *prefix;
+    char *line;
+    char *rest;		/* After "<prefix>:" */
+    int nf;
+    char *fv[AT_MAXFIELDS];
+} ATLINE;
+
+typedef void (*ATFUN)(ATLINE *alp, void *xp);
+
+typedef struct atparser ATPARSER;
+
+
+extern ATPARSER *
+at_create(void);
+
+extern void
+at_destroy(ATPARSER *ap);
+
+extern int
+at_register(ATPARSER *ap,
+	    const char *prefix,
+	    int flags,
+	    ATFUN fun,
+	    void *xp);
+
+extern int
+at_dispatch(ATPARSER *ap,
+	    char *line);
+
+extern int
+at_split(char *buf,
+	 char **fv,
+	 int fc);
+
+#endif
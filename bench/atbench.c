@@ -0,0 +1,165 @@
+/*
+ * atbench.c - Modem response parser benchmark
+ *
+ * Copyright (c) 2016-2020 Peter Eriksson <pen@lysator.liu.se>
+ *
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Runs the lines of a modem traffic capture through the response
+ * dispatcher and through the sscanf()/strcmp() chain it replaced, and
+ * reports the time per line for both.
+ *
+ * Usage: atbench [-n<lines>] [<capture>]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "atparse.h"
+
+int debug = 0;
+
+static unsigned long hits = 0;
+
+
+static void
+count(ATLINE *alp,
+      void *xp)
+{
+    hits += alp->nf + 1;
+}
+
+
+/* The parsing done by psmsd before the dispatcher */
+static void
+old_parse(char *buf)
+{
+    char status[64], phone[128], date[128];
+    int id;
+
+    if (sscanf(buf, "+CMTI: \"SM\",%u", &id) == 1)
+	hits += 3;
+    else if (sscanf(buf, "+CMGL: %u,\"%20[^\"]\",\"%80[^\"]\",,\"%80[^\"]\"",
+		    &id, status, phone, date) == 4)
+	hits += 6;
+    else if (sscanf(buf, "+CMGR: \"%20[^\"]\",\"%80[^\"]\",,\"%80[^\"]\"",
+		    status, phone, date) == 3)
+	hits += 5;
+    else if (strcmp(buf, "OK") == 0 ||
+	     strcmp(buf, "ERROR") == 0)
+	hits += 1;
+}
+
+
+static double
+elapsed(struct timespec *t0)
+{
+    struct timespec t1;
+
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    return (t1.tv_sec - t0->tv_sec) + (t1.tv_nsec - t0->tv_nsec)/1e9;
+}
+
+
+int
+main(int argc,
+     char *argv[])
+{
+    static const char *prefixes[] = {
+	"OK", "ERROR", "+CMS ERROR", "+CME ERROR", "+CMTI", "+CMGL", "+CMGR",
+	"+CMT", "+CMGS", "+CDS", "+CSQ", "RING", ">", NULL
+    };
+    char **lv = NULL, *cp, buf[1024], work[1024];
+    int i, j, lc = 0, total = 1000000;
+    struct timespec t0;
+    ATPARSER *ap;
+    FILE *fp;
+    double t;
+
+
+    for (i = 1; i < argc && argv[i][0] == '-'; i++)
+	if (argv[i][1] != 'n' || sscanf(argv[i]+2, "%d", &total) != 1 || total < 1)
+	{
+	    fprintf(stderr, "Usage: %s [-n<lines>] [<capture>]\n", argv[0]);
+	    exit(1);
+	}
+
+    fp = fopen(i < argc ? argv[i] : "bench/traffic.txt", "r");
+    if (!fp)
+    {
+	perror("atbench");
+	exit(1);
+    }
+    
+    while (fgets(buf, sizeof(buf), fp))
+    {
+	for (cp = buf+strlen(buf); cp > buf && (cp[-1] == '\n' || cp[-1] == '\r' || cp[-1] == ' '); cp--)
+	    ;
+	*cp = '\0';
+	
+	lv = realloc(lv, (lc+1)*sizeof(*lv));
+	lv[lc++] = strdup(buf);
+    }
+    fclose(fp);
+
+    if (lc == 0)
+    {
+	fprintf(stderr, "atbench: Empty capture\n");
+	exit(1);
+    }
+    
+    ap = at_create();
+    for (i = 0; prefixes[i]; i++)
+	at_register(ap, prefixes[i], 0, count, NULL);
+
+    /* The lines are modified - parse copies, in both cases */
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (i = j = 0; i < total; i++, j = (j+1 == lc ? 0 : j+1))
+    {
+	strcpy(work, lv[j]);
+	old_parse(work);
+    }
+    t = elapsed(&t0);
+    printf("sscanf chain  %8d lines %8.1f ns/line\n", total, t*1e9/total);
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (i = j = 0; i < total; i++, j = (j+1 == lc ? 0 : j+1))
+    {
+	strcpy(work, lv[j]);
+	at_dispatch(ap, work);
+    }
+    t = elapsed(&t0);
+    printf("dispatcher    %8d lines %8.1f ns/line\n", total, t*1e9/total);
+
+    at_destroy(ap);
+    exit(hits == 0);
+}
@@ -0,0 +1,184 @@
+/*
+ * benchutil.c - Helpers shared by the benchmark harnesses
+ *
+ * Copyright (c) 2016-2020 Peter Eriksson <pen@lysator.liu.se>
+ *
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "benchutil.h"
+
+
+long long
+us_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+
+pid_t
+spawn(char *const argv[],
+      const char *log,
+      int flags)
+{
+    pid_t pid;
+    int fd;
+
+
+    pid = fork();
+    if (pid < 0)
+	return -1;
+    
+    if (pid == 0)
+    {
+	fd = open(log, O_WRONLY|O_CREAT|flags, 0644);
+	if (fd >= 0)
+	{
+	    dup2(fd, 1);
+	    dup2(fd, 2);
+	    close(fd);
+	}
+	execv(argv[0], argv);
+	fprintf(stderr, "%s: %s\n", argv[0], strerror(errno));
+	_exit(127);
+    }
+    
+    return pid;
+}
+
+
+void
+stop(pid_t pid)
+{
+    long long t0 = us_now();
+
+    
+    if (pid <= 0)
+	return;
+    
+    kill(pid, SIGTERM);
+    while (waitpid(pid, NULL, WNOHANG) == 0)
+    {
+	if (us_now() - t0 > 10000000)
+	{
+	    kill(pid, SIGKILL);
+	    waitpid(pid, NULL, 0);
+	    return;
+	}
+	usleep(10000);
+    }
+}
+
+
+int
+wait_path(const char *path,
+	  int ms)
+{
+    struct stat sb;
+    long long t0 = us_now();
+
+    
+    while (stat(path, &sb) < 0)
+    {
+	if (us_now() - t0 > ms*1000LL)
+	    return -1;
+	usleep(10000);
+    }
+    return 0;
+}
+
+
+int
+sent_read(int fd,
+	  void (*fun)(const char *phone, const char *text, void *xp),
+	  void *xp)
+{
+    static char buf[65536];
+    static int len = 0;
+    char *cp, *nl, *tp;
+    int n, ready = 0;
+
+    
+    if (fd < 0)
+    {
+	len = 0;
+	return 0;
+    }
+    
+    while ((n = read(fd, buf+len, sizeof(buf)-1-len)) > 0)
+    {
+	len += n;
+	buf[len] = '\0';
+
+	for (cp = buf; (nl = strchr(cp, '\n')) != NULL; cp = nl+1)
+	{
+	    *nl = '\0';
+	    tp = strchr(cp, '|');
+	    if (!tp)
+		continue;
+	    *tp++ = '\0';
+	    
+	    if (strcmp(tp, "ready") == 0)
+		ready = 1;
+	    else
+		fun(cp, tp, xp);
+	}
+
+	len -= cp-buf;
+	memmove(buf, cp, len);
+	if (len == sizeof(buf)-1)
+	    len = 0;
+    }
+
+    return ready;
+}
+
+
+int
+cmp_ll(const void *a,
+       const void *b)
+{
+    long long x = *(const long long *) a, y = *(const long long *) b;
+
+    return x < y ? -1 : x > y;
+}
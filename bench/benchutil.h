@@ -0,0 +1,72 @@
+/*
+ * benchutil.h - Helpers shared by the benchmark harnesses
+ *
+ * Copyright (c) 2016-2020 Peter Eriksson <pen@lysator.liu.se>
+ *
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef BENCHUTIL_H
+#define BENCHUTIL_H
+
+#include <sys/types.h>
+
+
+/* Monotonic clock in microseconds */
+extern long long
+us_now(void);
+
+/* Run argv[0] with stdout and stderr to 'log', opened with 'flags' (O_TRUNC or O_APPEND) */
+extern pid_t
+spawn(char *const argv[],
+      const char *log,
+      int flags);
+
+/* SIGTERM, and SIGKILL if still running after 10 seconds */
+extern void
+stop(pid_t pid);
+
+extern int
+wait_path(const char *path,
+	  int ms);
+
+/*
+ * Read the "<phone>|<text>" lines the simulated modem has sent since
+ * last time, calling 'fun' for each (but "ready"). Returns 1 if a
+ * "ready" was seen. A negative 'fd' forgets a partial line.
+ */
+extern int
+sent_read(int fd,
+	  void (*fun)(const char *phone, const char *text, void *xp),
+	  void *xp);
+
+extern int
+cmp_ll(const void *a,
+       const void *b);
+
+#endif
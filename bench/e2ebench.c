@@ -0,0 +1,692 @@
+/*
+ * e2ebench.c - End-to-end throughput and latency benchmark
+ *
+ * Copyright (c) 2016-2020 Peter Eriksson <pen@lysator.liu.se>
+ *
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Starts psmsd against psmsd-sim (on a UNIX socket) for each workload
+ * and drives it with messages to send and messages received:
+ *
+ *   fifo     Submissions through the fifo, as fast as they are taken
+ *   psmsc    Submissions with psmsc, one process per message
+ *   inbound  A flood of commands received by SMS, each with a reply
+ *   mixed    Broadcasts to a group while commands are received
+ *
+ * Times are taken when the simulated modem answers OK to a message.
+ * Reports messages per second, submit-to-OK and inbound-to-reply
+ * latency percentiles, and the CPU time and peak RSS of psmsd. With -o
+ * the results are appended to a file as one JSON object per workload
+ * and run, to be compared across commits (-l).
+ *
+ * Usage: e2ebench [<options>] [<workload> ...]
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/wait.h>
+
+#include "benchutil.h"
+
+#define PHONE_OUT	"+46701000000"	/* Recipient of submissions */
+#define PHONE_GROUP	"+4670200"	/* ... of broadcasts, and a number */
+#define PHONE_IN	"+4670300"	/* Senders of commands, and a number */
+#define GROUP		"bench"
+#define NSENDERS	100		/* Known phones sending commands */
+
+#define WL_FIFO		1
+#define WL_PSMSC	2
+#define WL_INBOUND	3
+#define WL_MIXED	4
+
+static const char *wl_names[] = { "", "fifo", "psmsc", "inbound", "mixed", NULL };
+
+
+static char *bindir = ".";
+static char *results_path = NULL;
+static char *label = "";
+static char *sim_latency = NULL;	/* -L for psmsd-sim */
+static char *psmsd_opts[8];
+static int npsmsd_opts = 0;
+static int nmsgs = -1;			/* Default per workload */
+static int rate = -1;
+static int group_size = 20;
+static int nslots = 1000;
+static int idle_ms = 30000;		/* Give up when nothing arrives */
+static int keep = 0;
+static int verbose = 0;
+
+static char dir[64];
+static char sent[128];
+
+/* What has been submitted, and when the messages arrived */
+typedef struct
+{
+    long long t;		/* Submitted */
+    int left;			/* Deliveries still expected */
+} SUB;
+
+typedef struct
+{
+    SUB *subs;
+    int nsubs;
+    long long *lat;		/* One per delivery */
+    int nlat;
+    int expected;		/* Deliveries in all */
+} STREAM;
+
+static STREAM out;		/* Submissions and broadcasts */
+static STREAM in;		/* Received commands and their replies */
+
+
+static void
+usage(FILE *fp,
+      char *argv0)
+{
+    fprintf(fp, "Usage: %s [<options>] [<workload> ...]\n", argv0);
+    fprintf(fp, "Workloads: fifo, psmsc, inbound, mixed (default: all)\n");
+    fprintf(fp, "Options:\n");
+    fprintf(fp, "  -n<messages>          Messages (or broadcasts) per stream\n");
+    fprintf(fp, "  -r<rate>              Messages per second per stream (0: no limit)\n");
+    fprintf(fp, "  -g<members>           Broadcast group size (default: 20)\n");
+    fprintf(fp, "  -L[<cmd>=]<ms>        Simulated modem latency (see psmsd-sim)\n");
+    fprintf(fp, "  -S<slots>             Simulated modem storage (default: 1000)\n");
+    fprintf(fp, "  -E<backend>           psmsd event loop backend\n");
+    fprintf(fp, "  -W<workers>           psmsd command workers\n");
+    fprintf(fp, "  -R                    psmsd receives messages directly (+CMT)\n");
+    fprintf(fp, "  -o<file>              Append results (JSON lines) to a file\n");
+    fprintf(fp, "  -l<label>             Label of the results, such as a commit\n");
+    fprintf(fp, "  -P<dir>               Directory with the binaries (default: .)\n");
+    fprintf(fp, "  -k                    Keep the work directories\n");
+    fprintf(fp, "  -v                    Debug output of psmsd and psmsd-sim in the logs\n");
+}
+
+
+static void
+fail(const char *what)
+{
+    fprintf(stderr, "e2ebench: %s: %s\n", what, strerror(errno));
+    exit(1);
+}
+
+
+static void
+write_file(const char *path,
+	   const char *text)
+{
+    FILE *fp = fopen(path, "w");
+
+    if (!fp)
+	fail(path);
+    fputs(text, fp);
+    fclose(fp);
+}
+
+
+/* CPU time (user+system, own and waited for children) in ms, peak RSS in KB */
+static void
+proc_usage(pid_t pid,
+	   long *cpu,
+	   long *ccpu,
+	   long *rss)
+{
+    char path[64], buf[1024], *cp;
+    unsigned long ut, st;
+    long cut, cst;
+    FILE *fp;
+    long hz = sysconf(_SC_CLK_TCK);
+    
+
+    *cpu = *ccpu = *rss = 0;
+    
+    snprintf(path, sizeof(path), "/proc/%d/stat", (int) pid);
+    fp = fopen(path, "r");
+    if (fp)
+    {
+	/* The fields after the command name, which may hold spaces */
+	if (fgets(buf, sizeof(buf), fp) && (cp = strrchr(buf, ')')) != NULL &&
+	    sscanf(cp+2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu %ld %ld",
+		   &ut, &st, &cut, &cst) == 4)
+	{
+	    *cpu = (long) ((ut + st) * 1000 / hz);
+	    *ccpu = (cut + cst) * 1000 / hz;
+	}
+	fclose(fp);
+    }
+
+    snprintf(path, sizeof(path), "/proc/%d/status", (int) pid);
+    fp = fopen(path, "r");
+    if (fp)
+    {
+	while (fgets(buf, sizeof(buf), fp))
+	    if (sscanf(buf, "VmHWM: %ld", rss) == 1)
+		break;
+	fclose(fp);
+    }
+}
+
+
+static void
+stream_init(STREAM *sp,
+	    int nsubs,
+	    int per)
+{
+    memset(sp, 0, sizeof(*sp));
+    sp->subs = calloc(nsubs+1, sizeof(SUB));
+    sp->lat = calloc(nsubs*per+1, sizeof(long long));
+    if (!sp->subs || !sp->lat)
+	fail("malloc");
+    sp->expected = nsubs*per;
+}
+
+
+static void
+stream_free(STREAM *sp)
+{
+    free(sp->subs);
+    free(sp->lat);
+    memset(sp, 0, sizeof(*sp));
+}
+
+
+static void
+stream_sub(STREAM *sp,
+	   int per)
+{
+    sp->subs[sp->nsubs].t = us_now();
+    sp->subs[sp->nsubs].left = per;
+    sp->nsubs++;
+}
+
+
+static void
+stream_done(STREAM *sp,
+	    int i,
+	    long long now)
+{
+    if (i < 0 || i >= sp->nsubs || sp->subs[i].left <= 0)
+	return;
+    
+    sp->subs[i].left--;
+    sp->lat[sp->nlat++] = now - sp->subs[i].t;
+}
+
+
+static void
+sent_line(const char *phone,
+	  const char *text,
+	  void *xp)
+{
+    long long now = us_now();
+    int i;
+
+    
+    if (sscanf(text, "out-%d", &i) == 1)
+	stream_done(&out, i, now);
+    else if (sscanf(text, "in-%d", &i) == 1)
+	stream_done(&in, i, now);
+}
+
+
+static double
+pct(STREAM *sp,
+    double p)
+{
+    if (!sp->nlat)
+	return 0.0;
+    return sp->lat[(int) ((sp->nlat-1) * p)] / 1000.0;
+}
+
+
+static void
+report(FILE *fp,
+       const char *name,
+       STREAM *sp,
+       int json)
+{
+    qsort(sp->lat, sp->nlat, sizeof(long long), cmp_ll);
+
+    if (json)
+	fprintf(fp, ",\"%s\":{\"messages\":%d,\"lost\":%d,\"p50_ms\":%.3f,\"p99_ms\":%.3f,\"p999_ms\":%.3f,\"max_ms\":%.3f}",
+		name, sp->nlat, sp->expected - sp->nlat,
+		pct(sp, 0.5), pct(sp, 0.99), pct(sp, 0.999), pct(sp, 1.0));
+    else
+	fprintf(fp, "  %-8s %6d msgs, %4d lost, p50 %8.2f ms, p99 %8.2f ms, p99.9 %8.2f ms, max %8.2f ms\n",
+		name, sp->nlat, sp->expected - sp->nlat,
+		pct(sp, 0.5), pct(sp, 0.99), pct(sp, 0.999), pct(sp, 1.0));
+}
+
+
+/* Submit one message with psmsc, and wait for it */
+static void
+psmsc_send(const char *psmsc,
+	   const char *fifo,
+	   const char *text)
+{
+    char fopt[160];
+    int pfd[2];
+    pid_t pid;
+
+    
+    snprintf(fopt, sizeof(fopt), "-F%s", fifo);
+    if (pipe(pfd) < 0)
+	fail("pipe");
+    
+    pid = fork();
+    if (pid < 0)
+	fail("fork");
+    if (pid == 0)
+    {
+	dup2(pfd[0], 0);
+	close(pfd[0]);
+	close(pfd[1]);
+	execl(psmsc, psmsc, fopt, PHONE_OUT, (char *) NULL);
+	_exit(127);
+    }
+
+    close(pfd[0]);
+    if (write(pfd[1], text, strlen(text)) < 0)
+	perror("write");
+    close(pfd[1]);
+    waitpid(pid, NULL, 0);
+}
+
+
+static int
+run(int wl,
+    char *argv0)
+{
+    char sim[256], psmsd[256], psmsc[256], sock[128], fifo[128], ctl[128];
+    char cfile[128], ufile[128], gfile[128], log[128];
+    char sopt[160], oopt[160], copt[160], Sopt[32], Lopt[64], Fopt[160], Copt[160], Uopt[160], Gopt[160];
+    char buf[256], *sim_argv[12], *psmsd_argv[20];
+    pid_t sim_pid = -1, psmsd_pid = -1;
+    long long t0, tnext_out = 0, tnext_in = 0, tlast, tend = 0, iv;
+    long cpu0, ccpu0, cpu, ccpu, rss;
+    int i, n, fifo_fd = -1, ctl_fd = -1, sent_fd = -1, rc = 1;
+    int nout = 0, nin = 0, per = 1, r;
+    FILE *fp;
+    time_t now;
+    struct tm tm;
+
+
+    /* Messages (or broadcasts) to send, and commands to receive */
+    n = nmsgs;
+    switch (wl)
+    {
+      case WL_FIFO:
+	nout = n >= 0 ? n : 5000;
+	break;
+      case WL_PSMSC:
+	nout = n >= 0 ? n : 500;
+	break;
+      case WL_INBOUND:
+	nin = n >= 0 ? n : 500;
+	break;
+      case WL_MIXED:
+	nout = n >= 0 ? n : 50;
+	nin = n >= 0 ? n : 200;
+	per = group_size;
+	break;
+    }
+    r = rate >= 0 ? rate : (wl == WL_MIXED ? 20 : 0);
+    iv = r > 0 ? 1000000 / r : 0;
+    
+    stream_init(&out, nout, per);
+    stream_init(&in, nin, 1);
+    
+    strcpy(dir, "/tmp/e2ebench.XXXXXX");
+    if (!mkdtemp(dir))
+	fail("mkdtemp");
+    
+    snprintf(sim, sizeof(sim), "%s/psmsd-sim", bindir);
+    snprintf(psmsd, sizeof(psmsd), "%s/psmsd", bindir);
+    snprintf(psmsc, sizeof(psmsc), "%s/psmsc", bindir);
+    snprintf(sock, sizeof(sock), "%s/modem", dir);
+    snprintf(sent, sizeof(sent), "%s/sent", dir);
+    snprintf(fifo, sizeof(fifo), "%s/fifo", dir);
+    snprintf(ctl, sizeof(ctl), "%s/control", dir);
+    snprintf(cfile, sizeof(cfile), "%s/commands.dat", dir);
+    snprintf(ufile, sizeof(ufile), "%s/users.dat", dir);
+    snprintf(gfile, sizeof(gfile), "%s/groups.dat", dir);
+    snprintf(log, sizeof(log), "%s/log", dir);
+
+    write_file(cfile, "Bench\t*\tnobody\t/bin/echo\techo %*\n");
+    write_file(sent, "");
+    
+    /* Commands are only run for known phones */
+    fp = fopen(ufile, "w");
+    if (!fp)
+	fail(ufile);
+    for (i = 0; i < NSENDERS; i++)
+	fprintf(fp, "bench%02d\t%s%04d\tbench\t*\n", i, PHONE_IN, i);
+    fclose(fp);
+    
+    fp = fopen(gfile, "w");
+    if (!fp)
+	fail(gfile);
+    fprintf(fp, "%s", GROUP);
+    for (i = 0; i < group_size; i++)
+	fprintf(fp, " %s%04d", PHONE_GROUP, i);
+    fprintf(fp, "\n");
+    fclose(fp);
+    
+    /* The simulated modem */
+    snprintf(sopt, sizeof(sopt), "-s%s", sock);
+    snprintf(oopt, sizeof(oopt), "-o%s", sent);
+    snprintf(copt, sizeof(copt), "-c%s", ctl);
+    snprintf(Sopt, sizeof(Sopt), "-S%d", nslots);
+    n = 0;
+    sim_argv[n++] = sim;
+    sim_argv[n++] = sopt;
+    sim_argv[n++] = oopt;
+    sim_argv[n++] = copt;
+    sim_argv[n++] = Sopt;
+    if (sim_latency)
+    {
+	snprintf(Lopt, sizeof(Lopt), "-L%s", sim_latency);
+	sim_argv[n++] = Lopt;
+    }
+    if (verbose)
+	sim_argv[n++] = "-vv";
+    sim_argv[n] = NULL;
+    
+    sim_pid = spawn(sim_argv, log, O_APPEND);
+    if (sim_pid < 0 || wait_path(sock, 5000) < 0 || wait_path(ctl, 5000) < 0)
+    {
+	fprintf(stderr, "%s: %s: Did not start (see %s)\n", argv0, sim, log);
+	goto End;
+    }
+
+    /* The daemon, in the foreground */
+    snprintf(Fopt, sizeof(Fopt), "-F%s", fifo);
+    snprintf(Copt, sizeof(Copt), "-C%s", cfile);
+    snprintf(Uopt, sizeof(Uopt), "-U%s", ufile);
+    snprintf(Gopt, sizeof(Gopt), "-G%s", gfile);
+    n = 0;
+    psmsd_argv[n++] = psmsd;
+    psmsd_argv[n++] = verbose ? "-d2" : "-d";
+    psmsd_argv[n++] = Fopt;
+    psmsd_argv[n++] = Copt;
+    psmsd_argv[n++] = Uopt;
+    psmsd_argv[n++] = Gopt;
+    for (i = 0; i < npsmsd_opts; i++)
+	psmsd_argv[n++] = psmsd_opts[i];
+    psmsd_argv[n++] = sock;
+    psmsd_argv[n] = NULL;
+
+    /* psmsd -d logs every message, which is part of what is measured */
+    psmsd_pid = spawn(psmsd_argv, log, O_APPEND);
+    t0 = us_now();
+    while (psmsd_pid > 0 && (fifo_fd = open(fifo, O_WRONLY|O_NONBLOCK)) < 0 && us_now() - t0 < 5000000)
+	usleep(10000);
+    ctl_fd = open(ctl, O_WRONLY|O_NONBLOCK);
+    sent_fd = open(sent, O_RDONLY);
+    if (fifo_fd < 0 || ctl_fd < 0 || sent_fd < 0)
+    {
+	fprintf(stderr, "%s: %s: Did not start (see %s)\n", argv0, psmsd, log);
+	goto End;
+    }
+    
+    /* Blocking from here, the load is throttled by psmsd taking it */
+    fcntl(fifo_fd, F_SETFL, 0);
+    fcntl(ctl_fd, F_SETFL, 0);
+    
+    /* Wait for the modem to be up */
+    n = snprintf(buf, sizeof(buf), "%s ready\n", PHONE_OUT);
+    if (write(fifo_fd, buf, n) != n)
+	perror("write");
+    while (!sent_read(sent_fd, sent_line, NULL))
+    {
+	if (us_now() - t0 > 30000000)
+	{
+	    fprintf(stderr, "%s: psmsd did not send anything in 30 s (see %s)\n", argv0, log);
+	    goto End;
+	}
+	usleep(5000);
+    }
+
+    proc_usage(psmsd_pid, &cpu0, &ccpu0, &rss);
+    t0 = tlast = tnext_out = tnext_in = us_now();
+    
+    while (out.nlat + in.nlat < out.expected + in.expected)
+    {
+	long long now = us_now();
+	int progress = out.nlat + in.nlat;
+
+	
+	if (out.nsubs < nout && now >= tnext_out)
+	{
+	    if (wl == WL_PSMSC)
+	    {
+		snprintf(buf, sizeof(buf), "out-%d\n", out.nsubs);
+		stream_sub(&out, per);
+		psmsc_send(psmsc, fifo, buf);
+	    }
+	    else
+	    {
+		n = snprintf(buf, sizeof(buf), "%s out-%d\n",
+			     wl == WL_MIXED ? GROUP : PHONE_OUT, out.nsubs);
+		stream_sub(&out, per);
+		if (write(fifo_fd, buf, n) != n)
+		    perror("write");
+	    }
+	    tnext_out += iv;
+	}
+	
+	if (in.nsubs < nin && now >= tnext_in)
+	{
+	    /* Spread over senders, which psmsd runs in parallel */
+	    n = snprintf(buf, sizeof(buf), "%s%04d|bench in-%d\n",
+			 PHONE_IN, in.nsubs % NSENDERS, in.nsubs);
+	    stream_sub(&in, 1);
+	    if (write(ctl_fd, buf, n) != n)
+		perror("write");
+	    tnext_in += iv;
+	}
+
+	(void) sent_read(sent_fd, sent_line, NULL);
+	
+	if (out.nlat + in.nlat > progress)
+	    tlast = now;
+	else if (now - tlast > idle_ms*1000LL)
+	{
+	    fprintf(stderr, "%s: %s: Nothing sent in %d s, giving up\n", argv0, wl_names[wl], idle_ms/1000);
+	    break;
+	}
+
+	/* Submitting as fast as possible, or waiting */
+	if ((out.nsubs == nout || iv) && (in.nsubs == nin || iv))
+	    usleep(200);
+    }
+    tend = us_now();
+
+    proc_usage(psmsd_pid, &cpu, &ccpu, &rss);
+    cpu -= cpu0;
+    ccpu -= ccpu0;
+    rc = 0;
+    
+    n = out.nlat + in.nlat;
+    printf("%s: %d messages in %.3f s, %.1f msgs/s, psmsd CPU %ld ms (%.1f us/msg, commands %ld ms), peak RSS %ld KB\n",
+	   wl_names[wl], n, (tend-t0)/1e6, n ? n / ((tend-t0)/1e6) : 0.0,
+	   cpu, n ? cpu * 1000.0 / n : 0.0, ccpu, rss);
+    if (out.expected)
+	report(stdout, "submit", &out, 0);
+    if (in.expected)
+	report(stdout, "reply", &in, 0);
+    fflush(stdout);
+
+    if (results_path)
+    {
+	fp = fopen(results_path, "a");
+	if (!fp)
+	    fail(results_path);
+	
+	time(&now);
+	gmtime_r(&now, &tm);
+	strftime(buf, sizeof(buf), "%Y-%m-%dT%H:%M:%SZ", &tm);
+	fprintf(fp, "{\"label\":\"%s\",\"time\":\"%s\",\"workload\":\"%s\",\"rate\":%d,\"group\":%d,"
+		"\"messages\":%d,\"seconds\":%.3f,\"msgs_per_s\":%.1f,\"cpu_ms\":%ld,\"children_cpu_ms\":%ld,\"rss_kb\":%ld",
+		label, buf, wl_names[wl], r, wl == WL_MIXED ? group_size : 1,
+		n, (tend-t0)/1e6, n ? n / ((tend-t0)/1e6) : 0.0, cpu, ccpu, rss);
+	if (out.expected)
+	    report(fp, "submit", &out, 1);
+	if (in.expected)
+	    report(fp, "reply", &in, 1);
+	fprintf(fp, "}\n");
+	fclose(fp);
+    }
+    
+  End:
+    if (fifo_fd >= 0)
+	close(fifo_fd);
+    if (ctl_fd >= 0)
+	close(ctl_fd);
+    if (sent_fd >= 0)
+	close(sent_fd);
+    sent_read(-1, NULL, NULL);
+    
+    stop(psmsd_pid);
+    stop(sim_pid);
+    stream_free(&out);
+    stream_free(&in);
+
+    if (rc || keep)
+	printf("%s: Logs kept in %s\n", wl_names[wl], dir);
+    else
+    {
+	const char *files[] = { "modem", "sent", "fifo", "control", "commands.dat",
+				"users.dat", "groups.dat", "log", NULL };
+
+	for (i = 0; files[i]; i++)
+	{
+	    snprintf(buf, sizeof(buf), "%s/%s", dir, files[i]);
+	    unlink(buf);
+	}
+	rmdir(dir);
+    }
+    
+    return rc;
+}
+
+
+int
+main(int argc,
+     char *argv[])
+{
+    int i, j, *ip, failed = 0;
+
+
+    for (i = 1; i < argc && argv[i][0] == '-'; i++)
+    {
+	switch (argv[i][1])
+	{
+	  case 'n': ip = &nmsgs; break;
+	  case 'r': ip = &rate; break;
+	  case 'g': ip = &group_size; break;
+	  case 'S': ip = &nslots; break;
+
+	  case 'L':
+	    sim_latency = argv[i]+2;
+	    continue;
+	    
+	  case 'E':
+	  case 'W':
+	  case 'R':
+	    if (npsmsd_opts < 8)
+		psmsd_opts[npsmsd_opts++] = argv[i];
+	    continue;
+	    
+	  case 'o':
+	    results_path = argv[i]+2;
+	    continue;
+	    
+	  case 'l':
+	    label = argv[i]+2;
+	    continue;
+	    
+	  case 'P':
+	    bindir = argv[i]+2;
+	    continue;
+	    
+	  case 'k':
+	    keep = 1;
+	    continue;
+	    
+	  case 'v':
+	    verbose = 1;
+	    continue;
+	    
+	  case 'h':
+	    usage(stdout, argv[0]);
+	    exit(0);
+	    
+	  default:
+	    usage(stderr, argv[0]);
+	    exit(1);
+	}
+
+	if (sscanf(argv[i]+2, "%d", ip) != 1 || *ip < 0)
+	{
+	    fprintf(stderr, "%s: Invalid argument for -%c\n", argv[0], argv[i][1]);
+	    exit(1);
+	}
+    }
+    
+    signal(SIGPIPE, SIG_IGN);
+
+    if (i == argc)
+    {
+	for (j = 1; wl_names[j]; j++)
+	    failed |= run(j, argv[0]);
+	exit(failed);
+    }
+    
+    for (; i < argc; i++)
+    {
+	for (j = 1; wl_names[j] && strcmp(wl_names[j], argv[i]) != 0; j++)
+	    ;
+	if (!wl_names[j])
+	{
+	    fprintf(stderr, "%s: %s: Unknown workload\n", argv[0], argv[i]);
+	    exit(1);
+	}
+	failed |= run(j, argv[0]);
+    }
+    
+    exit(failed);
+}
@@ -0,0 +1,298 @@
+/*
+ * evbench.c - Event loop backend benchmark against a pty modem
+ *
+ * Copyright (c) 2016-2020 Peter Eriksson <pen@lysator.liu.se>
+ *
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Sends SMS submissions (AT+CMGS, wait for the prompt, payload, wait
+ * for OK) through the event loop to psmsd-sim on a UNIX socket, the
+ * same way psmsd does, and reports the syscalls made by the loop per
+ * message for each backend.
+ *
+ * Usage: evbench [-n<messages>] [-P<dir>] [<backend> ...]
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/resource.h>
+
+#include "evloop.h"
+#include "benchutil.h"
+
+int debug = 0;
+
+#define CMD	"AT+CMGS=\"+46701234567\"\r"
+#define DATA	"48656C6C6F2C20746869732069732061207465737420666F72207468652062656E63686D61726B\032"
+
+
+static char *bindir = ".";
+static char sock[128];
+
+
+/* Connect to the simulated modem */
+static int
+sim_connect(void)
+{
+    struct sockaddr_un sun;
+    int fd;
+
+    
+    memset(&sun, 0, sizeof(sun));
+    sun.sun_family = AF_UNIX;
+    strcpy(sun.sun_path, sock);
+    
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr *) &sun, sizeof(sun)) < 0)
+    {
+	perror(sock);
+	if (fd >= 0)
+	    close(fd);
+	return -1;
+    }
+    
+    fcntl(fd, F_SETFL, O_NONBLOCK);
+    return fd;
+}
+
+
+typedef struct bench
+{
+    int fd;
+    int sent;
+    int done;
+    int total;
+    char buf[256];
+    int len;
+    char rbuf[4096];
+} BENCH;
+
+
+static void
+bench_send(EVLOOP *lp,
+	   BENCH *bp)
+{
+    if (bp->sent == bp->total)
+    {
+	ev_stop(lp);
+	return;
+    }
+    
+    ++bp->sent;
+    ev_write(lp, bp->fd, CMD, sizeof(CMD)-1);
+}
+
+
+static void
+bench_input(EVLOOP *lp,
+	    int fd,
+	    char *buf,
+	    int len,
+	    void *xp)
+{
+    BENCH *bp = (BENCH *) xp;
+    char *cp;
+    
+
+    if (len <= 0)
+    {
+	fprintf(stderr, "evbench: modem closed: %s\n", len < 0 ? strerror(-len) : "EOF");
+	ev_stop(lp);
+	return;
+    }
+
+    if (bp->len + len >= (int) sizeof(bp->buf))
+	bp->len = 0;
+    memcpy(bp->buf + bp->len, buf, len);
+    bp->len += len;
+    bp->buf[bp->len] = '\0';
+
+    for (;;)
+    {
+	if ((cp = strstr(bp->buf, "> ")) != NULL)
+	{
+	    ev_write(lp, fd, DATA, sizeof(DATA)-1);
+	    cp += 2;
+	}
+	else if ((cp = strstr(bp->buf, "OK\r\n")) != NULL)
+	{
+	    ++bp->done;
+	    bench_send(lp, bp);
+	    cp += 4;
+	}
+	else
+	    break;
+
+	bp->len -= cp - bp->buf;
+	memmove(bp->buf, cp, bp->len+1);
+    }
+}
+
+
+static int
+bench_run(const char *backend,
+	  int total)
+{
+    struct timespec t0, t1;
+    struct rusage r0, r1;
+    EVLOOP *lp;
+    EVSTATS st;
+    BENCH b;
+    double t, cpu;
+    int fd;
+
+    
+    fd = sim_connect();
+    if (fd < 0)
+	return -1;
+
+    lp = ev_create(backend);
+    if (!lp)
+    {
+	fprintf(stderr, "evbench: %s: %s\n", backend, strerror(errno));
+	close(fd);
+	return -1;
+    }
+
+    memset(&b, 0, sizeof(b));
+    b.fd = fd;
+    b.total = total;
+    ev_add_reader(lp, fd, b.rbuf, sizeof(b.rbuf), bench_input, &b);
+    
+    getrusage(RUSAGE_SELF, &r0);
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    bench_send(lp, &b);
+    ev_run(lp);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    getrusage(RUSAGE_SELF, &r1);
+
+    ev_stats(lp, &st);
+    t = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec)/1e9;
+    cpu = (r1.ru_utime.tv_sec - r0.ru_utime.tv_sec + r1.ru_stime.tv_sec - r0.ru_stime.tv_sec)*1e6 +
+	(r1.ru_utime.tv_usec - r0.ru_utime.tv_usec + r1.ru_stime.tv_usec - r0.ru_stime.tv_usec);
+
+    /* Wakeups are returns from the wait, sleeps the times it blocked */
+    printf("%-10s %8d msgs %8.3f s %8.0f msgs/s %6.2f syscalls/msg %6.2f wakeups/msg %6.2f sleeps/msg %6.2f cpu us/msg\n",
+	   ev_backend(lp), b.done, t, b.done/t,
+	   (double) st.syscalls/b.done, (double) st.wakeups/b.done,
+	   (double) (r1.ru_nvcsw - r0.ru_nvcsw)/b.done, cpu/b.done);
+    
+    ev_destroy(lp);
+    close(fd);
+    return 0;
+}
+
+
+int
+main(int argc,
+     char *argv[])
+{
+    static char *all[] = { "poll", "epoll", "io_uring", NULL };
+    char **backends = all;
+    char dir[64], sim[256], log[128], sopt[160], *sim_argv[3];
+    int i, total = 10000, failed = 0;
+    pid_t sim_pid;
+
+
+    for (i = 1; i < argc && argv[i][0] == '-'; i++)
+	switch (argv[i][1])
+	{
+	  case 'n':
+	    if (sscanf(argv[i]+2, "%d", &total) != 1 || total < 1)
+	    {
+		fprintf(stderr, "%s: Invalid argument for -n\n", argv[0]);
+		exit(1);
+	    }
+	    break;
+
+	  case 'P':
+	    bindir = argv[i]+2;
+	    break;
+
+	  default:
+	    fprintf(stderr, "Usage: %s [-n<messages>] [-P<dir>] [<backend> ...]\n", argv[0]);
+	    exit(1);
+	}
+
+    if (i < argc)
+	backends = argv+i;
+    
+    signal(SIGPIPE, SIG_IGN);
+    
+    strcpy(dir, "/tmp/evbench.XXXXXX");
+    if (!mkdtemp(dir))
+    {
+	perror("mkdtemp");
+	exit(1);
+    }
+    
+    snprintf(sim, sizeof(sim), "%s/psmsd-sim", bindir);
+    snprintf(sock, sizeof(sock), "%s/modem", dir);
+    snprintf(log, sizeof(log), "%s/psmsd-sim.log", dir);
+    snprintf(sopt, sizeof(sopt), "-s%s", sock);
+    sim_argv[0] = sim;
+    sim_argv[1] = sopt;
+    sim_argv[2] = NULL;
+    
+    /* One connection to the simulated modem for each backend */
+    sim_pid = spawn(sim_argv, log, O_TRUNC);
+    if (sim_pid < 0 || wait_path(sock, 5000) < 0)
+    {
+	fprintf(stderr, "%s: %s: Did not start (see %s)\n", argv[0], sim, log);
+	stop(sim_pid);
+	exit(1);
+    }
+    
+    for (; *backends && !failed; backends++)
+	if (bench_run(*backends, total) < 0)
+	    failed = 1;
+
+    stop(sim_pid);
+    
+    if (failed)
+	printf("evbench: Logs kept in %s\n", dir);
+    else
+    {
+	unlink(sock);
+	unlink(log);
+	rmdir(dir);
+    }
+    
+    exit(failed);
+}
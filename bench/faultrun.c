@@ -0,0 +1,429 @@
+/*
+ * faultrun.c - Latency and recovery checks against a faulty simulated modem
+ *
+ * Copyright (c) 2016-2020 Peter Eriksson <pen@lysator.liu.se>
+ *
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Starts psmsd-sim with a fault scenario and psmsd against it, submits
+ * messages through the psmsd fifo at a steady rate and times their
+ * arrival at the simulated modem. Reports the queue latency and the
+ * longest stall (time with messages waiting but none sent), and fails
+ * if they, or the number of lost messages, are above the given bounds.
+ *
+ * Lines starting with "#!" in the scenario hold default options.
+ *
+ * Usage: faultrun [<options>] <scenario>
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+
+#include "benchutil.h"
+
+#define PHONE	"+46701000000"
+
+
+static char *bindir = ".";
+static int nmsgs = 100;		/* Messages to submit */
+static int interval = 50;	/* ms between them */
+static int cmd_timeout = 2000;	/* psmsd -S */
+static int wait_ms = 40000;	/* For stragglers after the last one */
+static int max_stall = -1;
+static int max_p99 = -1;
+static int max_latency = -1;
+static int max_lost = 0;
+static int keep = 0;
+static int verbose = 0;
+
+typedef struct
+{
+    long long submitted;
+    long long sent;		/* 0 if not (yet) */
+} MSG;
+
+static MSG *msgs;
+static char dir[64];
+
+
+static long long
+ms_now(void)
+{
+    return us_now() / 1000;
+}
+
+
+static void
+usage(FILE *fp,
+      char *argv0)
+{
+    fprintf(fp, "Usage: %s [<options>] <scenario>\n", argv0);
+    fprintf(fp, "Options:\n");
+    fprintf(fp, "  -n<messages>          Messages to submit (default: 100)\n");
+    fprintf(fp, "  -i<ms>                Interval between submissions (default: 50)\n");
+    fprintf(fp, "  -t<ms>                psmsd modem command timeout (default: 2000)\n");
+    fprintf(fp, "  -w<ms>                Wait for messages after the last (default: 40000)\n");
+    fprintf(fp, "  -r<ms>                Maximum stall (recovery time)\n");
+    fprintf(fp, "  -p<ms>                Maximum 99th percentile queue latency\n");
+    fprintf(fp, "  -q<ms>                Maximum queue latency\n");
+    fprintf(fp, "  -l<messages>          Maximum lost messages (default: 0)\n");
+    fprintf(fp, "  -P<dir>               Directory with psmsd and psmsd-sim (default: .)\n");
+    fprintf(fp, "  -k                    Keep the work directory\n");
+    fprintf(fp, "  -v                    Verbose (debug output of both in the logs)\n");
+}
+
+
+/* Returns the index of the first non-option argument */
+static int
+options(int argc,
+	char *argv[],
+	char *argv0)
+{
+    int i, *ip;
+
+
+    for (i = 0; i < argc && argv[i][0] == '-'; i++)
+    {
+	switch (argv[i][1])
+	{
+	  case 'n': ip = &nmsgs; break;
+	  case 'i': ip = &interval; break;
+	  case 't': ip = &cmd_timeout; break;
+	  case 'w': ip = &wait_ms; break;
+	  case 'r': ip = &max_stall; break;
+	  case 'p': ip = &max_p99; break;
+	  case 'q': ip = &max_latency; break;
+	  case 'l': ip = &max_lost; break;
+
+	  case 'P':
+	    bindir = strdup(argv[i]+2);
+	    continue;
+	    
+	  case 'k':
+	    keep = 1;
+	    continue;
+	    
+	  case 'v':
+	    verbose = 1;
+	    continue;
+	    
+	  case 'h':
+	    usage(stdout, argv0);
+	    exit(0);
+	    
+	  default:
+	    usage(stderr, argv0);
+	    exit(2);
+	}
+
+	if (sscanf(argv[i]+2, "%d", ip) != 1 || *ip < 0)
+	{
+	    fprintf(stderr, "%s: Invalid argument for -%c\n", argv0, argv[i][1]);
+	    exit(2);
+	}
+    }
+
+    return i;
+}
+
+
+/* Default options from the "#!" lines of the scenario */
+static void
+scenario_options(const char *path,
+		 char *argv0)
+{
+    FILE *fp;
+    char buf[256], *av[32], *cp;
+    int ac;
+
+
+    fp = fopen(path, "r");
+    if (!fp)
+    {
+	fprintf(stderr, "%s: %s: %s\n", argv0, path, strerror(errno));
+	exit(2);
+    }
+
+    while (fgets(buf, sizeof(buf), fp))
+    {
+	if (strncmp(buf, "#!", 2) != 0)
+	    continue;
+	
+	ac = 0;
+	for (cp = strtok(buf+2, " \t\r\n"); cp && ac < 32; cp = strtok(NULL, " \t\r\n"))
+	    av[ac++] = strdup(cp);
+	
+	if (options(ac, av, argv0) != ac)
+	{
+	    fprintf(stderr, "%s: %s: Invalid options\n", argv0, path);
+	    exit(2);
+	}
+    }
+    fclose(fp);
+}
+
+
+static void
+sent_line(const char *phone,
+	  const char *text,
+	  void *xp)
+{
+    int *delivered = (int *) xp;
+    int i;
+
+    
+    if (strcmp(phone, PHONE) != 0)
+	return;
+    
+    if (sscanf(text, "msg-%d", &i) == 1 && i >= 0 && i < nmsgs && !msgs[i].sent)
+    {
+	msgs[i].sent = ms_now();
+	++*delivered;
+    }
+}
+
+
+static int
+cmp_sent(const void *a,
+	 const void *b)
+{
+    const MSG *x = a, *y = b;
+
+    return cmp_ll(&x->sent, &y->sent);
+}
+
+
+int
+main(int argc,
+     char *argv[])
+{
+    char sim[256], psmsd[256], sock[128], sent[128], fifo[128], cfile[128], ufile[128];
+    char log1[128], log2[128], topt[32], fopt[256], sopt[160], oopt[160], Fopt[160], Copt[160], Uopt[160];
+    char buf[128];
+    char *sim_argv[8], *psmsd_argv[10];
+    pid_t sim_pid = -1, psmsd_pid = -1;
+    long long t0, next, last = 0, *lat, prev, start, stall = 0;
+    int i, n, fifo_fd = -1, sent_fd = -1, submitted = 0, delivered = 0, ndone, failed = 0;
+    const char *scenario, *name;
+
+
+    for (i = 1; i < argc && argv[i][0] == '-'; i++)
+	;
+    if (i != argc-1)
+    {
+	usage(stderr, argv[0]);
+	exit(2);
+    }
+    scenario = argv[i];
+    name = strrchr(scenario, '/') ? strrchr(scenario, '/')+1 : scenario;
+    
+    scenario_options(scenario, argv[0]);
+    options(argc-2, argv+1, argv[0]);
+
+    msgs = calloc(nmsgs, sizeof(MSG));
+    lat = calloc(nmsgs+1, sizeof(long long));
+    if (!msgs || !lat)
+    {
+	perror("malloc");
+	exit(2);
+    }
+    
+    signal(SIGPIPE, SIG_IGN);
+    
+    strcpy(dir, "/tmp/faultrun.XXXXXX");
+    if (!mkdtemp(dir))
+    {
+	perror("mkdtemp");
+	exit(2);
+    }
+    
+    snprintf(sim, sizeof(sim), "%s/psmsd-sim", bindir);
+    snprintf(psmsd, sizeof(psmsd), "%s/psmsd", bindir);
+    snprintf(sock, sizeof(sock), "%s/modem", dir);
+    snprintf(sent, sizeof(sent), "%s/sent", dir);
+    snprintf(fifo, sizeof(fifo), "%s/fifo", dir);
+    snprintf(cfile, sizeof(cfile), "%s/commands.dat", dir);
+    snprintf(ufile, sizeof(ufile), "%s/users.dat", dir);
+    snprintf(log1, sizeof(log1), "%s/psmsd-sim.log", dir);
+    snprintf(log2, sizeof(log2), "%s/psmsd.log", dir);
+
+    close(open(cfile, O_WRONLY|O_CREAT, 0644));
+    close(open(ufile, O_WRONLY|O_CREAT, 0644));
+    close(open(sent, O_WRONLY|O_CREAT, 0644));
+    
+    /* The simulated modem */
+    snprintf(sopt, sizeof(sopt), "-s%s", sock);
+    snprintf(oopt, sizeof(oopt), "-o%s", sent);
+    snprintf(fopt, sizeof(fopt), "-f%s", scenario);
+    n = 0;
+    sim_argv[n++] = sim;
+    sim_argv[n++] = sopt;
+    sim_argv[n++] = oopt;
+    sim_argv[n++] = fopt;
+    if (verbose)
+	sim_argv[n++] = "-vv";
+    sim_argv[n] = NULL;
+    
+    sim_pid = spawn(sim_argv, log1, O_TRUNC);
+    if (sim_pid < 0 || wait_path(sock, 5000) < 0)
+    {
+	fprintf(stderr, "%s: %s: Did not start (see %s)\n", argv[0], sim, log1);
+	failed = 2;
+	goto End;
+    }
+
+    /* The daemon, in the foreground */
+    snprintf(topt, sizeof(topt), "-S%d", cmd_timeout);
+    snprintf(Fopt, sizeof(Fopt), "-F%s", fifo);
+    snprintf(Copt, sizeof(Copt), "-C%s", cfile);
+    snprintf(Uopt, sizeof(Uopt), "-U%s", ufile);
+    n = 0;
+    psmsd_argv[n++] = psmsd;
+    psmsd_argv[n++] = verbose ? "-d2" : "-d";
+    psmsd_argv[n++] = topt;
+    psmsd_argv[n++] = Fopt;
+    psmsd_argv[n++] = Copt;
+    psmsd_argv[n++] = Uopt;
+    psmsd_argv[n++] = sock;
+    psmsd_argv[n] = NULL;
+    
+    psmsd_pid = spawn(psmsd_argv, log2, O_TRUNC);
+    t0 = ms_now();
+    while (psmsd_pid > 0 && (fifo_fd = open(fifo, O_WRONLY|O_NONBLOCK)) < 0 && ms_now() - t0 < 5000)
+	usleep(10000);
+    sent_fd = open(sent, O_RDONLY);
+    if (fifo_fd < 0 || sent_fd < 0)
+    {
+	fprintf(stderr, "%s: %s: Did not start (see %s)\n", argv[0], psmsd, log2);
+	failed = 2;
+	goto End;
+    }
+
+    /* Wait for the modem to be up */
+    n = snprintf(buf, sizeof(buf), "%s ready\n", PHONE);
+    if (write(fifo_fd, buf, n) != n)
+	perror("write");
+    
+    while (!sent_read(sent_fd, sent_line, &delivered))
+    {
+	if (ms_now() - t0 > 30000)
+	{
+	    fprintf(stderr, "%s: psmsd did not send anything in 30 s (see %s)\n", argv[0], log2);
+	    failed = 2;
+	    goto End;
+	}
+	usleep(5000);
+    }
+
+    next = ms_now();
+    while (delivered < nmsgs && (submitted < nmsgs || ms_now() - last < wait_ms))
+    {
+	if (submitted < nmsgs && ms_now() >= next)
+	{
+	    n = snprintf(buf, sizeof(buf), "%s msg-%d\n", PHONE, submitted);
+	    msgs[submitted].submitted = last = ms_now();
+	    if (write(fifo_fd, buf, n) != n)
+		perror("write");
+	    submitted++;
+	    next += interval;
+	}
+
+	(void) sent_read(sent_fd, sent_line, &delivered);
+	usleep(1000);
+    }
+
+    /* Queue latency, and stalls: waiting for the oldest message with none sent */
+    qsort(msgs, nmsgs, sizeof(MSG), cmp_sent);
+    for (i = ndone = 0, prev = 0; i < nmsgs; i++)
+    {
+	if (!msgs[i].sent)
+	    continue;
+	
+	lat[ndone++] = msgs[i].sent - msgs[i].submitted;
+	start = prev > msgs[i].submitted ? prev : msgs[i].submitted;
+	if (msgs[i].sent - start > stall)
+	    stall = msgs[i].sent - start;
+	prev = msgs[i].sent;
+    }
+    qsort(lat, ndone, sizeof(long long), cmp_ll);
+    if (!ndone)
+	lat[ndone++] = 0;
+
+    printf("%s: %d messages, %d sent, %d lost\n", name, nmsgs, delivered, nmsgs-delivered);
+    printf("%s: latency p50 %lld ms, p99 %lld ms, max %lld ms, longest stall %lld ms\n",
+	   name, lat[(ndone-1)/2], lat[(ndone-1)*99/100], lat[ndone-1], stall);
+
+    if (nmsgs-delivered > max_lost)
+    {
+	printf("%s: FAIL: %d messages lost (at most %d)\n", name, nmsgs-delivered, max_lost);
+	failed = 1;
+    }
+    if (max_stall >= 0 && stall > max_stall)
+    {
+	printf("%s: FAIL: Stalled for %lld ms (at most %d)\n", name, stall, max_stall);
+	failed = 1;
+    }
+    if (max_p99 >= 0 && lat[(ndone-1)*99/100] > max_p99)
+    {
+	printf("%s: FAIL: 99th percentile latency %lld ms (at most %d)\n", name, lat[(ndone-1)*99/100], max_p99);
+	failed = 1;
+    }
+    if (max_latency >= 0 && lat[ndone-1] > max_latency)
+    {
+	printf("%s: FAIL: Latency %lld ms (at most %d)\n", name, lat[ndone-1], max_latency);
+	failed = 1;
+    }
+
+  End:
+    stop(psmsd_pid);
+    stop(sim_pid);
+
+    if (failed || keep)
+	printf("%s: Logs kept in %s\n", name, dir);
+    else
+    {
+	unlink(sock);
+	unlink(sent);
+	unlink(fifo);
+	unlink(cfile);
+	unlink(ufile);
+	unlink(log1);
+	unlink(log2);
+	rmdir(dir);
+    }
+    
+    exit(failed);
+}
@@ -0,0 +1,237 @@
+/*
+ * qbench.c - Contention benchmark of QUEUE and MPSC
+ *
+ * Copyright (c) 2016-2020 Peter Eriksson <pen@lysator.liu.se>
+ *
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Producer threads put items to one consumer thread, as the fifo,
+ * door and worker threads do with the modem queue, through QUEUE
+ * (mutex, condition variable and an allocated entry per item) and
+ * through MPSC (intrusive nodes, an atomic exchange per item and a
+ * futex wakeup only when the consumer sleeps). Reports the time per
+ * item and the wakeups for 1, 2, 4 ... producers. With -w the
+ * consumer spends that many ns on each item, like a busy modem.
+ *
+ * Usage: qbench [-n<items per producer>] [-p<max producers>] [-w<ns>]
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "queue.h"
+#include "mpsc.h"
+
+
+typedef struct item
+{
+    MPSC_NODE node;	/* First */
+    int producer;
+    int seq;
+} ITEM;
+
+typedef struct prod
+{
+    pthread_t tid;
+    int id;
+    ITEM *items;
+} PROD;
+
+
+static int nitems = 200000;
+static int max_producers = 8;
+static int work_ns = 0;
+
+static QUEUE *qq;
+static MPSC *mq;
+static pthread_barrier_t start;
+
+
+static double
+now_s(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+static void
+work(void)
+{
+    struct timespec t0, t;
+
+    if (!work_ns)
+	return;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    do
+	clock_gettime(CLOCK_MONOTONIC, &t);
+    while ((t.tv_sec - t0.tv_sec) * 1000000000L + (t.tv_nsec - t0.tv_nsec) < work_ns);
+}
+
+
+static void *
+queue_producer(void *misc)
+{
+    PROD *pp = (PROD *) misc;
+    int i;
+
+    pthread_barrier_wait(&start);
+    for (i = 0; i < nitems; i++)
+	queue_put(qq, &pp->items[i]);
+    return NULL;
+}
+
+
+static void *
+mpsc_producer(void *misc)
+{
+    PROD *pp = (PROD *) misc;
+    int i;
+
+    pthread_barrier_wait(&start);
+    for (i = 0; i < nitems; i++)
+	mpsc_put(mq, &pp->items[i].node);
+    return NULL;
+}
+
+
+/* Returns seconds, checks that each producer's items come in order */
+static double
+run(int use_mpsc,
+    int np)
+{
+    PROD *pv;
+    ITEM *ip;
+    int *next, i, n = np * nitems;
+    double t0, t1;
+    
+
+    pv = calloc(np, sizeof(*pv));
+    next = calloc(np, sizeof(*next));
+    for (i = 0; i < np; i++)
+    {
+	int k;
+	
+	pv[i].id = i;
+	pv[i].items = calloc(nitems, sizeof(ITEM));
+	for (k = 0; k < nitems; k++)
+	{
+	    pv[i].items[k].producer = i;
+	    pv[i].items[k].seq = k;
+	}
+    }
+
+    pthread_barrier_init(&start, NULL, np+1);
+    for (i = 0; i < np; i++)
+	pthread_create(&pv[i].tid, NULL, use_mpsc ? mpsc_producer : queue_producer, &pv[i]);
+
+    pthread_barrier_wait(&start);
+    t0 = now_s();
+    for (i = 0; i < n; i++)
+    {
+	ip = use_mpsc ? (ITEM *) mpsc_wait(mq) : (ITEM *) queue_get(qq);
+	if (ip->seq != next[ip->producer]++)
+	{
+	    fprintf(stderr, "qbench: Producer %d: item %d out of order\n", ip->producer, ip->seq);
+	    exit(1);
+	}
+	work();
+    }
+    t1 = now_s();
+
+    for (i = 0; i < np; i++)
+    {
+	pthread_join(pv[i].tid, NULL);
+	free(pv[i].items);
+    }
+    pthread_barrier_destroy(&start);
+    free(pv);
+    free(next);
+    
+    return t1 - t0;
+}
+
+
+int
+main(int argc,
+     char *argv[])
+{
+    int i, np;
+    double tq, tm;
+    unsigned long w0;
+
+
+    for (i = 1; i < argc && argv[i][0] == '-'; i++)
+	switch (argv[i][1])
+	{
+	  case 'n':
+	    nitems = atoi(argv[i]+2);
+	    break;
+	  case 'p':
+	    max_producers = atoi(argv[i]+2);
+	    break;
+	  case 'w':
+	    work_ns = atoi(argv[i]+2);
+	    break;
+	  default:
+	    fprintf(stderr, "Usage: %s [-n<items per producer>] [-p<max producers>] [-w<ns>]\n", argv[0]);
+	    exit(1);
+	}
+
+    qq = queue_create();
+    mq = mpsc_create(NULL, NULL);
+    if (!qq || !mq)
+    {
+	perror("qbench");
+	exit(1);
+    }
+    
+    printf("%d items per producer, consumer work %d ns per item\n", nitems, work_ns);
+    printf("%9s  %14s  %14s  %12s\n", "producers", "QUEUE ns/item", "MPSC ns/item", "MPSC wakeups");
+    for (np = 1; np <= max_producers; np *= 2)
+    {
+	tq = run(0, np);
+	w0 = mq->wakeups;
+	tm = run(1, np);
+	printf("%9d  %14.1f  %14.1f  %12lu\n", np,
+	       tq * 1e9 / (np * (double) nitems), tm * 1e9 / (np * (double) nitems),
+	       mq->wakeups - w0);
+    }
+
+    queue_destroy(qq);
+    mpsc_destroy(mq);
+    exit(0);
+}
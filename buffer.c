@@ -38,6 +38,7 @@
 #include <sys/stat.h>
 
 #include "buffer.h"
+#include "arena.h"
 
 
 void
@@ -46,14 +47,26 @@ buf_init(BUFFER *bp)
     bp->buf = NULL;
     bp->size = 0;
     bp->len = 0;
+    bp->arena = NULL;
+}
+
+/* A buffer that grows in 'ap', and is freed with it */
+void
+buf_init_arena(BUFFER *bp,
+	       ARENA *ap)
+{
+    buf_init(bp);
+    bp->arena = ap;
 }
 
 void
 buf_clear(BUFFER *bp)
 {
+    ARENA *ap = bp->arena;
+    
     if (bp->buf)
-	free(bp->buf);
-    buf_init(bp);
+	arena_free(ap, bp->buf);
+    buf_init_arena(bp, ap);
 }
 
 BUFFER *
@@ -84,9 +97,12 @@ buf_putc(BUFFER *bp,
     if (bp->len >= bp->size)
     {
 	if (!bp->buf)
-	    bp->buf = malloc((bp->size = 256)+1);
+	    bp->buf = arena_alloc(bp->arena, (bp->size = 256)+1);
 	else
-	    bp->buf = realloc(bp->buf, (bp->size += 256)+1);
+	{
+	    bp->buf = arena_realloc(bp->arena, bp->buf, bp->size+1, bp->size+256+1);
+	    bp->size += 256;
+	}
 	if (!bp->buf)
 	    return -1;
 	
@@ -153,7 +169,7 @@ buf_load(BUFFER *bp,
     nsize = sb.st_size + bp->len;
     if (nsize >= bp->size)
     {
-	char *nbuf = realloc(bp->buf, nsize+1);
+	char *nbuf = arena_realloc(bp->arena, bp->buf, bp->buf ? bp->size+1 : 0, nsize+1);
 	
 	if (!nbuf)
 	    return -1;
@@ -39,12 +39,17 @@ typedef struct buffer
     char *buf;
     int len;
     int size;
+    struct arena *arena;	/* Where buf is from, NULL: malloc() */
 } BUFFER;
 
 
 extern void
 buf_init(BUFFER *bp);
 
+extern void
+buf_init_arena(BUFFER *bp,
+	       struct arena *ap);
+
 extern void
 buf_clear(BUFFER *bp);
 
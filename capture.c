@@ -0,0 +1,205 @@
+/*
+ * capture.c - Modem traffic capture
+ *
+ * Copyright (c) 2016-2020 Peter Eriksson <pen@lysator.liu.se>
+ *
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
+
+#include "capture.h"
+
+
+/* Start (or append to) a capture. Records are written a line at a time */
+CAPTURE *
+capture_open(const char *path,
+	     const char *device)
+{
+    CAPTURE *cp;
+    char tbuf[64];
+    time_t now;
+    struct tm tm;
+
+
+    cp = calloc(1, sizeof(*cp));
+    if (!cp)
+	return NULL;
+
+    cp->fp = fopen(path, "a");
+    if (!cp->fp)
+    {
+	free(cp);
+	return NULL;
+    }
+    setvbuf(cp->fp, NULL, _IOLBF, 0);
+    
+    clock_gettime(CLOCK_MONOTONIC, &cp->t0);
+    time(&now);
+    localtime_r(&now, &tm);
+    strftime(tbuf, sizeof(tbuf), "%Y-%m-%d %H:%M:%S", &tm);
+    fprintf(cp->fp, "# psmsd capture 1\n# device %s\n# start %s\n", device, tbuf);
+    
+    return cp;
+}
+
+
+void
+capture_close(CAPTURE *cp)
+{
+    if (!cp)
+	return;
+    
+    fclose(cp->fp);
+    free(cp);
+}
+
+
+/* One record for a write of several buffers, such as a command line */
+void
+capture_recordv(CAPTURE *cp,
+		int dir,
+		const struct iovec *iov,
+		int iovcnt)
+{
+    struct timespec ts;
+    char obuf[4096];
+    int i, k, n = 0;
+    
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    fprintf(cp->fp, "%lld %c ",
+	    (long long) (ts.tv_sec - cp->t0.tv_sec) * 1000000 + (ts.tv_nsec - cp->t0.tv_nsec) / 1000,
+	    dir);
+
+    for (k = 0; k < iovcnt; k++)
+    {
+	for (i = 0; i < (int) iov[k].iov_len; i++)
+	{
+	    unsigned char c = ((const unsigned char *) iov[k].iov_base)[i];
+	    
+	    if (n > (int) sizeof(obuf)-8)
+	    {
+		fwrite(obuf, 1, n, cp->fp);
+		n = 0;
+	    }
+	    
+	    if (c == '\r')
+		n += sprintf(obuf+n, "\\r");
+	    else if (c == '\n')
+		n += sprintf(obuf+n, "\\n");
+	    else if (c == '\\')
+		n += sprintf(obuf+n, "\\\\");
+	    else if (c < 0x20 || c > 0x7E)
+		n += sprintf(obuf+n, "\\x%02X", c);
+	    else
+		obuf[n++] = c;
+	}
+	cp->bytes += iov[k].iov_len;
+    }
+    obuf[n++] = '\n';
+    fwrite(obuf, 1, n, cp->fp);
+    
+    cp->records++;
+}
+
+
+void
+capture_record(CAPTURE *cp,
+	       int dir,
+	       const char *buf,
+	       int len)
+{
+    struct iovec iov;
+
+    iov.iov_base = (void *) buf;
+    iov.iov_len = len;
+    capture_recordv(cp, dir, &iov, 1);
+}
+
+
+static int
+hexval(int c)
+{
+    if (isdigit(c))
+	return c-'0';
+    return toupper(c)-'A'+10;
+}
+
+
+/*
+ * Read the next record of a capture into 'buf' (unescaped). Returns
+ * the number of bytes, or -1 at the end of the file. Lines that are
+ * not records are skipped.
+ */
+int
+capture_read(FILE *fp,
+	     long long *usec,
+	     int *dir,
+	     char *buf,
+	     int size)
+{
+    char line[8192], *cp;
+    int len;
+
+
+    while (fgets(line, sizeof(line), fp))
+    {
+	/* "<usec> <dir> <data>", the data may start with a space */
+	*usec = strtoll(line, &cp, 10);
+	if (cp == line || cp[0] != ' ' ||
+	    (cp[1] != CAPTURE_FROM_MODEM && cp[1] != CAPTURE_TO_MODEM) || cp[2] != ' ')
+	    continue;
+	*dir = cp[1];
+
+	len = 0;
+	for (cp += 3; *cp && *cp != '\n' && len < size; cp++)
+	{
+	    if (*cp != '\\')
+		buf[len++] = *cp;
+	    else if (cp[1] == 'r')
+		buf[len++] = '\r', cp++;
+	    else if (cp[1] == 'n')
+		buf[len++] = '\n', cp++;
+	    else if (cp[1] == 'x' && isxdigit((unsigned char) cp[2]) && isxdigit((unsigned char) cp[3]))
+	    {
+		buf[len++] = hexval((unsigned char) cp[2])*16 + hexval((unsigned char) cp[3]);
+		cp += 3;
+	    }
+	    else if (cp[1])
+		buf[len++] = *++cp;
+	}
+	return len;
+    }
+
+    return -1;
+}
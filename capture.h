@@ -0,0 +1,91 @@
+/*
+ * capture.h - Modem traffic capture
+ *
+ * Copyright (c) 2016-2020 Peter Eriksson <pen@lysator.liu.se>
+ *
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <stdio.h>
+#include <time.h>
+#include <sys/uio.h>
+
+/*
+ * A capture of the modem conversation is a text file with a few "#"
+ * header lines and then one record per read from or write to the
+ * modem:
+ *
+ *   <usec> <dir> <data>
+ *
+ * where <usec> is the time since the capture started, <dir> is '<'
+ * (from the modem) or '>' (to the modem) and <data> is the bytes with
+ * CR, LF, backslash and anything not printable escaped as \r, \n, \\
+ * and \xHH.
+ */
+#define CAPTURE_FROM_MODEM	'<'
+#define CAPTURE_TO_MODEM	'>'
+
+typedef struct capture
+{
+    FILE *fp;
+    struct timespec t0;
+    unsigned long records;
+    unsigned long bytes;
+} CAPTURE;
+
+
+extern CAPTURE *
+capture_open(const char *path,
+	     const char *device);
+
+extern void
+capture_close(CAPTURE *cp);
+
+extern void
+capture_record(CAPTURE *cp,
+	       int dir,
+	       const char *buf,
+	       int len);
+
+extern void
+capture_recordv(CAPTURE *cp,
+		int dir,
+		const struct iovec *iov,
+		int iovcnt);
+
+extern int
+capture_read(FILE *fp,
+	     long long *usec,
+	     int *dir,
+	     char *buf,
+	     int size);
+
+#endif
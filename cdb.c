@@ -0,0 +1,559 @@
+/*
+ * cdb.c - Constant database (CDB) files
+ *
+ * Copyright (c) 2016-2020 Peter Eriksson <pen@lysator.liu.se>
+ *
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Reads and writes files in D. J. Bernstein's cdb format, so they
+ * can also be created and inspected with the standard cdb tools.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+
+#include "cdb.h"
+#include "strmisc.h"
+
+extern int debug;
+
+
+#define CDB_HDRSIZE	2048
+#define CDB_MAXKEY	1024
+
+
+static uint32_t
+cdb_hash(const char *key,
+	 int klen)
+{
+    uint32_t h = 5381;
+
+    while (klen-- > 0)
+	h = ((h << 5) + h) ^ (unsigned char) *key++;
+
+    return h;
+}
+
+
+static uint32_t
+cdb_unpack(const unsigned char *p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+
+static void
+cdb_pack(unsigned char *p,
+	 uint32_t v)
+{
+    p[0] = v;
+    p[1] = v >> 8;
+    p[2] = v >> 16;
+    p[3] = v >> 24;
+}
+
+
+static int
+cdb_read(int fd,
+	 void *buf,
+	 size_t len,
+	 uint32_t pos)
+{
+    char *cp = buf;
+    ssize_t rc;
+
+
+    while (len > 0)
+    {
+	while ((rc = pread(fd, cp, len, pos)) < 0 && errno == EINTR)
+	    ;
+	if (rc <= 0)
+	{
+	    if (rc == 0)
+		errno = EINVAL;
+	    return -1;
+	}
+
+	cp += rc;
+	pos += rc;
+	len -= rc;
+    }
+
+    return 0;
+}
+
+
+CDB *
+cdb_open(const char *path)
+{
+    CDB *cp;
+    unsigned char hdr[CDB_HDRSIZE];
+    int i;
+
+
+    cp = calloc(1, sizeof(*cp));
+    if (!cp)
+	return NULL;
+
+    while ((cp->fd = open(path, O_RDONLY)) < 0 && errno == EINTR)
+	;
+    if (cp->fd < 0)
+	goto Fail;
+
+    if (cdb_read(cp->fd, hdr, sizeof(hdr), 0) < 0)
+	goto Fail;
+
+    cp->eod = 0xFFFFFFFF;
+    for (i = 0; i < 256; i++)
+    {
+	cp->hpos[i] = cdb_unpack(hdr+i*8);
+	cp->hlen[i] = cdb_unpack(hdr+i*8+4);
+	if (cp->hpos[i] < CDB_HDRSIZE)
+	{
+	    errno = EINVAL;
+	    goto Fail;
+	}
+	if (cp->hpos[i] < cp->eod)
+	    cp->eod = cp->hpos[i];
+    }
+
+    return cp;
+
+  Fail:
+    if (debug)
+	fprintf(stderr, "CDB_OPEN: %s: %s\n", path, strerror(errno));
+    if (cp->fd >= 0)
+	close(cp->fd);
+    free(cp);
+    return NULL;
+}
+
+
+void
+cdb_close(CDB *cp)
+{
+    if (!cp)
+	return;
+
+    close(cp->fd);
+    free(cp);
+}
+
+
+/*
+ * Look up the first record with a key. The data is copied
+ * (NUL-terminated, possibly truncated) into 'buf'. Returns the
+ * data length, -1 if not found or -2 on errors.
+ */
+int
+cdb_find(CDB *cp,
+	 const char *key,
+	 int klen,
+	 char *buf,
+	 int bufsize)
+{
+    unsigned char rb[8];
+    char kbuf[CDB_MAXKEY];
+    uint32_t h, t, slot, n, hh, pos, rklen, dlen;
+
+
+    if (klen > CDB_MAXKEY)
+	return -1;
+
+    h = cdb_hash(key, klen);
+    t = h & 255;
+    if (cp->hlen[t] == 0)
+	return -1;
+
+    slot = (h >> 8) % cp->hlen[t];
+    for (n = 0; n < cp->hlen[t]; n++)
+    {
+	if (cdb_read(cp->fd, rb, 8, cp->hpos[t] + slot*8) < 0)
+	    return -2;
+
+	hh = cdb_unpack(rb);
+	pos = cdb_unpack(rb+4);
+	if (pos == 0)
+	    return -1;
+
+	if (hh == h)
+	{
+	    if (cdb_read(cp->fd, rb, 8, pos) < 0)
+		return -2;
+
+	    rklen = cdb_unpack(rb);
+	    dlen = cdb_unpack(rb+4);
+
+	    if (rklen == klen)
+	    {
+		if (cdb_read(cp->fd, kbuf, klen, pos+8) < 0)
+		    return -2;
+
+		if (memcmp(kbuf, key, klen) == 0)
+		{
+		    n = (dlen < bufsize-1 ? dlen : bufsize-1);
+		    if (cdb_read(cp->fd, buf, n, pos+8+klen) < 0)
+			return -2;
+		    buf[n] = '\0';
+		    return dlen;
+		}
+	    }
+	}
+
+	if (++slot == cp->hlen[t])
+	    slot = 0;
+    }
+
+    return -1;
+}
+
+
+/* Call a function for every record, in file order */
+int
+cdb_foreach(CDB *cp,
+	    int (*fcp)(const char *key, int klen, const char *data, int dlen, void *xp),
+	    void *xp)
+{
+    FILE *fp;
+    unsigned char rb[8];
+    char *buf = NULL;
+    uint32_t pos, klen, dlen, bsize = 0;
+    int fd, rc = 0;
+
+
+    fd = dup(cp->fd);
+    if (fd < 0)
+	return -1;
+
+    fp = fdopen(fd, "r");
+    if (!fp)
+    {
+	close(fd);
+	return -1;
+    }
+
+    if (fseek(fp, CDB_HDRSIZE, SEEK_SET) < 0)
+    {
+	fclose(fp);
+	return -1;
+    }
+
+    for (pos = CDB_HDRSIZE; pos < cp->eod; pos += 8+klen+dlen)
+    {
+	if (fread(rb, 1, 8, fp) != 8)
+	{
+	    rc = -1;
+	    break;
+	}
+
+	klen = cdb_unpack(rb);
+	dlen = cdb_unpack(rb+4);
+
+	if (klen+dlen+1 > bsize)
+	{
+	    char *nbuf = realloc(buf, bsize = klen+dlen+1);
+
+	    if (!nbuf)
+	    {
+		rc = -1;
+		break;
+	    }
+	    buf = nbuf;
+	}
+
+	if (fread(buf, 1, klen+dlen, fp) != klen+dlen)
+	{
+	    rc = -1;
+	    break;
+	}
+	buf[klen+dlen] = '\0';
+
+	rc = (*fcp)(buf, klen, buf+klen, dlen, xp);
+	if (rc)
+	    break;
+    }
+
+    free(buf);
+    fclose(fp);
+    return rc;
+}
+
+
+static int
+cdb_make_write(CDBMAKE *cmp,
+	       const void *data,
+	       int len)
+{
+    const char *cp = data;
+    int n;
+    ssize_t rc;
+
+
+    while (len > 0)
+    {
+	if (cmp->blen == sizeof(cmp->buf))
+	{
+	    for (n = 0; n < cmp->blen; n += rc)
+	    {
+		while ((rc = write(cmp->fd, cmp->buf+n, cmp->blen-n)) < 0 && errno == EINTR)
+		    ;
+		if (rc < 0)
+		    return -1;
+	    }
+	    cmp->blen = 0;
+	}
+
+	n = sizeof(cmp->buf) - cmp->blen;
+	if (n > len)
+	    n = len;
+
+	memcpy(cmp->buf+cmp->blen, cp, n);
+	cmp->blen += n;
+	cp += n;
+	len -= n;
+    }
+
+    return 0;
+}
+
+
+static int
+cdb_make_flush(CDBMAKE *cmp)
+{
+    ssize_t rc;
+    int n;
+
+
+    for (n = 0; n < cmp->blen; n += rc)
+    {
+	while ((rc = write(cmp->fd, cmp->buf+n, cmp->blen-n)) < 0 && errno == EINTR)
+	    ;
+	if (rc < 0)
+	    return -1;
+    }
+
+    cmp->blen = 0;
+    return 0;
+}
+
+
+/* Start writing a new cdb file. It replaces 'path' when finished */
+CDBMAKE *
+cdb_make_start(const char *path)
+{
+    CDBMAKE *cmp;
+    char tmppath[1024];
+
+
+    cmp = calloc(1, sizeof(*cmp));
+    if (!cmp)
+	return NULL;
+
+    snprintf(tmppath, sizeof(tmppath), "%s.%ld", path, (long) getpid());
+    cmp->path = s_dup(path);
+    cmp->tmppath = s_dup(tmppath);
+
+    while ((cmp->fd = open(tmppath, O_WRONLY|O_CREAT|O_TRUNC, 0644)) < 0 && errno == EINTR)
+	;
+    if (cmp->fd < 0)
+    {
+	free(cmp->path);
+	free(cmp->tmppath);
+	free(cmp);
+	return NULL;
+    }
+
+    memset(cmp->buf, 0, CDB_HDRSIZE);
+    cmp->blen = CDB_HDRSIZE;
+    cmp->pos = CDB_HDRSIZE;
+    return cmp;
+}
+
+
+int
+cdb_make_add(CDBMAKE *cmp,
+	     const char *key,
+	     int klen,
+	     const char *data,
+	     int dlen)
+{
+    unsigned char rb[8];
+
+
+    if (klen > CDB_MAXKEY || (uint64_t) cmp->pos + 8 + klen + dlen > 0xFFFFFFF0U)
+    {
+	errno = EFBIG;
+	return -1;
+    }
+
+    if (cmp->n == cmp->size)
+    {
+	uint32_t *nhv = realloc(cmp->hv, sizeof(uint32_t)*2*(cmp->size += 4096));
+
+	if (!nhv)
+	    return -1;
+	cmp->hv = nhv;
+    }
+
+    cdb_pack(rb, klen);
+    cdb_pack(rb+4, dlen);
+    if (cdb_make_write(cmp, rb, 8) < 0 ||
+	cdb_make_write(cmp, key, klen) < 0 ||
+	cdb_make_write(cmp, data, dlen) < 0)
+	return -1;
+
+    cmp->hv[2*cmp->n] = cdb_hash(key, klen);
+    cmp->hv[2*cmp->n+1] = cmp->pos;
+    cmp->n++;
+
+    cmp->pos += 8+klen+dlen;
+    return 0;
+}
+
+
+/* Write the hash tables and header, and move the file into place */
+int
+cdb_make_finish(CDBMAKE *cmp)
+{
+    uint32_t count[256], start[256], *sorted = NULL, *slots = NULL;
+    unsigned char hdr[CDB_HDRSIZE], rb[8];
+    uint32_t i, t, h, len, slot, maxlen = 0;
+    int rc = -1;
+
+
+    memset(count, 0, sizeof(count));
+    for (i = 0; i < cmp->n; i++)
+	count[cmp->hv[2*i] & 255]++;
+
+    /* Bucket the entries by table, keeping insertion order */
+    for (t = 0, i = 0; t < 256; t++)
+    {
+	start[t] = i;
+	i += count[t];
+	if (count[t] > maxlen)
+	    maxlen = count[t];
+    }
+
+    sorted = malloc(sizeof(uint32_t)*(cmp->n ? cmp->n : 1));
+    slots = malloc(sizeof(uint32_t)*2*(maxlen ? 2*maxlen : 1));
+    if (!sorted || !slots)
+	goto End;
+
+    {
+	uint32_t next[256];
+
+	memcpy(next, start, sizeof(next));
+	for (i = 0; i < cmp->n; i++)
+	    sorted[next[cmp->hv[2*i] & 255]++] = i;
+    }
+
+    for (t = 0; t < 256; t++)
+    {
+	len = 2*count[t];
+
+	cdb_pack(hdr+t*8, cmp->pos);
+	cdb_pack(hdr+t*8+4, len);
+
+	memset(slots, 0, sizeof(uint32_t)*2*len);
+	for (i = 0; i < count[t]; i++)
+	{
+	    h = cmp->hv[2*sorted[start[t]+i]];
+	    for (slot = (h >> 8) % len; slots[2*slot+1]; slot = (slot+1) % len)
+		;
+	    slots[2*slot] = h;
+	    slots[2*slot+1] = cmp->hv[2*sorted[start[t]+i]+1];
+	}
+
+	for (i = 0; i < len; i++)
+	{
+	    cdb_pack(rb, slots[2*i]);
+	    cdb_pack(rb+4, slots[2*i+1]);
+	    if (cdb_make_write(cmp, rb, 8) < 0)
+		goto End;
+	}
+
+	if ((uint64_t) cmp->pos + 8*len > 0xFFFFFFF0U)
+	{
+	    errno = EFBIG;
+	    goto End;
+	}
+	cmp->pos += 8*len;
+    }
+
+    if (cdb_make_flush(cmp) < 0 ||
+	pwrite(cmp->fd, hdr, sizeof(hdr), 0) != sizeof(hdr) ||
+	fsync(cmp->fd) < 0)
+	goto End;
+
+    rc = close(cmp->fd);
+    cmp->fd = -1;
+    if (rc == 0)
+	rc = rename(cmp->tmppath, cmp->path);
+
+  End:
+    free(sorted);
+    free(slots);
+    if (rc < 0)
+    {
+	cdb_make_abort(cmp);
+	return -1;
+    }
+
+    if (debug)
+	fprintf(stderr, "CDB_MAKE: Wrote %s (%u records, %u bytes)\n",
+		cmp->path, cmp->n, cmp->pos);
+
+    free(cmp->hv);
+    free(cmp->path);
+    free(cmp->tmppath);
+    free(cmp);
+    return 0;
+}
+
+
+void
+cdb_make_abort(CDBMAKE *cmp)
+{
+    if (!cmp)
+	return;
+
+    if (cmp->fd >= 0)
+	close(cmp->fd);
+    unlink(cmp->tmppath);
+    free(cmp->hv);
+    free(cmp->path);
+    free(cmp->tmppath);
+    free(cmp);
+}
@@ -0,0 +1,98 @@
+/*
+ * cdb.h - Constant database (CDB) files
+ *
+ * Copyright (c) 2016-2020 Peter Eriksson <pen@lysator.liu.se>
+ *
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef CDB_H
+#define CDB_H 1
+
+#include <stdint.h>
+
+
+typedef struct cdb
+{
+    int fd;
+    uint32_t eod;	/* End of records (start of hash tables) */
+    uint32_t hpos[256];
+    uint32_t hlen[256];
+} CDB;
+
+
+typedef struct cdb_make
+{
+    int fd;
+    char *path;
+    char *tmppath;
+    uint32_t pos;
+    uint32_t n;
+    uint32_t size;
+    uint32_t *hv;	/* Hash & position pairs */
+    char buf[8192];
+    int blen;
+} CDBMAKE;
+
+
+extern CDB *
+cdb_open(const char *path);
+
+extern void
+cdb_close(CDB *cp);
+
+extern int
+cdb_find(CDB *cp,
+	 const char *key,
+	 int klen,
+	 char *buf,
+	 int bufsize);
+
+extern int
+cdb_foreach(CDB *cp,
+	    int (*fcp)(const char *key, int klen, const char *data, int dlen, void *xp),
+	    void *xp);
+
+
+extern CDBMAKE *
+cdb_make_start(const char *path);
+
+extern int
+cdb_make_add(CDBMAKE *cmp,
+	     const char *key,
+	     int klen,
+	     const char *data,
+	     int dlen);
+
+extern int
+cdb_make_finish(CDBMAKE *cmp);
+
+extern void
+cdb_make_abort(CDBMAKE *cmp);
+
+#endif
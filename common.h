@@ -44,6 +44,8 @@
 
 #define FIFO_PATH "/etc/psmsd/fifo"
 
+#define CAPTURE_PATH "/var/tmp/psmsd.cap"
+
 
 #if HAVE_DOORS
 
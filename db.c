@@ -0,0 +1,1348 @@
+/*
+ * db.c - Compiled user & command database images
+ *
+ * Copyright (c) 2016-2020 Peter Eriksson <pen@lysator.liu.se>
+ *
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "db.h"
+#include "phone.h"
+#include "strmisc.h"
+
+extern int debug;
+
+
+#define DB_ALIGN(n)	(((n)+7) & ~((size_t) 7))
+
+
+/* Shared read-only mapping of an image file */
+struct dbmap
+{
+    void *base;
+    size_t size;
+    int refs;
+};
+
+static pthread_mutex_t map_mtx = PTHREAD_MUTEX_INITIALIZER;
+
+
+/* String table with interning, used while compiling */
+typedef struct stab
+{
+    char *buf;
+    uint32_t len;
+    uint32_t size;
+    uint32_t *slot;
+    uint32_t nslot;
+    uint32_t n;
+    int failed;
+} STAB;
+
+
+/* Growable array of 32-bit words, used while compiling */
+typedef struct wvec
+{
+    uint32_t *v;
+    uint32_t n;
+    uint32_t size;
+} WVEC;
+
+
+
+static uint32_t
+db_hash(const char *s,
+	int fold)
+{
+    uint32_t h = 2166136261U;
+    int c;
+
+
+    while ((c = (unsigned char) *s++) != 0)
+    {
+	if (fold)
+	    c = tolower(c);
+	h ^= c;
+	h *= 16777619U;
+    }
+
+    return h;
+}
+
+
+/* Hash of a phone number - by key if it is an E.164 number */
+static uint32_t
+db_phone_hash(uint64_t key,
+	      const char *s)
+{
+    if (!key)
+	return db_hash(s, 0);
+
+    key ^= key >> 33;
+    key *= 0xff51afd7ed558ccdULL;
+    key ^= key >> 33;
+    return (uint32_t) key;
+}
+
+
+static uint32_t
+db_slots(uint32_t n)
+{
+    uint32_t ns = 8;
+
+    while (ns < 2*n)
+	ns <<= 1;
+
+    return ns;
+}
+
+
+static int
+wvec_add(WVEC *vp,
+	 uint32_t w)
+{
+    if (vp->n == vp->size)
+    {
+	uint32_t *nv = realloc(vp->v, sizeof(*nv)*(vp->size += 128));
+
+	if (!nv)
+	    return -1;
+	vp->v = nv;
+    }
+
+    vp->v[vp->n++] = w;
+    return 0;
+}
+
+
+static int
+stab_init(STAB *sp)
+{
+    memset(sp, 0, sizeof(*sp));
+
+    sp->buf = malloc(sp->size = 4096);
+    sp->slot = calloc(sp->nslot = 1024, sizeof(*sp->slot));
+    if (!sp->buf || !sp->slot)
+    {
+	free(sp->buf);
+	free(sp->slot);
+	return -1;
+    }
+
+    /* Offset 0 is reserved for NULL */
+    sp->buf[0] = '\0';
+    sp->len = 1;
+    return 0;
+}
+
+
+static void
+stab_clear(STAB *sp)
+{
+    free(sp->buf);
+    free(sp->slot);
+    memset(sp, 0, sizeof(*sp));
+}
+
+
+static int
+stab_rehash(STAB *sp)
+{
+    uint32_t *nslot, nn, i, j, off;
+
+
+    nn = sp->nslot*2;
+    nslot = calloc(nn, sizeof(*nslot));
+    if (!nslot)
+	return -1;
+
+    for (i = 0; i < sp->nslot; i++)
+	if ((off = sp->slot[i]) != 0)
+	{
+	    for (j = db_hash(sp->buf+off, 0) & (nn-1); nslot[j]; j = (j+1) & (nn-1))
+		;
+	    nslot[j] = off;
+	}
+
+    free(sp->slot);
+    sp->slot = nslot;
+    sp->nslot = nn;
+    return 0;
+}
+
+
+/* Add (or locate an identical) string, returns its offset */
+static uint32_t
+stab_add(STAB *sp,
+	 const char *s)
+{
+    uint32_t i, off, len;
+
+
+    if (!s || !*s || sp->failed)
+	return 0;
+
+    if (2*(sp->n+1) > sp->nslot && stab_rehash(sp) < 0)
+	goto Fail;
+
+    for (i = db_hash(s, 0) & (sp->nslot-1); (off = sp->slot[i]) != 0; i = (i+1) & (sp->nslot-1))
+	if (strcmp(sp->buf+off, s) == 0)
+	    return off;
+
+    len = strlen(s)+1;
+    while (sp->len+len > sp->size)
+    {
+	char *nbuf = realloc(sp->buf, sp->size *= 2);
+
+	if (!nbuf)
+	    goto Fail;
+	sp->buf = nbuf;
+    }
+
+    off = sp->len;
+    memcpy(sp->buf+off, s, len);
+    sp->len += len;
+    sp->slot[i] = off;
+    sp->n++;
+    return off;
+
+  Fail:
+    sp->failed = 1;
+    return 0;
+}
+
+
+/* Insert record 'idx' into a hash index at the given hash value */
+static void
+db_index_put(uint32_t *slot,
+	     uint32_t nslot,
+	     uint32_t h,
+	     uint32_t idx)
+{
+    uint32_t i;
+
+
+    for (i = h & (nslot-1); slot[i]; i = (i+1) & (nslot-1))
+	;
+    slot[i] = idx+1;
+}
+
+
+/* Insert record 'idx' into a hash index with the given key string */
+static void
+db_index_add(uint32_t *slot,
+	     uint32_t nslot,
+	     const char *key,
+	     int fold,
+	     uint32_t idx)
+{
+    if (key)
+	db_index_put(slot, nslot, db_hash(key, fold), idx);
+}
+
+
+/* Locate (or add) a command name in the ACL vocabulary */
+static uint32_t
+db_acl_voc(STAB *sp,
+	   WVEC *voc,
+	   WVEC *vhash,
+	   const char *name)
+{
+    uint32_t i, v, ns;
+
+
+    if (2*(voc->n+1) > vhash->n)
+    {
+	ns = vhash->n ? vhash->n*2 : 64;
+	free(vhash->v);
+	vhash->v = calloc(ns, sizeof(uint32_t));
+	if (!vhash->v)
+	{
+	    vhash->n = 0;
+	    sp->failed = 1;
+	    return 0;
+	}
+	vhash->n = vhash->size = ns;
+
+	for (v = 0; v < voc->n; v++)
+	    db_index_add(vhash->v, ns, sp->buf+voc->v[v], 1, v);
+    }
+
+    for (i = db_hash(name, 1) & (vhash->n-1); (v = vhash->v[i]) != 0; i = (i+1) & (vhash->n-1))
+	if (strcasecmp(sp->buf+voc->v[v-1], name) == 0)
+	    return v-1;
+
+    if (wvec_add(voc, stab_add(sp, name)) < 0)
+    {
+	sp->failed = 1;
+	return 0;
+    }
+
+    vhash->v[i] = voc->n;
+    return voc->n-1;
+}
+
+
+static int
+db_parse_users(FILE *fp,
+	       STAB *sp,
+	       WVEC *recs,
+	       WVEC *acls,
+	       WVEC *voc,
+	       WVEC *vhash)
+{
+    char buf[1024], pbuf[PHONE_MAX], *name, *pass, *phone, *acl, *cp, *endp;
+    DBUSER u;
+    uint32_t *w;
+    int i;
+
+
+    while (fgets(buf, sizeof(buf), fp))
+    {
+	name = strtok_r(buf, " \t\r\n", &endp);
+	if (!name || *name == '#')
+	    continue;
+
+	phone = strtok_r(NULL, " \t\n\r", &endp);
+	if (!phone)
+	    continue;
+
+	pass = strtok_r(NULL, " \t\n\r", &endp);
+	if (!pass)
+	    continue;
+
+	acl = strtok_r(NULL, "\n\r", &endp);
+
+	if (acl)
+	    while (isspace(*acl))
+		++acl;
+
+	if (debug > 1)
+	    fprintf(stderr,
+		    "DB_COMPILE: User: Name=%s, Phone=%s, Pass=%s, Acl=%s\n",
+		    name, phone, pass, acl ? acl : "<none>");
+
+	/* Phone numbers are stored normalized */
+	if (phone_normalize(phone, pbuf, sizeof(pbuf)) >= 0)
+	    phone = pbuf;
+
+	memset(&u, 0, sizeof(u));
+	u.name = stab_add(sp, name);
+	u.phone = stab_add(sp, phone);
+	u.phone_key = phone_key(phone);
+	u.pass = stab_add(sp, pass);
+	u.acl = stab_add(sp, acl);
+
+	/* ACL entries are kept as a 0-terminated list of vocabulary index+1 */
+	if (acl && strcmp(acl, "*") == 0)
+	    u.flags |= DB_USER_ACL_ALL;
+	else if (acl)
+	{
+	    cp = strtok_r(acl, "|", &endp);
+	    while (cp)
+	    {
+		if (wvec_add(acls, db_acl_voc(sp, voc, vhash, cp)+1) < 0)
+		    return -1;
+		cp = strtok_r(NULL, "|", &endp);
+	    }
+	}
+	if (wvec_add(acls, 0) < 0)
+	    return -1;
+
+	for (w = (uint32_t *) &u, i = 0; i < sizeof(u)/sizeof(*w); i++)
+	    if (wvec_add(recs, w[i]) < 0)
+		return -1;
+    }
+
+    return sp->failed ? -1 : 0;
+}
+
+
+static int
+db_parse_commands(FILE *fp,
+		  STAB *sp,
+		  WVEC *recs)
+{
+    char buf[1024], *name, *user, *path, *argv, *tmp, *endp;
+    int level;
+    DBCMD c;
+    uint32_t *w;
+    int i;
+
+
+    while (fgets(buf, sizeof(buf), fp))
+    {
+	name = strtok_r(buf, " \t\r\n", &endp);
+	if (!name || *name == '#')
+	    continue;
+
+	tmp = strtok_r(NULL, " \t\r\n", &endp);
+	if (!tmp)
+	    continue;
+	if (sscanf(tmp, "%u", &level) != 1)
+	{
+	    if (strcmp(tmp, "*") == 0 || strcmp(tmp, "all") == 0)
+		level = 0;
+	    else if (strcmp(tmp, "phone") == 0)
+		level = 1;
+	    else if (strcmp(tmp, "login") == 0)
+		level = 2;
+	    else
+		level = 3;
+	}
+
+	user = strtok_r(NULL, " \t\r\n", &endp);
+	if (!user)
+	    continue;
+
+	path = strtok_r(NULL, " \t\r\n", &endp);
+	if (!path)
+	    continue;
+
+	argv = strtok_r(NULL, "\r\n", &endp);
+	if (!argv)
+	    continue;
+
+	while (isspace(*argv))
+	    ++argv;
+
+	if (debug > 1)
+	    fprintf(stderr, "DB_COMPILE: Command: Name=%s, Level=%d, Path=%s, Argv=%s\n",
+		    name, level, path, argv);
+
+	memset(&c, 0, sizeof(c));
+	c.name = stab_add(sp, name);
+	c.level = level;
+	c.user = stab_add(sp, user);
+	c.path = stab_add(sp, path);
+	c.argv = stab_add(sp, argv);
+
+	for (w = (uint32_t *) &c, i = 0; i < sizeof(c)/sizeof(*w); i++)
+	    if (wvec_add(recs, w[i]) < 0)
+		return -1;
+    }
+
+    return sp->failed ? -1 : 0;
+}
+
+
+/*
+ * Parse a users.dat or commands.dat text file into a section
+ */
+DB *
+db_compile(int type,
+	   const char *path)
+{
+    FILE *fp = NULL;
+    struct stat sb;
+    STAB st;
+    WVEC recs, acls, voc, vhash;
+    DB *dbp = NULL;
+    DBSECTHDR *hp;
+    char *base = NULL;
+    uint32_t *slot, *bits, nrec, rsize, i, k;
+    size_t size;
+    int rc;
+
+
+    if (debug)
+	fprintf(stderr, "DB_COMPILE: Start (%s)\n", path);
+
+    memset(&recs, 0, sizeof(recs));
+    memset(&acls, 0, sizeof(acls));
+    memset(&voc, 0, sizeof(voc));
+    memset(&vhash, 0, sizeof(vhash));
+
+    if (stab_init(&st) < 0)
+	return NULL;
+
+    fp = fopen(path, "r");
+    if (!fp)
+    {
+	if (debug)
+	    fprintf(stderr, "DB_COMPILE: fopen (%s) failed: %s\n", path, strerror(errno));
+	goto Fail;
+    }
+
+    if (fstat(fileno(fp), &sb) < 0)
+	goto Fail;
+
+    switch (type)
+    {
+      case DB_SECT_USERS:
+	rsize = sizeof(DBUSER);
+	rc = db_parse_users(fp, &st, &recs, &acls, &voc, &vhash);
+	break;
+
+      case DB_SECT_COMMANDS:
+	rsize = sizeof(DBCMD);
+	rc = db_parse_commands(fp, &st, &recs);
+	break;
+
+      default:
+	errno = EINVAL;
+	goto Fail;
+    }
+
+    if (rc < 0)
+	goto Fail;
+
+    dbp = calloc(1, sizeof(*dbp));
+    if (!dbp)
+	goto Fail;
+
+    nrec = recs.n*sizeof(uint32_t)/rsize;
+
+    /* Lay out the section */
+    size = DB_ALIGN(sizeof(DBSECTHDR));
+    dbp->src_mtime = sb.st_mtime;
+    dbp->src_size = sb.st_size;
+
+    {
+	DBSECTHDR h;
+
+	memset(&h, 0, sizeof(h));
+	h.type = type;
+	h.nrec = nrec;
+	h.rec_off = size;
+	size += DB_ALIGN(nrec*rsize);
+
+	h.nslot = db_slots(nrec);
+	h.name_off = size;
+	size += DB_ALIGN(h.nslot*sizeof(uint32_t));
+
+	if (type == DB_SECT_USERS)
+	{
+	    h.phone_off = size;
+	    size += DB_ALIGN(h.nslot*sizeof(uint32_t));
+
+	    h.nacl = voc.n;
+	    h.aclvoc_off = size;
+	    size += DB_ALIGN(voc.n*sizeof(uint32_t));
+
+	    h.aclslot = db_slots(voc.n);
+	    h.aclhash_off = size;
+	    size += DB_ALIGN(h.aclslot*sizeof(uint32_t));
+
+	    h.aclwords = (voc.n+31)/32;
+	    h.aclbits_off = size;
+	    size += DB_ALIGN((size_t) nrec*h.aclwords*sizeof(uint32_t));
+	}
+
+	h.str_off = size;
+	h.str_size = st.len;
+	size += DB_ALIGN(st.len);
+
+	if (size > UINT32_MAX)
+	{
+	    errno = EFBIG;
+	    goto Fail;
+	}
+	h.size = size;
+
+	base = calloc(1, size);
+	if (!base)
+	    goto Fail;
+
+	memcpy(base, &h, sizeof(h));
+    }
+
+    hp = (DBSECTHDR *) base;
+    memcpy(base+hp->rec_off, recs.v, nrec*rsize);
+    memcpy(base+hp->str_off, st.buf, st.len);
+
+    /* Build the hash indexes */
+    slot = (uint32_t *) (base+hp->name_off);
+    for (i = 0; i < nrec; i++)
+	db_index_add(slot, hp->nslot, st.buf + recs.v[i*rsize/sizeof(uint32_t)], 1, i);
+
+    if (type == DB_SECT_USERS)
+    {
+	const DBUSER *up = (const DBUSER *) (base+hp->rec_off);
+
+	slot = (uint32_t *) (base+hp->phone_off);
+	for (i = 0; i < nrec; i++)
+	    if (up[i].phone)
+		db_index_put(slot, hp->nslot,
+			     db_phone_hash(up[i].phone_key, st.buf+up[i].phone), i);
+
+	memcpy(base+hp->aclvoc_off, voc.v, voc.n*sizeof(uint32_t));
+
+	slot = (uint32_t *) (base+hp->aclhash_off);
+	for (i = 0; i < voc.n; i++)
+	    db_index_add(slot, hp->aclslot, st.buf+voc.v[i], 1, i);
+
+	/* Convert the per-user ACL lists into bitsets */
+	bits = (uint32_t *) (base+hp->aclbits_off);
+	for (i = k = 0; i < nrec; i++, k++)
+	{
+	    for (; acls.v[k]; k++)
+		bits[i*hp->aclwords + (acls.v[k]-1)/32] |= 1U << ((acls.v[k]-1)%32);
+	}
+    }
+
+    dbp->mem = base;
+    dbp->base = base;
+    dbp->hp = hp;
+
+    if (debug)
+	fprintf(stderr, "DB_COMPILE: Stop (%u records, %u strings, %lu bytes)\n",
+		nrec, st.n, (unsigned long) size);
+
+    fclose(fp);
+    stab_clear(&st);
+    free(recs.v);
+    free(acls.v);
+    free(voc.v);
+    free(vhash.v);
+    return dbp;
+
+  Fail:
+    if (debug)
+	fprintf(stderr, "DB_COMPILE: Failed (%s)\n", path);
+
+    if (fp)
+	fclose(fp);
+    stab_clear(&st);
+    free(recs.v);
+    free(acls.v);
+    free(voc.v);
+    free(vhash.v);
+    free(base);
+    free(dbp);
+    return NULL;
+}
+
+
+static int
+db_write(int fd,
+	 const void *buf,
+	 size_t len)
+{
+    const char *cp = buf;
+    ssize_t rc;
+
+
+    while (len > 0)
+    {
+	while ((rc = write(fd, cp, len)) < 0 && errno == EINTR)
+	    ;
+	if (rc < 0)
+	    return -1;
+
+	cp += rc;
+	len -= rc;
+    }
+
+    return 0;
+}
+
+
+/*
+ * Write sections to an image file. The new image is written to a
+ * temporary file and then renamed into place so readers never see
+ * a partial image.
+ */
+int
+db_save(const char *path,
+	DB *users,
+	DB *commands)
+{
+    DBFILEHDR fh;
+    DB *sv[2];
+    char tmppath[1024];
+    static const char zero[8];
+    uint64_t off;
+    int fd, i, ns = 0;
+
+
+    if (users)
+	sv[ns++] = users;
+    if (commands)
+	sv[ns++] = commands;
+
+    memset(&fh, 0, sizeof(fh));
+    memcpy(fh.magic, DB_MAGIC, sizeof(fh.magic));
+    fh.version = DB_VERSION;
+    fh.byteorder = DB_BYTEORDER;
+    fh.phonecfg = phone_config_id();
+    fh.nsect = ns;
+
+    off = DB_ALIGN(sizeof(fh));
+    for (i = 0; i < ns; i++)
+    {
+	fh.sect[i].type = sv[i]->hp->type;
+	fh.sect[i].offset = off;
+	fh.sect[i].size = sv[i]->hp->size;
+	fh.sect[i].src_mtime = sv[i]->src_mtime;
+	fh.sect[i].src_size = sv[i]->src_size;
+	off += DB_ALIGN(sv[i]->hp->size);
+    }
+
+    snprintf(tmppath, sizeof(tmppath), "%s.%ld", path, (long) getpid());
+    while ((fd = open(tmppath, O_WRONLY|O_CREAT|O_TRUNC, 0644)) < 0 && errno == EINTR)
+	;
+    if (fd < 0)
+    {
+	if (debug)
+	    fprintf(stderr, "DB_SAVE: open (%s) failed: %s\n", tmppath, strerror(errno));
+	return -1;
+    }
+
+    if (db_write(fd, &fh, sizeof(fh)) < 0 ||
+	db_write(fd, zero, DB_ALIGN(sizeof(fh))-sizeof(fh)) < 0)
+	goto Fail;
+
+    for (i = 0; i < ns; i++)
+	if (db_write(fd, sv[i]->base, sv[i]->hp->size) < 0 ||
+	    db_write(fd, zero, DB_ALIGN(sv[i]->hp->size)-sv[i]->hp->size) < 0)
+	    goto Fail;
+
+    if (fsync(fd) < 0 || close(fd) < 0)
+    {
+	fd = -1;
+	goto Fail;
+    }
+
+    if (rename(tmppath, path) < 0)
+    {
+	fd = -1;
+	goto Fail;
+    }
+
+    if (debug)
+	fprintf(stderr, "DB_SAVE: Wrote %s (%d sections, %lu bytes)\n",
+		path, ns, (unsigned long) off);
+    return 0;
+
+  Fail:
+    if (debug)
+	fprintf(stderr, "DB_SAVE: %s: %s\n", path, strerror(errno));
+    if (fd >= 0)
+	close(fd);
+    unlink(tmppath);
+    return -1;
+}
+
+
+/*
+ * Compile the text sources into an image file
+ */
+int
+db_build(const char *path,
+	 const char *users_path,
+	 const char *commands_path)
+{
+    DB *users = NULL, *commands = NULL;
+    int rc = -1;
+
+
+    if (!users_path && !commands_path)
+	return -1;
+
+    if (users_path && (users = db_compile(DB_SECT_USERS, users_path)) == NULL)
+	goto End;
+
+    if (commands_path && (commands = db_compile(DB_SECT_COMMANDS, commands_path)) == NULL)
+	goto End;
+
+    rc = db_save(path, users, commands);
+
+  End:
+    db_free(users);
+    db_free(commands);
+    return rc;
+}
+
+
+static int
+db_read_header(int fd,
+	       DBFILEHDR *fhp)
+{
+    ssize_t rc;
+
+
+    while ((rc = pread(fd, fhp, sizeof(*fhp), 0)) < 0 && errno == EINTR)
+	;
+
+    if (rc != sizeof(*fhp) ||
+	memcmp(fhp->magic, DB_MAGIC, sizeof(fhp->magic)) != 0 ||
+	fhp->version != DB_VERSION ||
+	fhp->byteorder != DB_BYTEORDER ||
+	fhp->phonecfg != phone_config_id() ||
+	fhp->nsect > 2)
+    {
+	errno = EINVAL;
+	return -1;
+    }
+
+    return 0;
+}
+
+
+static int
+db_src_stale(DBFILEHDR *fhp,
+	     int type,
+	     const char *src)
+{
+    struct stat sb;
+    int i;
+
+
+    if (!src)
+	return 0;
+
+    if (stat(src, &sb) < 0)
+	return 0;
+
+    for (i = 0; i < fhp->nsect; i++)
+	if (fhp->sect[i].type == type)
+	    return (fhp->sect[i].src_mtime != sb.st_mtime ||
+		    fhp->sect[i].src_size != sb.st_size);
+
+    return 1;
+}
+
+
+/*
+ * Check if an image is missing, unusable or out of date with respect
+ * to the text sources it was compiled from.
+ */
+int
+db_stale(const char *path,
+	 const char *users_path,
+	 const char *commands_path)
+{
+    DBFILEHDR fh;
+    int fd, rc;
+
+
+    while ((fd = open(path, O_RDONLY)) < 0 && errno == EINTR)
+	;
+    if (fd < 0)
+	return 1;
+
+    rc = db_read_header(fd, &fh);
+    close(fd);
+    if (rc < 0)
+	return 1;
+
+    return (db_src_stale(&fh, DB_SECT_USERS, users_path) ||
+	    db_src_stale(&fh, DB_SECT_COMMANDS, commands_path));
+}
+
+
+static int
+db_valid(const char *base,
+	 size_t size,
+	 int type)
+{
+    const DBSECTHDR *hp = (const DBSECTHDR *) base;
+    size_t rsize = (type == DB_SECT_USERS ? sizeof(DBUSER) : sizeof(DBCMD));
+
+
+    if (size < sizeof(*hp) || hp->type != type || hp->size != size)
+	return 0;
+
+    if (hp->nslot == 0 || (hp->nslot & (hp->nslot-1)) != 0 ||
+	hp->rec_off + (size_t) hp->nrec*rsize > size ||
+	hp->name_off + (size_t) hp->nslot*sizeof(uint32_t) > size ||
+	hp->str_size == 0 ||
+	hp->str_off + (size_t) hp->str_size > size ||
+	base[hp->str_off + hp->str_size - 1] != '\0')
+	return 0;
+
+    if (type == DB_SECT_USERS &&
+	(hp->aclslot == 0 || (hp->aclslot & (hp->aclslot-1)) != 0 ||
+	 hp->aclwords != (hp->nacl+31)/32 ||
+	 hp->phone_off + (size_t) hp->nslot*sizeof(uint32_t) > size ||
+	 hp->aclvoc_off + (size_t) hp->nacl*sizeof(uint32_t) > size ||
+	 hp->aclhash_off + (size_t) hp->aclslot*sizeof(uint32_t) > size ||
+	 hp->aclbits_off + (size_t) hp->nrec*hp->aclwords*sizeof(uint32_t) > size))
+	return 0;
+
+    return 1;
+}
+
+
+static void
+db_unmap(struct dbmap *mp)
+{
+    int refs;
+
+
+    pthread_mutex_lock(&map_mtx);
+    refs = --mp->refs;
+    pthread_mutex_unlock(&map_mtx);
+
+    if (refs == 0)
+    {
+	munmap(mp->base, mp->size);
+	free(mp);
+    }
+}
+
+
+/*
+ * Map an image file read-only and return its sections
+ */
+int
+db_open(const char *path,
+	DB **users,
+	DB **commands)
+{
+    DBFILEHDR fh;
+    struct dbmap *mp = NULL;
+    struct stat sb;
+    DB *dbp, **dbpp;
+    int fd, i;
+
+
+    *users = NULL;
+    *commands = NULL;
+
+    while ((fd = open(path, O_RDONLY)) < 0 && errno == EINTR)
+	;
+    if (fd < 0)
+	return -1;
+
+    if (fstat(fd, &sb) < 0 || db_read_header(fd, &fh) < 0)
+	goto Fail;
+
+    mp = calloc(1, sizeof(*mp));
+    if (!mp)
+	goto Fail;
+
+    mp->size = sb.st_size;
+    mp->base = mmap(NULL, mp->size, PROT_READ, MAP_SHARED, fd, 0);
+    if (mp->base == MAP_FAILED)
+    {
+	free(mp);
+	mp = NULL;
+	goto Fail;
+    }
+    close(fd);
+    fd = -1;
+
+    /* Our own reference, dropped when done */
+    mp->refs = 1;
+
+    for (i = 0; i < fh.nsect; i++)
+    {
+	switch (fh.sect[i].type)
+	{
+	  case DB_SECT_USERS:
+	    dbpp = users;
+	    break;
+	  case DB_SECT_COMMANDS:
+	    dbpp = commands;
+	    break;
+	  default:
+	    continue;
+	}
+
+	if (*dbpp ||
+	    fh.sect[i].offset % 8 != 0 ||
+	    fh.sect[i].offset + fh.sect[i].size > mp->size ||
+	    !db_valid((char *) mp->base + fh.sect[i].offset, fh.sect[i].size, fh.sect[i].type))
+	{
+	    errno = EINVAL;
+	    goto Fail;
+	}
+
+	dbp = calloc(1, sizeof(*dbp));
+	if (!dbp)
+	    goto Fail;
+
+	dbp->base = (char *) mp->base + fh.sect[i].offset;
+	dbp->hp = (const DBSECTHDR *) dbp->base;
+	dbp->src_mtime = fh.sect[i].src_mtime;
+	dbp->src_size = fh.sect[i].src_size;
+	dbp->map = mp;
+
+	pthread_mutex_lock(&map_mtx);
+	mp->refs++;
+	pthread_mutex_unlock(&map_mtx);
+
+	*dbpp = dbp;
+    }
+
+    if (debug)
+	fprintf(stderr, "DB_OPEN: Mapped %s (%lu bytes, users=%d, commands=%d)\n",
+		path, (unsigned long) mp->size, db_count(*users), db_count(*commands));
+
+    db_unmap(mp);
+    return 0;
+
+  Fail:
+    if (debug)
+	fprintf(stderr, "DB_OPEN: %s: %s\n", path, strerror(errno));
+
+    db_free(*users);
+    db_free(*commands);
+    *users = *commands = NULL;
+
+    if (mp)
+	db_unmap(mp);
+    if (fd >= 0)
+	close(fd);
+    return -1;
+}
+
+
+void
+db_free(DB *dbp)
+{
+    if (!dbp)
+	return;
+
+    if (dbp->mem)
+	free(dbp->mem);
+
+    if (dbp->map)
+	db_unmap(dbp->map);
+
+    free(dbp);
+}
+
+
+int
+db_count(DB *dbp)
+{
+    return dbp ? dbp->hp->nrec : 0;
+}
+
+
+const char *
+db_str(DB *dbp,
+       uint32_t off)
+{
+    if (!off || off >= dbp->hp->str_size)
+	return NULL;
+
+    return dbp->base + dbp->hp->str_off + off;
+}
+
+
+const DBUSER *
+db_user(DB *dbp,
+	int idx)
+{
+    if (!dbp || idx < 0 || idx >= dbp->hp->nrec || dbp->hp->type != DB_SECT_USERS)
+	return NULL;
+
+    return (const DBUSER *) (dbp->base + dbp->hp->rec_off) + idx;
+}
+
+
+const DBCMD *
+db_command(DB *dbp,
+	   int idx)
+{
+    if (!dbp || idx < 0 || idx >= dbp->hp->nrec || dbp->hp->type != DB_SECT_COMMANDS)
+	return NULL;
+
+    return (const DBCMD *) (dbp->base + dbp->hp->rec_off) + idx;
+}
+
+
+/* Returns the first user with a matching name (case insensitive unless 'exact') */
+int
+db_user_byname(DB *dbp,
+	       const char *name,
+	       int exact)
+{
+    const uint32_t *slot;
+    const DBUSER *up;
+    const char *s;
+    uint32_t i, v, mask;
+
+
+    if (!dbp || !name || dbp->hp->type != DB_SECT_USERS)
+	return -1;
+
+    slot = (const uint32_t *) (dbp->base + dbp->hp->name_off);
+    mask = dbp->hp->nslot-1;
+
+    for (i = db_hash(name, 1) & mask; (v = slot[i]) != 0; i = (i+1) & mask)
+    {
+	up = db_user(dbp, v-1);
+	if (up && (s = db_str(dbp, up->name)) != NULL &&
+	    (exact ? strcmp(s, name) : strcasecmp(s, name)) == 0)
+	    return v-1;
+    }
+
+    return -1;
+}
+
+
+/* Returns the first user with a matching primary phone */
+int
+db_user_byphone(DB *dbp,
+		const char *phone)
+{
+    const uint32_t *slot;
+    const DBUSER *up;
+    const char *s;
+    char pbuf[PHONE_MAX];
+    uint64_t key;
+    uint32_t i, v, mask;
+
+
+    if (!dbp || !phone || dbp->hp->type != DB_SECT_USERS)
+	return -1;
+
+    if (phone_normalize(phone, pbuf, sizeof(pbuf)) >= 0)
+	phone = pbuf;
+    key = phone_key(phone);
+
+    slot = (const uint32_t *) (dbp->base + dbp->hp->phone_off);
+    mask = dbp->hp->nslot-1;
+
+    for (i = db_phone_hash(key, phone) & mask; (v = slot[i]) != 0; i = (i+1) & mask)
+    {
+	up = db_user(dbp, v-1);
+	if (!up)
+	    continue;
+	
+	if (key)
+	{
+	    if (up->phone_key == key)
+		return v-1;
+	}
+	else if (!up->phone_key && (s = db_str(dbp, up->phone)) != NULL && strcmp(s, phone) == 0)
+	    return v-1;
+    }
+
+    return -1;
+}
+
+
+int
+db_command_byname(DB *dbp,
+		  const char *name)
+{
+    const uint32_t *slot;
+    const DBCMD *cp;
+    const char *s;
+    uint32_t i, v, mask;
+
+
+    if (!dbp || !name || dbp->hp->type != DB_SECT_COMMANDS)
+	return -1;
+
+    slot = (const uint32_t *) (dbp->base + dbp->hp->name_off);
+    mask = dbp->hp->nslot-1;
+
+    for (i = db_hash(name, 1) & mask; (v = slot[i]) != 0; i = (i+1) & mask)
+    {
+	cp = db_command(dbp, v-1);
+	if (cp && (s = db_str(dbp, cp->name)) != NULL && strcasecmp(s, name) == 0)
+	    return v-1;
+    }
+
+    return -1;
+}
+
+
+/* Check if a user's ACL permits a command */
+int
+db_user_acl(DB *dbp,
+	    int idx,
+	    const char *command)
+{
+    const DBUSER *up;
+    const uint32_t *slot, *voc, *bits;
+    const char *s;
+    uint32_t i, v, mask;
+
+
+    up = db_user(dbp, idx);
+    if (!up || !command)
+	return 0;
+
+    if (up->flags & DB_USER_ACL_ALL)
+	return 1;
+
+    if (dbp->hp->nacl == 0)
+	return 0;
+
+    slot = (const uint32_t *) (dbp->base + dbp->hp->aclhash_off);
+    voc = (const uint32_t *) (dbp->base + dbp->hp->aclvoc_off);
+    mask = dbp->hp->aclslot-1;
+
+    for (i = db_hash(command, 1) & mask; (v = slot[i]) != 0; i = (i+1) & mask)
+    {
+	if (v > dbp->hp->nacl)
+	    break;
+
+	if ((s = db_str(dbp, voc[v-1])) != NULL && strcasecmp(s, command) == 0)
+	{
+	    bits = (const uint32_t *) (dbp->base + dbp->hp->aclbits_off) + (size_t) idx*dbp->hp->aclwords;
+	    return (bits[(v-1)/32] >> ((v-1)%32)) & 1;
+	}
+    }
+
+    return 0;
+}
+
+
+static int
+db_str_equal(DB *a,
+	     uint32_t oa,
+	     DB *b,
+	     uint32_t ob)
+{
+    const char *sa = db_str(a, oa);
+    const char *sb = db_str(b, ob);
+
+    if (!sa || !sb)
+	return sa == sb;
+
+    return strcmp(sa, sb) == 0;
+}
+
+
+/* Compare two records (possibly from different sections of the same type) */
+int
+db_equal(DB *a,
+	 int ia,
+	 DB *b,
+	 int ib)
+{
+    const DBUSER *ua, *ub;
+    const DBCMD *ca, *cb;
+
+
+    if (!a || !b || a->hp->type != b->hp->type)
+	return 0;
+
+    switch (a->hp->type)
+    {
+      case DB_SECT_USERS:
+	ua = db_user(a, ia);
+	ub = db_user(b, ib);
+	if (!ua || !ub)
+	    return 0;
+
+	return (ua->flags == ub->flags &&
+		db_str_equal(a, ua->name, b, ub->name) &&
+		db_str_equal(a, ua->pass, b, ub->pass) &&
+		db_str_equal(a, ua->phone, b, ub->phone) &&
+		db_str_equal(a, ua->acl, b, ub->acl));
+
+      case DB_SECT_COMMANDS:
+	ca = db_command(a, ia);
+	cb = db_command(b, ib);
+	if (!ca || !cb)
+	    return 0;
+
+	return (ca->level == cb->level &&
+		db_str_equal(a, ca->name, b, cb->name) &&
+		db_str_equal(a, ca->user, b, cb->user) &&
+		db_str_equal(a, ca->path, b, cb->path) &&
+		db_str_equal(a, ca->argv, b, cb->argv));
+    }
+
+    return 0;
+}
+
+
+static int
+db_lookup(DB *dbp,
+	  const char *name)
+{
+    if (dbp->hp->type == DB_SECT_USERS)
+	return db_user_byname(dbp, name, 1);
+
+    return db_command_byname(dbp, name);
+}
+
+
+static uint32_t
+db_name(DB *dbp,
+	int idx)
+{
+    if (dbp->hp->type == DB_SECT_USERS)
+	return db_user(dbp, idx)->name;
+
+    return db_command(dbp, idx)->name;
+}
+
+
+/*
+ * Count entries (matched by name) added, removed or changed
+ * between two versions of a section. Returns the total.
+ */
+int
+db_diff(DB *odb,
+	DB *ndb,
+	DBDIFF *dp)
+{
+    int i, j, n;
+
+
+    memset(dp, 0, sizeof(*dp));
+
+    if (!odb || !ndb || odb->hp->type != ndb->hp->type)
+    {
+	dp->added = db_count(ndb);
+	dp->removed = db_count(odb);
+	return dp->added + dp->removed;
+    }
+
+    n = db_count(ndb);
+    for (i = 0; i < n; i++)
+    {
+	j = db_lookup(odb, db_str(ndb, db_name(ndb, i)));
+	if (j < 0)
+	    dp->added++;
+	else if (!db_equal(odb, j, ndb, i))
+	    dp->changed++;
+    }
+
+    n = db_count(odb);
+    for (i = 0; i < n; i++)
+	if (db_lookup(ndb, db_str(odb, db_name(odb, i))) < 0)
+	    dp->removed++;
+
+    return dp->added + dp->removed + dp->changed;
+}
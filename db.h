@@ -0,0 +1,215 @@
+/*
+ * db.h - Compiled user & command database images
+ *
+ * Copyright (c) 2016-2020 Peter Eriksson <pen@lysator.liu.se>
+ *
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef DB_H
+#define DB_H 1
+
+#include <stdint.h>
+#include <time.h>
+#include <sys/types.h>
+
+#define DB_MAGIC		"PSMSDB\n\032"
+#define DB_VERSION		2
+#define DB_BYTEORDER		0x01020304
+
+#define DB_SECT_USERS		1
+#define DB_SECT_COMMANDS	2
+
+#define DB_USER_ACL_ALL		0x0001
+
+
+/*
+ * Image file header. Followed by the (8-byte aligned) sections.
+ * Everything is stored in host byte order.
+ */
+typedef struct db_filehdr
+{
+    char     magic[8];
+    uint32_t version;
+    uint32_t byteorder;
+    uint32_t nsect;
+    uint32_t phonecfg;		/* Phone normalization the keys were made with */
+    struct
+    {
+	uint32_t type;
+	uint32_t pad;
+	uint64_t offset;
+	uint64_t size;
+	int64_t  src_mtime;	/* Modification time of the text source */
+	uint64_t src_size;	/* Size of the text source */
+    } sect[2];
+} DBFILEHDR;
+
+
+/*
+ * Section header. All offsets are relative to the start of the
+ * section, strings are offsets into the string table (0 = NULL).
+ */
+typedef struct db_secthdr
+{
+    uint32_t type;
+    uint32_t size;
+    uint32_t nrec;
+    uint32_t rec_off;
+    uint32_t nslot;		/* Slots per hash index (power of two) */
+    uint32_t name_off;		/* Name index */
+    uint32_t phone_off;		/* Phone index (users only) */
+    uint32_t nacl;		/* ACL vocabulary size (users only) */
+    uint32_t aclvoc_off;	/* ACL vocabulary (string offsets) */
+    uint32_t aclslot;
+    uint32_t aclhash_off;	/* ACL vocabulary index */
+    uint32_t aclwords;		/* Words per user ACL bitset */
+    uint32_t aclbits_off;
+    uint32_t str_off;
+    uint32_t str_size;
+    uint32_t pad;
+} DBSECTHDR;
+
+
+typedef struct db_user
+{
+    uint32_t name;
+    uint32_t pass;
+    uint32_t phone;
+    uint32_t acl;
+    uint32_t flags;
+    uint32_t pad;
+    uint64_t phone_key;		/* Normalized phone number, 0 if not E.164 */
+} DBUSER;
+
+
+typedef struct db_command
+{
+    uint32_t name;
+    int32_t  level;
+    uint32_t user;
+    uint32_t path;
+    uint32_t argv;
+    uint32_t pad;
+} DBCMD;
+
+
+/* Differences between two versions of a section */
+typedef struct db_diff
+{
+    int added;
+    int removed;
+    int changed;
+} DBDIFF;
+
+
+/* A loaded section - either compiled in memory or mapped from an image */
+typedef struct db
+{
+    const char *base;
+    const DBSECTHDR *hp;
+    void *mem;
+    struct dbmap *map;
+    time_t src_mtime;
+    off_t src_size;
+} DB;
+
+
+extern DB *
+db_compile(int type,
+	   const char *path);
+
+extern int
+db_save(const char *path,
+	DB *users,
+	DB *commands);
+
+extern int
+db_build(const char *path,
+	 const char *users_path,
+	 const char *commands_path);
+
+extern int
+db_stale(const char *path,
+	 const char *users_path,
+	 const char *commands_path);
+
+extern int
+db_open(const char *path,
+	DB **users,
+	DB **commands);
+
+extern void
+db_free(DB *dbp);
+
+
+extern int
+db_count(DB *dbp);
+
+extern const char *
+db_str(DB *dbp,
+       uint32_t off);
+
+extern const DBUSER *
+db_user(DB *dbp,
+	int idx);
+
+extern const DBCMD *
+db_command(DB *dbp,
+	   int idx);
+
+extern int
+db_user_byname(DB *dbp,
+	       const char *name,
+	       int exact);
+
+extern int
+db_user_byphone(DB *dbp,
+		const char *phone);
+
+extern int
+db_command_byname(DB *dbp,
+		  const char *name);
+
+extern int
+db_user_acl(DB *dbp,
+	    int idx,
+	    const char *command);
+
+extern int
+db_equal(DB *a,
+	 int ia,
+	 DB *b,
+	 int ib);
+
+extern int
+db_diff(DB *odb,
+	DB *ndb,
+	DBDIFF *dp);
+
+#endif
@@ -0,0 +1,1883 @@
+/*
+ * evloop.c - Event loop (io_uring or epoll on Linux, poll elsewhere)
+ *
+ * Copyright (c) 2016-2020 Peter Eriksson <pen@lysator.liu.se>
+ *
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <signal.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#if HAVE_EPOLL
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#endif
+
+#if HAVE_IO_URING
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
+
+#include "evloop.h"
+
+extern int debug;
+
+
+/* Max events handled per wait */
+#define EV_BATCH 64
+
+/* Submission queue size for io_uring */
+#define EV_URING_ENTRIES 256
+
+#define EV_BACKEND_POLL		0
+#define EV_BACKEND_EPOLL	1
+#define EV_BACKEND_URING	2
+
+static const char *ev_backends[] = { "poll", "epoll", "io_uring" };
+
+/* Operations kept in flight per fd with io_uring, tagged in the user_data */
+#define EV_OP_POLL	1
+#define EV_OP_READ	2
+#define EV_OP_WRITE	3
+#define EV_OP_MASK	3
+
+
+typedef struct evbuf
+{
+    char *buf;
+    size_t off;		/* Already written */
+    size_t len;
+    size_t size;
+} EVBUF;
+
+
+typedef struct evfd
+{
+    int fd;
+    int events;		/* Requested by the caller */
+    int wanted;		/* Waited for in the backend */
+    EVFDFUN fun;
+    void *xp;
+
+    EVREADFUN rfun;	/* Reader: the loop reads and passes the data */
+    char *rbuf;
+    int rsize;
+    int rown;		/* rbuf allocated by the loop */
+    int reof;
+    int rwait;		/* Read would block, poll first (io_uring) */
+
+    EVBUF out;		/* Queued output */
+    EVBUF wout;		/* Output being written (io_uring) */
+
+    int polling;	/* Operations in flight (io_uring) */
+    int pevents;
+    int pcancel;
+    int reading;
+    int writing;
+    
+    int dead;
+    struct evfd *next;
+} EVFD;
+
+
+typedef struct evtimer
+{
+    int id;
+    long long due;	/* Monotonic milliseconds */
+    EVFUN fun;
+    void *xp;
+} EVTIMER;
+
+
+typedef struct evpost
+{
+    EVFUN fun;
+    EVSIGFUN sfun;
+    int sig;
+    void *xp;
+    struct evpost *next;
+} EVPOST;
+
+
+#if HAVE_IO_URING
+typedef struct evring
+{
+    int fd;
+    int ext_arg;	/* Wait timeout can be passed to io_uring_enter() */
+    unsigned pending;	/* Queued SQEs not yet submitted */
+    
+    void *sq_ptr;
+    size_t sq_size;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned sq_entries;
+    
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+    
+    void *cq_ptr;
+    size_t cq_size;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+} EVRING;
+#endif
+
+
+struct evloop
+{
+    int backend;
+    EVSTATS st;
+
+    int virt;		/* Virtual clock, advanced to the next timer when idle */
+    long long vnow;	/* Virtual milliseconds */
+    time_t vt0;		/* Wall clock time at virtual zero */
+    
+    EVFD *fds;
+    EVFD *dead;		/* Removed, freed when nothing refers to them */
+    
+    EVTIMER *tv;
+    int tc;
+    int ts;
+    int tid;
+
+    pthread_mutex_t mtx;	/* Protects the fields below */
+    EVPOST *ph;
+    EVPOST *pt;
+    int woken;
+    volatile int stop;
+    
+    EVFUN wfun;
+    void *wxp;
+
+    EVSIGFUN sfun;
+    void *sxp;
+
+    /* poll */
+    struct pollfd *pv;
+    EVFD **pe;
+    int ps;
+    
+#if HAVE_EPOLL
+    int epfd;
+    int tfd;		/* timerfd, armed for the next timer */
+    int efd;		/* eventfd for wakeups */
+    int sfd;		/* signalfd */
+    long long tfd_due;
+#else
+    int wfd[2];		/* Wakeup pipe */
+    sigset_t sigs;
+    int sthread;
+    pthread_t stid;
+#endif
+
+#if HAVE_IO_URING
+    EVRING ur;
+#endif
+};
+
+
+static void
+ev_update(EVLOOP *lp,
+	  EVFD *ep);
+
+#if HAVE_EPOLL
+static void
+ev_arm(EVLOOP *lp);
+#endif
+
+
+static long long
+ev_mono(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long) ts.tv_sec*1000 + ts.tv_nsec/1000000;
+}
+
+
+static EVFD *
+ev_find(EVLOOP *lp,
+	int fd)
+{
+    EVFD *ep;
+
+    for (ep = lp->fds; ep && ep->fd != fd; ep = ep->next)
+	;
+    return ep;
+}
+
+
+static int
+ev_poll_events(int events)
+{
+    return ((events & EV_READ) ? POLLIN : 0) | ((events & EV_WRITE) ? POLLOUT : 0);
+}
+
+
+static int
+ev_poll_revents(int revents)
+{
+    int events = 0;
+    
+    if (revents & POLLIN)
+	events |= EV_READ;
+    if (revents & POLLOUT)
+	events |= EV_WRITE;
+    if (revents & (POLLERR|POLLHUP|POLLNVAL))
+	events |= EV_ERROR;
+    return events;
+}
+
+
+static int
+ev_buf_append(EVBUF *bp,
+	      const char *buf,
+	      size_t len)
+{
+    if (bp->off > 0 && bp->off == bp->len)
+	bp->off = bp->len = 0;
+    
+    if (bp->len + len > bp->size)
+    {
+	size_t size = bp->size ? bp->size : 256;
+	char *nbuf;
+
+	while (size < bp->len + len)
+	    size *= 2;
+	
+	nbuf = realloc(bp->buf, size);
+	if (!nbuf)
+	    return -1;
+	bp->buf = nbuf;
+	bp->size = size;
+    }
+
+    memcpy(bp->buf + bp->len, buf, len);
+    bp->len += len;
+    return 0;
+}
+
+
+static void
+ev_run_posts(EVLOOP *lp)
+{
+    EVPOST *pp, *np;
+    EVFUN wfun;
+
+
+    pthread_mutex_lock(&lp->mtx);
+    pp = lp->ph;
+    lp->ph = lp->pt = NULL;
+    lp->woken = 0;
+    pthread_mutex_unlock(&lp->mtx);
+
+    for (; pp; pp = np)
+    {
+	np = pp->next;
+	if (pp->sfun)
+	    (*pp->sfun)(lp, pp->sig, pp->xp);
+	else
+	    (*pp->fun)(lp, pp->xp);
+	free(pp);
+    }
+
+    wfun = lp->wfun;
+    if (wfun)
+	(*wfun)(lp, lp->wxp);
+}
+
+
+static void
+ev_run_timers(EVLOOP *lp)
+{
+    long long now = ev_now(lp);
+    EVTIMER t;
+    int i;
+
+
+    for (i = 0; i < lp->tc; )
+    {
+	if (lp->tv[i].due > now)
+	{
+	    ++i;
+	    continue;
+	}
+
+	/* Remove before calling, the handler may add or remove timers */
+	t = lp->tv[i];
+	lp->tv[i] = lp->tv[--lp->tc];
+	(*t.fun)(lp, t.xp);
+	i = 0;
+    }
+}
+
+
+static long long
+ev_next_due(EVLOOP *lp)
+{
+    long long due = -1;
+    int i;
+
+    for (i = 0; i < lp->tc; i++)
+	if (due < 0 || lp->tv[i].due < due)
+	    due = lp->tv[i].due;
+
+    return due;
+}
+
+
+/* Milliseconds until the next timer, -1 if none */
+static int
+ev_timeout(EVLOOP *lp)
+{
+    long long due = ev_next_due(lp), now;
+
+    if (due < 0)
+	return -1;
+
+    now = ev_now(lp);
+    return due > now ? (int) (due-now) : 0;
+}
+
+
+static void
+ev_free(EVFD *ep)
+{
+    if (ep->rown)
+	free(ep->rbuf);
+    free(ep->out.buf);
+    free(ep->wout.buf);
+    free(ep);
+}
+
+
+/* Free removed fds that have no io_uring operations left in flight */
+static void
+ev_reap(EVLOOP *lp)
+{
+    EVFD **epp, *ep;
+
+    for (epp = &lp->dead; (ep = *epp) != NULL; )
+	if (ep->polling || ep->reading || ep->writing)
+	    epp = &ep->next;
+	else
+	{
+	    *epp = ep->next;
+	    ev_free(ep);
+	}
+}
+
+
+/* Read into the buffer of a reader and pass the data on */
+static void
+ev_read(EVLOOP *lp,
+	EVFD *ep)
+{
+    int n;
+
+    
+    do
+    {
+	++lp->st.syscalls;
+	++lp->st.reads;
+	n = read(ep->fd, ep->rbuf, ep->rsize);
+    } while (n < 0 && errno == EINTR);
+    
+    if (n < 0 && errno == EAGAIN)
+	return;
+    if (n > 0)
+	lp->st.rbytes += n;
+    
+    (*ep->rfun)(lp, ep->fd, ep->rbuf, n < 0 ? -errno : n, ep->xp);
+}
+
+
+/* Write queued output, as much as the fd takes */
+static void
+ev_flush(EVLOOP *lp,
+	 EVFD *ep)
+{
+    int n;
+
+
+    while (ep->out.off < ep->out.len)
+    {
+	++lp->st.syscalls;
+	++lp->st.writes;
+	n = write(ep->fd, ep->out.buf + ep->out.off, ep->out.len - ep->out.off);
+	if (n < 0)
+	{
+	    if (errno == EINTR)
+		continue;
+	    if (errno == EAGAIN)
+		break;
+	    
+	    if (debug)
+		fprintf(stderr, "EV_FLUSH: fd=%d: Write failed: %s\n", ep->fd, strerror(errno));
+	    ep->out.off = ep->out.len;
+	    break;
+	}
+	
+	lp->st.wbytes += n;
+	ep->out.off += n;
+    }
+
+    if (ep->out.off == ep->out.len)
+	ep->out.off = ep->out.len = 0;
+    
+    ev_update(lp, ep);
+}
+
+
+/* Handle readiness of an fd (poll and epoll) */
+static void
+ev_dispatch(EVLOOP *lp,
+	    EVFD *ep,
+	    int events)
+{
+    ++lp->st.events;
+    
+    if ((events & (EV_WRITE|EV_ERROR)) && ep->out.len > ep->out.off)
+	ev_flush(lp, ep);
+    if (ep->dead)
+	return;
+    
+    if (ep->rfun)
+    {
+	if (events & (EV_READ|EV_ERROR))
+	    ev_read(lp, ep);
+	return;
+    }
+
+    events &= ep->events|EV_ERROR;
+    if (events)
+	(*ep->fun)(lp, ep->fd, events, ep->xp);
+}
+
+
+#if HAVE_IO_URING
+
+static int
+ev_uring_setup(unsigned entries,
+	       struct io_uring_params *pp)
+{
+    return (int) syscall(__NR_io_uring_setup, entries, pp);
+}
+
+
+static int
+ev_uring_enter(EVLOOP *lp,
+	       unsigned submit,
+	       unsigned wait,
+	       int ms)
+{
+    struct io_uring_getevents_arg arg;
+    struct __kernel_timespec ts;
+    unsigned flags = wait ? IORING_ENTER_GETEVENTS : 0;
+    void *argp = NULL;
+    size_t argsz = 0;
+    
+
+    if (wait && ms >= 0 && lp->ur.ext_arg)
+    {
+	memset(&arg, 0, sizeof(arg));
+	ts.tv_sec = ms/1000;
+	ts.tv_nsec = (ms%1000)*1000000L;
+	arg.ts = (uint64_t) (uintptr_t) &ts;
+	argp = &arg;
+	argsz = sizeof(arg);
+	flags |= IORING_ENTER_EXT_ARG;
+    }
+    
+    ++lp->st.syscalls;
+    return (int) syscall(__NR_io_uring_enter, lp->ur.fd, submit, wait, flags, argp, argsz);
+}
+
+
+static int
+ev_uring_open(EVLOOP *lp)
+{
+    struct io_uring_params p;
+    EVRING *rp = &lp->ur;
+
+
+    memset(&p, 0, sizeof(p));
+    rp->fd = ev_uring_setup(EV_URING_ENTRIES, &p);
+    if (rp->fd < 0)
+	return -1;
+
+    fcntl(rp->fd, F_SETFD, FD_CLOEXEC);
+    
+    rp->ext_arg = (p.features & IORING_FEAT_EXT_ARG) != 0;
+    
+    rp->sq_size = p.sq_off.array + p.sq_entries*sizeof(unsigned);
+    rp->cq_size = p.cq_off.cqes + p.cq_entries*sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+    {
+	if (rp->cq_size > rp->sq_size)
+	    rp->sq_size = rp->cq_size;
+	rp->cq_size = 0;
+    }
+
+    rp->sq_ptr = mmap(NULL, rp->sq_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE,
+		      rp->fd, IORING_OFF_SQ_RING);
+    if (rp->sq_ptr == MAP_FAILED)
+	goto Fail;
+
+    if (rp->cq_size)
+    {
+	rp->cq_ptr = mmap(NULL, rp->cq_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE,
+			  rp->fd, IORING_OFF_CQ_RING);
+	if (rp->cq_ptr == MAP_FAILED)
+	    goto Fail;
+    }
+    else
+	rp->cq_ptr = rp->sq_ptr;
+
+    rp->sqes_size = p.sq_entries*sizeof(struct io_uring_sqe);
+    rp->sqes = mmap(NULL, rp->sqes_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE,
+		    rp->fd, IORING_OFF_SQES);
+    if (rp->sqes == MAP_FAILED)
+	goto Fail;
+    
+    rp->sq_head = (unsigned *) ((char *) rp->sq_ptr + p.sq_off.head);
+    rp->sq_tail = (unsigned *) ((char *) rp->sq_ptr + p.sq_off.tail);
+    rp->sq_mask = (unsigned *) ((char *) rp->sq_ptr + p.sq_off.ring_mask);
+    rp->sq_array = (unsigned *) ((char *) rp->sq_ptr + p.sq_off.array);
+    rp->sq_entries = p.sq_entries;
+
+    rp->cq_head = (unsigned *) ((char *) rp->cq_ptr + p.cq_off.head);
+    rp->cq_tail = (unsigned *) ((char *) rp->cq_ptr + p.cq_off.tail);
+    rp->cq_mask = (unsigned *) ((char *) rp->cq_ptr + p.cq_off.ring_mask);
+    rp->cqes = (struct io_uring_cqe *) ((char *) rp->cq_ptr + p.cq_off.cqes);
+    
+    return 0;
+
+  Fail:
+    if (rp->sqes && rp->sqes != MAP_FAILED)
+	munmap(rp->sqes, rp->sqes_size);
+    if (rp->cq_size && rp->cq_ptr && rp->cq_ptr != MAP_FAILED)
+	munmap(rp->cq_ptr, rp->cq_size);
+    if (rp->sq_ptr && rp->sq_ptr != MAP_FAILED)
+	munmap(rp->sq_ptr, rp->sq_size);
+    close(rp->fd);
+    memset(rp, 0, sizeof(*rp));
+    rp->fd = -1;
+    return -1;
+}
+
+
+static void
+ev_uring_close(EVLOOP *lp)
+{
+    EVRING *rp = &lp->ur;
+
+    if (rp->fd < 0)
+	return;
+    
+    munmap(rp->sqes, rp->sqes_size);
+    if (rp->cq_size)
+	munmap(rp->cq_ptr, rp->cq_size);
+    munmap(rp->sq_ptr, rp->sq_size);
+    close(rp->fd);
+    rp->fd = -1;
+}
+
+
+/* Get a free SQE. Queued SQEs are submitted with the next wait */
+static struct io_uring_sqe *
+ev_uring_sqe(EVLOOP *lp)
+{
+    EVRING *rp = &lp->ur;
+    struct io_uring_sqe *sqe;
+    unsigned tail, idx;
+    
+
+    tail = *rp->sq_tail;
+    if (tail - __atomic_load_n(rp->sq_head, __ATOMIC_ACQUIRE) == rp->sq_entries)
+    {
+	/* Full - submit what we have */
+	int n = ev_uring_enter(lp, rp->pending, 0, -1);
+
+	if (n < 0)
+	    return NULL;
+	rp->pending -= n;
+    }
+
+    idx = tail & *rp->sq_mask;
+    sqe = &rp->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    rp->sq_array[idx] = idx;
+    
+    __atomic_store_n(rp->sq_tail, tail+1, __ATOMIC_RELEASE);
+    ++rp->pending;
+    return sqe;
+}
+
+
+static uint64_t
+ev_uring_data(EVFD *ep,
+	      int op)
+{
+    return (uint64_t) (uintptr_t) ep | op;
+}
+
+
+/* Start the operations an fd needs: poll, read and write */
+static void
+ev_uring_arm(EVLOOP *lp,
+	     EVFD *ep)
+{
+    struct io_uring_sqe *sqe;
+    int pevents;
+
+    
+    if (ep->dead)
+	return;
+
+    pevents = ep->events | (ep->rwait ? EV_READ : 0);
+    
+    if (ep->polling)
+    {
+	/* Requested events changed - cancel, rearmed on completion */
+	if (ep->pevents != pevents && !ep->pcancel)
+	{
+	    sqe = ev_uring_sqe(lp);
+	    if (sqe)
+	    {
+		sqe->opcode = IORING_OP_POLL_REMOVE;
+		sqe->addr = ev_uring_data(ep, EV_OP_POLL);
+		ep->pcancel = 1;
+	    }
+	}
+    }
+    else if (pevents && (sqe = ev_uring_sqe(lp)) != NULL)
+    {
+	/* One-shot, rearmed after each completion (level triggered) */
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = ep->fd;
+	sqe->poll32_events = ev_poll_events(pevents);
+	sqe->user_data = ev_uring_data(ep, EV_OP_POLL);
+	ep->pevents = pevents;
+	ep->polling = 1;
+    }
+
+    if (ep->rfun && !ep->reading && !ep->reof && !ep->rwait &&
+	(sqe = ev_uring_sqe(lp)) != NULL)
+    {
+	sqe->opcode = IORING_OP_READ;
+	sqe->fd = ep->fd;
+	sqe->addr = (uint64_t) (uintptr_t) ep->rbuf;
+	sqe->len = ep->rsize;
+	sqe->off = (uint64_t) -1;
+	sqe->user_data = ev_uring_data(ep, EV_OP_READ);
+	ep->reading = 1;
+	++lp->st.reads;
+    }
+
+    if (!ep->writing)
+    {
+	if (ep->wout.off == ep->wout.len && ep->out.off < ep->out.len)
+	{
+	    /* The buffer being written may not move - swap them */
+	    EVBUF t = ep->wout;
+
+	    ep->wout = ep->out;
+	    ep->out = t;
+	    ep->out.off = ep->out.len = 0;
+	}
+	
+	if (ep->wout.off < ep->wout.len && (sqe = ev_uring_sqe(lp)) != NULL)
+	{
+	    sqe->opcode = IORING_OP_WRITE;
+	    sqe->fd = ep->fd;
+	    sqe->addr = (uint64_t) (uintptr_t) (ep->wout.buf + ep->wout.off);
+	    sqe->len = ep->wout.len - ep->wout.off;
+	    sqe->off = (uint64_t) -1;
+	    sqe->user_data = ev_uring_data(ep, EV_OP_WRITE);
+	    ep->writing = 1;
+	    ++lp->st.writes;
+	}
+    }
+}
+
+
+/* Cancel the operations in flight for a removed fd */
+static void
+ev_uring_cancel(EVLOOP *lp,
+		EVFD *ep)
+{
+    struct io_uring_sqe *sqe;
+
+    if (ep->polling && !ep->pcancel && (sqe = ev_uring_sqe(lp)) != NULL)
+    {
+	sqe->opcode = IORING_OP_POLL_REMOVE;
+	sqe->addr = ev_uring_data(ep, EV_OP_POLL);
+	ep->pcancel = 1;
+    }
+    if (ep->reading && (sqe = ev_uring_sqe(lp)) != NULL)
+    {
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->addr = ev_uring_data(ep, EV_OP_READ);
+    }
+    if (ep->writing && (sqe = ev_uring_sqe(lp)) != NULL)
+    {
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->addr = ev_uring_data(ep, EV_OP_WRITE);
+    }
+}
+
+
+static void
+ev_uring_complete(EVLOOP *lp,
+		  uint64_t data,
+		  int res)
+{
+    EVFD *ep = (EVFD *) (uintptr_t) (data & ~(uint64_t) EV_OP_MASK);
+
+    
+    /* Cancel requests */
+    if (!ep)
+	return;
+
+    ++lp->st.events;
+    
+    switch (data & EV_OP_MASK)
+    {
+      case EV_OP_POLL:
+	ep->polling = 0;
+	ep->pcancel = 0;
+	if (!ep->dead && res > 0)
+	{
+	    int events = ev_poll_revents(res);
+
+	    if (ep->rwait && (events & (EV_READ|EV_ERROR)))
+		ep->rwait = 0;
+	    
+	    events &= ep->events|EV_ERROR;
+	    if (events && ep->fun)
+		(*ep->fun)(lp, ep->fd, events, ep->xp);
+	}
+	break;
+
+      case EV_OP_READ:
+	ep->reading = 0;
+	if (res == -EAGAIN)
+	    ep->rwait = 1;
+	if (ep->dead || res == -ECANCELED || res == -EINTR || res == -EAGAIN)
+	    break;
+	if (res > 0)
+	    lp->st.rbytes += res;
+	else
+	    ep->reof = 1;
+	(*ep->rfun)(lp, ep->fd, ep->rbuf, res, ep->xp);
+	break;
+
+      case EV_OP_WRITE:
+	ep->writing = 0;
+	if (res > 0)
+	{
+	    lp->st.wbytes += res;
+	    ep->wout.off += res;
+	}
+	else if (res < 0 && res != -EINTR && res != -EAGAIN && res != -ECANCELED)
+	{
+	    if (debug)
+		fprintf(stderr, "EV_URING: fd=%d: Write failed: %s\n", ep->fd, strerror(-res));
+	    ep->wout.off = ep->wout.len;
+	    ep->out.off = ep->out.len;
+	}
+	if (ep->wout.off == ep->wout.len)
+	    ep->wout.off = ep->wout.len = 0;
+	break;
+    }
+
+    /* Rearm, continue short writes */
+    if (!ep->dead)
+	ev_uring_arm(lp, ep);
+}
+
+
+static int
+ev_uring_wait(EVLOOP *lp)
+{
+    EVRING *rp = &lp->ur;
+    struct io_uring_cqe cv[EV_BATCH];
+    unsigned head, tail;
+    int i, n, ms;
+
+    
+    head = *rp->cq_head;
+    tail = __atomic_load_n(rp->cq_tail, __ATOMIC_ACQUIRE);
+
+    /* Submit and wait in the same call */
+    if (head == tail || rp->pending)
+    {
+	ms = ev_timeout(lp);
+	if (!rp->ext_arg)
+	{
+	    ev_arm(lp);
+	    ms = -1;
+	}
+	
+	n = ev_uring_enter(lp, rp->pending, head == tail ? 1 : 0, ms);
+	if (n < 0)
+	{
+	    if (errno == EINTR || errno == ETIME || errno == EBUSY || errno == EAGAIN)
+		return 0;
+	    return -1;
+	}
+	rp->pending -= n;
+	++lp->st.wakeups;
+    }
+    
+    for (;;)
+    {
+	head = *rp->cq_head;
+	tail = __atomic_load_n(rp->cq_tail, __ATOMIC_ACQUIRE);
+	if (head == tail)
+	    break;
+
+	/* Copy out and release the slots before calling the handlers */
+	for (n = 0; head != tail && n < EV_BATCH; head++, n++)
+	    cv[n] = rp->cqes[head & *rp->cq_mask];
+	__atomic_store_n(rp->cq_head, head, __ATOMIC_RELEASE);
+
+	for (i = 0; i < n; i++)
+	    ev_uring_complete(lp, cv[i].user_data, cv[i].res);
+    }
+
+    return 0;
+}
+
+#endif
+
+
+#if HAVE_EPOLL
+
+/* Arm the timerfd for the earliest timer */
+static void
+ev_arm(EVLOOP *lp)
+{
+    struct itimerspec its;
+    long long due = ev_next_due(lp);
+
+
+    if (due == lp->tfd_due)
+	return;
+    
+    memset(&its, 0, sizeof(its));
+    if (due >= 0)
+    {
+	/* An absolute value of zero disarms the timer */
+	if (due == 0)
+	    due = 1;
+	its.it_value.tv_sec = due/1000;
+	its.it_value.tv_nsec = (due%1000)*1000000;
+    }
+    
+    ++lp->st.syscalls;
+    timerfd_settime(lp->tfd, TFD_TIMER_ABSTIME, &its, NULL);
+    lp->tfd_due = due;
+}
+
+
+static void
+ev_timerfd_handler(EVLOOP *lp,
+		   int fd,
+		   int events,
+		   void *xp)
+{
+    uint64_t n;
+
+    ++lp->st.syscalls;
+    while (read(fd, &n, sizeof(n)) < 0 && errno == EINTR)
+	;
+    lp->tfd_due = -1;
+}
+
+
+static void
+ev_eventfd_handler(EVLOOP *lp,
+		   int fd,
+		   int events,
+		   void *xp)
+{
+    uint64_t n;
+
+    ++lp->st.syscalls;
+    while (read(fd, &n, sizeof(n)) < 0 && errno == EINTR)
+	;
+    ev_run_posts(lp);
+}
+
+
+static void
+ev_signalfd_handler(EVLOOP *lp,
+		    int fd,
+		    int events,
+		    void *xp)
+{
+    struct signalfd_siginfo si;
+
+    ++lp->st.syscalls;
+    while (read(fd, &si, sizeof(si)) == sizeof(si))
+    {
+	if (lp->sfun)
+	    (*lp->sfun)(lp, si.ssi_signo, lp->sxp);
+	++lp->st.syscalls;
+    }
+}
+
+
+static int
+ev_epoll_wait(EVLOOP *lp)
+{
+    struct epoll_event ev[EV_BATCH];
+    int i, n;
+    EVFD *ep;
+
+    
+    ev_arm(lp);
+	    
+    ++lp->st.syscalls;
+    n = epoll_wait(lp->epfd, ev, EV_BATCH, -1);
+    if (n < 0)
+	return errno == EINTR ? 0 : -1;
+    ++lp->st.wakeups;
+    
+    for (i = 0; i < n; i++)
+    {
+	ep = (EVFD *) ev[i].data.ptr;
+	if (!ep->dead)
+	    ev_dispatch(lp, ep,
+			((ev[i].events & EPOLLIN) ? EV_READ : 0) |
+			((ev[i].events & EPOLLOUT) ? EV_WRITE : 0) |
+			((ev[i].events & (EPOLLERR|EPOLLHUP)) ? EV_ERROR : 0));
+    }
+
+    return 0;
+}
+
+#else
+
+static void
+ev_pipe_handler(EVLOOP *lp,
+		int fd,
+		int events,
+		void *xp)
+{
+    char buf[64];
+
+    ++lp->st.syscalls;
+    while (read(fd, buf, sizeof(buf)) > 0)
+	++lp->st.syscalls;
+    ev_run_posts(lp);
+}
+
+
+static void *
+ev_signal_thread(void *misc)
+{
+    EVLOOP *lp = (EVLOOP *) misc;
+    EVPOST *pp;
+    int sig;
+
+
+    while (!lp->stop && sigwait(&lp->sigs, &sig) == 0)
+    {
+	pp = calloc(1, sizeof(*pp));
+	if (!pp)
+	    continue;
+	
+	pp->sfun = lp->sfun;
+	pp->xp = lp->sxp;
+	pp->sig = sig;
+	
+	pthread_mutex_lock(&lp->mtx);
+	if (lp->pt)
+	    lp->pt->next = pp;
+	else
+	    lp->ph = pp;
+	lp->pt = pp;
+	pthread_mutex_unlock(&lp->mtx);
+	
+	ev_wakeup(lp);
+    }
+
+    return NULL;
+}
+
+#endif
+
+
+/* Fill in the pollfd array from the registered fds */
+static int
+ev_poll_prepare(EVLOOP *lp)
+{
+    EVFD *ep;
+    int n;
+
+
+    for (n = 0, ep = lp->fds; ep; ep = ep->next)
+	++n;
+	
+    if (n > lp->ps)
+    {
+	struct pollfd *npv = realloc(lp->pv, n*sizeof(*npv));
+	EVFD **npe;
+
+	if (!npv)
+	    return -1;
+	lp->pv = npv;
+	    
+	npe = realloc(lp->pe, n*sizeof(*npe));
+	if (!npe)
+	    return -1;
+	lp->pe = npe;
+	    
+	lp->ps = n;
+    }
+
+    for (n = 0, ep = lp->fds; ep; ep = ep->next, n++)
+    {
+	lp->pv[n].fd = ep->fd;
+	lp->pv[n].events = ev_poll_events(ep->wanted);
+	lp->pv[n].revents = 0;
+	lp->pe[n] = ep;
+    }
+
+    return n;
+}
+
+
+static int
+ev_poll_wait(EVLOOP *lp)
+{
+    int i, n, ms, rc;
+    EVFD *ep;
+
+    
+    n = ev_poll_prepare(lp);
+    if (n < 0)
+	return -1;
+
+    /* Virtual time does not pass while waiting, only when nothing is ready */
+    ms = ev_timeout(lp);
+    if (lp->virt && ms > 0)
+	ms = 0;
+    
+    ++lp->st.syscalls;
+    rc = poll(lp->pv, n, ms);
+    if (rc < 0)
+	return errno == EINTR ? 0 : -1;
+    if (rc == 0 && lp->virt && ms == 0)
+    {
+	if (ev_next_due(lp) > lp->vnow)
+	    lp->vnow = ev_next_due(lp);
+	return 0;
+    }
+    ++lp->st.wakeups;
+
+    for (i = 0; i < n; i++)
+    {
+	ep = lp->pe[i];
+	if (!ep->dead && lp->pv[i].revents)
+	    ev_dispatch(lp, ep, ev_poll_revents(lp->pv[i].revents));
+    }
+
+    return 0;
+}
+
+
+/* What the backend should wait for */
+static int
+ev_wanted(EVLOOP *lp,
+	  EVFD *ep)
+{
+    int w = ep->events;
+
+    if (ep->rfun)
+	w |= EV_READ;
+    if (ep->out.off < ep->out.len)
+	w |= EV_WRITE;
+    return w;
+}
+
+
+static void
+ev_update(EVLOOP *lp,
+	  EVFD *ep)
+{
+    int w;
+
+
+    switch (lp->backend)
+    {
+#if HAVE_IO_URING
+      case EV_BACKEND_URING:
+	ev_uring_arm(lp, ep);
+	return;
+#endif
+	
+#if HAVE_EPOLL
+      case EV_BACKEND_EPOLL:
+	w = ev_wanted(lp, ep);
+	if (w != ep->wanted)
+	{
+	    struct epoll_event ev;
+
+	    memset(&ev, 0, sizeof(ev));
+	    ev.events = ev_poll_events(w);
+	    ev.data.ptr = ep;
+	    ++lp->st.syscalls;
+	    if (epoll_ctl(lp->epfd, EPOLL_CTL_MOD, ep->fd, &ev) == 0)
+		ep->wanted = w;
+	}
+	return;
+#endif
+
+      default:
+	w = ev_wanted(lp, ep);
+	ep->wanted = w;
+    }
+}
+
+
+static EVFD *
+ev_attach(EVLOOP *lp,
+	  int fd,
+	  int events,
+	  EVFDFUN fun,
+	  EVREADFUN rfun,
+	  char *rbuf,
+	  int rsize,
+	  void *xp)
+{
+    EVFD *ep;
+
+
+    if (ev_find(lp, fd))
+    {
+	errno = EEXIST;
+	return NULL;
+    }
+    
+    ep = calloc(1, sizeof(*ep));
+    if (!ep)
+	return NULL;
+
+    ep->fd = fd;
+    ep->events = events;
+    ep->fun = fun;
+    ep->rfun = rfun;
+    ep->xp = xp;
+
+    if (rfun)
+    {
+	ep->rsize = rsize > 0 ? rsize : 4096;
+	ep->rbuf = rbuf;
+	if (!ep->rbuf)
+	{
+	    ep->rbuf = malloc(ep->rsize);
+	    if (!ep->rbuf)
+	    {
+		free(ep);
+		return NULL;
+	    }
+	    ep->rown = 1;
+	}
+    }
+    
+#if HAVE_EPOLL
+    if (lp->backend == EV_BACKEND_EPOLL)
+    {
+	struct epoll_event ev;
+
+	ep->wanted = ev_wanted(lp, ep);
+	
+	memset(&ev, 0, sizeof(ev));
+	ev.events = ev_poll_events(ep->wanted);
+	ev.data.ptr = ep;
+	++lp->st.syscalls;
+	if (epoll_ctl(lp->epfd, EPOLL_CTL_ADD, fd, &ev) < 0)
+	{
+	    ev_free(ep);
+	    return NULL;
+	}
+    }
+#endif
+
+    ep->next = lp->fds;
+    lp->fds = ep;
+    
+    ev_update(lp, ep);
+    return ep;
+}
+
+
+static int
+ev_backend_type(const char *name)
+{
+    int i;
+
+    if (!name || !*name)
+    {
+#if HAVE_EPOLL
+	return EV_BACKEND_EPOLL;
+#else
+	return EV_BACKEND_POLL;
+#endif
+    }
+    
+    for (i = 0; i < (int) (sizeof(ev_backends)/sizeof(ev_backends[0])); i++)
+	if (strcmp(name, ev_backends[i]) == 0)
+	    return i;
+    return -1;
+}
+
+
+/*
+ * Create a loop using the named backend ("io_uring", "epoll" or
+ * "poll"), NULL for the default. Falls back to epoll if io_uring is
+ * not available.
+ *
+ * "virtual" is poll with a simulated clock, for discrete-event
+ * simulations: whenever no fd is ready the clock jumps to the next
+ * timer, so timers run in order without waiting for them. Work done
+ * in other threads is not waited for.
+ */
+EVLOOP *
+ev_create(const char *backend)
+{
+    EVLOOP *lp;
+    int type, virt = 0;
+
+
+    if (backend && strcmp(backend, "virtual") == 0)
+    {
+	virt = 1;
+	type = EV_BACKEND_POLL;
+    }
+    else
+	type = ev_backend_type(backend);
+    if (type < 0)
+    {
+	errno = EINVAL;
+	return NULL;
+    }
+    
+    lp = calloc(1, sizeof(*lp));
+    if (!lp)
+	return NULL;
+
+    pthread_mutex_init(&lp->mtx, NULL);
+    
+    lp->virt = virt;
+    lp->vt0 = time(NULL);
+    
+#if HAVE_IO_URING
+    lp->ur.fd = -1;
+    if (type == EV_BACKEND_URING && ev_uring_open(lp) < 0)
+    {
+	if (debug)
+	    fprintf(stderr, "EV_CREATE: io_uring not available (%s), using epoll\n",
+		    strerror(errno));
+	type = EV_BACKEND_EPOLL;
+    }
+#else
+    if (type == EV_BACKEND_URING)
+	type = EV_BACKEND_EPOLL;
+#endif
+#if !HAVE_EPOLL
+    if (type == EV_BACKEND_EPOLL)
+	type = EV_BACKEND_POLL;
+#endif
+    lp->backend = type;
+    
+#if HAVE_EPOLL
+    lp->epfd = lp->tfd = lp->efd = lp->sfd = -1;
+    lp->tfd_due = -1;
+
+    if (type == EV_BACKEND_EPOLL)
+    {
+	lp->epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (lp->epfd < 0)
+	    goto Fail;
+    }
+
+    /* Timeouts are otherwise passed to the wait */
+    if (type == EV_BACKEND_EPOLL
+#if HAVE_IO_URING
+	|| (type == EV_BACKEND_URING && !lp->ur.ext_arg)
+#endif
+	)
+    {
+	lp->tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK|TFD_CLOEXEC);
+	if (lp->tfd < 0 || ev_add_fd(lp, lp->tfd, EV_READ, ev_timerfd_handler, NULL) < 0)
+	    goto Fail;
+    }
+
+    lp->efd = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+    if (lp->efd < 0 || ev_add_fd(lp, lp->efd, EV_READ, ev_eventfd_handler, NULL) < 0)
+	goto Fail;
+#else
+    lp->wfd[0] = lp->wfd[1] = -1;
+    if (pipe(lp->wfd) < 0)
+	goto Fail;
+    
+    fcntl(lp->wfd[0], F_SETFL, O_NONBLOCK);
+    fcntl(lp->wfd[1], F_SETFL, O_NONBLOCK);
+    fcntl(lp->wfd[0], F_SETFD, FD_CLOEXEC);
+    fcntl(lp->wfd[1], F_SETFD, FD_CLOEXEC);
+
+    if (ev_add_fd(lp, lp->wfd[0], EV_READ, ev_pipe_handler, NULL) < 0)
+	goto Fail;
+#endif
+
+    return lp;
+
+  Fail:
+    ev_destroy(lp);
+    return NULL;
+}
+
+
+void
+ev_destroy(EVLOOP *lp)
+{
+    EVFD *ep;
+    EVPOST *pp;
+
+
+    if (!lp)
+	return;
+
+    /* Cancels anything still in flight */
+#if HAVE_IO_URING
+    ev_uring_close(lp);
+#endif
+    
+#if HAVE_EPOLL
+    if (lp->sfd >= 0)
+	close(lp->sfd);
+    if (lp->efd >= 0)
+	close(lp->efd);
+    if (lp->tfd >= 0)
+	close(lp->tfd);
+    if (lp->epfd >= 0)
+	close(lp->epfd);
+#else
+    if (lp->sthread)
+    {
+	lp->stop = 1;
+	pthread_cancel(lp->stid);
+	pthread_join(lp->stid, NULL);
+    }
+    if (lp->wfd[0] >= 0)
+	close(lp->wfd[0]);
+    if (lp->wfd[1] >= 0)
+	close(lp->wfd[1]);
+#endif
+    free(lp->pv);
+    free(lp->pe);
+
+    while ((ep = lp->fds) != NULL)
+    {
+	lp->fds = ep->next;
+	ev_free(ep);
+    }
+    while ((ep = lp->dead) != NULL)
+    {
+	lp->dead = ep->next;
+	ev_free(ep);
+    }
+
+    while ((pp = lp->ph) != NULL)
+    {
+	lp->ph = pp->next;
+	free(pp);
+    }
+    
+    free(lp->tv);
+    pthread_mutex_destroy(&lp->mtx);
+    free(lp);
+}
+
+
+const char *
+ev_backend(EVLOOP *lp)
+{
+    return lp->virt ? "virtual" : ev_backends[lp->backend];
+}
+
+
+/* The clock of timers, in milliseconds: monotonic, or virtual */
+long long
+ev_now(EVLOOP *lp)
+{
+    return lp->virt ? lp->vnow : ev_mono();
+}
+
+
+/* Wall clock time, which follows the virtual clock in a simulation */
+time_t
+ev_time(EVLOOP *lp)
+{
+    return lp->virt ? lp->vt0 + (time_t) (lp->vnow / 1000) : time(NULL);
+}
+
+
+void
+ev_stats(EVLOOP *lp,
+	 EVSTATS *sp)
+{
+    *sp = lp->st;
+}
+
+
+int
+ev_add_fd(EVLOOP *lp,
+	  int fd,
+	  int events,
+	  EVFDFUN fun,
+	  void *xp)
+{
+    return ev_attach(lp, fd, events, fun, NULL, NULL, 0, xp) ? 0 : -1;
+}
+
+
+/*
+ * Read from 'fd' in the loop and pass the data to 'fun', at most
+ * 'size' bytes at a time into 'buf' (allocated by the loop if NULL).
+ * A length of 0 is end of file and a negative length an error (-errno).
+ */
+int
+ev_add_reader(EVLOOP *lp,
+	      int fd,
+	      char *buf,
+	      int size,
+	      EVREADFUN fun,
+	      void *xp)
+{
+    return ev_attach(lp, fd, 0, NULL, fun, buf, size, xp) ? 0 : -1;
+}
+
+
+/*
+ * Read into 'buf' from now on. Called from the reader function, so
+ * that the data can be read directly into where it is parsed.
+ */
+int
+ev_set_rbuf(EVLOOP *lp,
+	    int fd,
+	    char *buf,
+	    int size)
+{
+    EVFD *ep;
+
+
+    ep = ev_find(lp, fd);
+    if (!ep || !ep->rfun || size <= 0)
+    {
+	errno = ep ? EINVAL : ENOENT;
+	return -1;
+    }
+    if (ep->reading)
+    {
+	errno = EBUSY;
+	return -1;
+    }
+    
+    if (ep->rown)
+	free(ep->rbuf);
+    ep->rown = 0;
+    ep->rbuf = buf;
+    ep->rsize = size;
+    return 0;
+}
+
+
+int
+ev_mod_fd(EVLOOP *lp,
+	  int fd,
+	  int events)
+{
+    EVFD *ep;
+
+
+    ep = ev_find(lp, fd);
+    if (!ep)
+    {
+	errno = ENOENT;
+	return -1;
+    }
+
+    if (ep->events == events)
+	return 0;
+    
+    ep->events = events;
+    ev_update(lp, ep);
+    return 0;
+}
+
+
+int
+ev_del_fd(EVLOOP *lp,
+	  int fd)
+{
+    EVFD **epp, *ep;
+
+
+    for (epp = &lp->fds; (ep = *epp) != NULL && ep->fd != fd; epp = &ep->next)
+	;
+    if (!ep)
+    {
+	errno = ENOENT;
+	return -1;
+    }
+
+    switch (lp->backend)
+    {
+#if HAVE_IO_URING
+      case EV_BACKEND_URING:
+	ev_uring_cancel(lp, ep);
+	break;
+#endif
+#if HAVE_EPOLL
+      case EV_BACKEND_EPOLL:
+	++lp->st.syscalls;
+	(void) epoll_ctl(lp->epfd, EPOLL_CTL_DEL, fd, NULL);
+	break;
+#endif
+    }
+    
+    *epp = ep->next;
+    ep->dead = 1;
+    ep->next = lp->dead;
+    lp->dead = ep;
+    return 0;
+}
+
+
+/*
+ * Queue output for a registered fd. With poll and epoll as much as
+ * the fd takes is written directly with one writev(), the rest when it
+ * is writable again. With io_uring the data is submitted as one write
+ * with the next wait.
+ */
+int
+ev_writev(EVLOOP *lp,
+	  int fd,
+	  const struct iovec *iov,
+	  int iovcnt)
+{
+    EVFD *ep;
+    ssize_t n = 0;
+    int i;
+
+
+    ep = ev_find(lp, fd);
+    if (!ep)
+    {
+	errno = ENOENT;
+	return -1;
+    }
+
+    if (lp->backend != EV_BACKEND_URING && ep->out.off == ep->out.len)
+    {
+	do
+	{
+	    ++lp->st.syscalls;
+	    ++lp->st.writes;
+	    n = writev(fd, iov, iovcnt);
+	} while (n < 0 && errno == EINTR);
+	
+	if (n < 0)
+	{
+	    if (errno != EAGAIN)
+		return -1;
+	    n = 0;
+	}
+	lp->st.wbytes += n;
+    }
+
+    /* Queue what was not written */
+    for (i = 0; i < iovcnt; i++)
+    {
+	if ((size_t) n >= iov[i].iov_len)
+	{
+	    n -= iov[i].iov_len;
+	    continue;
+	}
+	
+	if (ev_buf_append(&ep->out, (char *) iov[i].iov_base + n, iov[i].iov_len - n) < 0)
+	    return -1;
+	n = 0;
+    }
+    
+    ev_update(lp, ep);
+    return 0;
+}
+
+
+int
+ev_write(EVLOOP *lp,
+	 int fd,
+	 const char *buf,
+	 size_t len)
+{
+    struct iovec iov;
+
+    iov.iov_base = (void *) buf;
+    iov.iov_len = len;
+    return ev_writev(lp, fd, &iov, 1);
+}
+
+
+/* Call 'fun' once after 'ms' milliseconds. Returns a timer id (> 0) */
+int
+ev_add_timer(EVLOOP *lp,
+	     int ms,
+	     EVFUN fun,
+	     void *xp)
+{
+    EVTIMER *tp;
+
+
+    if (lp->tc == lp->ts)
+    {
+	EVTIMER *ntv = realloc(lp->tv, sizeof(EVTIMER) * (lp->ts + 8));
+
+	if (!ntv)
+	    return -1;
+	lp->tv = ntv;
+	lp->ts += 8;
+    }
+
+    if (++lp->tid <= 0)
+	lp->tid = 1;
+    
+    tp = &lp->tv[lp->tc++];
+    tp->id = lp->tid;
+    tp->due = ev_now(lp) + (ms > 0 ? ms : 0);
+    tp->fun = fun;
+    tp->xp = xp;
+    
+    return tp->id;
+}
+
+
+int
+ev_del_timer(EVLOOP *lp,
+	     int id)
+{
+    int i;
+
+
+    for (i = 0; i < lp->tc && lp->tv[i].id != id; i++)
+	;
+    if (i == lp->tc)
+	return -1;
+
+    lp->tv[i] = lp->tv[--lp->tc];
+    return 0;
+}
+
+
+/*
+ * Deliver the signals in 'set' to 'fun' in the loop. The signals
+ * must be blocked in all threads.
+ */
+int
+ev_add_signals(EVLOOP *lp,
+	       const sigset_t *set,
+	       EVSIGFUN fun,
+	       void *xp)
+{
+    lp->sfun = fun;
+    lp->sxp = xp;
+    
+#if HAVE_EPOLL
+    lp->sfd = signalfd(-1, set, SFD_NONBLOCK|SFD_CLOEXEC);
+    if (lp->sfd < 0)
+	return -1;
+
+    return ev_add_fd(lp, lp->sfd, EV_READ, ev_signalfd_handler, NULL);
+#else
+    lp->sigs = *set;
+    if (pthread_create(&lp->stid, NULL, ev_signal_thread, lp) != 0)
+	return -1;
+    lp->sthread = 1;
+    return 0;
+#endif
+}
+
+
+/* Called in the loop after each wakeup */
+int
+ev_set_wakeup(EVLOOP *lp,
+	      EVFUN fun,
+	      void *xp)
+{
+    lp->wfun = fun;
+    lp->wxp = xp;
+    return 0;
+}
+
+
+/* Wake the loop up. May be called from any thread */
+int
+ev_wakeup(EVLOOP *lp)
+{
+    int w;
+    
+    
+    pthread_mutex_lock(&lp->mtx);
+    w = lp->woken;
+    lp->woken = 1;
+    pthread_mutex_unlock(&lp->mtx);
+
+    /* Already pending */
+    if (w)
+	return 0;
+    
+#if HAVE_EPOLL
+    {
+	uint64_t n = 1;
+
+	if (write(lp->efd, &n, sizeof(n)) < 0 && errno != EAGAIN)
+	    return -1;
+    }
+#else
+    if (write(lp->wfd[1], "", 1) < 0 && errno != EAGAIN)
+	return -1;
+#endif
+
+    return 0;
+}
+
+
+/* Run 'fun' in the loop. May be called from any thread */
+int
+ev_post(EVLOOP *lp,
+	EVFUN fun,
+	void *xp)
+{
+    EVPOST *pp;
+
+
+    pp = calloc(1, sizeof(*pp));
+    if (!pp)
+	return -1;
+
+    pp->fun = fun;
+    pp->xp = xp;
+    
+    pthread_mutex_lock(&lp->mtx);
+    if (lp->pt)
+	lp->pt->next = pp;
+    else
+	lp->ph = pp;
+    lp->pt = pp;
+    pthread_mutex_unlock(&lp->mtx);
+
+    return ev_wakeup(lp);
+}
+
+
+void
+ev_stop(EVLOOP *lp)
+{
+    lp->stop = 1;
+    ev_wakeup(lp);
+}
+
+
+/* Run until ev_stop() is called */
+int
+ev_run(EVLOOP *lp)
+{
+    int rc;
+
+
+    if (debug)
+	fprintf(stderr, "EV_RUN: Start (%s)\n", ev_backend(lp));
+    
+    lp->stop = 0;
+    while (!lp->stop)
+    {
+	ev_run_timers(lp);
+	if (lp->stop)
+	    break;
+
+	switch (lp->backend)
+	{
+#if HAVE_IO_URING
+	  case EV_BACKEND_URING:
+	    rc = ev_uring_wait(lp);
+	    break;
+#endif
+#if HAVE_EPOLL
+	  case EV_BACKEND_EPOLL:
+	    rc = ev_epoll_wait(lp);
+	    break;
+#endif
+	  default:
+	    rc = ev_poll_wait(lp);
+	}
+	if (rc < 0)
+	    return -1;
+	
+	ev_reap(lp);
+    }
+
+    if (debug)
+	fprintf(stderr, "EV_RUN: Stop\n");
+    
+    return 0;
+}
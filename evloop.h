@@ -0,0 +1,164 @@
+/*
+ * evloop.h - Event loop
+ *
+ * Copyright (c) 2016-2020 Peter Eriksson <pen@lysator.liu.se>
+ *
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef EVLOOP_H
+#define EVLOOP_H
+
+#include <signal.h>
+#include <stddef.h>
+#include <time.h>
+#include <sys/uio.h>
+
+#define EV_READ		0x01
+#define EV_WRITE	0x02
+#define EV_ERROR	0x04	/* Error or hangup (always reported) */
+
+
+typedef struct evloop EVLOOP;
+
+typedef void (*EVFDFUN)(EVLOOP *lp, int fd, int events, void *xp);
+typedef void (*EVFUN)(EVLOOP *lp, void *xp);
+typedef void (*EVSIGFUN)(EVLOOP *lp, int sig, void *xp);
+typedef void (*EVREADFUN)(EVLOOP *lp, int fd, char *buf, int len, void *xp);
+
+
+/* Counters kept by the loop thread */
+typedef struct evstats
+{
+    unsigned long syscalls;	/* Waits, reads, writes and control calls */
+    unsigned long wakeups;	/* Returns from the wait */
+    unsigned long events;	/* Events and completions handled */
+    unsigned long reads;	/* read() calls or submitted reads */
+    unsigned long writes;	/* write() calls or submitted writes */
+    unsigned long rbytes;
+    unsigned long wbytes;
+} EVSTATS;
+
+
+extern EVLOOP *
+ev_create(const char *backend);
+
+extern void
+ev_destroy(EVLOOP *lp);
+
+extern const char *
+ev_backend(EVLOOP *lp);
+
+extern void
+ev_stats(EVLOOP *lp,
+	 EVSTATS *sp);
+
+extern long long
+ev_now(EVLOOP *lp);
+
+extern time_t
+ev_time(EVLOOP *lp);
+
+extern int
+ev_add_fd(EVLOOP *lp,
+	  int fd,
+	  int events,
+	  EVFDFUN fun,
+	  void *xp);
+
+extern int
+ev_add_reader(EVLOOP *lp,
+	      int fd,
+	      char *buf,
+	      int size,
+	      EVREADFUN fun,
+	      void *xp);
+
+extern int
+ev_set_rbuf(EVLOOP *lp,
+	    int fd,
+	    char *buf,
+	    int size);
+
+extern int
+ev_mod_fd(EVLOOP *lp,
+	  int fd,
+	  int events);
+
+extern int
+ev_del_fd(EVLOOP *lp,
+	  int fd);
+
+extern int
+ev_write(EVLOOP *lp,
+	 int fd,
+	 const char *buf,
+	 size_t len);
+
+extern int
+ev_writev(EVLOOP *lp,
+	  int fd,
+	  const struct iovec *iov,
+	  int iovcnt);
+
+extern int
+ev_add_timer(EVLOOP *lp,
+	     int ms,
+	     EVFUN fun,
+	     void *xp);
+
+extern int
+ev_del_timer(EVLOOP *lp,
+	     int id);
+
+extern int
+ev_add_signals(EVLOOP *lp,
+	       const sigset_t *set,
+	       EVSIGFUN fun,
+	       void *xp);
+
+extern int
+ev_set_wakeup(EVLOOP *lp,
+	      EVFUN fun,
+	      void *xp);
+
+extern int
+ev_wakeup(EVLOOP *lp);
+
+extern int
+ev_post(EVLOOP *lp,
+	EVFUN fun,
+	void *xp);
+
+extern int
+ev_run(EVLOOP *lp);
+
+extern void
+ev_stop(EVLOOP *lp);
+
+#endif
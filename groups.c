@@ -0,0 +1,610 @@
+/*
+ * groups.c - Recipient groups
+ *
+ * Copyright (c) 2016-2020 Peter Eriksson <pen@lysator.liu.se>
+ *
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <ctype.h>
+#include <syslog.h>
+#include <pthread.h>
+
+#include "groups.h"
+#include "phone.h"
+#include "strmisc.h"
+
+extern int debug;
+
+
+/*
+ * A group. 'mv' are the members as written in the file, 'rv' the
+ * recipients (user names and phone numbers) after nested groups have
+ * been expanded and duplicates removed, and 'pv' their distinct phone
+ * numbers (see groups_resolve()).
+ */
+typedef struct group
+{
+    char *name;
+
+    char **mv;
+    int mc;
+    int ms;
+
+    char **rv;
+    int rc;
+    int rs;
+
+    char **pv;
+    int pc;
+
+    int state;		/* 0 = unexpanded, 1 = expanding, 2 = expanded */
+} GROUP;
+
+
+typedef struct gtab
+{
+    GROUP *gv;
+    int gc;
+    int gs;
+    unsigned int serial;	/* Changed by each load */
+    int resolved;	/* The phone numbers are set */
+    unsigned int gen;	/* ... for this generation of the users */
+} GTAB;
+
+
+/* A copy of a group's recipients, resolved without holding the lock */
+typedef struct gres
+{
+    char *name;
+    char **rv;
+    int rc;
+    char **pv;
+    int pc;
+} GRES;
+
+/* A recipient's phone number, while duplicates are removed */
+typedef struct gphone
+{
+    char *phone;
+    uint64_t key;
+    int pos;
+} GPHONE;
+
+
+static pthread_mutex_t mtx = PTHREAD_MUTEX_INITIALIZER;
+static GTAB groups = { NULL, 0, 0, 0, 0, 0 };
+
+
+
+static int
+strv_add(char ***vp,
+	 int *cp,
+	 int *sp,
+	 const char *s)
+{
+    if (*cp == *sp)
+    {
+	char **nv = realloc(*vp, sizeof(char *) * (*sp += 16));
+	
+	if (!nv)
+	    return -1;
+	*vp = nv;
+    }
+
+    (*vp)[*cp] = (char *) s;
+    return (*cp)++;
+}
+
+
+static void
+group_free_phones(GROUP *gp)
+{
+    int i;
+
+
+    for (i = 0; i < gp->pc; i++)
+	free(gp->pv[i]);
+    free(gp->pv);
+    gp->pv = NULL;
+    gp->pc = 0;
+}
+
+
+static void
+gtab_free(GTAB *tp)
+{
+    int i, j;
+
+
+    for (i = 0; i < tp->gc; i++)
+    {
+	for (j = 0; j < tp->gv[i].mc; j++)
+	    free(tp->gv[i].mv[j]);
+	free(tp->gv[i].mv);
+	free(tp->gv[i].rv);
+	group_free_phones(&tp->gv[i]);
+	free(tp->gv[i].name);
+    }
+    free(tp->gv);
+
+    memset(tp, 0, sizeof(*tp));
+}
+
+
+static int
+group_cmp(const void *a,
+	  const void *b)
+{
+    return strcmp(((const GROUP *) a)->name, ((const GROUP *) b)->name);
+}
+
+
+static GROUP *
+gtab_find(GTAB *tp,
+	  const char *name)
+{
+    GROUP key;
+
+
+    if (tp->gc == 0)
+	return NULL;
+    
+    key.name = (char *) name;
+    return bsearch(&key, tp->gv, tp->gc, sizeof(GROUP), group_cmp);
+}
+
+
+/* Append recipients, skipping ones that are already present */
+static int
+group_add_recipient(GROUP *gp,
+		    char *r)
+{
+    int i;
+
+
+    for (i = 0; i < gp->rc && strcmp(gp->rv[i], r) != 0; i++)
+	;
+    if (i < gp->rc)
+	return 0;
+
+    return strv_add(&gp->rv, &gp->rc, &gp->rs, r) < 0 ? -1 : 1;
+}
+
+
+/*
+ * Expand the members of a group into its recipient list. Nested
+ * groups are expanded first. Recipient strings point into the member
+ * lists so they are not copied.
+ */
+static int
+group_expand(GTAB *tp,
+	     GROUP *gp,
+	     int depth)
+{
+    GROUP *sgp;
+    int i, j;
+
+
+    if (gp->state == 2)
+	return 0;
+
+    if (gp->state == 1 || depth > GROUPS_MAX_DEPTH)
+    {
+	if (!debug)
+	    syslog(LOG_WARNING, "%s: Group loop or nesting too deep", gp->name);
+	else
+	    fprintf(stderr, "GROUPS_LOAD: %s: Group loop or nesting too deep\n", gp->name);
+	return -1;
+    }
+
+    gp->state = 1;
+    for (i = 0; i < gp->mc; i++)
+    {
+	sgp = gtab_find(tp, gp->mv[i]);
+	if (!sgp)
+	{
+	    if (group_add_recipient(gp, gp->mv[i]) < 0)
+		return -1;
+	    continue;
+	}
+
+	if (group_expand(tp, sgp, depth+1) < 0)
+	    return -1;
+
+	for (j = 0; j < sgp->rc; j++)
+	    if (group_add_recipient(gp, sgp->rv[j]) < 0)
+		return -1;
+    }
+    gp->state = 2;
+
+    return 0;
+}
+
+
+static int
+groups_parse(FILE *fp,
+	     GTAB *tp)
+{
+    char buf[1024], pbuf[PHONE_MAX], *name, *cp, *endp;
+    GROUP *gp;
+    int i, j;
+
+
+    while (fgets(buf, sizeof(buf), fp))
+    {
+	name = strtok_r(buf, " \t\r\n", &endp);
+	if (!name || *name == '#')
+	    continue;
+
+	/* A group may be split over several lines */
+	for (i = 0; i < tp->gc && strcmp(tp->gv[i].name, name) != 0; i++)
+	    ;
+	if (i == tp->gc)
+	{
+	    if (tp->gc == tp->gs)
+	    {
+		GROUP *ngv = realloc(tp->gv, sizeof(GROUP) * (tp->gs += 16));
+
+		if (!ngv)
+		    return -1;
+		tp->gv = ngv;
+	    }
+	    memset(&tp->gv[i], 0, sizeof(GROUP));
+	    tp->gv[i].name = s_dup(name);
+	    tp->gc++;
+	}
+	gp = &tp->gv[i];
+
+	while ((cp = strtok_r(NULL, " \t\r\n", &endp)) != NULL)
+	{
+	    if (*cp == '#')
+		break;
+
+	    /* Phone numbers are kept normalized so duplicates are found */
+	    if ((*cp == '+' || isdigit((unsigned char) *cp)) &&
+		phone_normalize(cp, pbuf, sizeof(pbuf)) >= 0)
+		cp = pbuf;
+	    
+	    if (strv_add(&gp->mv, &gp->mc, &gp->ms, s_dup(cp)) < 0)
+		return -1;
+	}
+    }
+
+    qsort(tp->gv, tp->gc, sizeof(GROUP), group_cmp);
+
+    for (i = 0; i < tp->gc; i++)
+	if (group_expand(tp, &tp->gv[i], 0) < 0)
+	    return -1;
+
+    if (debug > 1)
+	for (i = 0; i < tp->gc; i++)
+	{
+	    fprintf(stderr, "GROUPS_LOAD: Group: Name=%s, Recipients=",
+		    tp->gv[i].name);
+	    for (j = 0; j < tp->gv[i].rc; j++)
+		fprintf(stderr, "%s%s", j ? "," : "", tp->gv[i].rv[j]);
+	    putc('\n', stderr);
+	}
+
+    return 0;
+}
+
+
+/*
+ * Load (or reload) the groups file. The current groups are kept if
+ * the new file can not be read or contains loops.
+ */
+int
+groups_load(const char *path)
+{
+    FILE *fp;
+    GTAB nt, ot;
+    int rc;
+
+
+    if (debug)
+	fprintf(stderr, "GROUPS_LOAD: Start\n");
+
+    fp = fopen(path, "r");
+    if (!fp)
+	return -1;
+
+    memset(&nt, 0, sizeof(nt));
+    rc = groups_parse(fp, &nt);
+    fclose(fp);
+
+    if (rc < 0)
+    {
+	gtab_free(&nt);
+	return -1;
+    }
+
+    pthread_mutex_lock(&mtx);
+    ot = groups;
+    nt.serial = ot.serial + 1;
+    groups = nt;
+    pthread_mutex_unlock(&mtx);
+
+    gtab_free(&ot);
+
+    if (debug)
+	fprintf(stderr, "GROUPS_LOAD: Stop (%d groups)\n", nt.gc);
+    
+    return nt.gc;
+}
+
+
+/* By phone number, numbers without a key by the string, then in file order */
+static int
+gphone_cmp(const void *a,
+	   const void *b)
+{
+    const GPHONE *x = a, *y = b;
+    int d;
+
+
+    if (x->key != y->key)
+	return x->key < y->key ? -1 : 1;
+    if (!x->key && (d = strcmp(x->phone, y->phone)) != 0)
+	return d;
+    return x->pos - y->pos;
+}
+
+
+static int
+gphone_pos_cmp(const void *a,
+	       const void *b)
+{
+    return ((const GPHONE *) a)->pos - ((const GPHONE *) b)->pos;
+}
+
+
+static void
+gres_free(GRES *v,
+	  int n)
+{
+    int i, j;
+
+
+    for (i = 0; i < n; i++)
+    {
+	for (j = 0; j < v[i].rc; j++)
+	    free(v[i].rv[j]);
+	free(v[i].rv);
+	for (j = 0; j < v[i].pc; j++)
+	    free(v[i].pv[j]);
+	free(v[i].pv);
+	free(v[i].name);
+    }
+    free(v);
+}
+
+
+/* Copy the recipients of all groups, to be resolved without the lock */
+static GRES *
+gres_copy(GTAB *tp)
+{
+    GRES *v;
+    int i, j;
+
+
+    v = calloc(tp->gc+1, sizeof(GRES));
+    if (!v)
+	return NULL;
+
+    for (i = 0; i < tp->gc; i++)
+    {
+	v[i].name = s_dup(tp->gv[i].name);
+	v[i].rv = calloc(tp->gv[i].rc+1, sizeof(char *));
+	if (!v[i].name || !v[i].rv)
+	    goto Fail;
+	
+	for (j = 0; j < tp->gv[i].rc; j++)
+	{
+	    v[i].rv[j] = s_dup(tp->gv[i].rv[j]);
+	    if (!v[i].rv[j])
+		goto Fail;
+	    v[i].rc++;
+	}
+    }
+    return v;
+
+  Fail:
+    gres_free(v, tp->gc);
+    return NULL;
+}
+
+
+/*
+ * Set the distinct phone numbers of a group's recipients, in the order
+ * of the file. Members that share a phone are sent one message.
+ */
+static int
+group_resolve(GRES *rp,
+	      char *(*name2phone)(const char *name))
+{
+    GPHONE *v;
+    const char *r;
+    int i, n = 0;
+
+
+    v = calloc(rp->rc+1, sizeof(GPHONE));
+    rp->pv = calloc(rp->rc+1, sizeof(char *));
+    if (!v || !rp->pv)
+    {
+	free(v);
+	return -1;
+    }
+
+    for (i = 0; i < rp->rc; i++)
+    {
+	r = rp->rv[i];
+	v[n].phone = (*r == '+' || isdigit((unsigned char) *r)) ? s_dup(r) : (*name2phone)(r);
+	if (!v[n].phone)
+	{
+	    if (debug)
+		fprintf(stderr, "GROUPS_RESOLVE: %s: %s: Unknown group member\n", rp->name, r);
+	    continue;
+	}
+	v[n].key = phone_key(v[n].phone);
+	v[n].pos = n;
+	n++;
+    }
+
+    /* Duplicates end up next to the first one */
+    qsort(v, n, sizeof(GPHONE), gphone_cmp);
+    for (i = 1; i < n; i++)
+	if (v[i].key == v[i-1].key && (v[i].key || strcmp(v[i].phone, v[i-1].phone) == 0))
+	{
+	    free(v[i-1].phone);
+	    v[i-1].phone = NULL;
+	}
+    
+    qsort(v, n, sizeof(GPHONE), gphone_pos_cmp);
+    for (i = 0; i < n; i++)
+	if (v[i].phone)
+	    rp->pv[rp->pc++] = v[i].phone;
+    free(v);
+
+    return rp->pc;
+}
+
+
+/*
+ * Resolve the recipients of all groups to phone numbers, with
+ * 'name2phone' for the user names. Nothing is done if they already are
+ * for the users' generation 'gen' (which changes when the names or
+ * phones of the users do), so that a group send is a single lookup.
+ * The lookups are done on a copy, without the lock.
+ */
+int
+groups_resolve(char *(*name2phone)(const char *name),
+	       unsigned int gen)
+{
+    GRES *v;
+    unsigned int serial;
+    int i, n, rc = 0;
+
+
+    pthread_mutex_lock(&mtx);
+    if (groups.resolved && groups.gen == gen)
+    {
+	pthread_mutex_unlock(&mtx);
+	return 0;
+    }
+    
+    serial = groups.serial;
+    n = groups.gc;
+    v = gres_copy(&groups);
+    pthread_mutex_unlock(&mtx);
+
+    if (!v)
+	return -1;
+
+    for (i = 0; i < n && rc == 0; i++)
+	if (group_resolve(&v[i], name2phone) < 0)
+	    rc = -1;
+
+    if (rc == 0)
+    {
+	pthread_mutex_lock(&mtx);
+	
+	/* Unless a new file was loaded meanwhile, which is resolved by its loader */
+	if (groups.serial == serial)
+	{
+	    for (i = 0; i < n; i++)
+	    {
+		group_free_phones(&groups.gv[i]);
+		groups.gv[i].pv = v[i].pv;
+		groups.gv[i].pc = v[i].pc;
+		v[i].pv = NULL;
+		v[i].pc = 0;
+	    }
+	    groups.resolved = 1;
+	    groups.gen = gen;
+	}
+	
+	pthread_mutex_unlock(&mtx);
+    }
+
+    if (debug)
+	fprintf(stderr, "GROUPS_RESOLVE: %d groups%s\n", n, rc ? " (failed)" : "");
+    
+    gres_free(v, n);
+    return rc;
+}
+
+
+/*
+ * Call 'fcp' for each distinct phone number of a group, as set by
+ * groups_resolve(). Returns -1 if there is no such group, else the
+ * number of phone numbers.
+ */
+int
+groups_foreach(const char *name,
+	       int (*fcp)(const char *phone, void *xp),
+	       void *xp)
+{
+    GROUP *gp;
+    int i, rc;
+
+
+    pthread_mutex_lock(&mtx);
+    
+    gp = gtab_find(&groups, name);
+    if (!gp)
+    {
+	pthread_mutex_unlock(&mtx);
+	return -1;
+    }
+
+    for (i = 0; i < gp->pc; i++)
+	if ((rc = (*fcp)(gp->pv[i], xp)) != 0)
+	    break;
+
+    pthread_mutex_unlock(&mtx);
+    return i;
+}
+
+
+int
+groups_count(void)
+{
+    int n;
+
+    pthread_mutex_lock(&mtx);
+    n = groups.gc;
+    pthread_mutex_unlock(&mtx);
+
+    return n;
+}
@@ -259,6 +259,53 @@ gsm_to_latin1(const char *gs,
 }
 
 
+/*
+ * Look for a concatenation element (8 or 16 bit reference) in a user
+ * data header at the start of the hex encoded message 'gs'. Returns
+ * the length of the header in hex digits, or 0 if there is none.
+ */
+int
+gsm_udh_concat(const char *gs,
+	       int *ref,
+	       int *total,
+	       int *seq)
+{
+    int udhl, i, iei, iel, v[4], found = 0;
+
+    
+    if (sscanf(gs, "%2x", &udhl) != 1 || udhl < 5 || (int) strlen(gs) < 2*(1+udhl))
+	return 0;
+
+    for (i = 1; i < 1+udhl; i += 2+iel)
+    {
+	if (sscanf(gs+2*i, "%2x%2x", &iei, &iel) != 2 || i+2+iel > 1+udhl)
+	    return 0;
+	
+	if (iei == 0x00 && iel == 3 &&
+	    sscanf(gs+2*i+4, "%2x%2x%2x", &v[0], &v[1], &v[2]) == 3)
+	{
+	    *ref = v[0];
+	    *total = v[1];
+	    *seq = v[2];
+	    found = 1;
+	}
+	else if (iei == 0x08 && iel == 4 &&
+		 sscanf(gs+2*i+4, "%2x%2x%2x%2x", &v[0], &v[1], &v[2], &v[3]) == 4)
+	{
+	    *ref = (v[0] << 8) | v[1];
+	    *total = v[2];
+	    *seq = v[3];
+	    found = 1;
+	}
+    }
+
+    if (i != 1+udhl || !found || *total < 1 || *seq < 1 || *seq > *total)
+	return 0;
+    
+    return 2*(1+udhl);
+}
+
+
 #ifdef MAIN
 int
 main(int argc,
@@ -44,4 +44,10 @@ gsm_to_latin1(const char *gs,
 	      char *buf,
 	      int bufsize);
 
+extern int
+gsm_udh_concat(const char *gs,
+	       int *ref,
+	       int *total,
+	       int *seq);
+
 #endif
@@ -0,0 +1,388 @@
+/*
+ * journal.c - Inbound message journal
+ *
+ * Copyright (c) 2016-2020 Peter Eriksson <pen@lysator.liu.se>
+ *
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <inttypes.h>
+
+#include "journal.h"
+
+extern int debug;
+
+
+static void
+journal_put(JOURNAL *jp,
+	    uint64_t key,
+	    time_t t)
+{
+    int i = (int) (key & (jp->size-1));
+
+    while (jp->kv[i] && jp->kv[i] != key)
+	i = (i+1) & (jp->size-1);
+
+    if (!jp->kv[i])
+	jp->n++;
+    jp->kv[i] = key;
+    jp->tv[i] = t;
+}
+
+
+/* Move the entries recorded at or after 'since' to a table of 'size' slots */
+static int
+journal_rehash(JOURNAL *jp,
+	       int size,
+	       time_t since)
+{
+    uint64_t *okv = jp->kv;
+    time_t *otv = jp->tv;
+    int osize = jp->size;
+    int i;
+
+
+    jp->size = size;
+    jp->kv = calloc(jp->size, sizeof(*jp->kv));
+    jp->tv = calloc(jp->size, sizeof(*jp->tv));
+    if (!jp->kv || !jp->tv)
+    {
+	free(jp->kv);
+	free(jp->tv);
+	jp->kv = okv;
+	jp->tv = otv;
+	jp->size = osize;
+	return -1;
+    }
+
+    jp->n = 0;
+    for (i = 0; i < osize; i++)
+	if (okv[i] && otv[i] >= since)
+	    journal_put(jp, okv[i], otv[i]);
+
+    free(okv);
+    free(otv);
+    return 0;
+}
+
+
+static int
+journal_grow(JOURNAL *jp)
+{
+    return journal_rehash(jp, jp->size ? jp->size*2 : 256, 0);
+}
+
+
+/*
+ * Write the live entries to a new file and move it in place of the
+ * old one, dropping the expired entries and duplicate lines.
+ */
+static int
+journal_compact(JOURNAL *jp)
+{
+    char *tmp;
+    FILE *fp;
+    int i, fd;
+
+
+    tmp = malloc(strlen(jp->path)+5);
+    if (!tmp)
+	return -1;
+    sprintf(tmp, "%s.new", jp->path);
+
+    fp = fopen(tmp, "w");
+    if (!fp)
+    {
+	free(tmp);
+	return -1;
+    }
+
+    for (i = 0; i < jp->size; i++)
+	if (jp->kv[i])
+	    fprintf(fp, "%ld %016" PRIx64 "\n", (long) jp->tv[i], jp->kv[i]);
+
+    if (fflush(fp) != 0 || fsync(fileno(fp)) < 0)
+    {
+	fclose(fp);
+	goto Fail;
+    }
+    if (fclose(fp) != 0 || rename(tmp, jp->path) < 0)
+	goto Fail;
+    
+    free(tmp);
+
+    fd = open(jp->path, O_WRONLY|O_APPEND|O_CLOEXEC);
+    if (fd < 0)
+	return -1;
+
+    if (jp->fd >= 0)
+	close(jp->fd);
+    jp->fd = fd;
+    jp->lines = jp->n;
+    return 0;
+
+  Fail:
+    unlink(tmp);
+    free(tmp);
+    return -1;
+}
+
+
+static int
+journal_load(JOURNAL *jp)
+{
+    FILE *fp;
+    char buf[128];
+    long t;
+    uint64_t key;
+    time_t now = time(NULL);
+    int lines = 0;
+
+
+    fp = fopen(jp->path, "r");
+    if (!fp)
+	return errno == ENOENT ? 0 : -1;
+
+    while (fgets(buf, sizeof(buf), fp))
+    {
+	if (sscanf(buf, "%ld %" SCNx64, &t, &key) != 2 || !key)
+	    continue;
+	
+	lines++;
+	if (now - (time_t) t > JOURNAL_KEEP)
+	    continue;
+	
+	if (jp->n*2 >= jp->size && journal_grow(jp) < 0)
+	{
+	    fclose(fp);
+	    return -1;
+	}
+	journal_put(jp, key, (time_t) t);
+    }
+    fclose(fp);
+
+    if (debug)
+	fprintf(stderr, "JOURNAL_LOAD: %s: %d entries (%d lines)\n",
+		jp->path, jp->n, lines);
+    
+    jp->lines = lines;
+    return lines > jp->n;
+}
+
+
+/*
+ * Open (or create) the journal at 'path'. With a NULL path the
+ * journal is kept in memory only, which still catches messages
+ * that are read twice while running.
+ */
+JOURNAL *
+journal_open(const char *path)
+{
+    JOURNAL *jp;
+    int rc;
+
+
+    jp = calloc(1, sizeof(*jp));
+    if (!jp)
+	return NULL;
+
+    jp->fd = -1;
+    jp->expired = time(NULL);
+    if (journal_grow(jp) < 0)
+	goto Fail;
+
+    if (!path)
+	return jp;
+
+    jp->path = strdup(path);
+    if (!jp->path)
+	goto Fail;
+
+    rc = journal_load(jp);
+    if (rc < 0)
+	goto Fail;
+    
+    if (rc > 0)
+    {
+	if (journal_compact(jp) < 0)
+	    goto Fail;
+    }
+    else
+    {
+	jp->fd = open(path, O_WRONLY|O_APPEND|O_CREAT|O_CLOEXEC, 0600);
+	if (jp->fd < 0)
+	    goto Fail;
+    }
+
+    return jp;
+
+  Fail:
+    journal_close(jp);
+    return NULL;
+}
+
+
+void
+journal_close(JOURNAL *jp)
+{
+    if (!jp)
+	return;
+
+    if (jp->fd >= 0)
+	close(jp->fd);
+    free(jp->path);
+    free(jp->kv);
+    free(jp->tv);
+    free(jp);
+}
+
+
+/* FNV-1a over the fields, each terminated by its NUL */
+uint64_t
+journal_key(const char *modem,
+	    const char *scts,
+	    const char *sender,
+	    const char *text)
+{
+    const char *fv[4];
+    uint64_t h = 14695981039346656037ULL;
+    int i;
+
+
+    fv[0] = modem;
+    fv[1] = scts;
+    fv[2] = sender;
+    fv[3] = text;
+
+    for (i = 0; i < 4; i++)
+    {
+	const char *cp = fv[i] ? fv[i] : "";
+
+	do
+	{
+	    h ^= (unsigned char) *cp;
+	    h *= 1099511628211ULL;
+	} while (*cp++);
+    }
+
+    return h ? h : 1;
+}
+
+
+/* Returns 1 if 'key' has been recorded, 0 if not */
+int
+journal_check(JOURNAL *jp,
+	      uint64_t key)
+{
+    int i = (int) (key & (jp->size-1));
+
+    while (jp->kv[i])
+    {
+	if (jp->kv[i] == key)
+	    return 1;
+	i = (i+1) & (jp->size-1);
+    }
+    
+    return 0;
+}
+
+
+/*
+ * Drop the entries older than JOURNAL_KEEP, shrinking the table, and
+ * rewrite the file if it has lines that are no longer needed.
+ */
+static void
+journal_expire(JOURNAL *jp,
+	       time_t now)
+{
+    int i, size, live = 0, on = jp->n;
+
+    
+    jp->expired = now;
+    
+    for (i = 0; i < jp->size; i++)
+	if (jp->kv[i] && jp->tv[i] >= now - JOURNAL_KEEP)
+	    live++;
+    
+    for (size = 256; live*2 >= size; size *= 2)
+	;
+    if (journal_rehash(jp, size, now - JOURNAL_KEEP) < 0)
+	return;
+
+    if (jp->path && jp->lines > jp->n && journal_compact(jp) < 0)
+    {
+	/* Appending to the old file still works */
+	if (debug)
+	    fprintf(stderr, "JOURNAL_EXPIRE: %s: Compaction failed: %s\n",
+		    jp->path, strerror(errno));
+    }
+    
+    if (debug)
+	fprintf(stderr, "JOURNAL_EXPIRE: %d of %d entries kept (%d slots)\n",
+		jp->n, on, jp->size);
+}
+
+
+/*
+ * Remember 'key'. With a file the entry is on disk when this
+ * returns, so it is safe to act on the message.
+ */
+int
+journal_record(JOURNAL *jp,
+	       uint64_t key)
+{
+    time_t now = time(NULL);
+
+
+    /* Kept bounded while running, not only when opened */
+    if (now - jp->expired >= JOURNAL_EXPIRE || now < jp->expired)
+	journal_expire(jp, now);
+    
+    if (jp->n*2 >= jp->size && journal_grow(jp) < 0)
+	return -1;
+
+    if (jp->fd >= 0)
+    {
+	char buf[64];
+	int len;
+
+	len = snprintf(buf, sizeof(buf), "%ld %016" PRIx64 "\n", (long) now, key);
+	if (write(jp->fd, buf, len) != len || fsync(jp->fd) < 0)
+	    return -1;
+	jp->lines++;
+    }
+
+    journal_put(jp, key, now);
+    return 0;
+}
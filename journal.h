@@ -0,0 +1,83 @@
+/*
+ * journal.h - Inbound message journal
+ *
+ * Copyright (c) 2016-2020 Peter Eriksson <pen@lysator.liu.se>
+ *
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <stdint.h>
+#include <time.h>
+
+/*
+ * Received messages are identified by a 64-bit key computed from the
+ * modem, the SMSC timestamp, the sender and the message text. A key
+ * is recorded (and, with a file, synced to disk) before the message
+ * is run, so a message that is read again - from the SIM at startup,
+ * or through both +CMTI and AT+CMGL - is only run once.
+ */
+typedef struct journal
+{
+    char *path;
+    int fd;		/* Append only, -1 if kept in memory only */
+    int size;		/* Slots in the table, a power of two */
+    int n;
+    uint64_t *kv;	/* 0 = free slot */
+    time_t *tv;		/* When the key was recorded */
+    int lines;		/* In the file, including expired entries */
+    time_t expired;	/* When old entries were last dropped */
+} JOURNAL;
+
+#define JOURNAL_KEEP	(7*24*60*60)	/* Seconds to remember a message */
+#define JOURNAL_EXPIRE	(60*60)		/* Seconds between dropping old entries */
+
+
+extern JOURNAL *
+journal_open(const char *path);
+
+extern void
+journal_close(JOURNAL *jp);
+
+extern uint64_t
+journal_key(const char *modem,
+	    const char *scts,
+	    const char *sender,
+	    const char *text);
+
+extern int
+journal_check(JOURNAL *jp,
+	      uint64_t key);
+
+extern int
+journal_record(JOURNAL *jp,
+	       uint64_t key);
+
+#endif
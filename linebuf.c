@@ -0,0 +1,138 @@
+/*
+ * linebuf.c - Line reader buffer
+ *
+ * Copyright (c) 2016-2020 Peter Eriksson <pen@lysator.liu.se>
+ *
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "linebuf.h"
+
+
+int
+lb_init(LINEBUF *lb,
+	int size)
+{
+    lb->buf = malloc(size+1);
+    if (!lb->buf)
+	return -1;
+    
+    lb->size = size;
+    lb->start = lb->end = lb->scan = 0;
+    return 0;
+}
+
+
+void
+lb_free(LINEBUF *lb)
+{
+    free(lb->buf);
+    lb->buf = NULL;
+    lb->size = lb->start = lb->end = lb->scan = 0;
+}
+
+
+/* Free space to read into, at least half the buffer if possible */
+char *
+lb_space(LINEBUF *lb,
+	 int *len)
+{
+    if (lb->start == lb->end)
+	lb->start = lb->end = lb->scan = 0;
+    else if (lb->start > 0 && lb->size - lb->end < lb->size/2)
+    {
+	memmove(lb->buf, lb->buf + lb->start, lb->end - lb->start);
+	lb->end -= lb->start;
+	lb->scan -= lb->start;
+	lb->start = 0;
+    }
+
+    *len = lb->size - lb->end;
+    return lb->buf + lb->end;
+}
+
+
+void
+lb_commit(LINEBUF *lb,
+	  int len)
+{
+    lb->end += len;
+}
+
+
+/*
+ * Get the next line, NUL terminated in place with trailing CR/LF and
+ * spaces removed. The line is valid until the next lb_space(). Returns
+ * LB_LINE, LB_PROMPT or 0 if no complete line is buffered.
+ */
+int
+lb_getline(LINEBUF *lb,
+	   char **line,
+	   int *len)
+{
+    char *bp, *cp, *ep;
+    int rc = LB_LINE;
+    
+
+    bp = lb->buf + lb->start;
+    ep = lb->buf + lb->end;
+    
+    cp = memchr(lb->buf + lb->scan, '\n', ep - (lb->buf + lb->scan));
+    if (cp)
+	lb->start = cp+1 - lb->buf;
+    else if (ep - bp == 2 && bp[0] == '>' && bp[1] == ' ')
+    {
+	/* The SMS text prompt is not followed by a newline */
+	cp = ep;
+	lb->start = lb->end;
+	rc = LB_PROMPT;
+    }
+    else if (bp == lb->buf && lb->end == lb->size)
+    {
+	/* Overlong - return it in pieces */
+	cp = ep;
+	lb->start = lb->end;
+    }
+    else
+    {
+	lb->scan = lb->end;
+	return 0;
+    }
+    lb->scan = lb->start;
+
+    while (cp > bp && (cp[-1] == '\r' || cp[-1] == '\n' || cp[-1] == ' ' || cp[-1] == '\t'))
+	--cp;
+    *cp = '\0';
+
+    *line = bp;
+    *len = cp - bp;
+    return rc;
+}
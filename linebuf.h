@@ -0,0 +1,76 @@
+/*
+ * linebuf.h - Line reader buffer
+ *
+ * Copyright (c) 2016-2020 Peter Eriksson <pen@lysator.liu.se>
+ *
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef LINEBUF_H
+#define LINEBUF_H
+
+/*
+ * Input is read straight into the buffer (see lb_space() and
+ * lb_commit()) and lines are handed out as pointers into it. The
+ * unconsumed tail is moved to the front only when the free space
+ * runs out.
+ */
+typedef struct linebuf
+{
+    char *buf;
+    int size;
+    int start;		/* First unconsumed byte */
+    int end;		/* End of data */
+    int scan;		/* Searched for newlines up to here */
+} LINEBUF;
+
+#define LB_LINE		1	/* Complete (or overlong) line */
+#define LB_PROMPT	2	/* Unterminated "> " prompt */
+
+
+extern int
+lb_init(LINEBUF *lb,
+	int size);
+
+extern void
+lb_free(LINEBUF *lb);
+
+extern char *
+lb_space(LINEBUF *lb,
+	 int *len);
+
+extern void
+lb_commit(LINEBUF *lb,
+	  int len);
+
+extern int
+lb_getline(LINEBUF *lb,
+	   char **line,
+	   int *len);
+
+#endif
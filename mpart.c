@@ -0,0 +1,281 @@
+/*
+ * mpart.c - Reassembly of concatenated messages
+ *
+ * Copyright (c) 2016-2020 Peter Eriksson <pen@lysator.liu.se>
+ *
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mpart.h"
+
+
+MPART *
+mp_create(int maxsets,
+	  size_t maxbytes,
+	  int timeout,
+	  void (*report)(const char *why, int release, MPSET *sp))
+{
+    MPART *mp;
+
+
+    mp = calloc(1, sizeof(*mp));
+    if (!mp)
+	return NULL;
+
+    mp->maxsets = maxsets;
+    mp->maxbytes = maxbytes;
+    mp->timeout = timeout;
+    mp->report = report;
+    return mp;
+}
+
+
+/* Free a set returned complete by mp_add() */
+void
+mp_free(MPSET *sp)
+{
+    int i;
+
+
+    if (!sp)
+	return;
+    
+    if (sp->pv)
+	for (i = 0; i < sp->total; i++)
+	    free(sp->pv[i]);
+    free(sp->pv);
+    free(sp->iv);
+    free(sp->kv);
+    free(sp->phone);
+    free(sp);
+}
+
+
+static void
+mp_unlink(MPART *mp,
+	  MPSET **spp)
+{
+    MPSET *sp = *spp;
+
+
+    *spp = sp->next;
+    sp->next = NULL;
+    mp->nsets--;
+    mp->bytes -= sp->bytes;
+}
+
+
+/* Unlink, report and free a set */
+static void
+mp_drop(MPART *mp,
+	MPSET **spp,
+	const char *why,
+	int release)
+{
+    MPSET *sp = *spp;
+
+
+    mp_unlink(mp, spp);
+    if (mp->report)
+	(*mp->report)(why, release, sp);
+    mp_free(sp);
+}
+
+
+void
+mp_destroy(MPART *mp)
+{
+    if (!mp)
+	return;
+
+    while (mp->sets)
+	mp_drop(mp, &mp->sets, "discarded", 0);
+    free(mp);
+}
+
+
+/* The text of a complete set, to be freed by the caller */
+char *
+mp_join(MPSET *sp)
+{
+    char *msg, *cp;
+    int i;
+
+
+    msg = malloc(sp->bytes+1);
+    if (!msg)
+	return NULL;
+
+    cp = msg;
+    for (i = 0; i < sp->total; i++)
+    {
+	size_t len = strlen(sp->pv[i]);
+
+	memcpy(cp, sp->pv[i], len);
+	cp += len;
+    }
+    *cp = '\0';
+    return msg;
+}
+
+
+/*
+ * Add part 'seq' (1..total) of message 'ref' from 'phone', stored at
+ * 'index' (or -1). Returns 1 when the last part has arrived, with the
+ * set, no longer kept here, in *setp for mp_join() and mp_free(). 0 if
+ * more parts are needed (or the part is read again from the same
+ * index), 2 if the part has been seen before from another index (and
+ * is not kept), and -1 on errors, when the part is not kept either.
+ */
+int
+mp_add(MPART *mp,
+       const char *phone,
+       int ref,
+       int total,
+       int seq,
+       const char *text,
+       int index,
+       uint64_t key,
+       MPSET **setp)
+{
+    MPSET *sp, **spp;
+    size_t len = strlen(text);
+    int i;
+
+
+    *setp = NULL;
+    if (seq < 1 || seq > total || len > mp->maxbytes)
+	return -1;
+
+    for (spp = &mp->sets; (sp = *spp) != NULL; spp = &sp->next)
+	if (sp->ref == ref && sp->total == total && strcmp(sp->phone, phone) == 0)
+	    break;
+
+    if (!sp)
+    {
+	sp = calloc(1, sizeof(*sp));
+	if (!sp)
+	    return -1;
+	
+	sp->phone = strdup(phone);
+	sp->pv = calloc(total, sizeof(char *));
+	sp->iv = malloc(total * sizeof(int));
+	sp->kv = calloc(total, sizeof(uint64_t));
+	sp->total = total;
+	if (!sp->phone || !sp->pv || !sp->iv || !sp->kv)
+	{
+	    mp_free(sp);
+	    return -1;
+	}
+	for (i = 0; i < total; i++)
+	    sp->iv[i] = -1;
+	sp->ref = ref;
+	sp->expires = time(NULL) + mp->timeout;
+
+	/* Make room by evicting the oldest sets */
+	while (mp->sets && mp->nsets >= mp->maxsets)
+	    mp_drop(mp, &mp->sets, "evicted", 1);
+	
+	for (spp = &mp->sets; *spp; spp = &(*spp)->next)
+	    ;
+	*spp = sp;
+	mp->nsets++;
+    }
+
+    if (sp->pv[seq-1])
+	return sp->iv[seq-1] == index ? 0 : 2;
+
+    /* Evict the oldest other sets, or this one if they are not enough */
+    spp = &mp->sets;
+    while (mp->bytes + len > mp->maxbytes)
+    {
+	if (*spp == sp)
+	    spp = &sp->next;
+	
+	if (!*spp)
+	{
+	    for (spp = &mp->sets; *spp != sp; spp = &(*spp)->next)
+		;
+	    mp_drop(mp, spp, "evicted", 1);
+	    return -1;
+	}
+	mp_drop(mp, spp, "evicted", 1);
+    }
+    
+    sp->pv[seq-1] = strdup(text);
+    if (!sp->pv[seq-1])
+	return -1;
+    
+    sp->iv[seq-1] = index;
+    sp->kv[seq-1] = key;
+    sp->have++;
+    sp->bytes += len;
+    mp->bytes += len;
+
+    if (sp->have < sp->total)
+	return 0;
+
+    /* Complete */
+    for (spp = &mp->sets; *spp != sp; spp = &(*spp)->next)
+	;
+    mp_unlink(mp, spp);
+    *setp = sp;
+    return 1;
+}
+
+
+/*
+ * Drop (and report) the sets that have waited too long. Returns the
+ * number of seconds until the next set expires, or 0 if none is left.
+ */
+int
+mp_expire(MPART *mp,
+	  time_t now)
+{
+    MPSET **spp = &mp->sets;
+    time_t next = 0;
+
+
+    while (*spp)
+    {
+	if ((*spp)->expires <= now)
+	    mp_drop(mp, spp, "expired", 1);
+	else
+	{
+	    if (!next || (*spp)->expires < next)
+		next = (*spp)->expires;
+	    spp = &(*spp)->next;
+	}
+    }
+
+    return next ? (int) (next - now) : 0;
+}
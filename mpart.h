@@ -0,0 +1,112 @@
+/*
+ * mpart.h - Reassembly of concatenated messages
+ *
+ * Copyright (c) 2016-2020 Peter Eriksson <pen@lysator.liu.se>
+ *
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef MPART_H
+#define MPART_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+/*
+ * The parts of a concatenated message are collected per sender and
+ * reference number until all have arrived. Sets that do not complete
+ * in time, or that are evicted to stay within the limits, are passed
+ * to the report function and dropped. Its 'release' is 1 for those,
+ * and 0 for the sets dropped by mp_destroy(), whose parts are to stay
+ * where they are stored. 'why' is only for logging.
+ *
+ * Each part carries where it is stored and its journal key, so that
+ * the parts are only journaled and deleted once the set is done with.
+ */
+typedef struct mpset
+{
+    struct mpset *next;
+    char *phone;
+    int ref;
+    int total;
+    int have;
+    size_t bytes;
+    time_t expires;
+    char **pv;		/* Part texts, by sequence number - 1 */
+    int *iv;		/* Storage index of each part, -1 if not stored */
+    uint64_t *kv;	/* Journal key of each part */
+} MPSET;
+
+typedef struct mpart
+{
+    MPSET *sets;	/* Oldest first */
+    int nsets;
+    int maxsets;
+    size_t bytes;
+    size_t maxbytes;
+    int timeout;	/* Seconds */
+    void (*report)(const char *why, int release, MPSET *sp);
+} MPART;
+
+#define MPART_MAX_SETS		32
+#define MPART_MAX_BYTES		65536	/* Text held in incomplete sets */
+#define MPART_TIMEOUT		300	/* Seconds to wait for the missing parts */
+
+
+extern MPART *
+mp_create(int maxsets,
+	  size_t maxbytes,
+	  int timeout,
+	  void (*report)(const char *why, int release, MPSET *sp));
+
+extern void
+mp_destroy(MPART *mp);
+
+extern int
+mp_add(MPART *mp,
+       const char *phone,
+       int ref,
+       int total,
+       int seq,
+       const char *text,
+       int index,
+       uint64_t key,
+       MPSET **setp);
+
+extern char *
+mp_join(MPSET *sp);
+
+extern void
+mp_free(MPSET *sp);
+
+extern int
+mp_expire(MPART *mp,
+	  time_t now);
+
+#endif
@@ -0,0 +1,240 @@
+/*
+ * mpsc.c - Lock-free multi-producer, single-consumer queue
+ *
+ * Copyright (c) 2016-2020 Peter Eriksson <pen@lysator.liu.se>
+ *
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <unistd.h>
+
+#if defined(__linux__)
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#else
+#include <sched.h>
+#endif
+
+#include "mpsc.h"
+
+
+#if defined(__linux__)
+static void
+futex_wait(int *addr,
+	   int val)
+{
+    syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+}
+
+static void
+futex_wake(int *addr)
+{
+    syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+#else
+/* No futex - poll for the queue to be unparked */
+static void
+futex_wait(int *addr,
+	   int val)
+{
+    if (__atomic_load_n(addr, __ATOMIC_SEQ_CST) == val)
+	usleep(1000);
+}
+
+static void
+futex_wake(int *addr)
+{
+}
+#endif
+
+
+MPSC *
+mpsc_create(void (*wake)(void *xp),
+	    void *xp)
+{
+    MPSC *qp;
+
+    qp = calloc(1, sizeof(*qp));
+    if (!qp)
+	return NULL;
+
+    qp->head = qp->tail = &qp->stub;
+
+    /* The consumer has not looked yet, so the first put wakes it */
+    qp->parked = 1;
+    qp->wake = wake;
+    qp->xp = xp;
+    return qp;
+}
+
+
+/* The entries still queued are not freed, they belong to the caller */
+void
+mpsc_destroy(MPSC *qp)
+{
+    free(qp);
+}
+
+
+/* Link the chain 'first'..'last' in at the head */
+static void
+mpsc_link(MPSC *qp,
+	  MPSC_NODE *first,
+	  MPSC_NODE *last)
+{
+    MPSC_NODE *prev;
+
+    __atomic_store_n(&last->next, NULL, __ATOMIC_RELAXED);
+    prev = __atomic_exchange_n(&qp->head, last, __ATOMIC_ACQ_REL);
+
+    /* Until this store the consumer sees the queue end at 'prev' */
+    __atomic_store_n(&prev->next, first, __ATOMIC_SEQ_CST);
+}
+
+
+static void
+mpsc_unpark(MPSC *qp)
+{
+    if (!__atomic_load_n(&qp->parked, __ATOMIC_SEQ_CST) ||
+	!__atomic_exchange_n(&qp->parked, 0, __ATOMIC_SEQ_CST))
+	return;
+
+    __atomic_fetch_add(&qp->wakeups, 1, __ATOMIC_RELAXED);
+    if (qp->wake)
+	(*qp->wake)(qp->xp);
+    else
+	futex_wake(&qp->parked);
+}
+
+
+/* May be called from any thread */
+void
+mpsc_put(MPSC *qp,
+	 MPSC_NODE *np)
+{
+    mpsc_link(qp, np, np);
+    mpsc_unpark(qp);
+}
+
+
+/* Put a list linked through 'next', in order, with one exchange and one wakeup */
+void
+mpsc_put_list(MPSC *qp,
+	      MPSC_NODE *first,
+	      MPSC_NODE *last)
+{
+    mpsc_link(qp, first, last);
+    mpsc_unpark(qp);
+}
+
+
+/*
+ * Take the first entry, NULL if the queue is empty. Only from the
+ * consumer thread. NULL may also be returned while a put is half
+ * done, which is then seen by the unpark after it.
+ */
+MPSC_NODE *
+mpsc_get(MPSC *qp)
+{
+    MPSC_NODE *tail = qp->tail, *next, *head;
+
+    
+    next = __atomic_load_n(&tail->next, __ATOMIC_SEQ_CST);
+    if (tail == &qp->stub)
+    {
+	if (!next)
+	    return NULL;
+	qp->tail = tail = next;
+	next = __atomic_load_n(&next->next, __ATOMIC_SEQ_CST);
+    }
+
+    if (next)
+    {
+	qp->tail = next;
+	return tail;
+    }
+
+    head = __atomic_load_n(&qp->head, __ATOMIC_SEQ_CST);
+    if (tail != head)
+	return NULL;
+
+    /* The last entry: put the stub after it, so it can be taken */
+    mpsc_link(qp, &qp->stub, &qp->stub);
+    
+    next = __atomic_load_n(&tail->next, __ATOMIC_SEQ_CST);
+    if (next)
+    {
+	qp->tail = next;
+	return tail;
+    }
+    return NULL;
+}
+
+
+/*
+ * Take the first entry, or park the queue if it is empty: the next put
+ * wakes the consumer up.
+ */
+MPSC_NODE *
+mpsc_get_or_park(MPSC *qp)
+{
+    MPSC_NODE *np;
+
+
+    np = mpsc_get(qp);
+    if (np)
+    {
+	if (__atomic_load_n(&qp->parked, __ATOMIC_RELAXED))
+	    __atomic_store_n(&qp->parked, 0, __ATOMIC_RELAXED);
+	return np;
+    }
+    
+    __atomic_store_n(&qp->parked, 1, __ATOMIC_SEQ_CST);
+
+    /* Put before the park was seen? */
+    np = mpsc_get(qp);
+    if (np)
+	__atomic_store_n(&qp->parked, 0, __ATOMIC_SEQ_CST);
+    return np;
+}
+
+
+/* Take the first entry, sleeping until there is one (without 'wake') */
+MPSC_NODE *
+mpsc_wait(MPSC *qp)
+{
+    MPSC_NODE *np;
+
+    
+    while ((np = mpsc_get_or_park(qp)) == NULL)
+	futex_wait(&qp->parked, 1);
+    return np;
+}
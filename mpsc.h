@@ -0,0 +1,92 @@
+/*
+ * mpsc.h - Lock-free multi-producer, single-consumer queue
+ *
+ * Copyright (c) 2016-2020 Peter Eriksson <pen@lysator.liu.se>
+ *
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef MPSC_H
+#define MPSC_H
+
+/*
+ * A queue many threads put to and one thread takes from, without
+ * locks or allocation: the entries embed an MPSC_NODE, and a put is
+ * one atomic exchange (D. Vyukov's intrusive MPSC queue).
+ *
+ * The consumer "parks" the queue when it finds it empty and is about
+ * to sleep. Only a put to a parked queue wakes it up: with the wakeup
+ * function given, such as one waking an event loop, or else with a
+ * futex mpsc_wait() sleeps on. While the consumer is busy puts cost no
+ * system calls.
+ */
+typedef struct mpsc_node
+{
+    struct mpsc_node *next;
+} MPSC_NODE;
+
+
+typedef struct mpsc
+{
+    MPSC_NODE *head;		/* Last put, exchanged by the producers */
+    char pad[64 - sizeof(MPSC_NODE *)];	/* ... away from the consumer's fields */
+    MPSC_NODE *tail;		/* Next to take */
+    MPSC_NODE stub;
+    int parked;			/* Futex word: the consumer wants a wakeup */
+    void (*wake)(void *xp);
+    void *xp;
+    unsigned long wakeups;
+} MPSC;
+
+
+extern MPSC *
+mpsc_create(void (*wake)(void *xp),
+	    void *xp);
+
+extern void
+mpsc_destroy(MPSC *qp);
+
+extern void
+mpsc_put(MPSC *qp,
+	 MPSC_NODE *np);
+
+extern void
+mpsc_put_list(MPSC *qp,
+	      MPSC_NODE *first,
+	      MPSC_NODE *last);
+
+extern MPSC_NODE *
+mpsc_get(MPSC *qp);
+
+extern MPSC_NODE *
+mpsc_get_or_park(MPSC *qp);
+
+extern MPSC_NODE *
+mpsc_wait(MPSC *qp);
+
+#endif
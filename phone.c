@@ -0,0 +1,243 @@
+/*
+ * phone.c - Phone number normalization
+ *
+ * Copyright (c) 2016-2020 Peter Eriksson <pen@lysator.liu.se>
+ *
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+
+#include "phone.h"
+
+
+/*
+ * Dialling conventions used to turn national numbers into E.164.
+ * Without a default country only numbers that already are
+ * international ("+..." or with the international prefix) are
+ * normalized.
+ */
+static char country[8] = "";
+static char trunk[8] = "0";
+static char intl[8] = "00";
+
+
+static int
+digits(const char *s)
+{
+    if (!*s)
+	return 0;
+    
+    while (isdigit((unsigned char) *s))
+	++s;
+
+    return *s == '\0';
+}
+
+
+/*
+ * Set the default country code, trunk prefix and international
+ * prefix from a "<country>[:<trunk>[:<intl>]]" specification,
+ * for example "46:0" (Sweden) or "1:1:011" (NANP).
+ */
+int
+phone_setup(const char *spec)
+{
+    char buf[32], *cp, *tp, *ip, *endp;
+
+
+    if (strlen(spec) >= sizeof(buf))
+	goto Invalid;
+    strcpy(buf, spec);
+
+    cp = strtok_r(buf, ":", &endp);
+    tp = strtok_r(NULL, ":", &endp);
+    ip = strtok_r(NULL, ":", &endp);
+
+    if (cp && *cp == '+')
+	++cp;
+    
+    if (!cp || !digits(cp) || *cp == '0' || strlen(cp) > 3 ||
+	(tp && (!digits(tp) || strlen(tp) >= sizeof(trunk))) ||
+	(ip && (!digits(ip) || strlen(ip) >= sizeof(intl))))
+	goto Invalid;
+
+    strcpy(country, cp);
+    if (tp)
+	strcpy(trunk, tp);
+    if (ip)
+	strcpy(intl, ip);
+    return 0;
+
+  Invalid:
+    errno = EINVAL;
+    return -1;
+}
+
+
+/*
+ * Identifies the current conventions, so that stored keys can be
+ * checked against them.
+ */
+uint32_t
+phone_config_id(void)
+{
+    const char *sv[3];
+    uint32_t h = 2166136261U;
+    int i;
+    const char *s;
+
+
+    sv[0] = country;
+    sv[1] = trunk;
+    sv[2] = intl;
+    
+    for (i = 0; i < 3; i++)
+    {
+	for (s = sv[i]; *s; s++)
+	{
+	    h ^= (unsigned char) *s;
+	    h *= 16777619U;
+	}
+	h ^= ':';
+	h *= 16777619U;
+    }
+
+    return h;
+}
+
+
+/*
+ * Normalize a phone number into 'buf'. Returns 1 if the result is
+ * an E.164 number ("+<digits>"), 0 if it is not (short codes,
+ * alphanumeric senders - copied with separators removed) and -1 if
+ * it does not fit.
+ */
+int
+phone_normalize(const char *phone,
+		char *buf,
+		size_t bufsize)
+{
+    char tmp[PHONE_MAX], *np;
+    const char *cc = "";
+    size_t len, n, tl, il;
+
+
+    /* Drop the usual separators */
+    for (len = 0; *phone; phone++)
+    {
+	if (strchr(" \t-.()/", *phone))
+	    continue;
+	if (len+1 >= sizeof(tmp))
+	    return -1;
+	tmp[len++] = *phone;
+    }
+    tmp[len] = '\0';
+
+    tl = strlen(trunk);
+    il = strlen(intl);
+
+    /* Locate the country code (or the national number) */
+    if (tmp[0] == '+')
+    {
+	cc = "";
+	np = tmp+1;
+    }
+    else if (il && strncmp(tmp, intl, il) == 0)
+    {
+	cc = "";
+	np = tmp+il;
+    }
+    else if (*country && tl && strncmp(tmp, trunk, tl) == 0)
+    {
+	cc = country;
+	np = tmp+tl;
+    }
+    else
+	np = NULL;
+
+    if (np && digits(np) && *np != '0' && strlen(cc)+strlen(np) <= 15)
+    {
+	n = snprintf(buf, bufsize, "+%s%s", cc, np);
+	if (n >= bufsize)
+	    return -1;
+	return 1;
+    }
+
+    if (len >= bufsize)
+	return -1;
+    strcpy(buf, tmp);
+    return 0;
+}
+
+
+/*
+ * Returns the normalized number packed into an integer (the E.164
+ * digits, which never start with 0), or 0 if it is not an E.164
+ * number.
+ */
+uint64_t
+phone_key(const char *phone)
+{
+    char buf[PHONE_MAX];
+    uint64_t k = 0;
+    const char *cp;
+
+
+    if (!phone || phone_normalize(phone, buf, sizeof(buf)) != 1)
+	return 0;
+
+    for (cp = buf+1; *cp; cp++)
+	k = k*10 + (*cp - '0');
+
+    return k;
+}
+
+
+/* Compare phone numbers, by key if both are E.164 numbers */
+int
+phone_equal(const char *a,
+	    const char *b)
+{
+    uint64_t ka, kb;
+
+
+    if (!a || !b)
+	return a == b;
+
+    ka = phone_key(a);
+    kb = phone_key(b);
+    if (ka || kb)
+	return ka == kb;
+
+    return strcmp(a, b) == 0;
+}
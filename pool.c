@@ -0,0 +1,166 @@
+/*
+ * pool.c - Worker thread pool
+ *
+ * Copyright (c) 2016-2020 Peter Eriksson <pen@lysator.liu.se>
+ *
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "pool.h"
+
+extern int debug;
+
+
+typedef struct job
+{
+    void (*fun)(void *xp);
+    void *xp;
+} JOB;
+
+
+static void *
+pool_worker(void *misc)
+{
+    QUEUE *qp = (QUEUE *) misc;
+    void *jv[POOL_BATCH];
+    JOB *jp;
+    int i, n;
+
+
+    /* Until the queue is closed and drained */
+    while ((n = queue_getv(qp, jv, POOL_BATCH, -1)) > 0)
+	for (i = 0; i < n; i++)
+	{
+	    jp = (JOB *) jv[i];
+	    (*jp->fun)(jp->xp);
+	    free(jp);
+	}
+
+    return NULL;
+}
+
+
+POOL *
+pool_create(int nworkers)
+{
+    POOL *pp;
+    int i;
+
+
+    pp = calloc(1, sizeof(*pp));
+    if (!pp)
+	return NULL;
+
+    pp->tv = calloc(nworkers, sizeof(pthread_t));
+    pp->qv = calloc(nworkers, sizeof(QUEUE *));
+    if (!pp->tv || !pp->qv)
+	goto Fail;
+
+    for (i = 0; i < nworkers; i++)
+    {
+	pp->qv[i] = queue_create();
+	if (!pp->qv[i])
+	    goto Fail;
+	
+	if (pthread_create(&pp->tv[i], NULL, pool_worker, pp->qv[i]) != 0)
+	{
+	    queue_destroy(pp->qv[i]);
+	    goto Fail;
+	}
+	pp->nworkers++;
+    }
+
+    if (debug)
+	fprintf(stderr, "POOL_CREATE: %d workers\n", nworkers);
+    
+    return pp;
+
+  Fail:
+    pool_destroy(pp);
+    return NULL;
+}
+
+
+/*
+ * Run 'fun' in a worker. Jobs with the same key run on the same
+ * worker, in the order they were submitted.
+ */
+int
+pool_run(POOL *pp,
+	 unsigned int key,
+	 void (*fun)(void *xp),
+	 void *xp)
+{
+    JOB *jp;
+
+
+    jp = malloc(sizeof(*jp));
+    if (!jp)
+	return -1;
+
+    jp->fun = fun;
+    jp->xp = xp;
+    
+    if (queue_put(pp->qv[key % pp->nworkers], jp) < 0)
+    {
+	free(jp);
+	return -1;
+    }
+
+    return 0;
+}
+
+
+/* Let the workers finish the queued jobs, then stop them */
+void
+pool_destroy(POOL *pp)
+{
+    int i;
+
+
+    if (!pp)
+	return;
+    
+    for (i = 0; i < pp->nworkers; i++)
+	queue_close(pp->qv[i]);
+    
+    for (i = 0; i < pp->nworkers; i++)
+    {
+	pthread_join(pp->tv[i], NULL);
+	queue_destroy(pp->qv[i]);
+    }
+
+    free(pp->tv);
+    free(pp->qv);
+    free(pp);
+}
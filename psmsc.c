@@ -125,7 +125,7 @@ fifo_send_sms(const char *to,
 {
     FILE *fp;
 
-    fp = fopen(FIFO_PATH, "w");
+    fp = fopen(fifo_path, "w");
     if (!fp)
 	return -1;
 
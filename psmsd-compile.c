@@ -0,0 +1,248 @@
+/*
+ * psmsd-compile.c - Compile users & commands files into a database image
+ *
+ * Copyright (c) 2016-2020 Peter Eriksson <pen@lysator.liu.se>
+ *
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "common.h"
+#include "db.h"
+#include "users.h"
+#include "phone.h"
+#include "strmisc.h"
+
+
+int debug = 0;
+
+char *commands_path = NULL;
+char *userauth_path = NULL;
+int list_mode = 0;
+int cdb_mode = 0;
+
+
+void
+usage(FILE *fp,
+      char *argv0)
+{
+    fprintf(fp, "Usage: %s [<options>] <image-path>\n",
+	    argv0);
+    fprintf(fp, "Options:\n");
+    fprintf(fp, "  -h                    Display this information\n");
+    fprintf(fp, "  -V                    Print version and exit\n");
+    fprintf(fp, "  -d[<level>]           Set debug level\n");
+    fprintf(fp, "  -C<commands-path>     Path to commands definition file\n");
+    fprintf(fp, "  -U<users-path>        Path to users definition file\n");
+    fprintf(fp, "  -l                    List the contents of an image\n");
+    fprintf(fp, "  -N<cc>[:<tp>[:<ip>]]  Default country code, trunk & international prefix\n");
+    fprintf(fp, "  -k                    Write the users (-U) as a CDB file instead\n");
+}
+
+void
+p_header(void)
+{
+    printf("[psmsd-compile, version %s - Copyright (c) 2016 Peter Eriksson <pen@lysator.liu.se>]\n", VERSION);
+}
+
+
+static const char *
+nstr(const char *s)
+{
+    return s ? s : "-";
+}
+
+
+static int
+list_image(const char *path)
+{
+    DB *users, *commands;
+    const DBUSER *up;
+    const DBCMD *cp;
+    int i;
+
+
+    if (db_open(path, &users, &commands) < 0)
+	return -1;
+
+    if (users)
+    {
+	printf("# users: %d (acl vocabulary %u)\n", db_count(users), users->hp->nacl);
+	for (i = 0; i < db_count(users); i++)
+	{
+	    up = db_user(users, i);
+	    printf("%s\t%s\t%s\t%s\n",
+		   nstr(db_str(users, up->name)),
+		   nstr(db_str(users, up->phone)),
+		   nstr(db_str(users, up->pass)),
+		   nstr(db_str(users, up->acl)));
+	}
+    }
+
+    if (commands)
+    {
+	printf("# commands: %d\n", db_count(commands));
+	for (i = 0; i < db_count(commands); i++)
+	{
+	    cp = db_command(commands, i);
+	    printf("%s\t%d\t%s\t%s\t%s\n",
+		   nstr(db_str(commands, cp->name)),
+		   cp->level,
+		   nstr(db_str(commands, cp->user)),
+		   nstr(db_str(commands, cp->path)),
+		   nstr(db_str(commands, cp->argv)));
+	}
+    }
+
+    db_free(users);
+    db_free(commands);
+    return 0;
+}
+
+
+int
+main(int argc,
+     char *argv[])
+{
+    int i;
+
+
+    for (i = 1; i < argc && argv[i][0] == '-'; i++)
+	switch (argv[i][1])
+	{
+	  case 'V':
+	    p_header();
+	    exit(0);
+
+	  case 'C':
+	    if (!argv[i][2])
+	    {
+		fprintf(stderr, "%s: Missing path argument for -C\n", argv[0]);
+		exit(1);
+	    }
+	    commands_path = s_dup(argv[i]+2);
+	    break;
+
+	  case 'U':
+	    if (!argv[i][2])
+	    {
+		fprintf(stderr, "%s: Missing path argument for -U\n", argv[0]);
+		exit(1);
+	    }
+	    userauth_path = s_dup(argv[i]+2);
+	    break;
+
+	  case 'd':
+	    if (argv[i][2])
+	    {
+		if (sscanf(argv[i]+2, "%d", &debug) != 1)
+		{
+		    fprintf(stderr, "%s: Invalid argument for -d\n", argv[0]);
+		    exit(1);
+		}
+	    }
+	    else
+		++debug;
+	    break;
+
+	  case 'l':
+	    ++list_mode;
+	    break;
+
+	  case 'N':
+	    if (phone_setup(argv[i]+2) < 0)
+	    {
+		fprintf(stderr, "%s: Invalid argument for -N: %s\n", argv[0], argv[i]+2);
+		exit(1);
+	    }
+	    break;
+
+	  case 'k':
+	    ++cdb_mode;
+	    break;
+
+	  case 'h':
+	    usage(stdout, argv[0]);
+	    exit(0);
+
+	  default:
+	    fprintf(stderr, "%s: Invalid switch: %s\n",
+		    argv[0], argv[i]);
+	    exit(1);
+	}
+
+    if (i >= argc)
+    {
+	fprintf(stderr, "%s: Missing image path\n", argv[0]);
+	exit(1);
+    }
+
+    if (list_mode)
+    {
+	if (list_image(argv[i]) < 0)
+	{
+	    fprintf(stderr, "%s: %s: %s\n", argv[0], argv[i], strerror(errno));
+	    exit(1);
+	}
+	exit(0);
+    }
+
+    if (cdb_mode)
+    {
+	if (!userauth_path)
+	{
+	    fprintf(stderr, "%s: Missing -U\n", argv[0]);
+	    exit(1);
+	}
+	
+	if (users_make_cdb(userauth_path, argv[i]) < 0)
+	{
+	    fprintf(stderr, "%s: %s: CDB build failed: %s\n", argv[0], argv[i], strerror(errno));
+	    exit(1);
+	}
+	exit(0);
+    }
+
+    if (!commands_path && !userauth_path)
+    {
+	fprintf(stderr, "%s: Missing -C and/or -U\n", argv[0]);
+	exit(1);
+    }
+
+    if (db_build(argv[i], userauth_path, commands_path) < 0)
+    {
+	fprintf(stderr, "%s: %s: Image build failed: %s\n", argv[0], argv[i], strerror(errno));
+	exit(1);
+    }
+
+    exit(0);
+}
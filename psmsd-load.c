@@ -0,0 +1,362 @@
+/*
+ * psmsd-load.c - Replay a trace of submissions into psmsd
+ *
+ * Copyright (c) 2016-2020 Peter Eriksson <pen@lysator.liu.se>
+ *
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Reads a trace of the submissions a psmsd accepted (psmsd -L) and
+ * submits them again through the fifo of a (test) psmsd, at the pace
+ * they came (-x1), N times faster (-x<N>) or as fast as the fifo takes
+ * them (-x0). The texts are not in the trace: each message is
+ * "load-<n>" padded with 'x' to the traced size. Recipients can all
+ * be replaced (-T), so a production trace can be aimed at a simulated
+ * modem without messaging real phones.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+
+#include "common.h"
+#include "trace.h"
+
+
+int verbose = 0;
+
+char *fifo_path = FIFO_PATH;
+char *to_override = NULL;
+int source_filter = 0;
+double speed = 1.0;		/* 0 = as fast as possible */
+double skip_s = 0.0;		/* Start this far into the trace */
+double duration_s = 0.0;	/* ... and stop after this long (0: the rest) */
+long max_msgs = 0;
+int list_only = 0;
+
+
+#define LOAD_LINE_MAX	1000	/* Lines psmsd reads from the fifo are shorter */
+
+
+static int64_t
+usec_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+
+static void
+sleep_until(int64_t t)
+{
+    struct timespec ts;
+
+    ts.tv_sec = t / 1000000;
+    ts.tv_nsec = (t % 1000000) * 1000;
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+	;
+}
+
+
+static int
+cmp_i64(const void *a,
+	const void *b)
+{
+    int64_t x = *(const int64_t *) a, y = *(const int64_t *) b;
+
+    return x < y ? -1 : x > y;
+}
+
+
+static void
+list_rec(TRACE_REC *rp)
+{
+    char tbuf[64];
+    time_t t = rp->usec / 1000000;
+    struct tm tm;
+
+    localtime_r(&t, &tm);
+    strftime(tbuf, sizeof(tbuf), "%Y-%m-%d %H:%M:%S", &tm);
+    printf("%s.%06ld %-4s %4u %s\n",
+	   tbuf, (long) (rp->usec % 1000000), trace_source(rp->source), rp->size, rp->to);
+}
+
+
+void
+usage(FILE *fp,
+      char *argv0)
+{
+    fprintf(fp, "Usage: %s [<options>] <trace>\n", argv0);
+    fprintf(fp, "Options:\n");
+    fprintf(fp, "  -h                    Display this information\n");
+    fprintf(fp, "  -V                    Print version and exit\n");
+    fprintf(fp, "  -v[<level>]           Set verbosity level\n");
+    fprintf(fp, "  -l                    List the trace and exit\n");
+    fprintf(fp, "  -F<fifo-path>         Path to the fifo of psmsd\n");
+    fprintf(fp, "  -x<speed>             Times real time, 0 as fast as possible (default: 1)\n");
+    fprintf(fp, "  -T<recipient>         Send all messages to this recipient instead\n");
+    fprintf(fp, "  -s<source>            Only submissions from fifo, tty or door\n");
+    fprintf(fp, "  -o<seconds>           Start this far into the trace\n");
+    fprintf(fp, "  -d<seconds>           Replay this much of the trace\n");
+    fprintf(fp, "  -n<messages>          Stop after this many messages\n");
+}
+
+void
+p_header(void)
+{
+    printf("[psmsd-load, version %s - Copyright (c) 2016 Peter Eriksson <pen@lysator.liu.se>]\n", VERSION);
+}
+
+
+int
+main(int argc,
+     char *argv[])
+{
+    TRACE *tp;
+    TRACE_REC rec;
+    char buf[LOAD_LINE_MAX+TRACE_TO_MAX+2];
+    int i, n, fd = -1, rc;
+    const char *to;
+    int64_t first = -1, base = 0, t0 = 0, due, now, *late = NULL;
+    long nlate = 0, alate = 0, nsent = 0, nbytes = 0;
+    
+
+    for (i = 1; i < argc && argv[i][0] == '-'; i++)
+	switch (argv[i][1])
+	{
+	  case 'V':
+	    p_header();
+	    exit(0);
+	    
+	  case 'v':
+	    if (!argv[i][2])
+		++verbose;
+	    else if (sscanf(argv[i]+2, "%d", &verbose) != 1)
+	    {
+		fprintf(stderr, "%s: Invalid verbosity level: %s\n", argv[0], argv[i]+2);
+		exit(1);
+	    }
+	    break;
+
+	  case 'l':
+	    list_only = 1;
+	    break;
+	    
+	  case 'F':
+	    fifo_path = argv[i]+2;
+	    break;
+
+	  case 'T':
+	    to_override = argv[i]+2;
+	    break;
+
+	  case 's':
+	    for (n = TRACE_SRC_FIFO; n <= TRACE_SRC_DOOR && strcmp(trace_source(n), argv[i]+2) != 0; n++)
+		;
+	    if (n > TRACE_SRC_DOOR)
+	    {
+		fprintf(stderr, "%s: Invalid source: %s\n", argv[0], argv[i]+2);
+		exit(1);
+	    }
+	    source_filter = n;
+	    break;
+	    
+	  case 'x':
+	    if (sscanf(argv[i]+2, "%lf", &speed) != 1 || speed < 0)
+	    {
+		fprintf(stderr, "%s: Invalid argument for -x\n", argv[0]);
+		exit(1);
+	    }
+	    break;
+	    
+	  case 'o':
+	    if (sscanf(argv[i]+2, "%lf", &skip_s) != 1 || skip_s < 0)
+	    {
+		fprintf(stderr, "%s: Invalid argument for -o\n", argv[0]);
+		exit(1);
+	    }
+	    break;
+	    
+	  case 'd':
+	    if (sscanf(argv[i]+2, "%lf", &duration_s) != 1 || duration_s < 0)
+	    {
+		fprintf(stderr, "%s: Invalid argument for -d\n", argv[0]);
+		exit(1);
+	    }
+	    break;
+	    
+	  case 'n':
+	    if (sscanf(argv[i]+2, "%ld", &max_msgs) != 1 || max_msgs < 0)
+	    {
+		fprintf(stderr, "%s: Invalid argument for -n\n", argv[0]);
+		exit(1);
+	    }
+	    break;
+	    
+	  case 'h':
+	    usage(stdout, argv[0]);
+	    exit(0);
+	    
+	  default:
+	    fprintf(stderr, "%s: Invalid switch: %s\n", argv[0], argv[i]);
+	    exit(1);
+	}
+
+    if (i+1 != argc)
+    {
+	usage(stderr, argv[0]);
+	exit(1);
+    }
+
+    tp = trace_open_read(argv[i]);
+    if (!tp)
+    {
+	fprintf(stderr, "%s: %s: %s\n", argv[0], argv[i],
+		errno == EINVAL ? "Not a psmsd trace" : strerror(errno));
+	exit(1);
+    }
+
+    if (!list_only)
+    {
+	signal(SIGPIPE, SIG_IGN);
+	
+	/* Blocks until psmsd has it open */
+	fd = open(fifo_path, O_WRONLY);
+	if (fd < 0)
+	{
+	    fprintf(stderr, "%s: %s: %s\n", argv[0], fifo_path, strerror(errno));
+	    exit(1);
+	}
+    }
+
+    while ((rc = trace_read(tp, &rec)) > 0)
+    {
+	if (source_filter && rec.source != source_filter)
+	    continue;
+
+	if (first < 0)
+	    first = rec.usec;
+	if (rec.usec - first < (int64_t) (skip_s * 1000000))
+	    continue;
+	if (duration_s > 0 && rec.usec - first >= (int64_t) ((skip_s + duration_s) * 1000000))
+	    break;
+	
+	if (list_only)
+	{
+	    list_rec(&rec);
+	    if (max_msgs && ++nsent >= max_msgs)
+		break;
+	    continue;
+	}
+
+	/* The schedule starts with the first message replayed */
+	now = usec_now();
+	if (!nsent)
+	{
+	    t0 = now;
+	    base = rec.usec;
+	}
+	
+	due = t0;
+	if (speed > 0)
+	{
+	    due += (int64_t) ((rec.usec - base) / speed);
+	    if (due > now)
+		sleep_until(due);
+	}
+
+	to = to_override ? to_override : rec.to;
+	n = snprintf(buf, sizeof(buf), "%s load-%ld", to, nsent);
+	if (rec.size > LOAD_LINE_MAX)
+	    rec.size = LOAD_LINE_MAX;
+	while (n < (int) (strlen(to) + 1 + rec.size))
+	    buf[n++] = 'x';
+	buf[n++] = '\n';
+
+	if (write(fd, buf, n) != n)
+	{
+	    fprintf(stderr, "%s: %s: %s\n", argv[0], fifo_path, strerror(errno));
+	    exit(1);
+	}
+	
+	/* How far behind the trace the replay is */
+	if (speed > 0)
+	{
+	    if (nlate == alate)
+	    {
+		alate = alate ? alate*2 : 4096;
+		late = realloc(late, alate * sizeof(*late));
+		if (!late)
+		{
+		    fprintf(stderr, "%s: %s\n", argv[0], strerror(errno));
+		    exit(1);
+		}
+	    }
+	    now = usec_now();
+	    late[nlate++] = now > due ? now - due : 0;
+	}
+	
+	if (verbose > 1)
+	    fprintf(stderr, "%.*s", n, buf);
+	
+	nsent++;
+	nbytes += n;
+	if (max_msgs && nsent >= max_msgs)
+	    break;
+    }
+
+    if (rc < 0)
+	fprintf(stderr, "%s: %s: Damaged after %lu records\n", argv[0], argv[i], tp->records);
+    trace_close(tp);
+    
+    if (list_only)
+	exit(rc < 0 ? 1 : 0);
+    
+    close(fd);
+    now = usec_now();
+    printf("%s: %ld messages (%ld bytes) in %.3f s, %.1f msgs/s\n",
+	   argv[i], nsent, nbytes, nsent ? (now-t0) / 1e6 : 0.0,
+	   nsent && now > t0 ? nsent / ((now-t0) / 1e6) : 0.0);
+    if (nlate)
+    {
+	qsort(late, nlate, sizeof(*late), cmp_i64);
+	printf("%s: Behind the trace: p50 %.3f ms, p99 %.3f ms, max %.3f ms\n",
+	       argv[i], late[nlate/2] / 1e3, late[(nlate-1)*99/100] / 1e3, late[nlate-1] / 1e3);
+    }
+    free(late);
+    
+    exit(rc < 0 ? 1 : 0);
+}
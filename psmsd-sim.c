@@ -0,0 +1,1518 @@
+/*
+ * psmsd-sim.c - Simulated GSM modem for tests and benchmarks
+ *
+ * Copyright (c) 2016-2020 Peter Eriksson <pen@lysator.liu.se>
+ *
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Talks AT commands on a pty or a UNIX socket, like the modems psmsd
+ * is used with: I, CPIN, CSCS, CMGF, CSDH, CMGS (with the "> " prompt),
+ * CMGR, CMGL, CMGD, CPMS, CNMI (+CMTI or +CMT), CSMS/CNMA, CSMP (and
+ * +CDS status reports), CSQ and semicolon chained commands, in text
+ * mode only.
+ *
+ * Messages to "receive" are read from a file at startup (-i) and from
+ * a control fifo (-c), one "<phone>|<text>" per line. Longer texts are
+ * sent as concatenated parts.
+ *
+ * Faults are scripted in a scenario file (-f), one per line:
+ *
+ *   <fault> <command>|* <n>[/<every>] [<arg>]
+ *
+ * which hits the n:th (and then every <every>:th) matching command
+ * with one of: drop (no final result code), error <code> (+CMS ERROR
+ * instead), delay <ms> (stall before answering), garble (a line of
+ * noise before the answer), reboot <ms> (restart, RDY after <ms>) or
+ * full (a burst of incoming messages fills the storage).
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <termios.h>
+#include <poll.h>
+#include <time.h>
+#include <ctype.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "common.h"
+#include "gsm.h"
+
+
+int debug = 0;
+int verbose = 0;
+
+char *socket_path = NULL;
+char *link_path = NULL;
+char *ctl_path = NULL;
+char *inbox_path = NULL;
+char *sent_path = NULL;
+char *sim_pin = NULL;
+
+char *fault_path = NULL;
+
+int nslots = 30;
+int latency = 0;		/* ms, for all commands */
+
+
+#define SIM_LINE_MAX	2048
+#define SIM_OUT_MAX	65536
+#define SMS_CHARS	160
+#define SMS_PART_CHARS	153	/* With a concatenation header */
+
+
+/* Latency for specific commands, from -L<cmd>=<ms> */
+typedef struct cmdlat
+{
+    struct cmdlat *next;
+    char *name;
+    int ms;
+} CMDLAT;
+
+static CMDLAT *cmdlats = NULL;
+
+
+/* Scripted faults, from -f<file> */
+#define FAULT_DROP	1	/* No final result code */
+#define FAULT_ERROR	2	/* +CMS ERROR: <arg> instead of running it */
+#define FAULT_DELAY	3	/* Answer <arg> ms later */
+#define FAULT_GARBLE	4	/* A line of noise before the answer */
+#define FAULT_REBOOT	5	/* Restart, ready (RDY) after <arg> ms */
+#define FAULT_FULL	6	/* Incoming messages fill the storage */
+
+static const char *fault_names[] =
+    { "", "drop", "error", "delay", "garble", "reboot", "full", NULL };
+
+typedef struct fault
+{
+    struct fault *next;
+    int type;
+    char *name;		/* Command name, "*" for all */
+    int first;		/* Hit the first:th matching command */
+    int every;		/* ... and every every:th after it, if set */
+    int arg;
+    int seen;
+} FAULT;
+
+static FAULT *faults = NULL;
+
+
+typedef struct slot
+{
+    int used;
+    int read;
+    int fo;		/* First octet: 0x04 or 0x44 with a header */
+    char *phone;
+    char *text;
+    char *udh;		/* Header in hex, NULL if none */
+    char scts[32];
+} SLOT;
+
+static SLOT *slots = NULL;
+
+
+/* Received message waiting to be delivered */
+typedef struct inmsg
+{
+    struct inmsg *next;
+    char *phone;
+    char *text;
+    char *udh;
+    int fo;
+} INMSG;
+
+static INMSG *inq_head = NULL;
+static INMSG *inq_tail = NULL;
+
+
+/* Modem state */
+static int echo = 1;
+static int hex = 0;		/* CSCS="HEX" */
+static int textmode = 1;	/* CMGF */
+static int csdh = 0;
+static int cnmi_mt = 1;		/* 0 = store, 1 = +CMTI, 2 = +CMT */
+static int cnmi_ds = 0;
+static int csms = 0;
+static int csmp_fo = 17;
+static int pin_ok = 1;
+static int msg_ref = 0;
+static int part_ref = 0;
+
+/* Connection state */
+static int cfd = -1;		/* Client (or pty master) */
+static int lfd = -1;		/* Listening socket */
+static int ctl_fd = -1;
+static char ibuf[SIM_LINE_MAX];
+static int ilen = 0;
+static char obuf[SIM_OUT_MAX];	/* Response held back by the latency */
+static int olen = 0;
+static long long odue = 0;
+static int oprompt = 0;		/* Response is the "> " prompt */
+static int payload = 0;		/* Reading an SMS payload */
+static char payload_phone[64];
+static char ctlbuf[SIM_LINE_MAX];
+static int ctllen = 0;
+static int drop_final = 0;	/* Fault on the +CMGS after the payload */
+static char sent_line[SIM_LINE_MAX+80];	/* For -o, written with the OK */
+static long long boot_due = 0;	/* Rebooting, RDY at this time */
+
+static volatile sig_atomic_t stop = 0;
+
+static struct
+{
+    unsigned long commands;
+    unsigned long errors;
+    unsigned long sent;
+    unsigned long received;
+    unsigned long stored;
+    unsigned long direct;
+    unsigned long rejected;
+    unsigned long reports;
+    unsigned long faults;
+} stats;
+
+
+static long long
+ms_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+
+static void
+fatal(const char *msg)
+{
+    fprintf(stderr, "psmsd-sim: %s: %s\n", msg, strerror(errno));
+    exit(1);
+}
+
+
+static void
+scts_now(char *buf,
+	 size_t size)
+{
+    time_t t = time(NULL);
+    struct tm tm;
+
+    localtime_r(&t, &tm);
+    strftime(buf, size, "%y/%m/%d,%H:%M:%S+00", &tm);
+}
+
+
+static void
+client_write(const char *buf,
+	     int len)
+{
+    while (cfd >= 0 && len > 0)
+    {
+	int n = write(cfd, buf, len);
+
+	if (n < 0)
+	{
+	    if (errno == EINTR)
+		continue;
+	    if (errno == EAGAIN)
+	    {
+		struct pollfd pfd;
+
+		pfd.fd = cfd;
+		pfd.events = POLLOUT;
+		(void) poll(&pfd, 1, 1000);
+		continue;
+	    }
+	    return;
+	}
+	buf += n;
+	len -= n;
+    }
+}
+
+
+/* Queue response text, sent when the command latency has passed */
+static void
+out(const char *fmt,
+    ...)
+{
+    va_list ap;
+    int n;
+
+    va_start(ap, fmt);
+    n = vsnprintf(obuf+olen, sizeof(obuf)-olen, fmt, ap);
+    va_end(ap);
+
+    if (n > 0)
+	olen += n < (int) sizeof(obuf)-olen ? n : (int) sizeof(obuf)-olen-1;
+}
+
+
+/* The name of a command, as in -L and fault scenarios ("CMGS", "E") */
+static void
+cmd_name(const char *cmd,
+	 char *name,
+	 size_t size)
+{
+    size_t i = 0;
+
+    
+    if (*cmd == '+')
+	cmd++;
+    while (isalpha((unsigned char) cmd[i]) && i < size-1)
+    {
+	name[i] = toupper((unsigned char) cmd[i]);
+	i++;
+    }
+    name[i] = '\0';
+}
+
+
+static int
+cmd_latency(const char *cmd)
+{
+    CMDLAT *cp;
+    char name[32];
+
+
+    cmd_name(cmd, name, sizeof(name));
+    for (cp = cmdlats; cp; cp = cp->next)
+	if (strcmp(cp->name, name) == 0)
+	    return cp->ms;
+
+    return latency;
+}
+
+
+/* Count the command against the faults, and return the one to hit it */
+static FAULT *
+fault_check(const char *cmd)
+{
+    FAULT *fp, *hit = NULL;
+    char name[32];
+
+
+    cmd_name(cmd, name, sizeof(name));
+    for (fp = faults; fp; fp = fp->next)
+    {
+	if (strcmp(fp->name, "*") != 0 && strcmp(fp->name, name) != 0)
+	    continue;
+	
+	fp->seen++;
+	if (!hit && (fp->seen == fp->first ||
+		     (fp->every > 0 && fp->seen > fp->first && (fp->seen - fp->first) % fp->every == 0)))
+	    hit = fp;
+    }
+
+    if (hit)
+    {
+	stats.faults++;
+	if (verbose)
+	    fprintf(stderr, "SIM: Fault: %s on AT%s (%d)\n", fault_names[hit->type], cmd, hit->seen);
+    }
+    return hit;
+}
+
+
+static void
+fault_load(const char *path)
+{
+    FILE *fp;
+    FAULT *f, **last = &faults;
+    char buf[256], type[32], name[32], when[32];
+    int i, n, line = 0;
+
+
+    fp = fopen(path, "r");
+    if (!fp)
+	fatal(path);
+
+    while (fgets(buf, sizeof(buf), fp))
+    {
+	++line;
+	buf[strcspn(buf, "#\r\n")] = '\0';
+	
+	f = calloc(1, sizeof(*f));
+	if (!f)
+	    fatal("malloc");
+	
+	n = sscanf(buf, "%31s %31s %31s %d", type, name, when, &f->arg);
+	if (n <= 0)
+	{
+	    free(f);
+	    continue;
+	}
+
+	for (i = 1; fault_names[i] && strcmp(fault_names[i], type) != 0; i++)
+	    ;
+	f->type = i;
+	
+	if (!fault_names[i] || n < 3 ||
+	    sscanf(when, "%d/%d", &f->first, &f->every) < 1 || f->first < 1 ||
+	    ((f->type == FAULT_ERROR || f->type == FAULT_DELAY) && n < 4))
+	{
+	    fprintf(stderr, "psmsd-sim: %s: Invalid fault at line %d\n", path, line);
+	    exit(1);
+	}
+	
+	if (f->type == FAULT_REBOOT && n < 4)
+	    f->arg = 1000;
+	
+	for (i = 0; name[i]; i++)
+	    name[i] = toupper((unsigned char) name[i]);
+	f->name = strdup(name);
+	if (!f->name)
+	    fatal("malloc");
+
+	*last = f;
+	last = &f->next;
+    }
+    fclose(fp);
+}
+
+
+static void
+garble(void)
+{
+    int i, n = 8 + rand() % 32;
+
+
+    out("\r\n");
+    for (i = 0; i < n; i++)
+    {
+	int c = 0x20 + rand() % 0xE0;
+
+	out("%c", c == 0x7F ? '~' : c);
+    }
+    out("\r\n");
+}
+
+
+static int
+slots_used(void)
+{
+    int i, n = 0;
+
+    for (i = 1; i <= nslots; i++)
+	n += slots[i].used;
+    return n;
+}
+
+
+static void
+slot_free(SLOT *sp)
+{
+    free(sp->phone);
+    free(sp->text);
+    free(sp->udh);
+    memset(sp, 0, sizeof(*sp));
+}
+
+
+static const char *
+slot_stat(SLOT *sp)
+{
+    return sp->read ? "REC READ" : "REC UNREAD";
+}
+
+
+/* Length of the user data, as in the +CSDH=1 headers */
+static int
+msg_len(const char *text,
+	const char *udh)
+{
+    return (int) strlen(text) + (udh ? (int) strlen(udh)/2 : 0);
+}
+
+
+/*
+ * Encode a message for showing, in the current character set. Like
+ * real modems, messages with a header are always shown in hex.
+ */
+static char *
+encode(const char *text,
+       const char *udh,
+       char *buf,
+       size_t size)
+{
+    int len;
+
+
+    if (!hex && !udh)
+    {
+	snprintf(buf, size, "%s", text);
+	return buf;
+    }
+
+    snprintf(buf, size, "%s", udh ? udh : "");
+    len = strlen(buf);
+    latin1_to_gsm(text, buf+len, size-len);
+    return buf;
+}
+
+
+static void
+inq_put(const char *phone,
+	const char *text,
+	const char *udh)
+{
+    INMSG *ip;
+
+
+    ip = calloc(1, sizeof(*ip));
+    if (!ip || !(ip->phone = strdup(phone)) || !(ip->text = strdup(text)) ||
+	(udh && !(ip->udh = strdup(udh))))
+	fatal("malloc");
+    ip->fo = udh ? 0x44 : 0x04;
+
+    if (inq_tail)
+	inq_tail->next = ip;
+    else
+	inq_head = ip;
+    inq_tail = ip;
+}
+
+
+/* Queue a received message, split in concatenated parts if long */
+static void
+inject(const char *line)
+{
+    char phone[64], *text;
+    const char *cp;
+    int len, parts, i;
+
+
+    cp = strchr(line, '|');
+    if (!cp || cp == line || cp-line >= (int) sizeof(phone))
+    {
+	fprintf(stderr, "psmsd-sim: Invalid message (not <phone>|<text>): %s\n", line);
+	return;
+    }
+    memcpy(phone, line, cp-line);
+    phone[cp-line] = '\0';
+    text = (char *) cp+1;
+    len = strlen(text);
+
+    if (len <= SMS_CHARS)
+    {
+	inq_put(phone, text, NULL);
+	return;
+    }
+
+    parts = (len + SMS_PART_CHARS-1) / SMS_PART_CHARS;
+    if (parts > 255)
+	parts = 255;
+    part_ref = (part_ref+1) & 0xFF;
+    
+    for (i = 0; i < parts; i++)
+    {
+	char udh[16], part[SMS_PART_CHARS+1];
+
+	snprintf(udh, sizeof(udh), "050003%02X%02X%02X", part_ref, parts, i+1);
+	snprintf(part, sizeof(part), "%.*s", SMS_PART_CHARS, text + i*SMS_PART_CHARS);
+	inq_put(phone, part, udh);
+    }
+}
+
+
+static void
+inject_file(const char *path)
+{
+    FILE *fp;
+    char buf[SIM_LINE_MAX];
+
+
+    fp = fopen(path, "r");
+    if (!fp)
+	fatal(path);
+
+    while (fgets(buf, sizeof(buf), fp))
+    {
+	buf[strcspn(buf, "\r\n")] = '\0';
+	if (*buf && *buf != '#')
+	    inject(buf);
+    }
+    fclose(fp);
+}
+
+
+/* A burst of incoming messages, enough to fill the free storage */
+static void
+fill_storage(void)
+{
+    char text[32];
+    int i, n;
+
+
+    n = nslots - slots_used();
+    for (i = 0; i < n; i++)
+    {
+	snprintf(text, sizeof(text), "filler %d", i+1);
+	inq_put("+46700000000", text, NULL);
+    }
+}
+
+
+/* Deliver the next received message: store it or pass it on as +CMT */
+static void
+deliver(void)
+{
+    INMSG *ip = inq_head;
+    char scts[32], body[SIM_LINE_MAX], buf[SIM_LINE_MAX+512];
+    int i, n;
+
+
+    inq_head = ip->next;
+    if (!inq_head)
+	inq_tail = NULL;
+
+    stats.received++;
+    scts_now(scts, sizeof(scts));
+    
+    if (cnmi_mt == 2)
+    {
+	encode(ip->text, ip->udh, body, sizeof(body));
+	n = snprintf(buf, sizeof(buf), "\r\n+CMT: \"%s\",,\"%s\"", ip->phone, scts);
+	if (csdh)
+	    n += snprintf(buf+n, sizeof(buf)-n, ",145,%d,0,0,\"+46700000000\",145,%d",
+			  ip->fo, msg_len(ip->text, ip->udh));
+	n += snprintf(buf+n, sizeof(buf)-n, "\r\n%s\r\n", body);
+	client_write(buf, n < (int) sizeof(buf) ? n : (int) sizeof(buf)-1);
+	stats.direct++;
+	goto Done;
+    }
+
+    for (i = 1; i <= nslots && slots[i].used; i++)
+	;
+    if (i > nslots)
+    {
+	/* Storage full - the network will try again, we don't */
+	stats.rejected++;
+	if (verbose)
+	    fprintf(stderr, "SIM: Storage full, message from %s rejected\n", ip->phone);
+	goto Done;
+    }
+
+    slots[i].used = 1;
+    slots[i].read = 0;
+    slots[i].fo = ip->fo;
+    slots[i].phone = ip->phone;
+    slots[i].text = ip->text;
+    slots[i].udh = ip->udh;
+    strcpy(slots[i].scts, scts);
+    ip->phone = ip->text = ip->udh = NULL;
+    stats.stored++;
+
+    if (cnmi_mt == 1)
+    {
+	n = snprintf(buf, sizeof(buf), "\r\n+CMTI: \"SM\",%d\r\n", i);
+	client_write(buf, n);
+    }
+
+  Done:
+    free(ip->phone);
+    free(ip->text);
+    free(ip->udh);
+    free(ip);
+}
+
+
+static void
+show_msg(const char *prefix,
+	 int i,
+	 SLOT *sp)
+{
+    char body[SIM_LINE_MAX];
+
+    
+    if (i > 0)
+	out("\r\n%s: %d,\"%s\",\"%s\",,\"%s\"", prefix, i, slot_stat(sp), sp->phone, sp->scts);
+    else
+	out("\r\n%s: \"%s\",\"%s\",,\"%s\"", prefix, slot_stat(sp), sp->phone, sp->scts);
+
+    if (csdh && i > 0)
+	out(",145,%d", msg_len(sp->text, sp->udh));
+    else if (csdh)
+	out(",145,%d,0,0,\"+46700000000\",145,%d", sp->fo, msg_len(sp->text, sp->udh));
+    
+    out("\r\n%s\r\n", encode(sp->text, sp->udh, body, sizeof(body)));
+}
+
+
+static int
+list_match(SLOT *sp,
+	   const char *what)
+{
+    if (!strcmp(what, "ALL") || !strcmp(what, "4"))
+	return 1;
+    if (!strcmp(what, "REC UNREAD") || !strcmp(what, "0"))
+	return !sp->read;
+    if (!strcmp(what, "REC READ") || !strcmp(what, "1"))
+	return sp->read;
+    return 0;
+}
+
+
+static void
+unquote(char *buf,
+	size_t size,
+	const char *s)
+{
+    size_t i = 0;
+
+    
+    for (; *s && i < size-1; s++)
+	if (*s != '"')
+	    buf[i++] = *s;
+    buf[i] = '\0';
+}
+
+
+/*
+ * Run one command (without the "AT" and the separating ';'). Returns
+ * 0 (OK), 1 if the prompt was sent or -1 (ERROR). CMS errors are put
+ * in 'err'.
+ */
+static int
+run_cmd(char *cmd,
+	int *err)
+{
+    char arg[256];
+    int i, a, b;
+
+
+    stats.commands++;
+    
+    if (!*cmd || !strcasecmp(cmd, "Z") || !strcasecmp(cmd, "&F"))
+	return 0;
+    
+    if (toupper((unsigned char) cmd[0]) == 'E' && (cmd[1] == '0' || cmd[1] == '1' || !cmd[1] || cmd[1] == '+'))
+    {
+	echo = (cmd[1] == '1');
+
+	/* Basic commands can be followed by more, as in "E0+CSQ" */
+	i = isdigit((unsigned char) cmd[1]) ? 2 : 1;
+	if (cmd[i])
+	{
+	    stats.commands--;
+	    return run_cmd(cmd+i, err);
+	}
+	return 0;
+    }
+
+    if (!strcasecmp(cmd, "I"))
+    {
+	out("\r\npsmsd-sim\r\n");
+	return 0;
+    }
+    
+    if (*cmd != '+')
+	return -1;
+
+    for (i = 1; cmd[i] && cmd[i] != '=' && cmd[i] != '?'; i++)
+	cmd[i] = toupper((unsigned char) cmd[i]);
+
+    if (!strcmp(cmd, "+CPIN?"))
+    {
+	out("\r\n+CPIN: %s\r\n", pin_ok ? "READY" : "SIM PIN");
+	return 0;
+    }
+    if (!strncmp(cmd, "+CPIN=", 6))
+    {
+	unquote(arg, sizeof(arg), cmd+6);
+	if (!sim_pin || pin_ok || strcmp(arg, sim_pin) != 0)
+	{
+	    *err = 16;	/* Incorrect password (+CME) */
+	    return -1;
+	}
+	pin_ok = 1;
+	return 0;
+    }
+
+    /* Nothing below works without the PIN */
+    if (!pin_ok)
+    {
+	*err = 311;	/* SIM PIN required */
+	return -1;
+    }
+
+    if (!strncmp(cmd, "+CSCS=", 6))
+    {
+	unquote(arg, sizeof(arg), cmd+6);
+	if (!strcmp(arg, "HEX"))
+	    hex = 1;
+	else if (!strcmp(arg, "GSM") || !strcmp(arg, "IRA") || !strcmp(arg, "8859-1"))
+	    hex = 0;
+	else
+	    return -1;
+	return 0;
+    }
+    if (!strcmp(cmd, "+CSCS?"))
+    {
+	out("\r\n+CSCS: \"%s\"\r\n", hex ? "HEX" : "IRA");
+	return 0;
+    }
+    if (!strncmp(cmd, "+CMGF=", 6))
+    {
+	/* PDU mode is not simulated */
+	if (atoi(cmd+6) != 1)
+	    return -1;
+	textmode = 1;
+	return 0;
+    }
+    if (!strncmp(cmd, "+CSDH=", 6))
+    {
+	csdh = atoi(cmd+6) != 0;
+	return 0;
+    }
+    if (!strncmp(cmd, "+CSMP=", 6))
+    {
+	csmp_fo = atoi(cmd+6);
+	return 0;
+    }
+    if (!strcmp(cmd, "+CSQ"))
+    {
+	out("\r\n+CSQ: 20,99\r\n");
+	return 0;
+    }
+    if (!strncmp(cmd, "+CSMS=", 6))
+    {
+	csms = atoi(cmd+6);
+	out("\r\n+CSMS: 1,1,1\r\n");
+	return 0;
+    }
+    if (!strcmp(cmd, "+CNMA"))
+	return 0;
+    if (!strncmp(cmd, "+CNMI=", 6))
+    {
+	a = b = 0;
+	if (sscanf(cmd+6, "%*d,%d,%*d,%d", &a, &b) < 1 || a < 0 || a > 2)
+	    return -1;
+	cnmi_mt = a;
+	cnmi_ds = b;
+	return 0;
+    }
+    if (!strcmp(cmd, "+CPMS?"))
+    {
+	a = slots_used();
+	out("\r\n+CPMS: \"SM\",%d,%d,\"SM\",%d,%d,\"SM\",%d,%d\r\n",
+	    a, nslots, a, nslots, a, nslots);
+	return 0;
+    }
+    if (!strncmp(cmd, "+CPMS=", 6))
+    {
+	a = slots_used();
+	out("\r\n+CPMS: %d,%d,%d,%d,%d,%d\r\n", a, nslots, a, nslots, a, nslots);
+	return 0;
+    }
+    if (!strncmp(cmd, "+CMGR=", 6))
+    {
+	i = atoi(cmd+6);
+	if (i < 1 || i > nslots || !slots[i].used)
+	{
+	    *err = 321;	/* Invalid memory index */
+	    return -1;
+	}
+	show_msg("+CMGR", 0, &slots[i]);
+	slots[i].read = 1;
+	return 0;
+    }
+    if (!strncmp(cmd, "+CMGL", 5))
+    {
+	unquote(arg, sizeof(arg), cmd[5] == '=' ? cmd+6 : "REC UNREAD");
+	for (i = 1; i <= nslots; i++)
+	    if (slots[i].used && list_match(&slots[i], arg))
+	    {
+		show_msg("+CMGL", i, &slots[i]);
+		slots[i].read = 1;
+	    }
+	return 0;
+    }
+    if (!strncmp(cmd, "+CMGD=", 6))
+    {
+	a = b = 0;
+	if (sscanf(cmd+6, "%d,%d", &a, &b) < 1)
+	    return -1;
+	if (b == 0)
+	{
+	    if (a < 1 || a > nslots)
+	    {
+		*err = 321;
+		return -1;
+	    }
+	    if (slots[a].used)
+		slot_free(&slots[a]);
+	    return 0;
+	}
+	/* 1: read, 2, 3: read and sent (none stored here), 4: all */
+	for (i = 1; i <= nslots; i++)
+	    if (slots[i].used && (b == 4 || slots[i].read))
+		slot_free(&slots[i]);
+	return 0;
+    }
+    if (!strncmp(cmd, "+CMGS=", 6))
+    {
+	if (!textmode)
+	    return -1;
+	unquote(payload_phone, sizeof(payload_phone), cmd+6);
+	payload_phone[strcspn(payload_phone, ",")] = '\0';
+	return 1;
+    }
+
+    return -1;
+}
+
+
+/* Run a command line, which may hold several ';' separated commands */
+static void modem_reset(void);
+
+static void
+run_line(char *line)
+{
+    FAULT *fp;
+    char *cp, *next;
+    int rc = 0, err = 0, q, ms = 0, drop = 0;
+
+
+    if (verbose > 1)
+	fprintf(stderr, "SIM: < %s\n", line);
+
+    if (echo)
+    {
+	client_write(line, strlen(line));
+	client_write("\r", 1);
+    }
+
+    if (strncasecmp(line, "AT", 2) != 0)
+	return;
+
+    for (cp = line+2; cp && rc == 0; cp = next)
+    {
+	/* Split on ';' outside quotes */
+	for (next = cp, q = 0; *next && (q || *next != ';'); next++)
+	    if (*next == '"')
+		q = !q;
+	if (*next)
+	    *next++ = '\0';
+	else
+	    next = NULL;
+
+	ms += cmd_latency(cp);
+	
+	fp = fault_check(cp);
+	if (fp && fp->type == FAULT_REBOOT)
+	{
+	    /* Gone without a word, the input is lost */
+	    modem_reset();
+	    boot_due = ms_now() + fp->arg;
+	    return;
+	}
+	if (fp && fp->type == FAULT_ERROR)
+	{
+	    rc = -1;
+	    err = fp->arg;
+	    break;
+	}
+	if (fp && fp->type == FAULT_DELAY)
+	    ms += fp->arg;
+	if (fp && fp->type == FAULT_GARBLE)
+	    garble();
+	if (fp && fp->type == FAULT_DROP)
+	    drop = 1;
+	if (fp && fp->type == FAULT_FULL)
+	    fill_storage();
+	
+	rc = run_cmd(cp, &err);
+	if (rc > 0 && next)
+	    rc = -1;	/* No prompt in the middle of a line */
+    }
+
+    odue = ms_now() + ms;
+
+    if (drop && rc > 0)
+	drop_final = 1;	/* After the payload */
+    else if (drop)
+	return;
+    
+    if (rc > 0)
+    {
+	out("\r\n> ");
+	oprompt = 1;
+    }
+    else if (rc < 0)
+    {
+	stats.errors++;
+	if (err >= 300)
+	    out("\r\n+CMS ERROR: %d\r\n", err);
+	else if (err)
+	    out("\r\n+CME ERROR: %d\r\n", err);
+	else
+	    out("\r\nERROR\r\n");
+    }
+    else
+	out("\r\nOK\r\n");
+}
+
+
+/* Append the message sent to the -o file, when the OK is sent */
+static void
+sent_log(void)
+{
+    FILE *fp;
+
+    
+    if (!*sent_line)
+	return;
+    
+    fp = fopen(sent_path, "a");
+    if (fp)
+    {
+	fputs(sent_line, fp);
+	fclose(fp);
+    }
+    *sent_line = '\0';
+}
+
+
+/* The payload of an AT+CMGS was sent (^Z) */
+static void
+sms_sent(char *data)
+{
+    char text[SIM_LINE_MAX];
+    int ref;
+
+
+    if (hex)
+	gsm_to_latin1(data, text, sizeof(text));
+    else
+	snprintf(text, sizeof(text), "%s", data);
+
+    stats.sent++;
+    ref = msg_ref = (msg_ref+1) & 0xFF;
+    
+    if (verbose)
+	fprintf(stderr, "SIM: SMS to %s: %s\n", payload_phone, text);
+
+    if (sent_path)
+	snprintf(sent_line, sizeof(sent_line), "%s|%s\n", payload_phone, text);
+
+    odue = ms_now() + cmd_latency("CMGS");
+    if (drop_final)
+    {
+	drop_final = 0;
+	sent_log();
+    }
+    else
+	out("\r\n+CMGS: %d\r\n\r\nOK\r\n", ref);
+
+    /* Status report, if asked for (TP-SRR) and enabled */
+    if ((csmp_fo & 0x20) && cnmi_ds == 1)
+    {
+	char scts[32];
+
+	scts_now(scts, sizeof(scts));
+	out("\r\n+CDS: 6,%d,\"%s\",145,\"%s\",\"%s\",0\r\n", ref, payload_phone, scts, scts);
+	stats.reports++;
+    }
+}
+
+
+/* Handle buffered input, as far as the modem state allows */
+static void
+process_input(void)
+{
+    int i;
+
+
+    while (ilen > 0 && !olen)
+    {
+	if (payload)
+	{
+	    for (i = 0; i < ilen && ibuf[i] != 0x1A && ibuf[i] != 0x1B; i++)
+		;
+	    if (i == ilen)
+	    {
+		if (ilen == sizeof(ibuf))
+		    ilen = 0;	/* Overlong, drop it */
+		return;
+	    }
+
+	    payload = 0;
+	    if (ibuf[i] == 0x1A)
+	    {
+		ibuf[i] = '\0';
+		sms_sent(ibuf);
+	    }
+	    else
+		drop_final = 0;
+	    memmove(ibuf, ibuf+i+1, ilen-i-1);
+	    ilen -= i+1;
+	    continue;
+	}
+
+	/* Skip line feeds and ESC (cancel) between commands */
+	if (ibuf[0] == '\n' || ibuf[0] == 0x1B || ibuf[0] == 0x1A)
+	{
+	    memmove(ibuf, ibuf+1, --ilen);
+	    continue;
+	}
+	
+	for (i = 0; i < ilen && ibuf[i] != '\r'; i++)
+	    ;
+	if (i == ilen)
+	{
+	    if (ilen == sizeof(ibuf))
+		ilen = 0;
+	    return;
+	}
+
+	ibuf[i] = '\0';
+	run_line(ibuf);
+	if (boot_due)
+	    return;
+	memmove(ibuf, ibuf+i+1, ilen-i-1);
+	ilen -= i+1;
+    }
+}
+
+
+/* Send the held response, if its time has come */
+static void
+flush_output(void)
+{
+    if (!olen || ms_now() < odue)
+	return;
+
+    client_write(obuf, olen);
+    if (verbose > 1)
+	fprintf(stderr, "SIM: > %.*s\n", olen, obuf);
+    olen = 0;
+    sent_log();
+    
+    if (oprompt)
+    {
+	oprompt = 0;
+	payload = 1;
+    }
+}
+
+
+static void
+ctl_input(void)
+{
+    int n, i;
+
+
+    n = read(ctl_fd, ctlbuf+ctllen, sizeof(ctlbuf)-ctllen-1);
+    if (n <= 0)
+	return;
+    ctllen += n;
+
+    while ((i = strcspn(ctlbuf, "\n")) < ctllen)
+    {
+	ctlbuf[i] = '\0';
+	if (i > 0 && ctlbuf[i-1] == '\r')
+	    ctlbuf[i-1] = '\0';
+	if (*ctlbuf)
+	    inject(ctlbuf);
+	memmove(ctlbuf, ctlbuf+i+1, ctllen-i-1);
+	ctllen -= i+1;
+	ctlbuf[ctllen] = '\0';
+    }
+    
+    if (ctllen == sizeof(ctlbuf)-1)
+	ctllen = 0;
+    ctlbuf[ctllen] = '\0';
+}
+
+
+/* A new connection starts with the power-on settings */
+static void
+modem_reset(void)
+{
+    echo = 1;
+    hex = 0;
+    textmode = 1;
+    csdh = 0;
+    csms = 0;
+    csmp_fo = 17;
+    cnmi_mt = 1;
+    cnmi_ds = 0;
+    pin_ok = (sim_pin == NULL);
+    ilen = olen = 0;
+    oprompt = payload = drop_final = 0;
+    boot_due = 0;
+}
+
+
+static int
+open_pty(void)
+{
+    struct termios tio;
+    char *name;
+    int mfd, sfd;
+
+    
+    mfd = posix_openpt(O_RDWR|O_NOCTTY);
+    if (mfd < 0 || grantpt(mfd) < 0 || unlockpt(mfd) < 0)
+	fatal("pty");
+
+    name = ptsname(mfd);
+    
+    /* Kept open so the master does not hang up between clients */
+    sfd = open(name, O_RDWR|O_NOCTTY);
+    if (sfd < 0)
+	fatal(name);
+    tcgetattr(sfd, &tio);
+    cfmakeraw(&tio);
+    tcsetattr(sfd, TCSANOW, &tio);
+
+    if (link_path)
+    {
+	(void) unlink(link_path);
+	if (symlink(name, link_path) < 0)
+	    fatal(link_path);
+    }
+    
+    printf("%s\n", name);
+    fflush(stdout);
+    return mfd;
+}
+
+
+static int
+open_socket(void)
+{
+    struct sockaddr_un sun;
+    int fd;
+
+
+    if (strlen(socket_path) >= sizeof(sun.sun_path))
+    {
+	errno = ENAMETOOLONG;
+	fatal(socket_path);
+    }
+    
+    memset(&sun, 0, sizeof(sun));
+    sun.sun_family = AF_UNIX;
+    strcpy(sun.sun_path, socket_path);
+    (void) unlink(socket_path);
+
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || bind(fd, (struct sockaddr *) &sun, sizeof(sun)) < 0 || listen(fd, 1) < 0)
+	fatal(socket_path);
+    
+    printf("%s\n", socket_path);
+    fflush(stdout);
+    return fd;
+}
+
+
+static void
+on_signal(int sig)
+{
+    stop = 1;
+}
+
+
+void
+usage(FILE *fp,
+      char *argv0)
+{
+    fprintf(fp, "Usage: %s [<options>]\n", argv0);
+    fprintf(fp, "Options:\n");
+    fprintf(fp, "  -h                    Display this information\n");
+    fprintf(fp, "  -V                    Print version and exit\n");
+    fprintf(fp, "  -v[<level>]           Set verbosity level\n");
+    fprintf(fp, "  -s<socket-path>       Listen on a UNIX socket (default: a pty)\n");
+    fprintf(fp, "  -l<link-path>         Symlink to the pty\n");
+    fprintf(fp, "  -S<slots>             Message storage size (default: 30)\n");
+    fprintf(fp, "  -L[<cmd>=]<ms>        Latency of all (or one) commands\n");
+    fprintf(fp, "  -p<pin>               Require a SIM PIN\n");
+    fprintf(fp, "  -i<file>              Messages to receive at startup\n");
+    fprintf(fp, "  -c<fifo-path>         Control fifo for messages to receive\n");
+    fprintf(fp, "  -o<file>              Append sent messages to a file\n");
+    fprintf(fp, "  -f<file>              Fault scenario\n");
+}
+
+void
+p_header(void)
+{
+    printf("[psmsd-sim, version %s - Copyright (c) 2016 Peter Eriksson <pen@lysator.liu.se>]\n", VERSION);
+}
+
+
+int
+main(int argc,
+     char *argv[])
+{
+    struct pollfd pfdv[3];
+    struct sigaction sa;
+    int i, n, nfd, timeout;
+
+
+    for (i = 1; i < argc && argv[i][0] == '-'; i++)
+	switch (argv[i][1])
+	{
+	  case 'V':
+	    p_header();
+	    exit(0);
+	    
+	  case 'v':
+	    if (!argv[i][2])
+		++verbose;
+	    else if (sscanf(argv[i]+2, "%d", &verbose) != 1)
+	    {
+		fprintf(stderr, "%s: Invalid verbosity level: %s\n", argv[0], argv[i]+2);
+		exit(1);
+	    }
+	    break;
+
+	  case 's':
+	    socket_path = argv[i]+2;
+	    break;
+	    
+	  case 'l':
+	    link_path = argv[i]+2;
+	    break;
+	    
+	  case 'S':
+	    if (sscanf(argv[i]+2, "%d", &nslots) != 1 || nslots < 1)
+	    {
+		fprintf(stderr, "%s: Invalid argument for -S\n", argv[0]);
+		exit(1);
+	    }
+	    break;
+	    
+	  case 'L':
+	    {
+		char *cp = strchr(argv[i]+2, '=');
+		
+		if (cp)
+		{
+		    CMDLAT *lp = calloc(1, sizeof(*lp));
+		    
+		    if (!lp)
+			fatal("malloc");
+		    lp->name = strndup(argv[i]+2, cp-argv[i]-2);
+		    for (n = 0; lp->name[n]; n++)
+			lp->name[n] = toupper((unsigned char) lp->name[n]);
+		    lp->ms = atoi(cp+1);
+		    lp->next = cmdlats;
+		    cmdlats = lp;
+		}
+		else if (sscanf(argv[i]+2, "%d", &latency) != 1 || latency < 0)
+		{
+		    fprintf(stderr, "%s: Invalid argument for -L\n", argv[0]);
+		    exit(1);
+		}
+	    }
+	    break;
+
+	  case 'p':
+	    sim_pin = argv[i]+2;
+	    break;
+	    
+	  case 'i':
+	    inbox_path = argv[i]+2;
+	    break;
+	    
+	  case 'c':
+	    ctl_path = argv[i]+2;
+	    break;
+	    
+	  case 'o':
+	    sent_path = argv[i]+2;
+	    break;
+	    
+	  case 'f':
+	    fault_path = argv[i]+2;
+	    break;
+	    
+	  case 'h':
+	    usage(stdout, argv[0]);
+	    exit(0);
+	    
+	  default:
+	    fprintf(stderr, "%s: Invalid switch: %s\n", argv[0], argv[i]);
+	    exit(1);
+	}
+
+    slots = calloc(nslots+1, sizeof(SLOT));
+    if (!slots)
+	fatal("malloc");
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_signal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    if (fault_path)
+	fault_load(fault_path);
+    
+    if (inbox_path)
+	inject_file(inbox_path);
+    
+    if (ctl_path)
+    {
+	(void) mkfifo(ctl_path, 0660);
+	ctl_fd = open(ctl_path, O_RDWR|O_NONBLOCK);
+	if (ctl_fd < 0)
+	    fatal(ctl_path);
+    }
+
+    modem_reset();
+    if (socket_path)
+	lfd = open_socket();
+    else
+	cfd = open_pty();
+
+    while (!stop)
+    {
+	nfd = 0;
+	if (cfd >= 0)
+	{
+	    /* Not read while the input buffer is full */
+	    pfdv[nfd].fd = cfd;
+	    pfdv[nfd++].events = ilen < (int) sizeof(ibuf) ? POLLIN : 0;
+	}
+	else
+	{
+	    pfdv[nfd].fd = lfd;
+	    pfdv[nfd++].events = POLLIN;
+	}
+	if (ctl_fd >= 0)
+	{
+	    pfdv[nfd].fd = ctl_fd;
+	    pfdv[nfd++].events = POLLIN;
+	}
+
+	timeout = -1;
+	if (boot_due)
+	    timeout = boot_due > ms_now() ? (int) (boot_due - ms_now()) : 0;
+	else if (olen)
+	    timeout = odue > ms_now() ? (int) (odue - ms_now()) : 0;
+	else if (inq_head && cfd >= 0 && !payload)
+	    timeout = 0;
+
+	n = poll(pfdv, nfd, timeout);
+	if (n < 0)
+	{
+	    if (errno == EINTR)
+		continue;
+	    fatal("poll");
+	}
+
+	for (i = 0; i < nfd; i++)
+	{
+	    if (!pfdv[i].revents)
+		continue;
+
+	    if (pfdv[i].fd == ctl_fd)
+		ctl_input();
+	    else if (pfdv[i].fd == lfd)
+	    {
+		cfd = accept(lfd, NULL, NULL);
+		if (cfd >= 0)
+		{
+		    modem_reset();
+		    if (verbose)
+			fprintf(stderr, "SIM: Connected\n");
+		}
+	    }
+	    else
+	    {
+		int len = read(cfd, ibuf+ilen, sizeof(ibuf)-ilen);
+		
+		if (len <= 0 && (len == 0 || (errno != EINTR && errno != EAGAIN)))
+		{
+		    /* Client gone (a pty master sees EIO only if we closed it) */
+		    if (verbose)
+			fprintf(stderr, "SIM: Disconnected\n");
+		    if (socket_path)
+		    {
+			close(cfd);
+			cfd = -1;
+		    }
+		    ilen = olen = 0;
+		    payload = oprompt = 0;
+		    continue;
+		}
+		if (len > 0)
+		    ilen += len;
+	    }
+	}
+
+	if (boot_due)
+	{
+	    /* Nothing is heard while booting */
+	    ilen = 0;
+	    if (ms_now() < boot_due)
+		continue;
+	    
+	    boot_due = 0;
+	    client_write("\r\nRDY\r\n", 7);
+	    if (verbose)
+		fprintf(stderr, "SIM: Ready after reboot\n");
+	}
+	
+	/* Run what has been buffered as long as the answers are due */
+	flush_output();
+	do
+	{
+	    n = ilen;
+	    process_input();
+	    flush_output();
+	} while (ilen > 0 && ilen != n && !olen && !boot_due);
+	
+	/* Unsolicited results only between commands */
+	while (inq_head && cfd >= 0 && !olen && !payload && !ilen)
+	    deliver();
+    }
+
+    fprintf(stderr, "psmsd-sim: %lu commands (%lu errors), %lu sent, %lu received (%lu stored, %lu direct, %lu rejected), %lu status reports, %lu faults\n",
+	    stats.commands, stats.errors, stats.sent, stats.received,
+	    stats.stored, stats.direct, stats.rejected, stats.reports, stats.faults);
+
+    if (socket_path)
+	(void) unlink(socket_path);
+    if (link_path)
+	(void) unlink(link_path);
+    exit(0);
+}
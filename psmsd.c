@@ -41,9 +41,9 @@
 #include <pthread.h>
 #include <syslog.h>
 #include <unistd.h>
-#include <setjmp.h>
 #include <fcntl.h>
 #include <time.h>
+#include <inttypes.h>
 #include <pwd.h>
 
 #if HAVE_DOORS
@@ -60,7 +60,6 @@
 
 #include "common.h"
 #include "serial.h"
-#include "queue.h"
 #include "gsm.h"
 #include "argv.h"
 #include "buffer.h"
@@ -68,27 +67,64 @@
 #include "spawn.h"
 #include "ptime.h"
 #include "strmisc.h"
+#include "db.h"
+#include "watch.h"
+#include "groups.h"
+#include "phone.h"
+#include "evloop.h"
+#include "pool.h"
+#include "linebuf.h"
+#include "atparse.h"
+#include "journal.h"
+#include "capture.h"
+#include "trace.h"
+#include "vmodem.h"
+#include "mpsc.h"
+#include "slab.h"
+#include "arena.h"
+#include "mpart.h"
+#include "simstore.h"
 
 
 extern char version[];
 
 
-typedef struct extcmd
-{
-    char *name;
-    int level;
-    char *user;
-    char *path;	
-    char *argv;	
-} ECMD;
+/* Milliseconds to wait for a burst of config file writes to settle */
+#define CONFIG_DEBOUNCE 250
+
+/* Watched config file type for the groups file (the others are DB_SECT_*) */
+#define CONFIG_SECT_GROUPS 3
+
+/* Default number of worker threads for command execution */
+#define WORKERS 4
+
+/* Bytes on the stack for the allocations of a received message */
+#define RUN_ARENA_SIZE 8192
+
+/* Milliseconds to wait before sending the payload of a command */
+#define XMIT_DATA_DELAY 1000	/* If the modem does not prompt for the text */
+#define SER_INPUT_SIZE 8192
+#define LINEIN_SIZE 1024
+
+/* Longest AT command (without "AT") and XMSGs allocated at a time */
+#define XMSG_CMD_SIZE 128
+#define XMSG_CHUNK 256
+
+/* Times a message is sent again after a timeout, restart or +CMS ERROR */
+#define XMIT_RETRIES 3
 
 
 typedef struct xmitmsg
 {
-    char *cmd;
-    char *data;
+    MPSC_NODE node;	/* First, queued in q_xmit or q_urgent */
+    char *data;		/* NULL, or 'text' for messages */
     void (*ack)(int rc, void *misc);
     void *misc;
+    int timeout;	/* ms, 0 for serial_timeout */
+    int tries;		/* Messages: times sent again */
+    long long queued;	/* Messages: when queued, on the loop clock */
+    char cmd[XMSG_CMD_SIZE];
+    char text[MAX_SMS_MESSAGE+1];
 } XMSG;
 
 
@@ -98,7 +134,6 @@ char *argv0 = "psmsd";
 int verbose = 0;
 int debug = 0;
 
-volatile int abort_threads = 0;
 int autologout_time = 0;
 
 char *serial_device = SERIAL_DEVICE;
@@ -106,9 +141,7 @@ int serial_speed = SERIAL_SPEED;
 
 int serial_timeout = 30000;
 
-FILE *ser_r_fp = NULL;
-FILE *ser_w_fp = NULL;
-FILE *tty_fp = NULL;
+int ser_fd = -1;
 
 #if HAVE_DOORS
 char *door_path = DOOR_PATH;
@@ -117,20 +150,91 @@ char *door_path = DOOR_PATH;
 char *fifo_path = FIFO_PATH;
 int tty_reader = 0;
 
-QUEUE *q_xmit = NULL;
+MPSC *q_xmit = NULL;
+MPSC *q_urgent = NULL;		/* Sent before anything in q_xmit */
+SLAB *xmsg_slab = NULL;		/* All XMSGs, from any thread */
+
+int direct_delivery = 0;	/* Messages pushed as +CMT, not stored */
+int cnma_required = 0;		/* +CMT must be acknowledged with +CNMA */
+
+char *caps_path = NULL;		/* Cache of detected modem capabilities */
+int modem_caps = 0;
+int modem_caps_known = 0;
+
+#define MODEM_CAP_CHAIN		0x01	/* Semicolon chained commands */
+#define MODEM_CAP_CPMS		0x02	/* +CPMS? reports the storage */
+#define MODEM_CAP_DIRECT	0x04	/* +CNMI=2,2 (direct delivery) */
+
+#define MODEM_CAP_RETRY		(24*60*60)	/* Seconds before a missing one is tried again */
+#define DIRECT_RETRY_MS		60000	/* +CNMI=2,2 again after a +CMS/+CME ERROR */
+
+static char modem_ident[128];	/* ATI answer, the modem the caps belong to */
+static char caps_ident[128];	/* The modem in the cache */
+static int modem_ident_pending = 0;	/* Lines without a prefix are the ATI answer */
+static int modem_error_ext = 0;	/* Last error was +CMS/+CME ERROR, not ERROR */
+static int modem_chain_failed = 0;	/* The chained settings got an ERROR */
+static int modem_single_failed = 0;
+static int direct_retry_timer = 0;
+
+#define MODEM_PROBE_TIMEOUT	100	/* First probe, doubled for each retry */
+#define MODEM_PROBE_MAX		2000
+
+int modem_ready = 0;		/* Init done, q_xmit may be sent */
+static char *modem_pin = NULL;
+static char modem_cpin[64];	/* Last +CPIN: status */
+static int modem_probe_ms = 0;
+static int modem_probes = 0;
+static int modem_probing = 0;	/* Waiting for a probe to succeed */
+static int modem_probe_failed = 0;
+static int modem_probe_csq = 0;	/* +CSQ seen since the probe was sent */
+static int modem_probe_timer = 0;	/* Next probe after a failed one */
+static int modem_gen = 0;		/* Init sequences started */
+static struct timespec modem_t0;
+
+SIMSTORE sim;			/* Message storage indices in use */
+static int sim_reported = 0;	/* Messages stored, according to +CPMS */
+static int sim_scan_next = 0;	/* Next index to read at startup */
+static int sim_scan_left = 0;	/* Stored messages not found yet */
+static int sim_scan_pending = 0;	/* Reads queued in the current chunk */
+
+#define SIM_SCAN_CHUNK 8
+
+EVLOOP *loop = NULL;
+POOL *workers = NULL;
+int nworkers = WORKERS;
+char *ev_type = NULL;
+
+char *journal_path = NULL;
+
+char *capture_path = CAPTURE_PATH;
+static CAPTURE *capture = NULL;		/* Modem traffic, toggled with SIGUSR2 */
+char *trace_path = NULL;
+static TRACE *trace = NULL;		/* Accepted submissions */
+char *replay_path = NULL;		/* Replaying a capture instead */
+char *simulate_path = NULL;		/* Simulating a trace instead */
+static VMODEM *vmodem = NULL;		/* ... with a modeled modem */
+static int sim_cmd_ms = VM_CMD_MS;
+static int sim_send_ms = VM_SEND_MS;
+JOURNAL *journal = NULL;
 
 char *commands_path = NULL;
 char *userauth_path = NULL;
+char *image_path = NULL;
+char *groups_path = NULL;
+
+pthread_mutex_t config_mtx;
 
 pthread_mutex_t ecmd_mtx;
-ECMD *ev = NULL;
-int es = 0;
-int ec = 0;
+DB *cmd_db = NULL;
 
 
-volatile XMSG *resp_msg = NULL;
-pthread_mutex_t resp_mtx;
-pthread_cond_t resp_cv;
+/* The command the modem is currently executing */
+static XMSG *xmit_cur = NULL;
+static XMSG *xmit_retry = NULL;	/* A message to send again, before q_xmit */
+static int xmit_timer = 0;
+static int xmit_data_timer = 0;
+static int xmit_draining = 0;
+static int main_exit = 0;
 
 
 void
@@ -155,37 +259,121 @@ error(const char *msg, ...)
 }
 
 
-int
-_send_sms(const char *phone,
-	  const char *msg)
+/*
+ * A modem command from the slab, owned by the caller until it is
+ * queued and then by the loop, which frees it when it is done.
+ * NULL if the command is too long.
+ */
+static XMSG *
+xmsg_cmd(const char *cmd,
+	 void (*ack)(int rc, void *misc),
+	 void *misc)
 {
     XMSG *xp;
-    char buf[1024];
-    int len;
+    size_t len;
+
+
+    len = strlen(cmd);
+    if (len >= XMSG_CMD_SIZE)
+    {
+	errno = E2BIG;
+	return NULL;
+    }
+    
+    xp = slab_alloc(xmsg_slab);
+    if (!xp)
+	return NULL;
+
+    memcpy(xp->cmd, cmd, len+1);
+    xp->data = NULL;
+    xp->ack = ack;
+    xp->misc = misc;
+    xp->timeout = 0;
+    xp->tries = 0;
+    xp->queued = 0;
+    return xp;
+}
+
+
+static void
+xmsg_free(XMSG *xp)
+{
+    slab_free(xmsg_slab, xp);
+}
+
+
+static XMSG *
+sms_create(const char *phone,
+	   const char *msg)
+{
+    XMSG *xp;
+    char buf[1024], pbuf[PHONE_MAX];
+    size_t len;
     
 
+    if (phone_normalize(phone, pbuf, sizeof(pbuf)) >= 0)
+	phone = pbuf;
+    
     if (debug)
 	fprintf(stderr, "SEND_SMS: Phone=%s, Msg=%s\n", phone, msg);
 	
-    xp = malloc(sizeof(*xp));
-    if (!xp)
-	return -1;
-
     snprintf(buf, sizeof(buf), "+CMGS=\"%s\"", phone);
-    xp->cmd = s_dup(buf);
+    xp = xmsg_cmd(buf, NULL, NULL);
+    if (!xp)
+	return NULL;
 
     buf[0] = '\0';
     latin1_to_gsm(msg, buf, sizeof(buf));
     
-    xp->data = s_dup(buf);
-    len = strlen(xp->data);
+    len = strlen(buf);
     if (len > MAX_SMS_MESSAGE)
-	xp->data[MAX_SMS_MESSAGE] = 0;
+	len = MAX_SMS_MESSAGE;
+    memcpy(xp->text, buf, len);
+    xp->text[len] = '\0';
+    xp->data = xp->text;
     
-    xp->ack = NULL;
-    xp->misc = NULL;
+    xp->queued = loop ? ev_now(loop) : 0;
+
+    return xp;
+}
+
+
+/* Queue a command for the modem. May be called from any thread */
+static int
+xmit_put(XMSG *xp)
+{
+    mpsc_put(q_xmit, &xp->node);
+    return 0;
+}
+
+
+/* The loop has found the queues empty and is waiting for more */
+static void
+xmit_wake(void *misc)
+{
+    if (loop)
+	ev_wakeup(loop);
+}
+
+
+int
+_send_sms(const char *phone,
+	  const char *msg)
+{
+    XMSG *xp;
+
+
+    xp = sms_create(phone, msg);
+    if (!xp)
+	return -1;
+
+    if (xmit_put(xp) < 0)
+    {
+	xmsg_free(xp);
+	return -1;
+    }
     
-    return queue_put(q_xmit, xp);
+    return 0;
 }
 
 
@@ -199,11 +387,96 @@ do_send(USER *up, void *xp)
 }
 
 
+/* Messages for a group send, one per distinct phone number */
+typedef struct group_send
+{
+    const char *msg;
+    XMSG **xv;
+    int xc;
+    int xs;
+    int failed;
+} GROUP_SEND;
+
+
+static int
+group_send_phone(const char *phone,
+		 void *xp)
+{
+    GROUP_SEND *gsp = (GROUP_SEND *) xp;
+
+
+    if (gsp->xc == gsp->xs)
+    {
+	XMSG **nxv = realloc(gsp->xv, sizeof(XMSG *) * (gsp->xs + 16));
+
+	if (!nxv)
+	    goto Fail;
+	gsp->xv = nxv;
+	gsp->xs += 16;
+    }
+
+    gsp->xv[gsp->xc] = sms_create(phone, gsp->msg);
+    if (!gsp->xv[gsp->xc])
+	goto Fail;
+    
+    gsp->xc++;
+    return 0;
+
+  Fail:
+    gsp->failed = 1;
+    return -1;
+}
+
+
+/*
+ * Send to all recipients of a group with a single enqueue. Returns -2
+ * if 'name' is not a group.
+ */
+static int
+send_sms_group(const char *name,
+	       const char *msg)
+{
+    GROUP_SEND gs;
+    int i, rc;
+
+
+    /* A no-op unless the users have changed since the last time */
+    if (groups_resolve(users_name2pphone, users_generation()) < 0)
+	return -1;
+    
+    memset(&gs, 0, sizeof(gs));
+    gs.msg = msg;
+    
+    rc = groups_foreach(name, group_send_phone, &gs);
+    if (rc < 0)
+	return -2;
+
+    if (gs.failed)
+	rc = -1;
+    else
+    {
+	rc = 0;
+	for (i = 0; i < gs.xc-1; i++)
+	    gs.xv[i]->node.next = &gs.xv[i+1]->node;
+	if (gs.xc > 0)
+	    mpsc_put_list(q_xmit, &gs.xv[0]->node, &gs.xv[gs.xc-1]->node);
+    }
+
+    if (rc < 0)
+	for (i = 0; i < gs.xc; i++)
+	    xmsg_free(gs.xv[i]);
+    free(gs.xv);
+    
+    return rc;
+}
+
+
 int
 send_sms(const char *to,
 	 const char *msg)
 {
     char *phone;
+    int rc;
 
 
     if (!to || !msg)
@@ -212,113 +485,65 @@ send_sms(const char *to,
     if (strcmp(to, "*") == 0)
 	return users_foreach(do_send, (void *) msg);
 
-    if (*to == '+' || isdigit(*to))
+    if (*to == '+' || isdigit((unsigned char) *to))
 	return _send_sms(to, msg);
+
+    rc = send_sms_group(to, msg);
+    if (rc != -2)
+	return rc;
     
     phone = users_name2phone(to);
     if (!phone)
 	return -1;
     
-    return _send_sms(phone, msg);
+    rc = _send_sms(phone, msg);
+    free(phone);
+    return rc;
 }
 
 
 
 
 int
-ecmd_load(const char *ecmdpath)
+ecmd_load_db(DB *dbp)
 {
-    FILE *fp;
-    char buf[1024], *name, *user, *path, *argv;
-    int level;
+    int n;
 
 
-    if (debug)
-	fprintf(stderr, "ECMD_LOAD: Start\n");
+    if (!dbp)
+	return -1;
 
     pthread_mutex_lock(&ecmd_mtx);
-    if (ev)
-	free(ev);
+    db_free(cmd_db);
+    cmd_db = dbp;
+    n = db_count(cmd_db);
+    pthread_mutex_unlock(&ecmd_mtx);
 
-    ec = 0;
-    ev = malloc(sizeof(*ev)*(es = 128));
-    if (!ev)
-    {
-	pthread_mutex_unlock(&ecmd_mtx);
-	if (debug)
-	    fprintf(stderr, "ECMD_LOAD: malloc failed: %s\n", strerror(errno));
-	return -1;
-    }
-    
-    fp = fopen(ecmdpath, "r");
-    if (!fp)
-    {
-	pthread_mutex_unlock(&ecmd_mtx);
-	if (debug)
-	    fprintf(stderr, "ECMD_LOAD: fopen (%s) failed: %s\n", ecmdpath, strerror(errno));
-	return -1;
-    }
-    
-    while (fgets(buf, sizeof(buf), fp))
-    {
-	char *tmp, *endp;
-	
-	name = strtok_r(buf, " \t\r\n", &endp);
-	if (!name || *name == '#')
-	    continue;
-	
-	tmp = strtok_r(NULL, " \t\r\n", &endp);
-	if (!tmp)
-	    continue;
-	if (sscanf(tmp, "%u", &level) != 1)
-	{
-	    if (strcmp(tmp, "*") == 0 || strcmp(tmp, "all") == 0)
-		level = 0;
-	    else if (strcmp(tmp, "phone") == 0)
-		level = 1;
-	    else if (strcmp(tmp, "login") == 0)
-		level = 2;
-	    else
-		level = 3;
-	}
-	
-	user = strtok_r(NULL, " \t\r\n", &endp);
-	if (!user)
-	    continue;
+    return n;
+}
 
-	path = strtok_r(NULL, " \t\r\n", &endp);
-	if (!path)
-	    continue;
 
-	argv = strtok_r(NULL, "\r\n", &endp);
-	if (!argv)
-	    continue;
+int
+ecmd_load(const char *ecmdpath)
+{
+    DB *dbp;
 
-	while (isspace(*argv))
-	    ++argv;
-	
-	if (ec == es)
-	    ev = realloc(ev, sizeof(*ev)*(es += 128));
 
-	if (debug > 1)
-	    fprintf(stderr, "ECMD_LOAD: Name=%s, Level=%d, Path=%s, Argv=%s\n", name, level, path, argv);
-	
-	ev[ec].name = s_dup(name);
-	ev[ec].level = level;
-	ev[ec].user = s_dup(user);
-	ev[ec].path = s_dup(path);
-	ev[ec].argv  = s_dup(argv);
-	++ec;
-    }
+    if (debug)
+	fprintf(stderr, "ECMD_LOAD: Start\n");
 
-    fclose(fp);
+    dbp = db_compile(DB_SECT_COMMANDS, ecmdpath);
+    if (!dbp)
+    {
+	if (debug)
+	    fprintf(stderr, "ECMD_LOAD: %s: Failed\n", ecmdpath);
+	return -1;
+    }
 
-    pthread_mutex_unlock(&ecmd_mtx);
-    
     if (debug)
 	fprintf(stderr, "ECMD_LOAD: Stop\n");
-    
-    return ec;
+
+    return ecmd_load_db(dbp);
 }
 
 
@@ -328,22 +553,28 @@ int
 ecmd_list(UCRED *ucp,
 	  BUFFER *out)
 {
-    int i;
+    const DBCMD *cp;
+    const char *name;
+    int i, n;
 
     pthread_mutex_lock(&ecmd_mtx);
-    for (i = 0; i < ec; i++)
+    n = db_count(cmd_db);
+    for (i = 0; i < n; i++)
     {
-	if (users_valid_command(ucp, ev[i].name) &&
-	    ucp->level >= ev[i].level)
+	cp = db_command(cmd_db, i);
+	name = db_str(cmd_db, cp->name);
+	
+	if (users_valid_command(ucp, name) &&
+	    ucp->level >= cp->level)
 	{
 	    buf_puts(out, ",");
-	    buf_puts(out, ev[i].name);
+	    buf_puts(out, name);
 	}
     }
 
     pthread_mutex_unlock(&ecmd_mtx);
     
-    return ec;
+    return n;
 }
 
 struct ecmd_escapes {
@@ -351,6 +582,7 @@ struct ecmd_escapes {
     const char *phone;
     const char *date;
     const char *user;
+    ARENA *arena;
 };
     
 
@@ -364,6 +596,7 @@ ecmd_esc_handler(const char *esc,
     const char *rv = NULL;
 
     
+    /* The argv_getm_arena() strings are returned as they are */
     if (strcmp(esc, "P") == 0 || strcmp(esc, "phone") == 0)
 	rv = ep->phone;
 
@@ -374,13 +607,13 @@ ecmd_esc_handler(const char *esc,
 	rv = ep->user;
 
     else if (strcmp(esc, "*") == 0)
-	rv = argv_getm(ep->argv, 1, 0);
+	return argv_getm_arena(ep->arena, ep->argv, 1, 0);
 
     else if (sscanf(esc, "%u-%u%c", &start, &stop, &c) == 2)
-	rv = argv_getm(ep->argv, start, stop);
+	return argv_getm_arena(ep->arena, ep->argv, start, stop);
 
     else if (sscanf(esc, "-%u%c", &stop, &c) == 2)
-	rv = argv_getm(ep->argv, 1, stop);
+	return argv_getm_arena(ep->arena, ep->argv, 1, stop);
 
     else
     {
@@ -389,10 +622,10 @@ ecmd_esc_handler(const char *esc,
 	if (rc == 1)
 	    rv = argv_get(ep->argv, start);
 	else if (rc == 2 && c == '-')
-	    rv = argv_getm(ep->argv, start, 0);
+	    return argv_getm_arena(ep->arena, ep->argv, start, 0);
     }
 
-    return s_dup(rv);
+    return arena_strdup(ep->arena, rv);
 }
 
 
@@ -404,6 +637,7 @@ ecmd_run(UCRED *ucp,
 	 BUFFER *out)
 {
     struct ecmd_escapes edata;
+    const DBCMD *ecp;
     int i, pid, rc;
     FILE *fp_in = NULL, *fp_out = NULL;
     char **cmd_argv = NULL;
@@ -412,6 +646,7 @@ ecmd_run(UCRED *ucp,
     int uid = 60001, gid = 60001;
     struct passwd pb, *pp;
     char buf[256];
+    ARENA *ap = out->arena;	/* The command line is from the same arena */
 	
     
     
@@ -422,6 +657,7 @@ ecmd_run(UCRED *ucp,
     edata.user = ucp->name;
     edata.phone = ucp->phone;
     edata.date = date;
+    edata.arena = ap;
 
     if (debug)
     {
@@ -432,23 +668,22 @@ ecmd_run(UCRED *ucp,
     }
     
     pthread_mutex_lock(&ecmd_mtx);
-    for (i = 0; i < ec && strcasecmp(argv[0], ev[i].name) != 0; i++)
-	;
-    if (i >= ec)
+    ecp = db_command(cmd_db, db_command_byname(cmd_db, argv[0]));
+    if (!ecp)
     {
 	pthread_mutex_unlock(&ecmd_mtx);
 	return NULL;
     }
 
-    if (!(users_valid_command(ucp, ev[i].name) && ev[i].level <= ucp->level))
+    if (!(users_valid_command(ucp, db_str(cmd_db, ecp->name)) && ecp->level <= ucp->level))
     {
 	pthread_mutex_unlock(&ecmd_mtx);
 	return NULL;
     }
 	
-    cmd_argv = argv_create(ev[i].argv, ecmd_esc_handler, (void *) &edata);
-    path = s_dup(ev[i].path);
-    user = s_dup(ev[i].user);
+    cmd_argv = argv_create_arena(ap, db_str(cmd_db, ecp->argv), ecmd_esc_handler, (void *) &edata);
+    path = arena_strdup(ap, db_str(cmd_db, ecp->path));
+    user = arena_strdup(ap, db_str(cmd_db, ecp->user));
     
     pthread_mutex_unlock(&ecmd_mtx);
 
@@ -501,9 +736,11 @@ ecmd_run(UCRED *ucp,
     fclose(fp_in);
     fclose(fp_out);
     if (user)
-	free(user);
+	arena_free(ap, user);
     if (path)
-	free(path);
+	arena_free(ap, path);
+    if (cmd_argv && !ap)
+	argv_destroy(cmd_argv);
 
     if (debug)
 	fprintf(stderr, "ECMD_RUN: Command output: %s\n", buf_getall(out));
@@ -519,720 +756,2699 @@ ecmd_run(UCRED *ucp,
     if (fp_out)
 	fclose(fp_out);
     if (user)
-	free(user);
+	arena_free(ap, user);
     if (path)
-	free(path);
+	arena_free(ap, path);
+    if (cmd_argv && !ap)
+	argv_destroy(cmd_argv);
     return NULL;
 }
 
 
-void *
-ser_xmit_thread(void *tap)
-{
-    XMSG *p;
+static void xmit_start(EVLOOP *lp);
+static void modem_probe_ack(int rc, void *misc);
+static void sim_done(EVLOOP *lp, XMSG *xp, int rc);
+static void modem_reinit(const char *why);
 
 
-    if (debug)
-	fprintf(stderr, "SER_XMIT_THREAD: Starting\n");
+/*
+ * All output to the modem goes through here, each AT command line
+ * and each payload as one write.
+ */
+static void
+ser_write(EVLOOP *lp,
+	  const struct iovec *iov,
+	  int iovcnt)
+{
+    if (vmodem)
+    {
+	vm_writev(vmodem, iov, iovcnt);
+	return;
+    }
+    
+    /* Replaying - there is no modem */
+    if (ser_fd < 0)
+	return;
     
-    while ((p = (XMSG *) queue_get(q_xmit)) != NULL)
+    if (capture)
+	capture_recordv(capture, CAPTURE_TO_MODEM, iov, iovcnt);
+    
+    if (ev_writev(lp, ser_fd, iov, iovcnt) < 0)
     {
-	pthread_mutex_lock(&resp_mtx);
-	while (resp_msg != NULL)
-	    pthread_cond_wait(&resp_cv, &resp_mtx);
-	resp_msg = p;
-	pthread_mutex_unlock(&resp_mtx);
-	pthread_cond_signal(&resp_cv);
+	if (!debug)
+	    syslog(LOG_ERR, "%s: Write to modem failed: %m", serial_device);
+	else
+	    fprintf(stderr, "SER_WRITE: %s: Write failed: %s\n", serial_device, strerror(errno));
+    }
+}
 
-	if (debug > 1)
-	    fprintf(stderr, "XMIT: MSG: %s, DATA: %s\n", p->cmd, p->data ? p->data : "<null>");
 
-	fprintf(ser_w_fp, "AT%s\r", p->cmd);
-	fflush(ser_w_fp);
+/*
+ * Finish the current modem transaction. The transaction owns its
+ * XMSG, which is freed here after the acknowledge callback.
+ *
+ * A message that was lost (rc < 0: timed out or the modem restarted)
+ * or refused with a +CMS ERROR is kept and sent again, ahead of the
+ * queue once the modem is set up, up to XMIT_RETRIES times. One that
+ * did go out before a lost OK may then be sent twice.
+ */
+static void
+xmit_done(EVLOOP *lp,
+	  int rc)
+{
+    XMSG *xp = xmit_cur;
 
-	if (p->data)
-	{
-	    /* XXX: Should wait for ">" */
-	    sleep(1);
-	    fputs(p->data, ser_w_fp);
-	    putc(0x1A, ser_w_fp);
-	    fflush(ser_w_fp);
-	}
 
+    if (!xp)
+    {
+	if (debug)
+	    fprintf(stderr, "XMIT: Unsolicited final response (rc=%d)\n", rc);
+	return;
     }
 
-    if (debug)
-	fprintf(stderr, "SER_XMIT_THREAD: Stopping\n");
-    return NULL;
+    xmit_cur = NULL;
+    
+    if (xmit_timer)
+	ev_del_timer(lp, xmit_timer);
+    if (xmit_data_timer)
+	ev_del_timer(lp, xmit_data_timer);
+    xmit_timer = xmit_data_timer = 0;
+
+    if (xp->data && (rc < 0 || (rc && modem_error_ext)) && xp->tries < XMIT_RETRIES)
+    {
+	xp->tries++;
+	if (!debug)
+	    syslog(LOG_NOTICE, "Sending message again (try %d of %d): AT%s",
+		   xp->tries, XMIT_RETRIES, xp->cmd);
+	else
+	    fprintf(stderr, "XMIT: Retry %d of %d: AT%s\n", xp->tries, XMIT_RETRIES, xp->cmd);
+	
+	xmit_retry = xp;
+	xmit_start(lp);
+	return;
+    }
+    
+    if (vmodem)
+	sim_done(lp, xp, rc);
+    
+    if (xp->ack)
+	xp->ack(rc, xp->misc);
+    xmsg_free(xp);
+
+    xmit_start(lp);
 }
 
 
-int
-read_sms(int id)
+static void
+xmit_timeout(EVLOOP *lp,
+	     void *misc)
 {
-    XMSG *xp;
-    char buf[1024];
+    int probe = (xmit_cur && xmit_cur->ack == modem_probe_ack);
+    struct iovec iov;
+
+    
+    xmit_timer = 0;
     
+    if (!debug)
+	syslog(LOG_WARNING, "Modem command timed out: AT%s", xmit_cur ? xmit_cur->cmd : "?");
+    else
+	fprintf(stderr, "XMIT: Timeout: AT%s\n", xmit_cur ? xmit_cur->cmd : "?");
 
-    xp = malloc(sizeof(*xp));
-    if (!xp)
-	return -1;
+    /* The modem may have been reset or hung - set it up before anything else */
+    if (!probe)
+	modem_reinit("Command timed out");
 
-    snprintf(buf, sizeof(buf), "+CMGR=%u", id);
-    xp->cmd = s_dup(buf);
-    xp->data = NULL;
-    xp->ack = NULL;
-    xp->misc = NULL;
+    /* Get the modem out of a half entered message before the next command */
+    iov.iov_base = "\033";
+    iov.iov_len = 1;
+    ser_write(lp, &iov, 1);
+    
+    xmit_done(lp, -1);
+}
+
+
+/* Send the payload of the current command */
+static void
+xmit_data(EVLOOP *lp,
+	  void *misc)
+{
+    struct iovec iov[2];
 
-    return queue_put(q_xmit, xp);
+    
+    xmit_data_timer = 0;
+    
+    if (!xmit_cur || !xmit_cur->data)
+	return;
+    
+    /* Payload and terminator in one write */
+    iov[0].iov_base = xmit_cur->data;
+    iov[0].iov_len = strlen(xmit_cur->data);
+    iov[1].iov_base = "\032";
+    iov[1].iov_len = 1;
+    ser_write(lp, iov, 2);
 }
 
-int
-list_sms(char *type)
+
+/* Start the next queued modem command, unless one is in progress */
+static void
+xmit_start(EVLOOP *lp)
 {
-    XMSG *xp;
-    char buf[1024];
+    struct iovec iov[3];
+    XMSG *p;
+
+
+    if (xmit_cur)
+	return;
+
+    /* Only the init sequence (and acks) until the modem is ready */
+    p = (XMSG *) mpsc_get_or_park(q_urgent);
+    if (!p && modem_ready && xmit_retry)
+    {
+	p = xmit_retry;
+	xmit_retry = NULL;
+    }
+    if (!p && modem_ready)
+	p = (XMSG *) mpsc_get_or_park(q_xmit);
+    if (!p)
+    {
+	if (xmit_draining)
+	    ev_stop(lp);
+	return;
+    }
+
+    xmit_cur = p;
     
+    if (debug > 1)
+	fprintf(stderr, "XMIT: MSG: %s, DATA: %s\n", p->cmd, p->data ? p->data : "<null>");
 
-    xp = malloc(sizeof(*xp));
-    if (!xp)
-	return -1;
+    iov[0].iov_base = "AT";
+    iov[0].iov_len = 2;
+    iov[1].iov_base = p->cmd;
+    iov[1].iov_len = strlen(p->cmd);
+    iov[2].iov_base = "\r";
+    iov[2].iov_len = 1;
+    ser_write(lp, iov, 3);
+
+    /* The text is sent on the "> " prompt */
+    if (p->data)
+	xmit_data_timer = ev_add_timer(lp, XMIT_DATA_DELAY, xmit_data, NULL);
+
+    xmit_timer = ev_add_timer(lp, p->timeout ? p->timeout : serial_timeout, xmit_timeout, NULL);
+}
 
-    snprintf(buf, sizeof(buf), "+CMGL=\"%s\"", type);
-    xp->cmd = s_dup(buf);
-    xp->data = NULL;
-    xp->ack = NULL;
-    xp->misc = NULL;
 
-    return queue_put(q_xmit, xp);
+static void
+xmit_wakeup(EVLOOP *lp,
+	    void *misc)
+{
+    xmit_start(lp);
 }
 
 
 int
-select_charset(char *type)
+read_sms(int id)
 {
     XMSG *xp;
-    char buf[1024];
+    char buf[XMSG_CMD_SIZE];
     
 
-    xp = malloc(sizeof(*xp));
+    if (snprintf(buf, sizeof(buf), "+CMGR=%u", id) >= (int) sizeof(buf))
+	return -1;
+    
+    xp = xmsg_cmd(buf, NULL, NULL);
     if (!xp)
 	return -1;
 
-    snprintf(buf, sizeof(buf), "+CSCS=\"%s\"", type);
-    xp->cmd = s_dup(buf);
-    xp->data = NULL;
-    xp->ack = NULL;
-    xp->misc = NULL;
-
-    return queue_put(q_xmit, xp);
+    return xmit_put(xp);
 }
+
 int
-send_pin(char *pin)
+list_sms(char *type)
 {
     XMSG *xp;
-    char buf[1024];
+    char buf[XMSG_CMD_SIZE];
     
 
-    xp = malloc(sizeof(*xp));
+    if (snprintf(buf, sizeof(buf), "+CMGL=\"%s\"", type) >= (int) sizeof(buf))
+	return -1;
+    
+    xp = xmsg_cmd(buf, NULL, NULL);
     if (!xp)
 	return -1;
 
-    snprintf(buf, sizeof(buf), "+CPIN=%s", pin);
-    xp->cmd = s_dup(buf);
-    xp->data = NULL;
-    xp->ack = NULL;
-    xp->misc = NULL;
+    return xmit_put(xp);
+}
+
 
-    return queue_put(q_xmit, xp);
+static int
+xmit_put_urgent(XMSG *xp)
+{
+    mpsc_put(q_urgent, &xp->node);
+    return 0;
 }
 
+
+/* Acknowledge a directly delivered message (+CMT), ahead of the queue */
 int
-delete_sms(int id, int mode)
+ack_sms(void)
 {
     XMSG *xp;
-    char buf[1024];
-    
 
-    xp = malloc(sizeof(*xp));
+    
+    xp = xmsg_cmd("+CNMA", NULL, NULL);
     if (!xp)
 	return -1;
 
-    snprintf(buf, sizeof(buf), "+CMGD=%u,%u", id, mode);
-    xp->cmd = s_dup(buf);
-    xp->data = NULL;
-    xp->ack = NULL;
-    xp->misc = NULL;
-
-    return queue_put(q_xmit, xp);
+    return xmit_put_urgent(xp);
 }
 
-static int
-cmd_users(USER *up, void *xp)
-{
-    BUFFER *bp = (BUFFER *) xp;
 
-    if (up->cphone)
-    {
-	buf_puts(bp, up->name);
-	buf_putc(bp, ' ');
-	buf_puts(bp, up->cphone);
-	buf_putc(bp, '\n');
-    }
-    return 0;
-}
+static struct
+{
+    const char *name;
+    int cap;
+    time_t when;	/* Found missing */
+} modem_capv[] =
+{
+    { "chain", MODEM_CAP_CHAIN, 0 },
+    { "cpms", MODEM_CAP_CPMS, 0 },
+    { "direct", MODEM_CAP_DIRECT, 0 },
+    { NULL, 0, 0 }
+};
 
-#if !HAVE_LOADAVG
-int
-getloadavg(double lav[],
-           int nlav) {
-  errno = ENOSYS;
-  return -1;
-}
-#endif
 
-int
-run_message(const char *msg,
-	    const char *phone,
-	    const char *date)
+/* True if the modem is known not to support 'cap' */
+static int
+modem_cap_missing(int cap)
 {
-    char tmpbuf[1024], *cp, **argv, **sargv;
-    int i, len;
-    BUFFER in, out;
-    UCRED *ucp;
-    
-    
-    ucp = users_get_creds(phone);
-    if (!ucp)
-	return -1;
-    
-    buf_init(&in);
-    buf_init(&out);
+    return (modem_caps_known & cap) && !(modem_caps & cap);
+}
 
-    cp = s_dup(msg);
-    i = strcspn(cp, "\r\n");
-    if (i >= 0)
-	cp[i++] = '\0';
 
-    while (cp[i] && isspace(cp[i]))
-	++i;
-    
-    if (!debug)
-	syslog(LOG_INFO, "Date=%s, Phone=%s, User=%s, Level=%d: %s",
-	       date, ucp->phone, ucp->name ? ucp->name : "<unknown>", ucp->level, cp);
-    else
-	fprintf(stderr, "RUN_MSG: Date=%s, Phone=%s, User=%s, Level=%d: %s\n",
-		date, ucp->phone, ucp->name ? ucp->name : "<unknown>", ucp->level, cp);
-    
-    buf_puts(&in, cp+i);
-    sargv = argv = argv_create(cp, NULL, NULL);
-    free(cp);
+/*
+ * Load the capabilities detected at an earlier start, if cached. They
+ * are checked against the modem with modem_caps_check() once it is up.
+ */
+static void
+modem_caps_load(void)
+{
+    FILE *fp;
+    char buf[256], name[64];
+    long when;
+    int i, v, n;
 
-    if (!argv || !argv[0])
-    {
-	argv_destroy(argv);
-	buf_clear(&in);
-	buf_clear(&out);
-	users_free_creds(ucp);
-	return -1;
-    }
 
-    if (argv[0] && (len = strlen(argv[0])) > 2 &&
-	argv[0][0] == '[' && argv[0][len-1] == ']' &&
-	ucp->name)
-    {
-	argv[0][len-1] = '\0';
-	if (!users_login(ucp, ucp->name, argv[0]+1))
-	{
-	    buf_puts(&out, "Invalid password");
-	    goto End;
-	}
+    if (!caps_path || (fp = fopen(caps_path, "r")) == NULL)
+	return;
 
-	++argv;
-    }
-    
-    if (strcasecmp(argv[0], "Help") == 0)
-    {
-	buf_puts(&out, "Help,Whoami,Login");
-	if (ucp->level > 0)
-	    buf_puts(&out, ",LoadAvg,Users");
-	if (ucp->level > 1)
-	    buf_puts(&out, ",Logout");
-	ecmd_list(ucp, &out);
-	goto End;
-    }
-    
-    if (strcasecmp(argv[0], "Whoami") == 0)
+    while (fgets(buf, sizeof(buf), fp))
     {
-	buf_puts(&out, ucp->phone);
-	if (ucp->level > 0)
+	if (strncmp(buf, "modem ", 6) == 0)
 	{
-	    buf_puts(&out, " ");
-	    if (ucp->level < 2)
-		buf_puts(&out, "(");
-	    buf_puts(&out, ucp->name);
-	    if (ucp->level < 2)
-		buf_puts(&out, ")");
+	    buf[strcspn(buf, "\n")] = '\0';
+	    snprintf(caps_ident, sizeof(caps_ident), "%s", buf+6);
+	    continue;
 	}
-	goto End;
-    }
+	
+	/* Caches without the time are from older versions, retried */
+	when = 0;
+	if ((n = sscanf(buf, "%63s %d %ld", name, &v, &when)) < 2)
+	    continue;
+	
+	for (i = 0; modem_capv[i].name && strcmp(modem_capv[i].name, name) != 0; i++)
+	    ;
+	if (!modem_capv[i].name)
+	    continue;
 
-    if (strcasecmp(argv[0], "Login") == 0)
-    {
-	if (!argv[1] || !argv[2] || !users_login(ucp, argv[1], argv[2]))
-	{
-	    if (ucp->name)
-		buf_puts(&out, "Login denied!");
-	}
+	modem_caps_known |= modem_capv[i].cap;
+	modem_capv[i].when = when;
+	if (v)
+	    modem_caps |= modem_capv[i].cap;
 	else
-	    buf_puts(&out, "Login OK");
-	goto End;
+	    modem_caps &= ~modem_capv[i].cap;
     }
+    fclose(fp);
 
-    if (ucp->level > 1 && strcasecmp(argv[0], "Logout") == 0)
+    if (debug)
+	fprintf(stderr, "MODEM_CAPS: Loaded %s (modem \"%s\", known %02x, supported %02x)\n",
+		caps_path, caps_ident, modem_caps_known, modem_caps);
+}
+
+
+static void
+modem_caps_save(void)
+{
+    FILE *fp;
+    int i;
+
+
+    if (!caps_path)
+	return;
+
+    fp = fopen(caps_path, "w");
+    if (!fp)
     {
-	if (users_logout(ucp))
-	    buf_puts(&out, "Logout OK");
+	if (!debug)
+	    syslog(LOG_WARNING, "%s: Modem capabilities not saved: %m", caps_path);
 	else
-	{
-	    if (ucp->name)
-		buf_puts(&out, "Logout denied!");
-	}
-	goto End;
+	    fprintf(stderr, "MODEM_CAPS: %s: Not saved: %s\n", caps_path, strerror(errno));
+	return;
     }
 
-    if (ucp->level > 0 && strcasecmp(argv[0], "LoadAvg") == 0)
+    fprintf(fp, "modem %s\n", caps_ident);
+    for (i = 0; modem_capv[i].name; i++)
+	if (modem_caps_known & modem_capv[i].cap)
+	    fprintf(fp, "%s %d %ld\n", modem_capv[i].name,
+		    (modem_caps & modem_capv[i].cap) ? 1 : 0,
+		    (long) modem_capv[i].when);
+    fclose(fp);
+}
+
+
+/*
+ * Forget the cached capabilities if they belong to another modem, and
+ * the ones found missing more than MODEM_CAP_RETRY seconds ago, so
+ * that a firmware upgrade or a passing failure is not kept forever.
+ */
+static void
+modem_caps_check(void)
+{
+    time_t now = time(NULL);
+    int i, old = modem_caps_known;
+
+    
+    if (strcmp(caps_ident, modem_ident) != 0)
     {
-	double loadavg[3];
+	if (modem_caps_known && debug)
+	    fprintf(stderr, "MODEM_CAPS: Modem changed (\"%s\", was \"%s\"), probing again\n",
+		    modem_ident, caps_ident);
 	
-	if (getloadavg(loadavg, 3) < 0)
-          buf_puts(&out, "No load averages");
-        else {
-          snprintf(tmpbuf, sizeof(tmpbuf), "%.2f/%.2f/%.2f",
-                   loadavg[0], loadavg[1], loadavg[2]);
-          buf_puts(&out, tmpbuf);
-        }
-        goto End;
+	snprintf(caps_ident, sizeof(caps_ident), "%s", modem_ident);
+	modem_caps_known = modem_caps = 0;
+	modem_caps_save();
+	return;
     }
 
-    if (ucp->level > 0 && strcasecmp(argv[0], "Users") == 0)
+    for (i = 0; modem_capv[i].name; i++)
+	if (modem_cap_missing(modem_capv[i].cap) &&
+	    (now - modem_capv[i].when >= MODEM_CAP_RETRY || now < modem_capv[i].when))
+	    modem_caps_known &= ~modem_capv[i].cap;
+
+    if (modem_caps_known != old)
     {
-	users_foreach(cmd_users, (void *) &out);
-	goto End;
+	if (debug)
+	    fprintf(stderr, "MODEM_CAPS: Trying missing capabilities again (known %02x)\n",
+		    modem_caps_known);
+	modem_caps_save();
     }
-
-    if (ucp->level > 0 && ecmd_run(ucp, argv, date, &in, &out) != NULL)
-	goto End;
+}
 
 
-    /* Only return an error if sent from a valid user or known phone */
-    if (ucp->level > 0)
-    {
-	buf_puts(&out, "What?\r(");
-	buf_puts(&out, msg);
-	buf_puts(&out, ")");
-    }
+/*
+ * Remember if the modem supports 'cap'. Nothing is remembered if 'ok'
+ * is negative (see modem_cap_result()).
+ */
+static void
+modem_cap(int cap,
+	  int ok)
+{
+    int old = modem_caps, i;
 
-  End:
-    cp = buf_getall(&out);
-    if (cp && *cp)
-	send_sms(phone, cp);
-    
-    buf_clear(&in);
-    buf_clear(&out);
-    users_free_creds(ucp);
-    argv_destroy(sargv);
     
-    return 0;
+    if (ok < 0 || ((modem_caps_known & cap) && !(old & cap) == !ok))
+	return;
+
+    modem_caps_known |= cap;
+    if (ok)
+	modem_caps |= cap;
+    else
+	modem_caps &= ~cap;
+
+    for (i = 0; modem_capv[i].name; i++)
+	if (modem_capv[i].cap == cap)
+	    modem_capv[i].when = ok ? 0 : time(NULL);
+    modem_caps_save();
 }
 
 
-static jmp_buf sigusr1_env;
+/*
+ * Only a plain ERROR says that a command is not supported. A +CMS or
+ * +CME ERROR is the modem or the SIM refusing it for now (not ready,
+ * busy) and tells nothing: -1.
+ */
+static int
+modem_cap_result(int rc)
+{
+    if (rc == 0)
+	return 1;
+    return modem_error_ext ? -1 : 0;
+}
+
 
-void
-sigusr1_handler(int sig)
+static void
+sim_delete_ack(int rc,
+	       void *misc)
 {
-    longjmp(sigusr1_env, 1);
+    if (rc == 0)
+	ss_clear(&sim, (int) (intptr_t) misc);
 }
 
-void *
-ser_recv_thread(void *tap)
+
+/* Delete the message at 'id' from the storage, ahead of the queue */
+int
+sim_delete(int id)
 {
-    char buf[1024], status[64], phone[128], date[128];
-    int i, id;
-    int delete_read_msgs = 0;
-    
+    XMSG *xp;
+    char buf[64];
 
-    if (debug)
-	fprintf(stderr, "SER_RECV_THREAD: Starting\n");
 
-    setjmp(sigusr1_env);
-    signal(SIGUSR1, sigusr1_handler);
-    
-    while (!abort_threads && fgets(buf, sizeof(buf), ser_r_fp) != NULL)
-    {
-	for (i = strlen(buf); i > 0 && isspace(buf[i-1]); i--)
-	    ;
+    snprintf(buf, sizeof(buf), "+CMGD=%d", id);
+    xp = xmsg_cmd(buf, sim_delete_ack, (void *) (intptr_t) id);
+    if (!xp)
+	return -1;
 
-	buf[i] = '\0';
-	
-	if (debug > 1)
-	    fprintf(stderr, "RECV: %s\n", buf);
+    return xmit_put_urgent(xp);
+}
 
-	if (sscanf(buf, "+CMTI: \"SM\",%u", &id) == 1)
-	{
-	    if (debug)
-		fprintf(stderr, "NEW INCOMING SMS #%u\n", id);
 
-	    read_sms(id);
-	}
-	
-	else if (sscanf(buf, "+CMGL: %u,\"%20[^\"]\",\"%80[^\"]\",,\"%80[^\"]\"",
-			&id, status, phone, date) == 4)
-	{
-	    if (debug)
-		fprintf(stderr, "SMS #%u FROM %s AT %s STATUS %s\n",
-			id, phone, date, status);
-	    
-	    if (fgets(buf, sizeof(buf), ser_r_fp) != NULL)
-	    {
-		char obuf[1024];
+static int
+sim_scan(void);
 
-		gsm_to_latin1(buf, obuf, sizeof(obuf));
-		if (debug)
-		    fprintf(stderr, "MESSAGE: %s\n", obuf);
+static void
+sim_scan_ack(int rc,
+	     void *misc)
+{
+    /* A restart of the scan (after a modem reset) zeroes the count */
+    if (sim_scan_pending > 0 && --sim_scan_pending == 0)
+	sim_scan();
+}
 
-		run_message(obuf, phone, date);
-		delete_read_msgs = 1;
-	    }
-	}
 
-	else if (sscanf(buf, "+CMGR: \"%20[^\"]\",\"%80[^\"]\",,\"%80[^\"]\"",
-			status, phone, date) == 3)
-	{
-	    if (debug)
-		fprintf(stderr, "SMS FROM %s AT %s STATUS %s\n",
-			phone, date, status);
-	    
-	    if (fgets(buf, sizeof(buf), ser_r_fp) != NULL)
-	    {
-		char obuf[1024];
+/*
+ * Read the next chunk of storage indices, until as many messages as
+ * +CPMS reported have been found. The next chunk is queued when the
+ * last read of this one is done, after the deletes of what it found.
+ */
+static int
+sim_scan(void)
+{
+    XMSG *xp;
+    char buf[64];
 
-		gsm_to_latin1(buf, obuf, sizeof(obuf));
-		if (debug)
-		    fprintf(stderr, "MESSAGE: %s\n", obuf);
 
-		run_message(obuf, phone, date);
-		delete_read_msgs = 1;
-	    }
-	}
+    while (sim_scan_left > 0 && sim_scan_next <= sim.total &&
+	   sim_scan_pending < SIM_SCAN_CHUNK)
+    {
+	snprintf(buf, sizeof(buf), "+CMGR=%d", sim_scan_next);
+	xp = xmsg_cmd(buf, sim_scan_ack, NULL);
+	if (!xp || xmit_put(xp) < 0)
+	    return -1;
+	
+	sim_scan_next++;
+	sim_scan_pending++;
+    }
 
-	else if (strcmp(buf, "OK") == 0 ||
-		 strcmp(buf, "ERROR") == 0)
-	{
-	    int rc = (strcmp(buf, "OK") != 0);
+    if (!sim_scan_pending && debug)
+	fprintf(stderr, "SIM_SCAN: Done (%d of %d indices read, %d messages not found)\n",
+		sim_scan_next-1, sim.total, sim_scan_left);
+    return 0;
+}
 
-	    if (debug)
-		fprintf(stderr, "ACKNOWLEDGE OF TYPE: %s (rc=%d)\n", buf, rc);
-	    
-	    if (delete_read_msgs)
-	    {
-		if (debug)
-		    fprintf(stderr, "DELETING READ MESSAGES\n");
 
-		delete_sms(1,2);
-		delete_read_msgs = 0;
-	    }
-	    
-	    pthread_mutex_lock(&resp_mtx);
-	    while (resp_msg == NULL)
-		pthread_cond_wait(&resp_cv, &resp_mtx);
-	    
-	    if (resp_msg->ack)
-	    {
-		resp_msg->ack(rc, resp_msg->misc);
-	    }
-	    if (resp_msg->data)
-		free(resp_msg->data);
-	    if (resp_msg->cmd)
-		free(resp_msg->data);
-	    free((void *) resp_msg);
-	    resp_msg = NULL;
-	    
-	    pthread_mutex_unlock(&resp_mtx);
-	    pthread_cond_signal(&resp_cv);
-	}
-	
-	else if (*buf)
-	    if (debug)
-		fprintf(stderr, "IGNORING: %s\n", buf);
+static void
+sim_cpms_ack(int rc,
+	     void *misc)
+{
+    if (rc < 0)
+	return;
+    
+    modem_cap(MODEM_CAP_CPMS, rc ? modem_cap_result(rc) : sim.total > 0);
+    
+    if (rc || sim.total <= 0)
+    {
+	/* Storage size unknown, fall back to listing everything */
+	list_sms("ALL");
+	return;
     }
 
     if (debug)
-	fprintf(stderr, "SER_RECV_THREAD: Stopping (error: %s)\n", strerror(errno));
-    return NULL;
+	fprintf(stderr, "SIM_CPMS: %d of %d used\n", sim_reported, sim.total);
+
+    sim_scan_left = sim_reported;
+    sim_scan_next = 1;
+    sim_scan_pending = 0;
+    sim_scan();
 }
 
-void *
-tty_read_thread(void *tap)
+
+/* Read the messages already in storage, starting with +CPMS? */
+int
+sim_query(void)
 {
-    char buf[256];
+    XMSG *xp;
+
+
+    if (modem_cap_missing(MODEM_CAP_CPMS))
+	return list_sms("ALL");
     
+    xp = xmsg_cmd("+CPMS?", sim_cpms_ack, NULL);
+    if (!xp)
+	return -1;
 
-    if (debug)
-	fprintf(stderr, "TTY_READ_THREAD: Starting\n");
+    if (xmit_put(xp) < 0)
+    {
+	xmsg_free(xp);
+	return -1;
+    }
+    return 0;
+}
+
+
+int
+set_direct_delivery(void);
+
+static void
+direct_retry(EVLOOP *lp,
+	     void *misc)
+{
+    direct_retry_timer = 0;
+    if (modem_ready)
+	set_direct_delivery();
+}
+
+
+static void
+direct_cnmi_ack(int rc,
+		void *misc)
+{
+    XMSG *xp;
+    int ok;
+    
+    
+    if (rc < 0)
+	return;
+    
+    ok = modem_cap_result(rc);
+    modem_cap(MODEM_CAP_DIRECT, ok);
+    
+    if (rc == 0)
+    {
+	if (debug)
+	    fprintf(stderr, "DIRECT DELIVERY: Enabled (%s)\n",
+		    cnma_required ? "acknowledged with +CNMA" : "no acknowledge");
+	return;
+    }
 
-    if (!tty_fp)
-      tty_fp = stdin;
-      
-    while (fgets(buf, sizeof(buf), tty_fp) != NULL)
+    if (ok < 0)
+    {
+	/* Refused for now (SIM not ready...) - store messages until tried again */
+	if (!debug)
+	    syslog(LOG_WARNING, "Direct SMS delivery refused, using SIM storage for now");
+	else
+	    fprintf(stderr, "DIRECT DELIVERY: Refused, using SIM storage for %d ms\n",
+		    DIRECT_RETRY_MS);
+	
+	if (!direct_retry_timer)
+	    direct_retry_timer = ev_add_timer(loop, DIRECT_RETRY_MS, direct_retry, NULL);
+    }
+    else
     {
-	char *phone, *cp, *endp;
+	/* Not supported - fall back to storing messages and +CMTI */
+	if (!debug)
+	    syslog(LOG_WARNING, "Modem does not support direct SMS delivery, using SIM storage");
+	else
+	    fprintf(stderr, "DIRECT DELIVERY: Not supported, using SIM storage\n");
 	
-	if (debug > 1)
-	    fprintf(stderr, "TTY RECV: %s\n", buf);
+	direct_delivery = 0;
+    }
+    
+    xp = xmsg_cmd("+CNMI=2,1,0,0,0", NULL, NULL);
+    if (xp)
+	mpsc_put(q_urgent, &xp->node);
+}
 
-	phone = strtok_r(buf, " \t\r\n", &endp);
-	if (!phone)
-	    continue;
 
-	cp = strtok_r(NULL, "\n\r", &endp);
-	if (!cp)
-	    continue;
+static void
+direct_csms_ack(int rc,
+		void *misc)
+{
+    /* Phase 2+ (service 1) needs every +CMT acknowledged */
+    if (rc >= 0)
+	cnma_required = (rc == 0);
+}
 
-	while (isspace(*cp))
-	    ++cp;
 
-	if (!*cp)
-	    continue;
-	
-	send_sms(phone, cp);
+/*
+ * Have new messages pushed as +CMT URCs instead of stored. Messages
+ * already in storage are still read with list_sms().
+ */
+int
+set_direct_delivery(void)
+{
+    XMSG *xp;
+    
+
+    if (modem_cap_missing(MODEM_CAP_DIRECT))
+    {
+	direct_cnmi_ack(1, NULL);
+	return 0;
     }
+    
+    xp = xmsg_cmd("+CSMS=1", direct_csms_ack, NULL);
+    if (!xp || xmit_put(xp) < 0)
+	return -1;
+    
+    xp = xmsg_cmd("+CNMI=2,2,0,0,0", direct_cnmi_ack, NULL);
+    if (!xp || xmit_put(xp) < 0)
+	return -1;
 
-    if (debug)
-	fprintf(stderr, "TTY_READ_THREAD: Stopping\n");
+    return 0;
+}
+
+
+static int
+modem_cmd(const char *cmd,
+	  void (*ack)(int rc, void *misc),
+	  int timeout)
+{
+    XMSG *xp;
+
+
+    xp = xmsg_cmd(cmd, ack, (void *) (intptr_t) modem_gen);
+    if (!xp)
+	return -1;
     
-    queue_put(q_xmit, NULL);
-    return NULL;
+    xp->timeout = timeout;
+    return xmit_put_urgent(xp);
 }
 
 
-void *
-fifo_read_thread(void *tap)
+/* 
+ * The acks of the init sequence ignore timeouts (rc < 0), which make
+ * xmit_timeout() start it over, and answers to an earlier sequence.
+ */
+static int
+modem_stale(int rc,
+	    void *misc)
 {
-    char buf[256];
-    FILE *fp;
+    return rc < 0 || (intptr_t) misc != modem_gen;
+}
+
+
+static void
+modem_up(void)
+{
+    struct timespec t1;
+    long ms;
+
+
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    ms = (t1.tv_sec - modem_t0.tv_sec) * 1000 + (t1.tv_nsec - modem_t0.tv_nsec) / 1000000;
+    
+    if (!debug)
+	syslog(LOG_INFO, "%s: Modem ready in %ld ms (%d probes)", serial_device, ms, modem_probes);
+    else
+	fprintf(stderr, "MODEM: Ready in %ld ms (%d probes)\n", ms, modem_probes);
+
+    modem_ready = 1;
+    
+    if (direct_retry_timer)
+	ev_del_timer(loop, direct_retry_timer);
+    direct_retry_timer = 0;
     
+    if (direct_delivery)
+	set_direct_delivery();
     
+    sim_query();
+}
 
-    if (debug)
-	fprintf(stderr, "FIFO_READ_THREAD: Starting (fifo=%s)\n", (char *) tap);
 
-    while ((fp = fopen((char *) tap, "r")) != NULL)
-    {
-	if (debug > 1)
-	    fprintf(stderr, "FIFO_READ_THREAD: Fifo opened\n");
-	
-	while (fgets(buf, sizeof(buf), fp) != NULL)
-	{
-	    char *phone, *cp, *endp;
-	    
-	    if (debug > 1)
-		fprintf(stderr, "FIFO RECV: %s\n", buf);
-	    
-	    phone = strtok_r(buf, " \t\r\n", &endp);
-	    if (!phone)
-		continue;
-	    
-	    cp = strtok_r(NULL, "\n\r", &endp);
-	    if (!cp)
-		continue;
-	    
-	    while (isspace(*cp))
-		++cp;
-	    
-	    if (!*cp)
-		continue;
-	    
-	    send_sms(phone, cp);
-	}
+static void
+modem_settings_ack(int rc,
+		   void *misc)
+{
+    if (modem_stale(rc, misc))
+	return;
+    
+    if (rc)
+	modem_single_failed = 1;
 
-	fclose(fp);
-	if (debug > 1)
-	    fprintf(stderr, "FIFO_READ_THREAD: Fifo closed\n");
-	
-    }
+    /*
+     * Chaining is only missing if the same commands work one by one,
+     * not if one of them is what the modem rejected.
+     */
+    if (modem_chain_failed && !modem_single_failed)
+	modem_cap(MODEM_CAP_CHAIN, 0);
+    modem_up();
+}
 
-    if (debug)
-	fprintf(stderr, "FIFO_READ_THREAD: Stopping\n");
+
+static void
+modem_cscs_ack(int rc,
+	       void *misc)
+{
+    if (!modem_stale(rc, misc) && rc)
+	modem_single_failed = 1;
+}
+
+
+static void
+modem_settings_single(void)
+{
+    modem_single_failed = 0;
+    modem_cmd("+CSCS=\"HEX\"", modem_cscs_ack, 0);
+    modem_cmd("+CSDH=1", modem_settings_ack, 0);
+}
+
+
+static void
+modem_chain_ack(int rc,
+		void *misc)
+{
+    if (modem_stale(rc, misc))
+	return;
     
-    queue_put(q_xmit, NULL);
-    return NULL;
+    if (rc == 0)
+    {
+	modem_cap(MODEM_CAP_CHAIN, 1);
+	modem_up();
+	return;
+    }
+
+    /* Try them one by one, in case only one was rejected */
+    modem_chain_failed = (modem_cap_result(rc) == 0);
+    modem_settings_single();
 }
 
 
-#if !HAVE_CLOSEFROM
-void
-closefrom(int fd) {
-  while (fd < 256)
-    close(fd++);
+/* The independent settings, in one command line if possible */
+static void
+modem_settings(void)
+{
+    modem_chain_failed = 0;
+    if (modem_cap_missing(MODEM_CAP_CHAIN))
+	modem_settings_single();
+    else
+	modem_cmd("+CSCS=\"HEX\";+CSDH=1", modem_chain_ack, 0);
 }
-#endif
 
-#if HAVE_DOORS
+
 static void
-door_servproc(void *cookie,
-	      char *dataptr,
-	      size_t datasize,
-	      door_desc_t *descptr,
-	      uint_t ndesc)
+modem_pin_ack(int rc,
+	      void *misc)
 {
-    door_cred_t cb;
-    int rc = -1;
-    DOORSMS *dsp;
+    if (modem_stale(rc, misc))
+	return;
+    
+    if (rc)
+    {
+	if (!debug)
+	    syslog(LOG_ERR, "%s: SIM PIN rejected", serial_device);
+	else
+	    fprintf(stderr, "MODEM: SIM PIN rejected\n");
+    }
+    modem_settings();
+}
 
 
+static void
+modem_cpin_ack(int rc,
+	       void *misc)
+{
+    char buf[128];
+
+    
+    if (modem_stale(rc, misc))
+	return;
+    
     if (debug)
-	fprintf(stderr, "DOOR: servproc: Start\n");
+	fprintf(stderr, "MODEM: SIM status: %s\n", *modem_cpin ? modem_cpin : "unknown");
     
-    door_cred(&cb);
+    /* Only send the PIN if it is asked for (or if we can't tell) */
+    if (modem_pin && (strcmp(modem_cpin, "SIM PIN") == 0 || !*modem_cpin))
+    {
+	snprintf(buf, sizeof(buf), "+CPIN=%s", modem_pin);
+	modem_cmd(buf, modem_pin_ack, 0);
+	return;
+    }
+    
+    if (strcmp(modem_cpin, "SIM PIN") == 0)
+    {
+	if (!debug)
+	    syslog(LOG_ERR, "%s: SIM PIN required (use -p)", serial_device);
+	else
+	    fprintf(stderr, "MODEM: SIM PIN required (use -p)\n");
+    }
+    
+    modem_settings();
+}
+
+
+/* The caps are checked against the modem's ATI answer (if any) */
+static void
+modem_ident_ack(int rc,
+		void *misc)
+{
+    if (modem_stale(rc, misc))
+	return;
 
+    modem_ident_pending = 0;
+    if (rc)
+	*modem_ident = '\0';
+    
     if (debug)
-	fprintf(stderr, "DOOR: credentials: euid=%d, egid=%d, ruid=%d, rgid=%d\n",
-		(int) cb.dc_euid, (int) cb.dc_egid, (int) cb.dc_ruid, (int) cb.dc_rgid);
+	fprintf(stderr, "MODEM: Identity: %s\n", *modem_ident ? modem_ident : "unknown");
     
-    if (dataptr == DOOR_UNREF_DATA)
-    {
-	if (debug)
-	    fprintf(stderr, "DOOR: servproc: door unreferenced\n");
+    if (caps_path)
+	modem_caps_check();
+    
+    *modem_cpin = '\0';
+    modem_cmd("+CPIN?", modem_cpin_ack, 0);
+}
 
-	rc = -1;
-	door_return((char *) &rc, sizeof(rc), NULL, 0);
+
+static void
+modem_probe(EVLOOP *lp,
+	    void *misc);
+
+static void
+modem_probe_ack(int rc,
+		void *misc)
+{
+    if ((intptr_t) misc != modem_gen)
+	return;
+    
+    /* An OK without +CSQ belongs to an earlier command */
+    if (rc == 0 && !modem_probe_csq)
+	rc = 1;
+    
+    if (rc == 0 && modem_probe_failed)
+    {
+	/*
+	 * Answers to the probes that timed out may still be on their
+	 * way. Let them arrive (and be ignored) and probe once more.
+	 */
+	modem_probe_failed = 0;
+	modem_probe_timer = ev_add_timer(loop, modem_probe_ms, modem_probe, NULL);
+	return;
+    }
+    
+    if (rc == 0)
+    {
+	modem_probing = 0;
+	*modem_ident = '\0';
+	modem_ident_pending = 1;
+	modem_cmd("I", modem_ident_ack, 0);
 	return;
     }
 
-    if (datasize != sizeof(*dsp))
-    {
-	if (debug)
-	    fprintf(stderr, "DOOR: servproc: invalid request structure\n");
+    /* No answer (or an error) - try again, backing off */
+    modem_probe_failed = 1;
+    modem_probe_ms *= 2;
+    if (modem_probe_ms > MODEM_PROBE_MAX)
+	modem_probe_ms = MODEM_PROBE_MAX;
+    
+    if (modem_probes == 10)
+    {
+	if (!debug)
+	    syslog(LOG_WARNING, "%s: Modem not responding, still trying", serial_device);
+	else
+	    fprintf(stderr, "MODEM: Not responding, still trying\n");
+    }
+    
+    modem_probe_timer = ev_add_timer(loop, modem_probe_ms/2, modem_probe, NULL);
+}
+
+
+/*
+ * Probe with ATE0+CSQ (echo off, signal quality) until the modem
+ * answers with +CSQ and OK, so that a stray OK is not taken for it.
+ */
+static void
+modem_probe(EVLOOP *lp,
+	    void *misc)
+{
+    modem_probe_timer = 0;
+    modem_probes++;
+    modem_probe_csq = 0;
+    modem_cmd("E0+CSQ", modem_probe_ack, modem_probe_ms);
+}
+
+
+static void
+modem_start(void)
+{
+    if (modem_probe_timer)
+	ev_del_timer(loop, modem_probe_timer);
+    modem_probe_timer = 0;
+    
+    modem_gen++;
+    modem_ready = 0;
+    modem_ident_pending = 0;
+    modem_probing = 1;
+    modem_probe_failed = 0;
+    modem_probes = 0;
+    modem_probe_ms = MODEM_PROBE_TIMEOUT;
+    modem_probe(loop, NULL);
+}
+
+
+/*
+ * Bring the modem up: probe, unlock the SIM if needed and apply the
+ * settings. Commands in q_xmit are held until it is done.
+ */
+int
+modem_init(char *pin)
+{
+    modem_pin = pin;
+    modem_caps_load();
+    modem_start();
+    return 0;
+}
+
+
+/*
+ * The modem timed out or restarted: run the init sequence again,
+ * unless it is already probing.
+ */
+static void
+modem_reinit(const char *why)
+{
+    if (modem_probing)
+	return;
+
+    if (!debug)
+	syslog(LOG_WARNING, "%s: %s, reinitializing modem", serial_device, why);
+    else
+	fprintf(stderr, "MODEM: %s, reinitializing\n", why);
+    
+    clock_gettime(CLOCK_MONOTONIC, &modem_t0);
+    modem_start();
+}
+
+
+static int
+cmd_users(USER *up, void *xp)
+{
+    BUFFER *bp = (BUFFER *) xp;
+
+    if (up->cphone)
+    {
+	buf_puts(bp, up->name);
+	buf_putc(bp, ' ');
+	buf_puts(bp, up->cphone);
+	buf_putc(bp, '\n');
+    }
+    return 0;
+}
+
+#if !HAVE_LOADAVG
+int
+getloadavg(double lav[],
+           int nlav) {
+  errno = ENOSYS;
+  return -1;
+}
+#endif
+
+int
+run_message(const char *msg,
+	    const char *phone,
+	    const char *date)
+{
+    char tmpbuf[1024], *cp, **argv;
+    char ablock[RUN_ARENA_SIZE];
+    int i, len;
+    BUFFER in, out;
+    UCRED *ucp;
+    ARENA arena;
+    
+
+    /* Everything for the message is from here, and freed at once at the end */
+    arena_init(&arena, ablock, sizeof(ablock));
+    
+    ucp = users_get_creds_arena(phone, &arena);
+    if (!ucp)
+    {
+	arena_reset(&arena);
+	return -1;
+    }
+    
+    buf_init_arena(&in, &arena);
+    buf_init_arena(&out, &arena);
+
+    cp = arena_strdup(&arena, msg);
+    if (!cp)
+    {
+	users_free_creds(ucp);
+	arena_reset(&arena);
+	return -1;
+    }
+    
+    /* The first line is the command, the rest its input */
+    i = strcspn(cp, "\r\n");
+    if (cp[i])
+	cp[i++] = '\0';
+
+    while (cp[i] && isspace(cp[i]))
+	++i;
+    
+    if (!debug)
+	syslog(LOG_INFO, "Date=%s, Phone=%s, User=%s, Level=%d: %s",
+	       date, ucp->phone, ucp->name ? ucp->name : "<unknown>", ucp->level, cp);
+    else
+	fprintf(stderr, "RUN_MSG: Date=%s, Phone=%s, User=%s, Level=%d: %s\n",
+		date, ucp->phone, ucp->name ? ucp->name : "<unknown>", ucp->level, cp);
+    
+    buf_puts(&in, cp+i);
+    argv = argv_create_arena(&arena, cp, NULL, NULL);
+
+    if (!argv || !argv[0])
+    {
+	users_free_creds(ucp);
+	arena_reset(&arena);
+	return -1;
+    }
+
+    if (argv[0] && (len = strlen(argv[0])) > 2 &&
+	argv[0][0] == '[' && argv[0][len-1] == ']' &&
+	ucp->name)
+    {
+	argv[0][len-1] = '\0';
+	if (!users_login(ucp, ucp->name, argv[0]+1))
+	{
+	    buf_puts(&out, "Invalid password");
+	    goto End;
+	}
+
+	++argv;
+    }
+    
+    if (strcasecmp(argv[0], "Help") == 0)
+    {
+	buf_puts(&out, "Help,Whoami,Login");
+	if (ucp->level > 0)
+	    buf_puts(&out, ",LoadAvg,Users");
+	if (ucp->level > 1)
+	    buf_puts(&out, ",Logout");
+	ecmd_list(ucp, &out);
+	goto End;
+    }
+    
+    if (strcasecmp(argv[0], "Whoami") == 0)
+    {
+	buf_puts(&out, ucp->phone);
+	if (ucp->level > 0)
+	{
+	    buf_puts(&out, " ");
+	    if (ucp->level < 2)
+		buf_puts(&out, "(");
+	    buf_puts(&out, ucp->name);
+	    if (ucp->level < 2)
+		buf_puts(&out, ")");
+	}
+	goto End;
+    }
+
+    if (strcasecmp(argv[0], "Login") == 0)
+    {
+	if (!argv[1] || !argv[2] || !users_login(ucp, argv[1], argv[2]))
+	{
+	    if (ucp->name)
+		buf_puts(&out, "Login denied!");
+	}
+	else
+	    buf_puts(&out, "Login OK");
+	goto End;
+    }
+
+    if (ucp->level > 1 && strcasecmp(argv[0], "Logout") == 0)
+    {
+	if (users_logout(ucp))
+	    buf_puts(&out, "Logout OK");
+	else
+	{
+	    if (ucp->name)
+		buf_puts(&out, "Logout denied!");
+	}
+	goto End;
+    }
+
+    if (ucp->level > 0 && strcasecmp(argv[0], "LoadAvg") == 0)
+    {
+	double loadavg[3];
+	
+	if (getloadavg(loadavg, 3) < 0)
+          buf_puts(&out, "No load averages");
+        else {
+          snprintf(tmpbuf, sizeof(tmpbuf), "%.2f/%.2f/%.2f",
+                   loadavg[0], loadavg[1], loadavg[2]);
+          buf_puts(&out, tmpbuf);
+        }
+        goto End;
+    }
+
+    if (ucp->level > 0 && strcasecmp(argv[0], "Users") == 0)
+    {
+	users_foreach(cmd_users, (void *) &out);
+	goto End;
+    }
+
+    if (ucp->level > 0 && ecmd_run(ucp, argv, date, &in, &out) != NULL)
+	goto End;
+
+
+    /* Only return an error if sent from a valid user or known phone */
+    if (ucp->level > 0)
+    {
+	buf_puts(&out, "What?\r(");
+	buf_puts(&out, msg);
+	buf_puts(&out, ")");
+    }
+
+  End:
+    cp = buf_getall(&out);
+    if (cp && *cp)
+	send_sms(phone, cp);
+    
+    /* The heap calls the same work takes without the arena, and with it */
+    if (debug)
+	fprintf(stderr, "RUN_MSG: Done (%lu allocations, %lu bytes; heap calls %lu without the arena, %lu with)\n",
+		arena.allocs, arena.bytes, arena.heap, arena.mallocs);
+    
+    users_free_creds(ucp);
+    arena_reset(&arena);
+    
+    return 0;
+}
+
+
+/* A received message, handed to a worker. One allocation with the strings */
+typedef struct msgjob
+{
+    char *msg;
+    char *phone;
+    char *date;
+    char buf[];
+} MSGJOB;
+
+
+static void
+msg_job(void *xp)
+{
+    MSGJOB *jp = (MSGJOB *) xp;
+
+
+    run_message(jp->msg, jp->phone, jp->date);
+    free(jp);
+}
+
+
+/* Messages from the same phone are run in order, on the same worker */
+static unsigned int
+msg_key(const char *phone)
+{
+    uint64_t k = phone_key(phone);
+    unsigned int h = 2166136261U;
+
+    if (k)
+	return (unsigned int) (k ^ (k >> 32));
+
+    while (*phone)
+    {
+	h ^= (unsigned char) *phone++;
+	h *= 16777619U;
+    }
+    return h;
+}
+
+
+static int
+msg_dispatch(const char *msg,
+	     const char *phone,
+	     const char *date)
+{
+    MSGJOB *jp;
+    size_t mlen, plen, dlen;
+
+
+    /* Commands in a capture are not run again */
+    if (replay_path)
+    {
+	if (debug)
+	    fprintf(stderr, "REPLAY: Not run: %s: %s\n", phone, msg);
+	return 0;
+    }
+    
+    mlen = strlen(msg)+1;
+    plen = strlen(phone)+1;
+    dlen = strlen(date)+1;
+    
+    jp = malloc(sizeof(*jp) + mlen + plen + dlen);
+    if (!jp)
+	return -1;
+
+    jp->msg = memcpy(jp->buf, msg, mlen);
+    jp->phone = memcpy(jp->buf+mlen, phone, plen);
+    jp->date = memcpy(jp->buf+mlen+plen, date, dlen);
+    
+    if (pool_run(workers, msg_key(phone), msg_job, jp) < 0)
+    {
+	free(jp);
+	return -1;
+    }
+
+    return 0;
+}
+
+
+/* Modem input state */
+static LINEBUF ser_lb;
+static int ser_body = 0;	/* Next line is a message body */
+static char ser_phone[128];
+static char ser_date[128];
+static int ser_fo = -1;		/* First octet (+CSDH=1), -1 if unknown */
+static int ser_index = -1;	/* Storage index of the message, -1 if unknown */
+static ATPARSER *ser_parser = NULL;
+
+int modem_rssi = 99;		/* Last +CSQ signal quality, 99 = unknown */
+
+#define SER_BODY_STORED	1	/* Read from the SIM, delete when done */
+#define SER_BODY_DIRECT	2	/* Delivered directly (+CMT) */
+
+
+static void
+ser_field(char *buf,
+	  size_t size,
+	  ATLINE *alp,
+	  int i)
+{
+    snprintf(buf, size, "%s", i < alp->nf ? alp->fv[i] : "");
+}
+
+
+/* Final result: OK, ERROR, +CMS ERROR or +CME ERROR */
+static void
+at_final(ATLINE *alp,
+	 void *xp)
+{
+    EVLOOP *lp = (EVLOOP *) xp;
+    int rc = (strcmp(alp->prefix, "OK") != 0);
+
+    
+    modem_error_ext = (rc && *alp->prefix == '+');
+    
+    if (debug)
+	fprintf(stderr, "ACKNOWLEDGE OF TYPE: %s%s%s (rc=%d)\n",
+		alp->prefix, alp->nf ? ": " : "", alp->nf ? alp->fv[0] : "", rc);
+
+    if (rc && alp->nf)
+    {
+	if (!debug)
+	    syslog(LOG_WARNING, "Modem: %s: %s", alp->prefix, alp->fv[0]);
+    }
+
+    xmit_done(lp, rc);
+}
+
+
+static void
+sim_check_full(void)
+{
+    if (sim.total <= 0 || sim.used < sim.total)
+	return;
+
+    if (!debug)
+	syslog(LOG_WARNING, "SIM message storage full (%d messages)", sim.used);
+    else
+	fprintf(stderr, "SIM: Message storage full (%d messages)\n", sim.used);
+}
+
+
+/* +CPIN: <code> */
+static void
+at_cpin(ATLINE *alp,
+	void *xp)
+{
+    ser_field(modem_cpin, sizeof(modem_cpin), alp, 0);
+}
+
+
+/* +CPMS: [<mem1>,]<used1>,<total1>,... */
+static void
+at_cpms(ATLINE *alp,
+	void *xp)
+{
+    int k = (alp->nf > 0 && !isdigit((unsigned char) *alp->fv[0]));
+
+    
+    if (alp->nf < k+2)
+	return;
+
+    sim_reported = atoi(alp->fv[k]);
+    sim.total = atoi(alp->fv[k+1]);
+    if (sim_reported >= sim.total)
+	sim_check_full();
+}
+
+
+/* +CMTI: <mem>,<index> */
+static void
+at_cmti(ATLINE *alp,
+	void *xp)
+{
+    int id;
+
+    
+    if (alp->nf < 2 || strcmp(alp->fv[0], "SM") != 0 || sscanf(alp->fv[1], "%u", &id) != 1)
+    {
+	if (debug)
+	    fprintf(stderr, "IGNORING: %s\n", alp->line);
+	return;
+    }
+    
+    if (debug)
+	fprintf(stderr, "NEW INCOMING SMS #%u\n", id);
+
+    ss_set(&sim, id);
+    sim_check_full();
+    
+    read_sms(id);
+}
+
+
+/* +CMGL: <index>,<stat>,<oa>,[<alpha>],<scts> */
+static void
+at_cmgl(ATLINE *alp,
+	void *xp)
+{
+    if (alp->nf < 5)
+	return;
+    
+    ser_field(ser_phone, sizeof(ser_phone), alp, 2);
+    ser_field(ser_date, sizeof(ser_date), alp, 4);
+    ser_fo = -1;
+    ser_index = atoi(alp->fv[0]);
+    ss_set(&sim, ser_index);
+    
+    if (debug)
+	fprintf(stderr, "SMS #%s FROM %s AT %s STATUS %s\n",
+		alp->fv[0], ser_phone, ser_date, alp->fv[1]);
+    ser_body = SER_BODY_STORED;
+}
+
+
+/* +CMGR: <stat>,<oa>,[<alpha>],<scts> */
+static void
+at_cmgr(ATLINE *alp,
+	void *xp)
+{
+    if (alp->nf < 4)
+	return;
+    
+    ser_field(ser_phone, sizeof(ser_phone), alp, 1);
+    ser_field(ser_date, sizeof(ser_date), alp, 3);
+    ser_fo = alp->nf > 5 && *alp->fv[5] ? atoi(alp->fv[5]) : -1;
+
+    /* The index is only in the command */
+    if (!xmit_cur || sscanf(xmit_cur->cmd, "+CMGR=%d", &ser_index) != 1)
+	ser_index = -1;
+    else if (ss_set(&sim, ser_index) > 0 && sim_scan_left > 0)
+	sim_scan_left--;
+    
+    if (debug)
+	fprintf(stderr, "SMS FROM %s AT %s STATUS %s\n",
+		ser_phone, ser_date, alp->fv[0]);
+    ser_body = SER_BODY_STORED;
+}
+
+
+/* +CMT: <oa>,[<alpha>],<scts> - message delivered without storing */
+static void
+at_cmt(ATLINE *alp,
+       void *xp)
+{
+    if (alp->nf < 3)
+	return;
+    
+    ser_field(ser_phone, sizeof(ser_phone), alp, 0);
+    ser_field(ser_date, sizeof(ser_date), alp, 2);
+    ser_fo = alp->nf > 4 && *alp->fv[4] ? atoi(alp->fv[4]) : -1;
+    ser_index = -1;
+    
+    if (debug)
+	fprintf(stderr, "SMS FROM %s AT %s (DIRECT)\n", ser_phone, ser_date);
+    ser_body = SER_BODY_DIRECT;
+}
+
+
+/* +CDS: <fo>,<mr>,[<ra>],[<tora>],<scts>,<dt>,<st> */
+static void
+at_cds(ATLINE *alp,
+       void *xp)
+{
+    if (alp->nf < 7)
+	return;
+
+    if (verbose || debug)
+    {
+	if (!debug)
+	    syslog(LOG_INFO, "Delivery report for message %s to %s: status %s",
+		   alp->fv[1], alp->fv[2], alp->fv[6]);
+	else
+	    fprintf(stderr, "DELIVERY REPORT: MR=%s TO %s AT %s STATUS %s\n",
+		    alp->fv[1], alp->fv[2], alp->fv[5], alp->fv[6]);
+    }
+}
+
+
+/* +CSQ: <rssi>,<ber> */
+static void
+at_csq(ATLINE *alp,
+       void *xp)
+{
+    if (alp->nf < 1 || sscanf(alp->fv[0], "%d", &modem_rssi) != 1)
+	return;
+    
+    modem_probe_csq = 1;
+    
+    if (debug)
+	fprintf(stderr, "SIGNAL QUALITY: %d\n", modem_rssi);
+}
+
+
+/* +CMGS: <mr> */
+static void
+at_cmgs(ATLINE *alp,
+	void *xp)
+{
+    if (debug)
+	fprintf(stderr, "MESSAGE SENT: REFERENCE %s\n", alp->nf ? alp->fv[0] : "?");
+}
+
+
+/* The modem has (re)started, and forgotten its settings */
+static void
+at_rdy(ATLINE *alp,
+       void *xp)
+{
+    EVLOOP *lp = (EVLOOP *) xp;
+
+    
+    modem_probing = 0;
+    modem_reinit("Modem restarted");
+    
+    /* Whatever was in flight is lost (a message is sent again) */
+    if (xmit_cur)
+	xmit_done(lp, -1);
+}
+
+
+static void
+at_ring(ATLINE *alp,
+	void *xp)
+{
+    if (debug)
+	fprintf(stderr, "INCOMING CALL (IGNORED)\n");
+}
+
+
+/* The modem waits for the SMS text */
+static void
+at_prompt(ATLINE *alp,
+	  void *xp)
+{
+    EVLOOP *lp = (EVLOOP *) xp;
+
+    
+    /* Nothing waiting for it */
+    if (!xmit_data_timer)
+	return;
+
+    ev_del_timer(lp, xmit_data_timer);
+    xmit_data(lp, NULL);
+}
+
+
+static int
+ser_parser_init(EVLOOP *lp)
+{
+    ser_parser = at_create();
+    if (!ser_parser)
+	return -1;
+
+    if (at_register(ser_parser, "OK", AT_RAW, at_final, lp) < 0 ||
+	at_register(ser_parser, "ERROR", AT_RAW, at_final, lp) < 0 ||
+	at_register(ser_parser, "+CMS ERROR", 0, at_final, lp) < 0 ||
+	at_register(ser_parser, "+CME ERROR", 0, at_final, lp) < 0 ||
+	at_register(ser_parser, "+CMTI", 0, at_cmti, lp) < 0 ||
+	at_register(ser_parser, "+CPMS", 0, at_cpms, lp) < 0 ||
+	at_register(ser_parser, "+CPIN", 0, at_cpin, lp) < 0 ||
+	at_register(ser_parser, "+CMGL", 0, at_cmgl, lp) < 0 ||
+	at_register(ser_parser, "+CMGR", 0, at_cmgr, lp) < 0 ||
+	at_register(ser_parser, "+CMT", 0, at_cmt, lp) < 0 ||
+	at_register(ser_parser, "+CMGS", 0, at_cmgs, lp) < 0 ||
+	at_register(ser_parser, "+CDS", 0, at_cds, lp) < 0 ||
+	at_register(ser_parser, "+CSQ", 0, at_csq, lp) < 0 ||
+	at_register(ser_parser, "RDY", AT_RAW, at_rdy, lp) < 0 ||
+	at_register(ser_parser, "RING", AT_RAW, at_ring, lp) < 0 ||
+	at_register(ser_parser, ">", AT_RAW, at_prompt, lp) < 0)
+	return -1;
+
+    return 0;
+}
+
+
+static MPART *ser_parts = NULL;
+static int ser_parts_timer = 0;
+
+
+/*
+ * Returns 1 if the message with 'key' is new, 0 if it has been seen
+ * before.
+ */
+static int
+ser_journal_check(uint64_t key)
+{
+    if (journal_check(journal, key))
+    {
+	if (debug)
+	    fprintf(stderr, "SER_JOURNAL: %016" PRIx64 ": Duplicate message from %s at %s, ignored\n",
+		    key, ser_phone, ser_date);
+	return 0;
+    }
+
+    return 1;
+}
+
+
+/* Returns 0, or -1 if 'key' could not be journaled */
+static int
+ser_journal_record(uint64_t key,
+		   const char *phone)
+{
+    if (journal_record(journal, key) < 0)
+    {
+	/* Not run, rather than risk running it again */
+	if (!debug)
+	    syslog(LOG_ERR, "%s: Journal write failed, message from %s dropped: %m",
+		   journal_path, phone);
+	else
+	    fprintf(stderr, "SER_JOURNAL: %s: Journal write failed, message from %s dropped: %s\n",
+		    journal_path, phone, strerror(errno));
+	return -1;
+    }
+
+    return 0;
+}
+
+
+/*
+ * Returns 1 if the message should be run, 0 if it is a duplicate and
+ * -1 if it could not be journaled. It is recorded in the journal
+ * first, so it is dropped if it is read again later - also after a
+ * restart if it was not yet deleted from the SIM.
+ */
+static int
+ser_journal(const char *msg)
+{
+    uint64_t key = journal_key(serial_device, ser_date, ser_phone, msg);
+
+
+    if (!ser_journal_check(key))
+	return 0;
+
+    return ser_journal_record(key, ser_phone) < 0 ? -1 : 1;
+}
+
+
+/*
+ * Journal the parts of a set that is done with, and then delete the
+ * stored ones. Returns -1, leaving them stored, if the journal could
+ * not be written.
+ */
+static int
+ser_parts_release(MPSET *sp)
+{
+    int i;
+
+
+    for (i = 0; i < sp->total; i++)
+	if (sp->pv[i] && ser_journal_record(sp->kv[i], sp->phone) < 0)
+	    return -1;
+
+    for (i = 0; i < sp->total; i++)
+	if (sp->pv[i] && sp->iv[i] >= 0)
+	    sim_delete(sp->iv[i]);
+    return 0;
+}
+
+
+static void
+ser_parts_report(const char *why,
+		 int release,
+		 MPSET *sp)
+{
+    if (!debug)
+	syslog(LOG_WARNING, "Incomplete message from %s (ref %d, %d of %d parts) %s",
+	       sp->phone, sp->ref, sp->have, sp->total, why);
+    else
+	fprintf(stderr, "SER_PARTS: Incomplete message from %s (ref %d, %d of %d parts) %s\n",
+		sp->phone, sp->ref, sp->have, sp->total, why);
+
+    /* At exit the stored parts are kept, to be read again at the next start */
+    if (release)
+	ser_parts_release(sp);
+}
+
+
+static void
+ser_parts_tick(EVLOOP *lp,
+	       void *xp)
+{
+    int n;
+
+    
+    ser_parts_timer = 0;
+    n = mp_expire(ser_parts, time(NULL));
+    if (n > 0)
+	ser_parts_timer = ev_add_timer(lp, n*1000, ser_parts_tick, NULL);
+}
+
+
+/*
+ * One part of a concatenated message, with its journal key, run the
+ * message when it is complete. Stored parts are kept on the SIM until
+ * then, so a restart does not lose them. Returns 1 if the part is
+ * taken care of, 0 if it was dropped, for the caller to journal and
+ * delete, and 2 if it is a copy of a part already kept, to be deleted.
+ */
+static int
+ser_part(int ref,
+	 int total,
+	 int seq,
+	 const char *text,
+	 uint64_t key)
+{
+    MPSET *sp;
+    char *msg;
+    int rc;
+
+
+    rc = mp_add(ser_parts, ser_phone, ref, total, seq, text, ser_index, key, &sp);
+    if (rc == 1)
+    {
+	/* Run only once all parts are journaled */
+	if (ser_parts_release(sp) == 0)
+	{
+	    msg = mp_join(sp);
+	    if (msg)
+		msg_dispatch(msg, ser_phone, ser_date);
+	    free(msg);
+	}
+	mp_free(sp);
+	return 1;
+    }
+    
+    if (rc < 0)
+    {
+	if (!debug)
+	    syslog(LOG_WARNING, "Part %d/%d of message from %s (ref %d) dropped",
+		   seq, total, ser_phone, ref);
+	else
+	    fprintf(stderr, "SER_PART: Part %d/%d of message from %s (ref %d) dropped\n",
+		    seq, total, ser_phone, ref);
+	return 0;
+    }
+
+    if (rc == 0 && !ser_parts_timer)
+	ser_parts_timer = ev_add_timer(loop, ser_parts->timeout*1000, ser_parts_tick, NULL);
+    
+    return rc == 0 ? 1 : 2;
+}
+
+
+static void
+ser_line(EVLOOP *lp,
+	 char *buf)
+{
+    size_t n;
+
+    
+    if (ser_body)
+    {
+	char obuf[1024];
+	int hlen = 0, ref, total, seq, rc;
+
+	/* TP-UDHI (0x40) set, or not known (+CMGL) */
+	if (ser_fo < 0 || (ser_fo & 0x40))
+	    hlen = gsm_udh_concat(buf, &ref, &total, &seq);
+	
+	gsm_to_latin1(buf+hlen, obuf, sizeof(obuf));
+	if (debug)
+	{
+	    if (hlen)
+		fprintf(stderr, "MESSAGE (PART %d/%d, REF %d): %s\n", seq, total, ref, obuf);
+	    else
+		fprintf(stderr, "MESSAGE: %s\n", obuf);
+	}
+
+	if (hlen)
+	{
+	    /* Journaled with the other parts, when the message is complete */
+	    uint64_t key = journal_key(serial_device, ser_date, ser_phone, buf);
+	    
+	    rc = ser_journal_check(key);
+	    if (rc > 0)
+		switch (ser_part(ref, total, seq, obuf, key))
+		{
+		  case 1:
+		    if (ser_body == SER_BODY_DIRECT && cnma_required)
+			ack_sms();
+		    ser_body = 0;
+		    return;
+		    
+		  case 0:
+		    if (ser_journal_record(key, ser_phone) < 0)
+			rc = -1;
+		    break;
+		}
+	}
+	else
+	{
+	    rc = ser_journal(buf);
+	    if (rc > 0)
+		msg_dispatch(obuf, ser_phone, ser_date);
+	}
+	
+	if (ser_body == SER_BODY_STORED)
+	{
+	    /*
+	     * Kept if it could not be journaled, to be run after a restart.
+	     * Without its index it is left alone: sweeping all read messages
+	     * would also take parts kept for reassembly. The journal stops it
+	     * from running again when it is read next time.
+	     */
+	    if (rc >= 0 && ser_index >= 0)
+		sim_delete(ser_index);
+	    else if (rc >= 0 && debug)
+		fprintf(stderr, "SER_LINE: Storage index unknown, message left on the SIM\n");
+	}
+	else if (cnma_required && rc >= 0)
+	{
+	    /* Not acknowledged if it could not be journaled: the network delivers it again */
+	    ack_sms();
+	}
+	ser_body = 0;
+	return;
+    }
+    
+    if (debug > 1)
+	fprintf(stderr, "RECV: %s\n", buf);
+
+    if (at_dispatch(ser_parser, buf) || !*buf)
+	return;
+    
+    if (modem_ident_pending)
+    {
+	/* Multi-line answers are joined */
+	n = strlen(modem_ident);
+	snprintf(modem_ident+n, sizeof(modem_ident)-n, "%s%s", n ? " " : "", buf);
+    }
+    else if (debug)
+	fprintf(stderr, "IGNORING: %s\n", buf);
+}
+
+
+static void
+ser_input(EVLOOP *lp,
+	  int fd,
+	  char *buf,
+	  int len,
+	  void *misc)
+{
+    char *line;
+    int n, rc;
+
+
+    if (len <= 0)
+    {
+	if (!debug)
+	    syslog(LOG_ERR, "%s: Modem connection lost: %s", serial_device,
+		   len < 0 ? strerror(-len) : "EOF");
+	else
+	    fprintf(stderr, "SER_INPUT: %s: Modem connection lost: %s\n", serial_device,
+		    len < 0 ? strerror(-len) : "EOF");
+	
+	ev_del_fd(lp, fd);
+	main_exit = 1;
+	ev_stop(lp);
+	return;
+    }
+
+    if (capture)
+	capture_record(capture, CAPTURE_FROM_MODEM, buf, len);
+    
+    /* Read directly into the line buffer */
+    lb_commit(&ser_lb, len);
+    
+    /* The "> " prompt is dispatched as ">" */
+    while ((rc = lb_getline(&ser_lb, &line, &n)) != 0)
+	ser_line(lp, line);
+
+    buf = lb_space(&ser_lb, &n);
+    ev_set_rbuf(lp, fd, buf, n);
+}
+
+
+/* Line input from the fifo and the tty: "<phone> <message>" */
+typedef struct linein
+{
+    LINEBUF lb;
+    const char *name;
+    int source;		/* For the trace */
+} LINEIN;
+
+static LINEIN fifo_in = { { NULL }, "FIFO", TRACE_SRC_FIFO };
+static LINEIN tty_in = { { NULL }, "TTY", TRACE_SRC_TTY };
+
+
+/* Record an accepted submission, if tracing */
+static void
+trace_submit(int source,
+	     const char *to,
+	     const char *msg)
+{
+    if (trace && trace_record(trace, source, to, strlen(msg)) < 0 && debug)
+	fprintf(stderr, "TRACE: %s: %s\n", trace_path, strerror(errno));
+}
+
+
+static void
+line_send(LINEIN *ip,
+	  char *buf)
+{
+    char *phone, *cp, *endp;
+
+
+    if (debug > 1)
+	fprintf(stderr, "%s RECV: %s\n", ip->name, buf);
+	    
+    phone = strtok_r(buf, " \t\r\n", &endp);
+    if (!phone)
+	return;
+	    
+    cp = strtok_r(NULL, "\n\r", &endp);
+    if (!cp)
+	return;
+	    
+    while (isspace(*cp))
+	++cp;
+	    
+    if (!*cp)
+	return;
+	    
+    if (send_sms(phone, cp) >= 0)
+	trace_submit(ip->source, phone, cp);
+}
+
+
+static void
+line_input(EVLOOP *lp,
+	   int fd,
+	   char *buf,
+	   int len,
+	   void *misc)
+{
+    LINEIN *ip = (LINEIN *) misc;
+    char *line;
+    int n;
+
+
+    if (len <= 0)
+    {
+	if (debug)
+	    fprintf(stderr, "%s: Input closed\n", ip->name);
+	ev_del_fd(lp, fd);
+	return;
+    }
+
+    lb_commit(&ip->lb, len);
+    
+    while (lb_getline(&ip->lb, &line, &n) != 0)
+	line_send(ip, line);
+
+    buf = lb_space(&ip->lb, &n);
+    ev_set_rbuf(lp, fd, buf, n);
+}
+
+
+/* Start reading lines from 'fd' */
+static int
+line_reader(EVLOOP *lp,
+	    int fd,
+	    LINEIN *ip)
+{
+    char *buf;
+    int n;
+
+    
+    if (!ip->lb.buf && lb_init(&ip->lb, LINEIN_SIZE) < 0)
+	return -1;
+
+    buf = lb_space(&ip->lb, &n);
+    return ev_add_reader(lp, fd, buf, n, line_input, ip);
+}
+
+
+#if !HAVE_CLOSEFROM
+void
+closefrom(int fd) {
+  while (fd < 256)
+    close(fd++);
+}
+#endif
+
+#if HAVE_DOORS
+static void
+door_servproc(void *cookie,
+	      char *dataptr,
+	      size_t datasize,
+	      door_desc_t *descptr,
+	      uint_t ndesc)
+{
+    door_cred_t cb;
+    int rc = -1;
+    DOORSMS *dsp;
+
+
+    if (debug)
+	fprintf(stderr, "DOOR: servproc: Start\n");
+    
+    door_cred(&cb);
+
+    if (debug)
+	fprintf(stderr, "DOOR: credentials: euid=%d, egid=%d, ruid=%d, rgid=%d\n",
+		(int) cb.dc_euid, (int) cb.dc_egid, (int) cb.dc_ruid, (int) cb.dc_rgid);
+    
+    if (dataptr == DOOR_UNREF_DATA)
+    {
+	if (debug)
+	    fprintf(stderr, "DOOR: servproc: door unreferenced\n");
+
+	rc = -1;
+	door_return((char *) &rc, sizeof(rc), NULL, 0);
+	return;
+    }
+
+    if (datasize != sizeof(*dsp))
+    {
+	if (debug)
+	    fprintf(stderr, "DOOR: servproc: invalid request structure\n");
+
+	rc = -2;
+	door_return((char *) &rc, sizeof(rc), NULL, 0);
+	return;
+    }
+
+    dsp = (DOORSMS *) dataptr;
+    if (debug)
+	fprintf(stderr, "DOOR: servproc: sending SMS to %s: %s\n", dsp->phone, dsp->message);
+    
+    rc = send_sms(dsp->phone, dsp->message);
+    if (rc >= 0)
+	trace_submit(TRACE_SRC_DOOR, dsp->phone, dsp->message);
+
+    if (debug)
+	fprintf(stderr, "DOOR: servproc: send_sms returned: %d\n", rc);
+    
+    door_return((char *) &rc, sizeof(rc), NULL, 0);
+}
+
+
+
+int
+door_start_server(const char *path)
+{
+    int rc, fd;
+
+    
+    while ((rc = unlink(path)) < 0 && errno == EINTR)
+	;
+    if (rc < 0 && errno != ENOENT)
+	error("unlink(\"%s\") failed: %s\n", path, strerror(errno));
+    
+    while ((fd = open(path, O_CREAT|O_RDWR, 0644)) < 0 && errno == EINTR)
+	;
+    if (fd < 0)
+	error("open(\"%s\") failed: %s\n", path, strerror(errno));
+    
+    while ((rc = close(fd)) < 0 && errno == EINTR)
+	;
+    if (rc < 0)
+	error("close(%d) failed: %s\n", fd, strerror(errno));
+
+    fd = door_create(door_servproc, NULL, DOOR_UNREF);
+    if (fd < 0)
+	error("door_create() failed: %s\n", strerror(errno));
+
+    if (fattach(fd, path) < 0)
+	error("fattach(\"%s\") failed: %s\n", path, strerror(errno)); 
+    
+    return 0;
+}
+#endif
+
+
+static void
+autologout_handler(USER *up)
+{
+    send_sms(up->cphone, "Autologout\r(Inactivity)");
+}
+
+/* The users text file, or NULL if users come from another backend */
+static const char *
+users_file(void)
+{
+    const char *path;
+
+    if (!userauth_path ||
+	users_backend(userauth_path, &path) != USERS_BACKEND_FILE)
+	return NULL;
+
+    return path;
+}
+
+
+/*
+ * Load the users & commands databases, either from the compiled
+ * image (rebuilt from the text files first if out of date) or
+ * directly from the text files. Users from a key-value backend
+ * are always loaded from it directly.
+ */
+int
+config_load(void)
+{
+    DB *udb = NULL, *ncdb = NULL;
+    int rc = 0;
+
+
+    pthread_mutex_lock(&config_mtx);
+    
+    if (image_path)
+    {
+	if (db_stale(image_path, users_file(), commands_path))
+	{
+	    if (debug)
+		fprintf(stderr, "CONFIG_LOAD: Rebuilding %s\n", image_path);
+	    rc = db_build(image_path, users_file(), commands_path);
+	}
+
+	if (rc < 0 || db_open(image_path, &udb, &ncdb) < 0)
+	{
+	    if (!debug)
+		syslog(LOG_WARNING, "%s: Unusable image, using text files", image_path);
+	    else
+		fprintf(stderr, "CONFIG_LOAD: %s: Unusable image, using text files\n", image_path);
+	}
+    }
+
+    if (udb && users_file())
+	users_load_db(udb);
+    else
+    {
+	db_free(udb);
+	if (userauth_path)
+	    users_load(userauth_path);
+    }
+
+    if (ncdb)
+	ecmd_load_db(ncdb);
+    else if (commands_path)
+	ecmd_load(commands_path);
+
+    if (groups_path && groups_load(groups_path) < 0)
+    {
+	if (!debug)
+	    syslog(LOG_WARNING, "%s: Unable to load groups", groups_path);
+	else
+	    fprintf(stderr, "CONFIG_LOAD: %s: Unable to load groups\n", groups_path);
+    }
+    groups_resolve(users_name2pphone, users_generation());
+
+    pthread_mutex_unlock(&config_mtx);
+    return 0;
+}
+
+
+/*
+ * Recompile one of the text files after it has changed and install
+ * it if it differs from what is loaded. Entries that are unchanged
+ * keep their state (logged in sessions).
+ */
+static int
+config_reload_sect(int type,
+		   const char *path)
+{
+    DB *odb, *ndb;
+    DBDIFF d;
+    struct timespec t0, t1;
+    int n;
+
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+
+    if (type == CONFIG_SECT_GROUPS)
+    {
+	if (groups_load(path) < 0)
+	{
+	    if (!debug)
+		syslog(LOG_WARNING, "%s: Reload failed", path);
+	    else
+		fprintf(stderr, "CONFIG_RELOAD: %s: Reload failed\n", path);
+	    return -1;
+	}
+	return 0;
+    }
+    
+    /* Key-value backends are replaced as a whole */
+    if (type == DB_SECT_USERS && !users_file())
+    {
+	if (users_load(userauth_path) < 0)
+	{
+	    if (!debug)
+		syslog(LOG_WARNING, "%s: Reload failed", path);
+	    else
+		fprintf(stderr, "CONFIG_RELOAD: %s: Reload failed\n", path);
+	    return -1;
+	}
+	
+	if (debug)
+	    fprintf(stderr, "CONFIG_RELOAD: %s: Reopened\n", path);
+	return 0;
+    }
+    
+    ndb = db_compile(type, path);
+    if (!ndb)
+    {
+	if (!debug)
+	    syslog(LOG_WARNING, "%s: Reload failed", path);
+	else
+	    fprintf(stderr, "CONFIG_RELOAD: %s: Reload failed\n", path);
+	return -1;
+    }
+
+    odb = (type == DB_SECT_USERS ? users_db() : cmd_db);
+    n = db_diff(odb, ndb, &d);
+    
+    if (n == 0)
+	db_free(ndb);
+    else if (type == DB_SECT_USERS)
+	users_load_db(ndb);
+    else
+	ecmd_load_db(ndb);
+
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    
+    if (!debug)
+	syslog(LOG_INFO, "%s: Reloaded in %.3f ms: %d added, %d removed, %d changed",
+	       path, (t1.tv_sec-t0.tv_sec)*1000.0 + (t1.tv_nsec-t0.tv_nsec)/1000000.0,
+	       d.added, d.removed, d.changed);
+    else
+	fprintf(stderr, "CONFIG_RELOAD: %s: Reloaded in %.3f ms: %d added, %d removed, %d changed\n",
+		path, (t1.tv_sec-t0.tv_sec)*1000.0 + (t1.tv_nsec-t0.tv_nsec)/1000000.0,
+		d.added, d.removed, d.changed);
+
+    return n;
+}
+
+
+static const char *watch_paths[3];
+static int watch_types[3];
+static int watch_n = 0;
+
+
+/* Called from the file watcher with a bitmask of changed files */
+static void
+config_changed(int changed,
+	       void *misc)
+{
+    int i, n = 0;
+
+
+    pthread_mutex_lock(&config_mtx);
+
+    for (i = 0; i < watch_n; i++)
+	if ((changed & (1 << i)) &&
+	    config_reload_sect(watch_types[i], watch_paths[i]) > 0)
+	    ++n;
+
+    /* The groups and the users they refer to, resolved again if changed */
+    groups_resolve(users_name2pphone, users_generation());
+
+    /* Keep the image in sync for the next restart */
+    if (n > 0 && image_path && db_save(image_path, users_db(), cmd_db) < 0)
+    {
+	if (!debug)
+	    syslog(LOG_WARNING, "%s: Image update failed: %m", image_path);
+	else
+	    fprintf(stderr, "CONFIG_CHANGED: %s: Image update failed: %s\n",
+		    image_path, strerror(errno));
+    }
+    
+    pthread_mutex_unlock(&config_mtx);
+}
+
+
+int
+config_watch(void)
+{
+    if (userauth_path)
+    {
+	users_backend(userauth_path, &watch_paths[watch_n]);
+	watch_types[watch_n++] = DB_SECT_USERS;
+    }
+    
+    if (commands_path)
+    {
+	watch_paths[watch_n] = commands_path;
+	watch_types[watch_n++] = DB_SECT_COMMANDS;
+    }
+
+    if (groups_path)
+    {
+	watch_paths[watch_n] = groups_path;
+	watch_types[watch_n++] = CONFIG_SECT_GROUPS;
+    }
+
+    if (watch_n == 0)
+	return 0;
+    
+    return watch_start((char **) watch_paths, watch_n, CONFIG_DEBOUNCE, config_changed, NULL);
+}
+
+
+void
+daemonize(void)
+{
+    pid_t pid;
+    int fd;
+
+
+    pid = fork();
+    if (pid < 0)
+	exit(EXIT_FAILURE);
+    else if (pid > 0)
+	exit(EXIT_SUCCESS);
+
+    signal(SIGTTOU, SIG_IGN);
+    signal(SIGTTIN, SIG_IGN);
+#ifdef SIGTTOU
+    signal(SIGTTOU, SIG_IGN);
+#endif
+    setsid();
+
+    while (chdir("/") < 0 && errno == EINTR)
+	;
+    umask(022);
+
+    closefrom(0);
+    while ((fd = open("/dev/null", O_RDWR)) < 0 && errno == EINTR)
+	;
+    
+    if (fd != 0)
+	dup2(fd, 0);
+    if (fd != 1)
+	dup2(fd, 1);
+    if (!debug && fd != 2)
+	dup2(fd, 2);
+    if (fd > 2)
+	close(fd);
+}
+
+void
+usage(FILE *fp, char *argv0)
+{
+    fprintf(fp, "Usage: %s [<options>] <serial device>\n",
+	    argv0);
+    fprintf(fp, "Options:\n");
+    fprintf(fp, "  -h                    Display this information\n");
+    fprintf(fp, "  -V                    Print version and exit\n");
+    fprintf(fp, "  -C<commands-path>     Path to commands definition file\n");
+    fprintf(fp, "  -U<users-path>        Path to users definition file\n");
+    fprintf(fp, "  -I<image-path>        Path to compiled users & commands image\n");
+    fprintf(fp, "  -G<groups-path>       Path to recipient groups file\n");
+    fprintf(fp, "  -N<cc>[:<tp>[:<ip>]]  Default country code, trunk & international prefix\n");
+    fprintf(fp, "  -T<autologout-time>   Set autologout timeout\n");
+    fprintf(fp, "  -d[<level>]           Set debug level\n");
+    fprintf(fp, "  -v[<level>]           Set verbosity level\n");
+    fprintf(fp, "  -t                    Enable TTY reader\n");
+    fprintf(fp, "  -p<pin>               SIM card PIN code\n");
+    fprintf(fp, "  -F<fifo-path>         Path to fifo\n");
+    fprintf(fp, "  -W<workers>           Number of command worker threads\n");
+    fprintf(fp, "  -E<backend>           Event loop backend (io_uring, epoll or poll)\n");
+    fprintf(fp, "  -R                    Receive messages directly (+CMT), not via SIM storage\n");
+    fprintf(fp, "  -J<journal-path>      Path to journal of received messages\n");
+    fprintf(fp, "  -K<caps-path>         Path to cache of detected modem capabilities\n");
+    fprintf(fp, "  -S<ms>                Modem command timeout (default: 30000)\n");
+    fprintf(fp, "  -X[<capture-path>]    Capture modem traffic (toggled with SIGUSR2)\n");
+    fprintf(fp, "  -Y<capture-path>      Replay the modem input in a capture and exit\n");
+    fprintf(fp, "  -L<trace-path>        Trace accepted submissions (reopened on SIGHUP)\n");
+    fprintf(fp, "  -Z<trace-path>[:<send-ms>[:<cmd-ms>]]\n");
+    fprintf(fp, "                        Simulate a trace on a virtual clock and exit\n");
+#if HAVE_DOORS
+    fprintf(fp, "  -D<door-path>         Path to door\n");
+#endif
+}
+
+static void
+config_job(void *misc)
+{
+    config_load();
+}
+
+
+/* Start or stop capturing the modem traffic */
+static void
+capture_toggle(void)
+{
+    if (capture)
+    {
+	if (!debug)
+	    syslog(LOG_INFO, "%s: Capture stopped (%lu records, %lu bytes)",
+		   capture_path, capture->records, capture->bytes);
+	else
+	    fprintf(stderr, "CAPTURE: %s: Stopped (%lu records, %lu bytes)\n",
+		    capture_path, capture->records, capture->bytes);
+	capture_close(capture);
+	capture = NULL;
+	return;
+    }
+
+    capture = capture_open(capture_path, serial_device);
+    if (!capture)
+    {
+	if (!debug)
+	    syslog(LOG_ERR, "%s: Capture failed: %m", capture_path);
+	else
+	    fprintf(stderr, "CAPTURE: %s: Failed: %s\n", capture_path, strerror(errno));
+	return;
+    }
+    
+    if (!debug)
+	syslog(LOG_INFO, "%s: Capturing modem traffic", capture_path);
+    else
+	fprintf(stderr, "CAPTURE: %s: Started\n", capture_path);
+}
+
+
+/* Input from a modem without an fd: a capture or a modeled modem */
+static void
+ser_feed(const char *data,
+	 int len,
+	 void *misc)
+{
+    char *buf;
+    int off, n;
+
+    
+    for (off = 0; off < len; off += n)
+    {
+	buf = lb_space(&ser_lb, &n);
+	if (n > len-off)
+	    n = len-off;
+	memcpy(buf, data+off, n);
+	ser_input(loop, -1, buf, n, NULL);
+    }
+}
+
+
+/*
+ * Feed what the modem sent in a capture through the input path (line
+ * buffer, response dispatcher and handlers) as fast as it goes, with
+ * the reads split as they were. Queued modem commands are "sent" where
+ * the capture has a write, so the handlers see the command they answer.
+ * Nothing is written and no commands from messages are run.
+ */
+static int
+replay(const char *path)
+{
+    FILE *fp;
+    struct timespec t0, t1;
+    char rbuf[8192];
+    int dir, len;
+    long long usec, ns = 0;
+    unsigned long reads = 0, writes = 0, bytes = 0;
+
+
+    fp = fopen(path, "r");
+    if (!fp)
+	return -1;
+
+    while ((len = capture_read(fp, &usec, &dir, rbuf, sizeof(rbuf))) >= 0)
+    {
+	/* Keep in step: send (nowhere) what psmsd has queued by now */
+	if (dir != CAPTURE_FROM_MODEM)
+	{
+	    writes++;
+	    xmit_start(loop);
+	    continue;
+	}
+
+	reads++;
+	bytes += len;
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	ser_feed(rbuf, len, NULL);
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	ns += (t1.tv_sec - t0.tv_sec) * 1000000000LL + (t1.tv_nsec - t0.tv_nsec);
+    }
+    fclose(fp);
+
+    fprintf(stderr, "%s: %lu reads (%lu bytes) replayed, %lu writes skipped\n",
+	    path, reads, bytes, writes);
+    fprintf(stderr, "%s: %.3f ms, %.0f ns/read, %.1f ns/byte\n",
+	    path, ns / 1e6, reads ? (double) ns / reads : 0.0, bytes ? (double) ns / bytes : 0.0);
+    return 0;
+}
+
+
+/*
+ * Simulation: the submissions in a trace are sent through a modeled
+ * modem on the virtual clock of the event loop, so the queueing and
+ * scheduling of a day of traffic is seen in seconds. Reports when the
+ * messages were sent, in virtual time, relative to their submission.
+ */
+static TRACE *sim_trace = NULL;
+static TRACE_REC sim_rec;
+static long long sim_t0;		/* Virtual ms of the first submission */
+static int64_t sim_first;		/* ... and its time in the trace */
+static unsigned long sim_subs = 0, sim_rejected = 0, sim_failed = 0;
+static long long *sim_lat = NULL;	/* Submitted to sent, virtual ms */
+static size_t sim_nlat = 0, sim_alat = 0;
+
+
+/* A message has been sent (or failed) by the modeled modem */
+static void
+sim_done(EVLOOP *lp,
+	 XMSG *xp,
+	 int rc)
+{
+    if (strncmp(xp->cmd, "+CMGS=", 6) != 0)
+	return;
+
+    if (rc != 0)
+    {
+	sim_failed++;
+	return;
+    }
+    
+    if (sim_nlat == sim_alat)
+    {
+	long long *nv = realloc(sim_lat, (sim_alat ? sim_alat*2 : 4096) * sizeof(*nv));
+
+	if (!nv)
+	    return;
+	sim_lat = nv;
+	sim_alat = sim_alat ? sim_alat*2 : 4096;
+    }
+    sim_lat[sim_nlat++] = ev_now(lp) - xp->queued;
+}
+
+
+/* Submit what is due in the trace, and wait for the next */
+static void
+sim_submit(EVLOOP *lp,
+	   void *misc)
+{
+    char buf[1024];
+    long long due;
+    int n, rc;
+
+
+    do
+    {
+	n = snprintf(buf, sizeof(buf), "sim-%lu", sim_subs + sim_rejected);
+	while (n < (int) sim_rec.size && n < (int) sizeof(buf)-1)
+	    buf[n++] = 'x';
+	buf[n] = '\0';
+	
+	if (send_sms(sim_rec.to, buf) < 0)
+	    sim_rejected++;
+	else
+	    sim_subs++;
+
+	rc = trace_read(sim_trace, &sim_rec);
+	if (rc <= 0)
+	{
+	    if (rc < 0)
+		fprintf(stderr, "%s: Damaged after %lu records\n", simulate_path, sim_trace->records);
+	    
+	    /* Stop when the queue is empty */
+	    xmit_draining = 1;
+	    xmit_start(lp);
+	    return;
+	}
+	
+	due = sim_t0 + (sim_rec.usec - sim_first) / 1000;
+    } while (due <= ev_now(lp));
+
+    ev_add_timer(lp, (int) (due - ev_now(lp)), sim_submit, NULL);
+}
 
-	rc = -2;
-	door_return((char *) &rc, sizeof(rc), NULL, 0);
-	return;
-    }
 
-    dsp = (DOORSMS *) dataptr;
-    if (debug)
-	fprintf(stderr, "DOOR: servproc: sending SMS to %s: %s\n", dsp->phone, dsp->message);
-    
-    rc = send_sms(dsp->phone, dsp->message);
+static int
+sim_cmp(const void *a,
+	const void *b)
+{
+    long long x = *(const long long *) a, y = *(const long long *) b;
 
-    if (debug)
-	fprintf(stderr, "DOOR: servproc: send_sms returned: %d\n", rc);
-    
-    door_return((char *) &rc, sizeof(rc), NULL, 0);
+    return x < y ? -1 : x > y;
 }
 
 
-
-int
-door_start_server(const char *path)
+static int
+simulate(const char *path)
 {
-    int rc, fd;
+    struct timespec t0, t1;
+    double wall, span;
+    EVSTATS st;
+    int rc;
+    
+
+    sim_trace = trace_open_read(path);
+    if (!sim_trace)
+	return -1;
 
+    rc = trace_read(sim_trace, &sim_rec);
+    if (rc < 0)
+	return -1;
     
-    while ((rc = unlink(path)) < 0 && errno == EINTR)
-	;
-    if (rc < 0 && errno != ENOENT)
-	error("unlink(\"%s\") failed: %s\n", path, strerror(errno));
+    /* Messages submitted before the modem is up wait for it, as at a start */
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    sim_t0 = ev_now(loop);
+    if (rc > 0)
+    {
+	sim_first = sim_rec.usec;
+	ev_add_timer(loop, 0, sim_submit, NULL);
+	ev_run(loop);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+
+    trace_close(sim_trace);
+    sim_trace = NULL;
     
-    while ((fd = open(path, O_CREAT|O_RDWR, 0644)) < 0 && errno == EINTR)
-	;
-    if (fd < 0)
-	error("open(\"%s\") failed: %s\n", path, strerror(errno));
+    wall = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+    span = (ev_now(loop) - sim_t0) / 1000.0;
+    ev_stats(loop, &st);
     
-    while ((rc = close(fd)) < 0 && errno == EINTR)
-	;
-    if (rc < 0)
-	error("close(%d) failed: %s\n", fd, strerror(errno));
-
-    fd = door_create(door_servproc, NULL, DOOR_UNREF);
-    if (fd < 0)
-	error("door_create() failed: %s\n", strerror(errno));
-
-    if (fattach(fd, path) < 0)
-	error("fattach(\"%s\") failed: %s\n", path, strerror(errno)); 
+    fprintf(stderr, "%s: %lu submissions (%lu rejected), %lu messages sent (%lu failed)\n",
+	    path, sim_subs, sim_rejected, (unsigned long) sim_nlat, sim_failed);
+    fprintf(stderr, "%s: %.1f s simulated in %.3f s (%.0fx), %lu modem commands\n",
+	    path, span, wall, wall > 0 ? span / wall : 0.0, vmodem->commands);
+    if (sim_nlat)
+    {
+	qsort(sim_lat, sim_nlat, sizeof(*sim_lat), sim_cmp);
+	fprintf(stderr, "%s: Submitted to sent: p50 %.3f s, p99 %.3f s, max %.3f s\n",
+		path, sim_lat[sim_nlat/2] / 1000.0, sim_lat[(sim_nlat-1)*99/100] / 1000.0,
+		sim_lat[sim_nlat-1] / 1000.0);
+    }
+    free(sim_lat);
     
     return 0;
 }
-#endif
 
 
 static void
-autologout_handler(USER *up)
-{
-    send_sms(up->cphone, "Autologout\r(Inactivity)");
-}
-
-void
-daemonize(void)
+main_signal(EVLOOP *lp,
+	    int sig,
+	    void *misc)
 {
-    pid_t pid;
-    int fd;
+    if (debug)
+	fprintf(stderr, "MAIN: Got signal: %d\n", sig);
+	
+    switch (sig)
+    {
+      case SIGHUP:
+	/* Reload config files - in a worker, it may take a while */
+	pool_run(workers, 0, config_job, NULL);
 
+	/* Start a new trace file if it has been rotated */
+	if (trace && trace_reopen(trace) < 0)
+	{
+	    if (!debug)
+		syslog(LOG_ERR, "%s: Trace failed: %m", trace_path);
+	    else
+		fprintf(stderr, "TRACE: %s: Failed: %s\n", trace_path, strerror(errno));
+	}
+	break;
+	    
+      case SIGTERM:
+	/* Terminate gracefully */
+	ev_stop(lp);
+	break;
 
-    pid = fork();
-    if (pid < 0)
-	exit(EXIT_FAILURE);
-    else if (pid > 0)
-	exit(EXIT_SUCCESS);
+      case SIGUSR2:
+	capture_toggle();
+	break;
 
-    signal(SIGTTOU, SIG_IGN);
-    signal(SIGTTIN, SIG_IGN);
+      case SIGPIPE:
 #ifdef SIGTTOU
-    signal(SIGTTOU, SIG_IGN);
+      case SIGTTOU:
 #endif
-    setsid();
+	/* Ignore */
+	break;
 
-    while (chdir("/") < 0 && errno == EINTR)
-	;
-    umask(022);
+      case SIGINT:
+	exit(1);
+	    
+      default:
+	fprintf(stderr, "MAIN: Unhandled signal (%d) received", sig);
+    }
+}
 
-    closefrom(0);
-    while ((fd = open("/dev/null", O_RDWR)) < 0 && errno == EINTR)
-	;
-    
-    if (fd != 0)
-	dup2(fd, 0);
-    if (fd != 1)
-	dup2(fd, 1);
-    if (!debug && fd != 2)
-	dup2(fd, 2);
-    if (fd > 2)
-	close(fd);
+
+static void
+main_drain_timeout(EVLOOP *lp,
+		   void *misc)
+{
+    if (debug)
+	fprintf(stderr, "MAIN: Timeout sending queued modem commands\n");
+    ev_stop(lp);
 }
 
-void
-usage(FILE *fp, char *argv0)
+
+static void
+autologout_tick(EVLOOP *lp,
+		void *misc)
 {
-    fprintf(fp, "Usage: %s [<options>] <serial device>\n",
-	    argv0);
-    fprintf(fp, "Options:\n");
-    fprintf(fp, "  -h                    Display this information\n");
-    fprintf(fp, "  -V                    Print version and exit\n");
-    fprintf(fp, "  -C<commands-path>     Path to commands definition file\n");
-    fprintf(fp, "  -U<users-path>        Path to users definition file\n");
-    fprintf(fp, "  -T<autologout-time>   Set autologout timeout\n");
-    fprintf(fp, "  -d[<level>]           Set debug level\n");
-    fprintf(fp, "  -v[<level>]           Set verbosity level\n");
-    fprintf(fp, "  -t                    Enable TTY reader\n");
-    fprintf(fp, "  -p<pin>               SIM card PIN code\n");
-    fprintf(fp, "  -F<fifo-path>         Path to fifo\n");
-#if HAVE_DOORS
-    fprintf(fp, "  -D<door-path>         Path to door\n");
-#endif
+    int n;
+
+    n = users_autologout_run();
+    if (n > 0)
+	ev_add_timer(lp, n*1000, autologout_tick, NULL);
 }
 
+
 void
 p_header(void)
 {
@@ -1244,9 +3460,8 @@ int
 main(int argc,
      char *argv[])
 {
-    pthread_t t_recv, t_xmit, t_tty, t_fifo;
     sigset_t srvsigset;
-    int sig, rc, fd, i;
+    int rc, fd, fifo_fd = -1, i, capture_start = 0;
     char *pin = NULL;
     double t;
     
@@ -1274,6 +3489,25 @@ main(int argc,
 	    userauth_path = s_dup(argv[i]+2);
 	    break;
 	    
+	  case 'I':
+	    if (!argv[i][2])
+		error("Missing path argument for -I");
+	    
+	    image_path = s_dup(argv[i]+2);
+	    break;
+	    
+	  case 'G':
+	    if (!argv[i][2])
+		error("Missing path argument for -G");
+	    
+	    groups_path = s_dup(argv[i]+2);
+	    break;
+	    
+	  case 'N':
+	    if (phone_setup(argv[i]+2) < 0)
+		error("Invalid phone number convention for -N: %s", argv[i]+2);
+	    break;
+	    
 	  case 'T':
 	    rc = time_get(argv[i]+2, &t);
 	    if (rc > 0)
@@ -1324,6 +3558,79 @@ main(int argc,
 		fifo_path = FIFO_PATH;
 	    break;
 	    
+	  case 'R':
+	    direct_delivery = 1;
+	    break;
+	    
+	  case 'E':
+	    if (!argv[i][2])
+		error("Missing backend argument for -E");
+	    
+	    ev_type = s_dup(argv[i]+2);
+	    break;
+	    
+	  case 'K':
+	    if (!argv[i][2])
+		error("Missing path argument for -K");
+	    
+	    caps_path = s_dup(argv[i]+2);
+	    break;
+	    
+	  case 'J':
+	    if (!argv[i][2])
+		error("Missing path argument for -J");
+	    
+	    journal_path = s_dup(argv[i]+2);
+	    break;
+	    
+	  case 'L':
+	    if (!argv[i][2])
+		error("Missing path argument for -L");
+	    
+	    trace_path = s_dup(argv[i]+2);
+	    break;
+	    
+	  case 'X':
+	    if (argv[i][2])
+		capture_path = s_dup(argv[i]+2);
+	    capture_start = 1;
+	    break;
+	    
+	  case 'Y':
+	    if (!argv[i][2])
+		error("Missing path argument for -Y");
+	    
+	    replay_path = s_dup(argv[i]+2);
+	    break;
+	    
+	  case 'Z':
+	    if (!argv[i][2])
+		error("Missing path argument for -Z");
+	    
+	    simulate_path = s_dup(argv[i]+2);
+	    {
+		char *cp = strchr(simulate_path, ':');
+
+		if (cp)
+		{
+		    *cp++ = '\0';
+		    if (sscanf(cp, "%d:%d", &sim_send_ms, &sim_cmd_ms) < 1 ||
+			sim_send_ms < 0 || sim_cmd_ms < 0)
+			error("Invalid modem latency for -Z");
+		}
+	    }
+	    break;
+	    
+	  case 'S':
+	    if (sscanf(argv[i]+2, "%d", &serial_timeout) != 1 || serial_timeout < 1)
+		error("Invalid argument for -S");
+	    break;
+	    
+	  case 'W':
+	    if (sscanf(argv[i]+2, "%d", &nworkers) != 1 || nworkers < 1)
+		error("Invalid argument for -W");
+	    break;
+	    
 #if HAVE_DOORS	    
 	  case 'D':
 	    if (argv[i][2])
@@ -1349,7 +3656,19 @@ main(int argc,
     if (i < argc)
 	serial_device = argv[i++];
     
-    if (access(serial_device, R_OK|W_OK) < 0) {
+    if (replay_path || simulate_path)
+    {
+	/* Nothing is written: no modem, journal, capabilities or fifo */
+	if (simulate_path)
+	    ev_type = "virtual";
+	journal_path = NULL;
+	caps_path = NULL;
+	fifo_path = NULL;
+	tty_reader = 0;
+	capture_start = 0;
+	trace_path = NULL;
+    }
+    else if (access(serial_device, R_OK|W_OK) < 0) {
 	fprintf(stderr, "%s: %s: %s\n", argv[0], serial_device, strerror(errno));
 	exit(1);
     }
@@ -1359,128 +3678,234 @@ main(int argc,
 	/* XXX: Check for errors */
     }
     
-    if (!debug)
+    if (!debug && !replay_path && !simulate_path)
 	daemonize();
     
     openlog(argv[0], LOG_NDELAY|LOG_NOWAIT|(verbose ? LOG_CONS : 0), LOG_LOCAL3);
     syslog(LOG_INFO, "Version %s started", VERSION);
     
-    fd = serial_open(serial_device, serial_speed, serial_timeout);
-    if (fd < 0)
-	error("Open of serial device: %s: %s", serial_device, strerror(errno));
-
-    ser_r_fp = fdopen(fd, "r");
-    ser_w_fp = fdopen(fd, "w");
+    clock_gettime(CLOCK_MONOTONIC, &modem_t0);
 
-    putc(27, ser_w_fp);
-    fflush(ser_w_fp);
-    sleep(1);
+    if (!replay_path && !simulate_path)
+    {
+	fd = serial_open(serial_device, serial_speed, serial_timeout);
+	if (fd < 0)
+	    error("Open of serial device: %s: %s", serial_device, strerror(errno));
+	
+	ser_fd = fd;
+	
+	/* The event loop never waits for the modem */
+	fcntl(ser_fd, F_SETFL, fcntl(ser_fd, F_GETFL) | O_NONBLOCK);
+	
+	if (capture_start)
+	    capture_toggle();
+	
+	/* Get the modem out of any half entered command */
+	if (serial_write(ser_fd, "\033", 1, serial_timeout) < 0)
+	    error("Write to serial device: %s: %s", serial_device, strerror(errno));
+	if (capture)
+	    capture_record(capture, CAPTURE_TO_MODEM, "\033", 1);
+    }
 			   
     sigemptyset(&srvsigset);
     sigaddset(&srvsigset, SIGINT);
     sigaddset(&srvsigset, SIGHUP);
     sigaddset(&srvsigset, SIGTERM);
     sigaddset(&srvsigset, SIGPIPE);
+    sigaddset(&srvsigset, SIGUSR2);
 #ifdef SIGTTOU
     sigaddset(&srvsigset, SIGTTOU);
 #endif
     
+    /* Blocked in all threads, delivered through the event loop */
     pthread_sigmask(SIG_BLOCK, &srvsigset, NULL);
 
-    pthread_mutex_init(&resp_mtx, NULL);
-    pthread_cond_init(&resp_cv, NULL);
-    
+    pthread_mutex_init(&config_mtx, NULL);
     pthread_mutex_init(&ecmd_mtx, NULL);
     
-    if (commands_path)
-	ecmd_load(commands_path);
+    config_load();
+
+    if (config_watch() < 0 && errno != ENOSYS)
+    {
+	if (!debug)
+	    syslog(LOG_WARNING, "Config file watch failed: %m");
+	else
+	    fprintf(stderr, "MAIN: Config file watch failed: %s\n", strerror(errno));
+    }
     
-    if (userauth_path)
-	users_load(userauth_path);
+    journal = journal_open(journal_path);
+    if (!journal)
+	error("Journal: %s: %s", journal_path ? journal_path : "(memory)", strerror(errno));
+    
+    if (trace_path)
+    {
+	trace = trace_open(trace_path);
+	if (!trace)
+	    error("Trace: %s: %s", trace_path, strerror(errno));
+    }
     
-    q_xmit = queue_create();
+    q_xmit = mpsc_create(xmit_wake, NULL);
+    q_urgent = mpsc_create(xmit_wake, NULL);
+    xmsg_slab = slab_create(sizeof(XMSG), XMSG_CHUNK);
+    if (!q_xmit || !q_urgent || !xmsg_slab)
+	error("Modem queues: %s", strerror(errno));
+
+    loop = ev_create(ev_type);
+    if (!loop)
+	error("Event loop: %s", strerror(errno));
+
+    workers = pool_create(nworkers);
+    if (!workers)
+	error("Worker threads: %s", strerror(errno));
     
-    if (debug)
-	fprintf(stderr, "MAIN: Starting threads:\n");
+    if (ev_add_signals(loop, &srvsigset, main_signal, NULL) < 0)
+	error("Signal handling: %s", strerror(errno));
+
+    ev_set_wakeup(loop, xmit_wakeup, NULL);
+
+    if (simulate_path)
+    {
+	vmodem = vm_create(loop, sim_cmd_ms, sim_send_ms, ser_feed, NULL);
+	if (!vmodem)
+	    error("Modeled modem: %s", strerror(errno));
+    }
     
-    pthread_create(&t_recv, NULL, ser_recv_thread, NULL);
-    pthread_create(&t_xmit, NULL, ser_xmit_thread, NULL);
+    if (ss_init(&sim, 256) < 0)
+	error("SIM storage map: %s", strerror(errno));
+    
+    ser_parts = mp_create(MPART_MAX_SETS, MPART_MAX_BYTES, MPART_TIMEOUT, ser_parts_report);
+    if (!ser_parts)
+	error("Message reassembly: %s", strerror(errno));
+    
+    if (ser_parser_init(loop) < 0)
+	error("Modem response parser: %s", strerror(errno));
+    
+    if (lb_init(&ser_lb, SER_INPUT_SIZE) < 0)
+	error("%s: Input buffer: %s", serial_device, strerror(errno));
+    {
+	char *buf;
+	int n;
+	
+	buf = lb_space(&ser_lb, &n);
+	if (ser_fd >= 0 && ev_add_reader(loop, ser_fd, buf, n, ser_input, NULL) < 0)
+	    error("%s: Event loop: %s", serial_device, strerror(errno));
+    }
 
     if (autologout_time > 0)
+    {
 	users_autologout_start(autologout_time, autologout_handler);
+	ev_add_timer(loop, autologout_time*1000, autologout_tick, NULL);
+    }
     
-    if (pin)
-	send_pin(pin);
+    modem_init(pin);
 
-    select_charset("HEX");
-    
-    list_sms("ALL");
+    if (replay_path)
+    {
+	if (replay(replay_path) < 0)
+	    error("Replay: %s: %s", replay_path, strerror(errno));
+	exit(0);
+    }
+
+    if (simulate_path)
+    {
+	if (simulate(simulate_path) < 0)
+	    error("Simulation: %s: %s", simulate_path,
+		  errno == EINVAL ? "Not a psmsd trace" : strerror(errno));
+	exit(0);
+    }
     
 #if HAVE_DOORS
     if (door_path)
 	door_start_server(door_path);
 #endif
-    
+
+    /* Opened read-write so it never sees EOF when writers close it */
     if (fifo_path)
-	pthread_create(&t_fifo,  NULL, fifo_read_thread, (void *) fifo_path);
+    {
+	fifo_fd = open(fifo_path, O_RDWR|O_NONBLOCK|O_CLOEXEC);
+	if (fifo_fd < 0 || line_reader(loop, fifo_fd, &fifo_in) < 0)
+	{
+	    if (!debug)
+		syslog(LOG_WARNING, "%s: Fifo disabled: %m", fifo_path);
+	    else
+		fprintf(stderr, "MAIN: %s: Fifo disabled: %s\n", fifo_path, strerror(errno));
+	    if (fifo_fd >= 0)
+		close(fifo_fd);
+	    fifo_fd = -1;
+	}
+    }
 
-    if (tty_reader)
-	pthread_create(&t_tty,  NULL, tty_read_thread, NULL);
+    if (tty_reader && line_reader(loop, 0, &tty_in) < 0)
+	error("TTY reader: %s", strerror(errno));
+
+    if (debug)
+	fprintf(stderr, "MAIN: Running\n");
 
+    rc = ev_run(loop);
+
+    /*
+     * Shut down: stop taking new input, let the workers finish the
+     * commands they have, then send what is queued for the modem
+     * (bounded by the modem timeout).
+     */
     if (debug)
-	fprintf(stderr, "MAIN: Waiting for signals...\n");
+	fprintf(stderr, "MAIN: Stopping\n");
+
+    watch_stop();
+    users_autologout_stop();
     
-    while ((rc = sigwait(&srvsigset, &sig)) == 0)
+    if (fifo_fd >= 0)
     {
-	if (debug)
-	    fprintf(stderr, "MAIN: Got signal: %d\n", sig);
-	
-	switch (sig)
-	{
-	  case SIGHUP:
-	    /* Close and reopen config & log files */
-	    if (commands_path)
-		ecmd_load(commands_path);
-	    if (userauth_path)
-		users_load(userauth_path);
-	    break;
-	    
-	  case SIGTERM:
-	    /* Terminate gracefully - close server socket, but wait for
-	       other active threads to finish */
-
-	    abort_threads = 1;
-	    
-	    /* Tell SER_XMIT to terminate */
-	    queue_put(q_xmit, NULL);
+	ev_del_fd(loop, fifo_fd);
+	close(fifo_fd);
+    }
+    if (tty_reader)
+	ev_del_fd(loop, 0);
 
-	    /* Tell SER_RECV to terminate */
-	    pthread_kill(t_recv, SIGUSR1);
-	    
-	    /* XXX: Kill autologout_thread and tty_read_thread - if active */
-	    if (debug)
-		fprintf(stderr, "Stopping autologout thread...\n");
-	    users_autologout_stop();
-	    if (debug)
-		fprintf(stderr, "Stopping tty reader thread...\n");
-	    close(0);
-	    if (debug)
-		fprintf(stderr, "Terminating main thread...\n");
-	    pthread_exit(NULL);
+    pool_destroy(workers);
+    workers = NULL;
 
-	  case SIGPIPE:
-	  case SIGTTOU:
-	    /* Ignore */
-	    break;
+    mp_destroy(ser_parts);
+    ser_parts = NULL;
 
-	  case SIGINT:
-	    queue_put(q_xmit, NULL);
-	    exit(1);
-	    
-	  default:
-	    fprintf(stderr, "MAIN: Unhandled signal (%d) received", sig);
-	}
+    if (rc == 0 && !main_exit)
+    {
+	xmit_draining = 1;
+	ev_add_timer(loop, serial_timeout, main_drain_timeout, NULL);
+	xmit_start(loop);
+	if (xmit_cur)
+	    ev_run(loop);
     }
 
-    return 1;
+    if (capture)
+	capture_toggle();
+
+    if (trace)
+    {
+	if (debug)
+	    fprintf(stderr, "TRACE: %s: %lu submissions\n", trace_path, trace->records);
+	trace_close(trace);
+	trace = NULL;
+    }
+    
+    if (debug)
+    {
+	EVSTATS st;
+
+	ev_stats(loop, &st);
+	fprintf(stderr, "MAIN: Event loop (%s): %lu syscalls, %lu wakeups, %lu events\n",
+		ev_backend(loop), st.syscalls, st.wakeups, st.events);
+	fprintf(stderr, "MAIN: Event loop (%s): %lu bytes in %lu reads (%.1f/read), %lu bytes out in %lu writes (%.1f/write)\n",
+		ev_backend(loop),
+		st.rbytes, st.reads, st.reads ? (double) st.rbytes/st.reads : 0.0,
+		st.wbytes, st.writes, st.writes ? (double) st.wbytes/st.writes : 0.0);
+	fprintf(stderr, "MAIN: Modem commands: %lu allocated, peak %lu in use, %lu KB in %lu chunks\n",
+		xmsg_slab->allocs, xmsg_slab->peak,
+		(xmsg_slab->nchunks * XMSG_CHUNK * xmsg_slab->size + 1023) / 1024,
+		xmsg_slab->nchunks);
+	fprintf(stderr, "MAIN: Terminated\n");
+    }
+    
+    exit(main_exit);
 }
+
@@ -33,6 +33,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <errno.h>
 
 #include "queue.h"
 
@@ -41,15 +42,23 @@ QUEUE *
 queue_create(void)
 {
     QUEUE *qp;
+    pthread_condattr_t ca;
 
     qp = malloc(sizeof(*qp));
     if (!qp)
 	return NULL;
 
     pthread_mutex_init(&qp->mtx, NULL);
-    pthread_cond_init(&qp->cv, NULL);
+
+    /* Deadlines are not moved by changes to the wall clock */
+    pthread_condattr_init(&ca);
+    pthread_condattr_setclock(&ca, CLOCK_MONOTONIC);
+    pthread_cond_init(&qp->cv, &ca);
+    pthread_condattr_destroy(&ca);
 
     qp->head = qp->tail = NULL;
+    qp->waiting = 0;
+    qp->closed = 0;
     return qp;
 }
 
@@ -57,60 +66,225 @@ queue_create(void)
 int
 queue_put(QUEUE *qp, void *p)
 {
-    QENTRY *qep;
+    return queue_putv(qp, &p, 1);
+}
 
 
-    if (!qp)
-	return -1;
-    
-    qep = malloc(sizeof(*qep));
-    if (!qep)
+/* Put several entries at once, in order, with a single lock/wakeup */
+int
+queue_putv(QUEUE *qp, void **pv, int pc)
+{
+    QENTRY *head = NULL, *tail = NULL, *qep;
+    int i;
+
+
+    if (!qp || pc < 0)
 	return -1;
 
-    qep->p = p;
-    qep->next = NULL;
+    if (pc == 0)
+	return 0;
+
+    for (i = 0; i < pc; i++)
+    {
+	qep = malloc(sizeof(*qep));
+	if (!qep)
+	{
+	    for (; head; head = qep)
+	    {
+		qep = head->next;
+		free(head);
+	    }
+	    return -1;
+	}
+
+	qep->p = pv[i];
+	qep->next = NULL;
+	if (tail)
+	    tail->next = qep;
+	else
+	    head = qep;
+	tail = qep;
+    }
     
     pthread_mutex_lock(&qp->mtx);
-    
-    if (qp->tail)
+
+    if (qp->closed)
     {
-	qp->tail->next = qep;
-	qp->tail = qep;
+	pthread_mutex_unlock(&qp->mtx);
+	for (; head; head = qep)
+	{
+	    qep = head->next;
+	    free(head);
+	}
+	errno = EPIPE;
+	return -1;
     }
+    
+    if (qp->tail)
+	qp->tail->next = head;
     else
-	qp->head = qp->tail = qep;
+	qp->head = head;
+    qp->tail = tail;
 
-    pthread_cond_signal(&qp->cv);
+    /* One consumer per entry at most */
+    if (qp->waiting > 1 && pc > 1)
+	pthread_cond_broadcast(&qp->cv);
+    else if (qp->waiting)
+	pthread_cond_signal(&qp->cv);
     pthread_mutex_unlock(&qp->mtx);
     return 0;
 }
 
 
-void *
-queue_get(QUEUE *qp)
+/*
+ * Take up to 'pc' entries, waiting until 'deadline' (NULL: for ever)
+ * for the first. Returns the number taken, 0 at the deadline, or -1
+ * if the queue is closed and empty.
+ */
+static int
+queue_take(QUEUE *qp,
+	   void **pv,
+	   int pc,
+	   const struct timespec *deadline)
 {
-    void *p;
-    QENTRY *qep;
+    QENTRY *first, *qep;
+    int n, rc = 0, closed;
     
 
-    if (!qp)
-	return NULL;
+    if (!qp || pc < 1)
+	return -1;
     
     pthread_mutex_lock(&qp->mtx);
-    while ((qep = qp->head) == NULL)
-	pthread_cond_wait(&qp->cv, &qp->mtx);
+    while (!qp->head && !qp->closed && rc != ETIMEDOUT)
+    {
+	qp->waiting++;
+	if (deadline)
+	    rc = pthread_cond_timedwait(&qp->cv, &qp->mtx, deadline);
+	else
+	    pthread_cond_wait(&qp->cv, &qp->mtx);
+	qp->waiting--;
+    }
 
-    p = qep->p;
+    first = qp->head;
+    if (!first)
+    {
+	closed = qp->closed;
+	pthread_mutex_unlock(&qp->mtx);
+	return closed ? -1 : 0;
+    }
+    
+    for (n = 0, qep = first; n < pc-1 && qep->next; n++)
+	qep = qep->next;
     qp->head = qep->next;
-    if (qp->tail == qep)
+    if (!qp->head)
 	qp->tail = NULL;
+    qep->next = NULL;
+
+    /* Entries left for another consumer that was not signalled */
+    if (qp->head && qp->waiting)
+	pthread_cond_signal(&qp->cv);
     pthread_mutex_unlock(&qp->mtx);
-    free(qep);
 
+    for (n = 0; first; first = qep, n++)
+    {
+	qep = first->next;
+	pv[n] = first->p;
+	free(first);
+    }
+    
+    return n;
+}
+
+
+static struct timespec *
+queue_deadline(struct timespec *ts,
+	       int ms)
+{
+    if (ms < 0)
+	return NULL;
+
+    clock_gettime(CLOCK_MONOTONIC, ts);
+    ts->tv_sec += ms / 1000;
+    ts->tv_nsec += (ms % 1000) * 1000000L;
+    if (ts->tv_nsec >= 1000000000L)
+    {
+	ts->tv_sec++;
+	ts->tv_nsec -= 1000000000L;
+    }
+    return ts;
+}
+
+
+/* Get an entry into *pp. Returns 1, 0 at the deadline or -1 if closed */
+int
+queue_get_until(QUEUE *qp,
+		void **pp,
+		const struct timespec *deadline)
+{
+    return queue_take(qp, pp, 1, deadline);
+}
+
+
+/* As queue_get_until(), waiting 'ms' (for ever if < 0, not at all if 0) */
+int
+queue_get_timed(QUEUE *qp,
+		void **pp,
+		int ms)
+{
+    struct timespec ts;
+
+    return queue_take(qp, pp, 1, queue_deadline(&ts, ms));
+}
+
+
+/* Take up to 'pc' entries in one go, waiting 'ms' for the first */
+int
+queue_getv(QUEUE *qp,
+	   void **pv,
+	   int pc,
+	   int ms)
+{
+    struct timespec ts;
+
+    return queue_take(qp, pv, pc, queue_deadline(&ts, ms));
+}
+
+
+/* Waits for an entry. NULL if the queue is closed (or the entry is NULL) */
+void *
+queue_get(QUEUE *qp)
+{
+    void *p;
+
+    if (queue_take(qp, &p, 1, NULL) <= 0)
+	return NULL;
+    return p;
+}
+
+
+/* Returns the first entry, or NULL at once if the queue is empty */
+void *
+queue_tryget(QUEUE *qp)
+{
+    void *p;
+
+    if (queue_get_timed(qp, &p, 0) <= 0)
+	return NULL;
     return p;
 }
 
 
+/* No more puts: wake up all consumers, to take what is left and stop */
+void
+queue_close(QUEUE *qp)
+{
+    pthread_mutex_lock(&qp->mtx);
+    qp->closed = 1;
+    pthread_cond_broadcast(&qp->cv);
+    pthread_mutex_unlock(&qp->mtx);
+}
+
+
 void
 queue_destroy(QUEUE *qp)
 {
@@ -121,5 +295,7 @@ queue_destroy(QUEUE *qp)
 	qn = qc->next;
 	free(qc);
     }
+    pthread_cond_destroy(&qp->cv);
+    pthread_mutex_destroy(&qp->mtx);
     free(qp);
 }
@@ -35,6 +35,7 @@
 #define QUEUE_H
 
 #include <pthread.h>
+#include <time.h>
 
 
 typedef struct qentry
@@ -45,6 +46,12 @@ typedef struct qentry
 } QENTRY;
 
 
+/*
+ * A queue any number of threads put to and get from. Gets wait for an
+ * entry, optionally until a deadline (CLOCK_MONOTONIC). After
+ * queue_close() puts fail, and gets return what is left and then -1
+ * in all waiting and later consumers.
+ */
 typedef struct queue
 {
     pthread_mutex_t mtx;
@@ -52,6 +59,8 @@ typedef struct queue
 
     QENTRY *head;
     QENTRY *tail;
+    int waiting;	/* Consumers in pthread_cond_wait */
+    int closed;
 } QUEUE;
 
 
@@ -61,9 +70,27 @@ queue_create(void);
 extern int
 queue_put(QUEUE *qp, void *p);
 
+extern int
+queue_putv(QUEUE *qp, void **pv, int pc);
+
+extern int
+queue_get_until(QUEUE *qp, void **pp, const struct timespec *deadline);
+
+extern int
+queue_get_timed(QUEUE *qp, void **pp, int ms);
+
+extern int
+queue_getv(QUEUE *qp, void **pv, int pc, int ms);
+
 extern void *
 queue_get(QUEUE *qp);
 
+extern void *
+queue_tryget(QUEUE *qp);
+
+extern void
+queue_close(QUEUE *qp);
+
 extern void
 queue_destroy(QUEUE *qp);
 
@@ -38,6 +38,7 @@
 #include <string.h>
 #include <termios.h>
 #include <unistd.h>
+#include <time.h>
 
 #include <poll.h>
 #include <sys/ioctl.h>
@@ -45,6 +46,7 @@
 #include <sys/filio.h>
 #endif
 #include <sys/stat.h>
+#include <sys/uio.h>
 
 #include <sys/types.h>
 #include <sys/socket.h>
@@ -57,6 +59,8 @@
 int debug;
 int verbose;
 
+SERIAL_STATS serial_stats;
+
 
 static struct
 {
@@ -163,56 +167,118 @@ serial_read(int fd,
     if (avail > bufsize)
 	avail = bufsize;
     
-    code = read(fd, buf, avail);
+    return read(fd, buf, avail);
+}
 
-    if (debug > 2)
-    {
-	int i;
 
-	for (i = 0; i < code; i++)
-	    fprintf(stderr, "serial_read: read char 0x%02x\n", buf[i]);
-    }
+static long long
+serial_now(void)
+{
+    struct timespec ts;
 
-    return code;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long) ts.tv_sec*1000 + ts.tv_nsec/1000000;
 }
 
 
+/*
+ * Write all of 'iov' with as few writev() calls as the tty allows,
+ * waiting for it to become writable only after a short write. The
+ * timeout (milliseconds, -1 for none) is for the whole write. Returns
+ * the number of bytes written. The iovec array is modified.
+ */
 int
-serial_write(int fd,
-	     const char *buf,
-	     int bufsize,
-	     int timeout)
+serial_writev(int fd,
+	      struct iovec *iov,
+	      int iovcnt,
+	      int timeout)
 {
     struct pollfd pfd;
-    int i, code;
+    long long deadline = timeout < 0 ? -1 : serial_now() + timeout;
+    int code, total = 0, ms;
+    ssize_t n;
 
 
     pfd.fd = fd;
     pfd.events = POLLOUT;
-    pfd.revents = 0;
 
-    for (i = 0; i < bufsize; i++)
+    for (;;)
     {
-	code = poll(&pfd, 1, timeout);
-	if (code == 0)
+	while (iovcnt > 0 && iov->iov_len == 0)
 	{
-	    errno = EINTR;
-	    return i ? i : SERIAL_E_UNIX_ERROR;
+	    ++iov;
+	    --iovcnt;
 	}
+	if (iovcnt == 0)
+	    return total;
+
+	n = writev(fd, iov, iovcnt);
+	serial_stats.writes++;
+
+	if (n > 0)
+	{
+	    serial_stats.bytes += n;
+	    total += n;
+	    
+	    if (debug > 2)
+		fprintf(stderr, "serial_write: wrote %d bytes\n", (int) n);
+
+	    while (n > 0 && (size_t) n >= iov->iov_len)
+	    {
+		n -= iov->iov_len;
+		iov->iov_len = 0;
+		++iov;
+		--iovcnt;
+	    }
+	    if (n > 0)
+	    {
+		iov->iov_base = (char *) iov->iov_base + n;
+		iov->iov_len -= n;
+	    }
+	    continue;
+	}
+
+	if (n < 0 && errno == EINTR)
+	    continue;
 	
-	if (code < 0)
-	    return i ? i : code;
-	
-	code = write(fd, buf+i, 1);
+	if (n < 0 && errno != EAGAIN)
+	    return total ? total : SERIAL_E_UNIX_ERROR;
 
-	if (debug > 2)
-	    fprintf(stderr, "serial_write: wrote char 0x%02x\n", buf[i]);
+	/* Short write - wait until the tty takes more */
+	ms = -1;
+	if (deadline >= 0)
+	{
+	    ms = (int) (deadline - serial_now());
+	    if (ms < 0)
+		ms = 0;
+	}
+
+	pfd.revents = 0;
+	serial_stats.waits++;
+	code = poll(&pfd, 1, ms);
+	if (code == 0)
+	{
+	    errno = EINTR;
+	    return total ? total : SERIAL_E_UNIX_ERROR;
+	}
 	
-	if (code <= 0)
-	    return i ? i : code;
+	if (code < 0 && errno != EINTR)
+	    return total ? total : code;
     }
+}
+
 
-    return bufsize;
+int
+serial_write(int fd,
+	     const char *buf,
+	     int bufsize,
+	     int timeout)
+{
+    struct iovec iov;
+
+    iov.iov_base = (void *) buf;
+    iov.iov_len = bufsize;
+    return serial_writev(fd, &iov, 1, timeout);
 }
 
 
@@ -267,9 +333,9 @@ serial_strerror(int code)
 int
 serial_open(const char *devname,
 	    int speed,
-	    int timeout) /* should be device open timeout - not used */
+	    int timeout) /* ms to wait for the device (or socket) to connect */
 {
-    int fd, scode;
+    int fd, scode, flags;
     struct termios tiob;
     char devbuf[1024];
     struct stat sb;
@@ -306,12 +372,43 @@ serial_open(const char *devname,
 	    return SERIAL_E_UNIX_ERROR;
 
 	/* Set socket to non-blocking and poll (for timeout) */
+	flags = fcntl(fd, F_GETFL);
+	fcntl(fd, F_SETFL, flags | O_NONBLOCK);
 	
 	if (connect(fd, (struct sockaddr *) &sb, sizeof(sb.sun_family)+len) < 0)
 	{
-	    (void) close(fd);
-	    return SERIAL_E_UNIX_ERROR;
+	    long long deadline = serial_now() + timeout;
+	    int err = errno;
+	    socklen_t elen = sizeof(err);
+
+	    /* A full listen backlog (EAGAIN) is retried until the deadline */
+	    while (err == EAGAIN && serial_now() < deadline)
+	    {
+		(void) poll(NULL, 0, 10);
+		err = connect(fd, (struct sockaddr *) &sb, sizeof(sb.sun_family)+len) < 0 ? errno : 0;
+	    }
+	    
+	    if (err == EINPROGRESS)
+	    {
+		struct pollfd pfd;
+
+		pfd.fd = fd;
+		pfd.events = POLLOUT;
+		pfd.revents = 0;
+		if (poll(&pfd, 1, timeout) != 1 ||
+		    getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &elen) < 0)
+		    err = ETIMEDOUT;
+	    }
+	    
+	    if (err)
+	    {
+		(void) close(fd);
+		errno = err;
+		return SERIAL_E_UNIX_ERROR;
+	    }
 	}
+	
+	fcntl(fd, F_SETFL, flags);
     }
     else
     {
@@ -330,7 +427,8 @@ serial_open(const char *devname,
 	    return SERIAL_E_LOCK_FAILED;
 #endif
 	
-	fd = open(devname, O_RDWR|O_NOCTTY, 0);
+	/* Do not wait for carrier on open */
+	fd = open(devname, O_RDWR|O_NOCTTY|O_NONBLOCK, 0);
 	if (fd < 0)
 	{
 	    (void) uucp_funlock(devname);
@@ -387,6 +485,9 @@ serial_open(const char *devname,
 	}
 
 	tcflush(fd, TCIOFLUSH);
+
+	flags = fcntl(fd, F_GETFL);
+	fcntl(fd, F_SETFL, flags & ~O_NONBLOCK);
     }
     
     return fd;
@@ -44,6 +44,19 @@
 #define SERIAL_E_SETSPEED_FAILED        -7
 #define SERIAL_E_SETATTR_FAILED         -8
 
+#include <sys/uio.h>
+
+/* Counters for serial_write() and serial_writev() */
+typedef struct serial_stats
+{
+    unsigned long writes;	/* write() calls */
+    unsigned long waits;	/* Waits for the tty after short writes */
+    unsigned long bytes;
+} SERIAL_STATS;
+
+extern SERIAL_STATS serial_stats;
+
+
 extern const char *
 serial_strerror(int code);
 
@@ -67,6 +80,12 @@ serial_write(int fd,
 	     int bufsize,
 	     int timeout);
 
+extern int
+serial_writev(int fd,
+	      struct iovec *iov,
+	      int iovcnt,
+	      int timeout);
+
 
 
 
@@ -0,0 +1,112 @@
+/*
+ * simstore.c - SIM message storage occupancy
+ *
+ * Copyright (c) 2016-2020 Peter Eriksson <pen@lysator.liu.se>
+ *
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "simstore.h"
+
+
+int
+ss_init(SIMSTORE *ss,
+	int size)
+{
+    ss->size = size < 8 ? 8 : (size+7) & ~7;
+    ss->used = 0;
+    ss->total = 0;
+    ss->map = calloc(ss->size/8, 1);
+    return ss->map ? 0 : -1;
+}
+
+
+void
+ss_free(SIMSTORE *ss)
+{
+    free(ss->map);
+    ss->map = NULL;
+    ss->size = ss->used = ss->total = 0;
+}
+
+
+/* Returns 1 if index 'i' was not already in use, 0 if it was */
+int
+ss_set(SIMSTORE *ss,
+       int i)
+{
+    if (i < 0)
+	return -1;
+
+    if (i >= ss->size)
+    {
+	int nsize = ss->size*2;
+	unsigned char *nmap;
+
+	while (nsize <= i)
+	    nsize *= 2;
+	nmap = realloc(ss->map, nsize/8);
+	if (!nmap)
+	    return -1;
+	memset(nmap+ss->size/8, 0, (nsize-ss->size)/8);
+	ss->map = nmap;
+	ss->size = nsize;
+    }
+
+    if (ss->map[i/8] & (1 << (i%8)))
+	return 0;
+    
+    ss->map[i/8] |= 1 << (i%8);
+    ss->used++;
+    return 1;
+}
+
+
+/* Returns 1 if index 'i' was in use */
+int
+ss_clear(SIMSTORE *ss,
+	 int i)
+{
+    if (!ss_test(ss, i))
+	return 0;
+
+    ss->map[i/8] &= ~(1 << (i%8));
+    ss->used--;
+    return 1;
+}
+
+
+int
+ss_test(SIMSTORE *ss,
+	int i)
+{
+    return i >= 0 && i < ss->size && (ss->map[i/8] & (1 << (i%8)));
+}
@@ -0,0 +1,69 @@
+/*
+ * simstore.h - SIM message storage occupancy
+ *
+ * Copyright (c) 2016-2020 Peter Eriksson <pen@lysator.liu.se>
+ *
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef SIMSTORE_H
+#define SIMSTORE_H
+
+/*
+ * A bitmap of the message storage indices known to be in use, as
+ * learned from +CPMS, +CMTI, +CMGL and +CMGR. It grows as needed.
+ */
+typedef struct simstore
+{
+    int size;		/* Indices 0..size-1 */
+    int used;		/* Bits set */
+    int total;		/* Storage size reported by +CPMS, 0 if unknown */
+    unsigned char *map;
+} SIMSTORE;
+
+
+extern int
+ss_init(SIMSTORE *ss,
+	int size);
+
+extern void
+ss_free(SIMSTORE *ss);
+
+extern int
+ss_set(SIMSTORE *ss,
+       int i);
+
+extern int
+ss_clear(SIMSTORE *ss,
+	 int i);
+
+extern int
+ss_test(SIMSTORE *ss,
+	int i);
+
+#endif
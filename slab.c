@@ -0,0 +1,149 @@
+/*
+ * slab.c - Fixed size object allocator
+ *
+ * Copyright (c) 2016-2020 Peter Eriksson <pen@lysator.liu.se>
+ *
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "slab.h"
+
+
+/* Alignment of the objects, as malloc() gives */
+#define SLAB_ALIGN 16
+
+
+SLAB *
+slab_create(size_t size,
+	    int per_chunk)
+{
+    SLAB *sp;
+
+
+    if (size < 1 || per_chunk < 1)
+	return NULL;
+
+    sp = calloc(1, sizeof(*sp));
+    if (!sp)
+	return NULL;
+
+    pthread_mutex_init(&sp->mtx, NULL);
+    sp->size = (size + SLAB_ALIGN-1) & ~(size_t) (SLAB_ALIGN-1);
+    sp->per_chunk = per_chunk;
+    return sp;
+}
+
+
+/* Add a chunk of objects to the free list. With the mutex held */
+static int
+slab_grow(SLAB *sp)
+{
+    char *cp, *op;
+    int i;
+
+
+    /* The first SLAB_ALIGN bytes link the chunks */
+    cp = malloc(SLAB_ALIGN + sp->size * sp->per_chunk);
+    if (!cp)
+	return -1;
+
+    * (void **) cp = sp->chunks;
+    sp->chunks = cp;
+    sp->nchunks++;
+
+    for (i = sp->per_chunk-1; i >= 0; i--)
+    {
+	op = cp + SLAB_ALIGN + sp->size * i;
+	* (void **) op = sp->free;
+	sp->free = op;
+    }
+    return 0;
+}
+
+
+/* May be called from any thread. The object is not cleared */
+void *
+slab_alloc(SLAB *sp)
+{
+    void *p;
+
+    
+    pthread_mutex_lock(&sp->mtx);
+    if (!sp->free && slab_grow(sp) < 0)
+    {
+	pthread_mutex_unlock(&sp->mtx);
+	return NULL;
+    }
+    
+    p = sp->free;
+    sp->free = * (void **) p;
+    if (++sp->inuse > sp->peak)
+	sp->peak = sp->inuse;
+    sp->allocs++;
+    pthread_mutex_unlock(&sp->mtx);
+    return p;
+}
+
+
+/* May be called from any thread */
+void
+slab_free(SLAB *sp,
+	  void *p)
+{
+    if (!p)
+	return;
+    
+    pthread_mutex_lock(&sp->mtx);
+    * (void **) p = sp->free;
+    sp->free = p;
+    sp->inuse--;
+    pthread_mutex_unlock(&sp->mtx);
+}
+
+
+/* Frees all chunks, including objects still in use */
+void
+slab_destroy(SLAB *sp)
+{
+    void *cp, *next;
+
+    
+    if (!sp)
+	return;
+    
+    for (cp = sp->chunks; cp; cp = next)
+    {
+	next = * (void **) cp;
+	free(cp);
+    }
+    pthread_mutex_destroy(&sp->mtx);
+    free(sp);
+}
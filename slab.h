@@ -0,0 +1,74 @@
+/*
+ * slab.h - Fixed size object allocator
+ *
+ * Copyright (c) 2016-2020 Peter Eriksson <pen@lysator.liu.se>
+ *
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef SLAB_H
+#define SLAB_H
+
+#include <stddef.h>
+#include <pthread.h>
+
+/*
+ * Objects of one size, carved out of chunks that are never given back
+ * until slab_destroy(). Freed objects go on a free list and are reused
+ * first, so once the peak number in use has been reached allocation
+ * is a pop and free a push, under a mutex, without malloc.
+ */
+typedef struct slab
+{
+    pthread_mutex_t mtx;
+    size_t size;		/* Object size, rounded up for alignment */
+    int per_chunk;
+    void *free;			/* Free objects, linked through their first word */
+    void *chunks;		/* Chunks, linked through their first word */
+    unsigned long nchunks;
+    unsigned long inuse;
+    unsigned long peak;
+    unsigned long allocs;
+} SLAB;
+
+
+extern SLAB *
+slab_create(size_t size,
+	    int per_chunk);
+
+extern void *
+slab_alloc(SLAB *sp);
+
+extern void
+slab_free(SLAB *sp,
+	  void *p);
+
+extern void
+slab_destroy(SLAB *sp);
+
+#endif
@@ -0,0 +1,325 @@
+/*
+ * trace.c - Binary trace of accepted submissions
+ *
+ * Copyright (c) 2016-2020 Peter Eriksson <pen@lysator.liu.se>
+ *
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include "trace.h"
+
+
+static int64_t
+usec_clock(clockid_t id)
+{
+    struct timespec ts;
+
+    clock_gettime(id, &ts);
+    return (int64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+
+static int
+put_varint(unsigned char *buf,
+	   uint64_t v)
+{
+    int n = 0;
+
+    while (v >= 0x80)
+    {
+	buf[n++] = (v & 0x7F) | 0x80;
+	v >>= 7;
+    }
+    buf[n++] = v;
+    return n;
+}
+
+
+static int
+get_varint(FILE *fp,
+	   uint64_t *vp)
+{
+    uint64_t v = 0;
+    int c, shift;
+
+    for (shift = 0; shift < 64; shift += 7)
+    {
+	c = getc(fp);
+	if (c == EOF)
+	    return -1;
+	v |= (uint64_t) (c & 0x7F) << shift;
+	if (!(c & 0x80))
+	{
+	    *vp = v;
+	    return 0;
+	}
+    }
+    return -1;
+}
+
+
+/* Open the file (again) and start a new segment with the current time */
+static int
+trace_start(TRACE *tp)
+{
+    unsigned char buf[9];
+    int64_t t;
+    int i;
+
+
+    tp->fp = fopen(tp->path, "a");
+    if (!tp->fp)
+	return -1;
+
+    if (ftell(tp->fp) == 0)
+	fwrite(TRACE_MAGIC, 1, TRACE_MAGIC_LEN, tp->fp);
+    
+    t = usec_clock(CLOCK_REALTIME);
+    buf[0] = TRACE_EPOCH;
+    for (i = 0; i < 8; i++)
+	buf[1+i] = (uint64_t) t >> (8*i);
+    fwrite(buf, 1, sizeof(buf), tp->fp);
+    tp->last = usec_clock(CLOCK_MONOTONIC);
+    
+    if (fflush(tp->fp) != 0)
+    {
+	fclose(tp->fp);
+	tp->fp = NULL;
+	return -1;
+    }
+    
+    return 0;
+}
+
+
+/* Start (or append to) a trace */
+TRACE *
+trace_open(const char *path)
+{
+    TRACE *tp;
+
+
+    tp = calloc(1, sizeof(*tp));
+    if (!tp)
+	return NULL;
+
+    tp->path = strdup(path);
+    if (!tp->path || trace_start(tp) < 0)
+    {
+	free(tp->path);
+	free(tp);
+	return NULL;
+    }
+    
+    pthread_mutex_init(&tp->mtx, NULL);
+    return tp;
+}
+
+
+/* Close and open the file, after it has been rotated */
+int
+trace_reopen(TRACE *tp)
+{
+    int rc;
+
+    
+    pthread_mutex_lock(&tp->mtx);
+    if (tp->fp)
+	fclose(tp->fp);
+    rc = trace_start(tp);
+    pthread_mutex_unlock(&tp->mtx);
+
+    return rc;
+}
+
+
+void
+trace_close(TRACE *tp)
+{
+    if (!tp)
+	return;
+    
+    if (tp->fp)
+	fclose(tp->fp);
+    pthread_mutex_destroy(&tp->mtx);
+    free(tp->path);
+    free(tp);
+}
+
+
+/* Record a submission, written at once so a trace survives a crash */
+int
+trace_record(TRACE *tp,
+	     int source,
+	     const char *to,
+	     size_t size)
+{
+    unsigned char buf[1+10+1+10+1+TRACE_TO_MAX];
+    size_t tlen = strlen(to);
+    int64_t t;
+    int n = 0, rc = 0;
+
+
+    if (tlen > TRACE_TO_MAX)
+	tlen = TRACE_TO_MAX;
+    
+    pthread_mutex_lock(&tp->mtx);
+    if (!tp->fp)
+    {
+	pthread_mutex_unlock(&tp->mtx);
+	errno = EBADF;
+	return -1;
+    }
+    
+    t = usec_clock(CLOCK_MONOTONIC);
+    buf[n++] = TRACE_SUBMIT;
+    n += put_varint(buf+n, t > tp->last ? t - tp->last : 0);
+    buf[n++] = source;
+    n += put_varint(buf+n, size);
+    buf[n++] = tlen;
+    memcpy(buf+n, to, tlen);
+    n += tlen;
+    
+    if (fwrite(buf, 1, n, tp->fp) != (size_t) n || fflush(tp->fp) != 0)
+	rc = -1;
+    else
+    {
+	tp->last = t;
+	tp->records++;
+    }
+    pthread_mutex_unlock(&tp->mtx);
+
+    return rc;
+}
+
+
+TRACE *
+trace_open_read(const char *path)
+{
+    TRACE *tp;
+    char magic[TRACE_MAGIC_LEN];
+
+
+    tp = calloc(1, sizeof(*tp));
+    if (!tp)
+	return NULL;
+
+    tp->path = strdup(path);
+    tp->fp = fopen(path, "r");
+    if (!tp->path || !tp->fp)
+	goto Fail;
+    
+    if (fread(magic, 1, sizeof(magic), tp->fp) != sizeof(magic) ||
+	memcmp(magic, TRACE_MAGIC, TRACE_MAGIC_LEN) != 0)
+    {
+	errno = EINVAL;
+	goto Fail;
+    }
+    
+    pthread_mutex_init(&tp->mtx, NULL);
+    return tp;
+
+  Fail:
+    if (tp->fp)
+	fclose(tp->fp);
+    free(tp->path);
+    free(tp);
+    return NULL;
+}
+
+
+/*
+ * Read the next submission. Returns 1, 0 at the end of the trace or
+ * -1 (with errno EINVAL) if it is damaged. A trace cut off in the
+ * middle of a record, such as by a crash, ends before it.
+ */
+int
+trace_read(TRACE *tp,
+	   TRACE_REC *rp)
+{
+    unsigned char buf[8];
+    uint64_t v;
+    int c, i, n;
+
+
+    while ((c = getc(tp->fp)) != EOF)
+    {
+	switch (c)
+	{
+	  case TRACE_EPOCH:
+	    if (fread(buf, 1, 8, tp->fp) != 8)
+		return 0;
+	    for (v = 0, i = 0; i < 8; i++)
+		v |= (uint64_t) buf[i] << (8*i);
+	    tp->now = (int64_t) v;
+	    break;
+
+	  case TRACE_SUBMIT:
+	    if (get_varint(tp->fp, &v) < 0)
+		return 0;
+	    tp->now += v;
+	    rp->usec = tp->now;
+	    
+	    if ((rp->source = getc(tp->fp)) == EOF || get_varint(tp->fp, &v) < 0 ||
+		(n = getc(tp->fp)) == EOF || fread(rp->to, 1, n, tp->fp) != (size_t) n)
+		return 0;
+	    rp->size = v;
+	    rp->to[n] = '\0';
+	    tp->records++;
+	    return 1;
+
+	  default:
+	    errno = EINVAL;
+	    return -1;
+	}
+    }
+
+    return 0;
+}
+
+
+const char *
+trace_source(int source)
+{
+    switch (source)
+    {
+      case TRACE_SRC_FIFO:
+	return "fifo";
+      case TRACE_SRC_TTY:
+	return "tty";
+      case TRACE_SRC_DOOR:
+	return "door";
+    }
+    return "?";
+}
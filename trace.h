@@ -0,0 +1,114 @@
+/*
+ * trace.h - Binary trace of accepted submissions
+ *
+ * Copyright (c) 2016-2020 Peter Eriksson <pen@lysator.liu.se>
+ *
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <pthread.h>
+
+/*
+ * A trace records each submission psmsd accepted (from the fifo, the
+ * tty or the door): when, from where, to whom and how long it was,
+ * but not the text. It is a binary file, little-endian, starting with
+ * the 8 byte magic "PSMTRC\0\1" and then records, each starting with
+ * a type byte:
+ *
+ *   'E' <8 byte usec since the epoch>
+ *	 Written when the trace is opened, times after it are relative
+ *
+ *   'S' <varint usec since the last record> <source> <varint size>
+ *       <recipient length> <recipient>
+ *	 A submission, ~20 bytes for a phone number
+ *
+ * Varints are 7 bits per byte, least significant first, with the top
+ * bit set on all but the last byte.
+ */
+#define TRACE_MAGIC	"PSMTRC\0\1"
+#define TRACE_MAGIC_LEN	8
+
+#define TRACE_EPOCH	'E'
+#define TRACE_SUBMIT	'S'
+
+#define TRACE_SRC_FIFO	1
+#define TRACE_SRC_TTY	2
+#define TRACE_SRC_DOOR	3
+
+#define TRACE_TO_MAX	255
+
+typedef struct trace
+{
+    char *path;
+    FILE *fp;
+    pthread_mutex_t mtx;	/* Submissions come from several threads */
+    int64_t last;		/* Monotonic usec of the last record */
+    int64_t now;		/* Reading: usec since the epoch */
+    unsigned long records;
+} TRACE;
+
+typedef struct trace_rec
+{
+    int64_t usec;		/* Since the epoch */
+    int source;
+    unsigned int size;
+    char to[TRACE_TO_MAX+1];
+} TRACE_REC;
+
+
+extern TRACE *
+trace_open(const char *path);
+
+extern int
+trace_reopen(TRACE *tp);
+
+extern void
+trace_close(TRACE *tp);
+
+extern int
+trace_record(TRACE *tp,
+	     int source,
+	     const char *to,
+	     size_t size);
+
+extern TRACE *
+trace_open_read(const char *path);
+
+extern int
+trace_read(TRACE *tp,
+	   TRACE_REC *rp);
+
+extern const char *
+trace_source(int source);
+
+#endif
@@ -36,186 +36,874 @@
 #include <string.h>
 #include <unistd.h>
 #include <ctype.h>
+#include <errno.h>
 #include <pthread.h>
 #include <signal.h>
 
 #include "users.h"
+#include "db.h"
+#include "cdb.h"
+#include "phone.h"
 #include "strmisc.h"
+#include "arena.h"
 
 extern int debug;
 
-static pthread_mutex_t mtx;
-static USER *uv = NULL;
-static int us = 0;
-static int uc = 0;
+
+/* A logged in user: the phone it is currently using */
+typedef struct session
+{
+    char *name;
+    char *phone;
+    uint64_t key;	/* Phone number key, 0 if not E.164 */
+    time_t expires;
+} SESSION;
+
+
+/* A user entry as returned by a backend. Valid while 'mtx' is held */
+typedef struct userent
+{
+    const char *name;
+    const char *pass;
+    const char *phone;
+    const char *acl;
+    int idx;		/* Index in a compiled database, or -1 */
+} USERENT;
+
+
+/* User directory backend */
+typedef struct userdb USERDB;
+
+typedef struct userdb_ops
+{
+    const char *type;
+    int cached;		/* Put the lookup cache in front of it */
+    int (*byname)(USERDB *bp, const char *name, int exact, USERENT *ep);
+    int (*byphone)(USERDB *bp, const char *phone, USERENT *ep);
+    int (*foreach)(USERDB *bp, int (*fcp)(USERENT *ep, void *xp), void *xp);
+    void (*close)(USERDB *bp);
+} USERDB_OPS;
+
+struct userdb
+{
+    const USERDB_OPS *ops;
+    DB *dbp;
+    CDB *cdbp;
+    char buf[1024];	/* Lookup buffer */
+};
+
+
+/* Positive & negative lookup cache */
+typedef struct ucache
+{
+    uint32_t hash;
+    int kind;
+    int found;
+    time_t expires;
+    char *data;		/* Key followed by the entry strings */
+    USERENT ent;
+} UCACHE;
+
+
+static pthread_mutex_t mtx = PTHREAD_MUTEX_INITIALIZER;
+static USERDB *ubp = NULL;
+
+static UCACHE cache[USERS_CACHE_SIZE];
+static unsigned long cache_hits = 0;
+static unsigned long cache_misses = 0;
+
+static SESSION *sv = NULL;
+static int ss = 0;
+static int sc = 0;
+
+static unsigned int gen = 0;	/* Changed with the backend */
 
 static int autologout_time = 0;
-static pthread_t autologout_tid;
+static void (*autologout_handler)(USER *up) = NULL;
+
+
+static int
+session_byname(const char *name)
+{
+    int i;
+
+    for (i = 0; i < sc && strcmp(sv[i].name, name) != 0; i++)
+	;
+    return i < sc ? i : -1;
+}
+
+
+static int
+session_byphone(const char *phone)
+{
+    uint64_t key;
+    int i;
+
+
+    if (!phone)
+	return -1;
+    
+    key = phone_key(phone);
+    if (key)
+    {
+	for (i = 0; i < sc && sv[i].key != key; i++)
+	    ;
+    }
+    else
+    {
+	for (i = 0; i < sc && (sv[i].key || strcmp(sv[i].phone, phone) != 0); i++)
+	    ;
+    }
+    
+    return i < sc ? i : -1;
+}
+
+
+static void
+session_remove(int i)
+{
+    if (i < 0 || i >= sc)
+	return;
+
+    free(sv[i].name);
+    free(sv[i].phone);
+    sv[i] = sv[--sc];
+}
+
+
+static int
+session_add(const char *name,
+	    const char *phone,
+	    time_t expires)
+{
+    if (sc == ss)
+    {
+	SESSION *nsv = realloc(sv, sizeof(*sv)*(ss += 16));
+
+	if (!nsv)
+	    return -1;
+	sv = nsv;
+    }
+
+    sv[sc].name = s_dup(name);
+    sv[sc].phone = s_dup(phone);
+    sv[sc].key = phone_key(phone);
+    sv[sc].expires = expires;
+    return sc++;
+}
+
+
+
+/*
+ * Compiled database backend (text file or image)
+ */
+
+static int
+dbent(DB *dbp,
+      int idx,
+      USERENT *ep)
+{
+    const DBUSER *up;
+
+
+    up = db_user(dbp, idx);
+    if (!up)
+	return -1;
+
+    ep->name = db_str(dbp, up->name);
+    ep->pass = db_str(dbp, up->pass);
+    ep->phone = db_str(dbp, up->phone);
+    ep->acl = db_str(dbp, up->acl);
+    ep->idx = idx;
+    return 0;
+}
+
+
+static int
+db_byname(USERDB *bp,
+	  const char *name,
+	  int exact,
+	  USERENT *ep)
+{
+    return dbent(bp->dbp, db_user_byname(bp->dbp, name, exact), ep);
+}
+
+
+static int
+db_byphone(USERDB *bp,
+	   const char *phone,
+	   USERENT *ep)
+{
+    return dbent(bp->dbp, db_user_byphone(bp->dbp, phone), ep);
+}
+
+
+static int
+db_foreach(USERDB *bp,
+	   int (*fcp)(USERENT *ep, void *xp),
+	   void *xp)
+{
+    USERENT e;
+    int i, n, rc;
+
+
+    n = db_count(bp->dbp);
+    for (i = 0; i < n; i++)
+	if (dbent(bp->dbp, i, &e) == 0 && (rc = (*fcp)(&e, xp)) != 0)
+	    return rc;
+
+    return 0;
+}
+
+
+static void
+db_close(USERDB *bp)
+{
+    db_free(bp->dbp);
+}
+
+
+static const USERDB_OPS db_ops =
+{
+    "file", 0, db_byname, db_byphone, db_foreach, db_close
+};
+
+
+
+/*
+ * CDB key-value file backend.
+ *
+ * Each user is stored twice, under the keys "n:<lowercase name>"
+ * and "p:<phone>", with the data "name<TAB>phone<TAB>pass<TAB>acl".
+ */
+
+static int
+cdbent(char *buf,
+       USERENT *ep)
+{
+    char *cp;
+
+
+    memset(ep, 0, sizeof(*ep));
+    ep->idx = -1;
+
+    ep->name = buf;
+    if ((cp = strchr(buf, '\t')) == NULL)
+	return -1;
+    *cp++ = '\0';
+
+    ep->phone = cp;
+    if ((cp = strchr(cp, '\t')) == NULL)
+	return -1;
+    *cp++ = '\0';
+
+    ep->pass = cp;
+    if ((cp = strchr(cp, '\t')) != NULL)
+    {
+	*cp++ = '\0';
+	ep->acl = *cp ? cp : NULL;
+    }
+
+    return 0;
+}
+
+
+static int
+cdb_lookup(USERDB *bp,
+	   int kind,
+	   const char *key,
+	   USERENT *ep)
+{
+    char kbuf[256];
+    int i, klen;
+
+
+    kbuf[0] = kind;
+    kbuf[1] = ':';
+    for (i = 0; key[i] && i < sizeof(kbuf)-3; i++)
+	kbuf[i+2] = (kind == 'n' ? tolower((unsigned char) key[i]) : key[i]);
+    klen = i+2;
+
+    if (cdb_find(bp->cdbp, kbuf, klen, bp->buf, sizeof(bp->buf)) < 0)
+	return -1;
+
+    return cdbent(bp->buf, ep);
+}
+
+
+static int
+cdb_byname(USERDB *bp,
+	   const char *name,
+	   int exact,
+	   USERENT *ep)
+{
+    if (cdb_lookup(bp, 'n', name, ep) < 0)
+	return -1;
+
+    if (exact && strcmp(ep->name, name) != 0)
+	return -1;
+
+    return 0;
+}
+
+
+static int
+cdb_byphone(USERDB *bp,
+	    const char *phone,
+	    USERENT *ep)
+{
+    return cdb_lookup(bp, 'p', phone, ep);
+}
+
+
+struct cdb_foreach_args
+{
+    int (*fcp)(USERENT *ep, void *xp);
+    void *xp;
+};
+
+
+static int
+cdb_foreach_rec(const char *key,
+		int klen,
+		const char *data,
+		int dlen,
+		void *xp)
+{
+    struct cdb_foreach_args *ap = (struct cdb_foreach_args *) xp;
+    USERENT e;
+
+
+    if (klen < 2 || key[0] != 'n' || key[1] != ':')
+	return 0;
+
+    if (cdbent((char *) data, &e) < 0)
+	return 0;
+
+    return (*ap->fcp)(&e, ap->xp);
+}
+
+
+static int
+cdb_foreach_users(USERDB *bp,
+		  int (*fcp)(USERENT *ep, void *xp),
+		  void *xp)
+{
+    struct cdb_foreach_args a;
+
+
+    a.fcp = fcp;
+    a.xp = xp;
+    return cdb_foreach(bp->cdbp, cdb_foreach_rec, &a);
+}
 
 
 static void
-sigusr1_handler(int sig)
+cdb_close_users(USERDB *bp)
 {
+    cdb_close(bp->cdbp);
 }
 
 
-static void *
-autologout_thread(void *misc)
+static const USERDB_OPS cdb_ops =
 {
+    "cdb", 1, cdb_byname, cdb_byphone, cdb_foreach_users, cdb_close_users
+};
+
+
+
+/*
+ * Lookup cache. Direct mapped, entries expire after USERS_CACHE_TTL
+ * (found) or USERS_CACHE_NEG_TTL (not found) seconds.
+ */
+
+static uint32_t
+cache_hash(int kind,
+	   const char *key)
+{
+    uint32_t h = 2166136261U ^ kind;
+
+    while (*key)
+    {
+	h ^= (unsigned char) (kind == 'n' ? tolower((unsigned char) *key) : *key);
+	h *= 16777619U;
+	++key;
+    }
+
+    return h;
+}
+
+
+static void
+cache_flush(void)
+{
+    int i;
+
+    for (i = 0; i < USERS_CACHE_SIZE; i++)
+    {
+	free(cache[i].data);
+	memset(&cache[i], 0, sizeof(cache[i]));
+    }
+}
+
+
+static UCACHE *
+cache_get(int kind,
+	  const char *key,
+	  uint32_t h,
+	  time_t now)
+{
+    UCACHE *cp = &cache[h % USERS_CACHE_SIZE];
+
+
+    if (!cp->data || cp->hash != h || cp->kind != kind || cp->expires <= now)
+	return NULL;
+
+    if ((kind == 'n' ? strcasecmp(cp->data, key) : strcmp(cp->data, key)) != 0)
+	return NULL;
+
+    return cp;
+}
+
+
+static void
+cache_put(int kind,
+	  const char *key,
+	  uint32_t h,
+	  time_t now,
+	  USERENT *ep)
+{
+    UCACHE *cp = &cache[h % USERS_CACHE_SIZE];
+    const char *vv[5];
+    char *data, *dp;
     int i, len;
-    time_t now, next;
-    void (*logout_handler)(USER *up);
 
 
-    logout_handler = (void (*)(USER *up)) misc;
+    vv[0] = key;
+    if (ep)
+    {
+	vv[1] = ep->name;
+	vv[2] = ep->pass;
+	vv[3] = ep->phone;
+	vv[4] = ep->acl;
+    }
+    else
+	vv[1] = vv[2] = vv[3] = vv[4] = NULL;
 
-    if (debug)
-	fprintf(stderr, "AUTOLOGOUT_THREAD: Start\n");
+    for (len = i = 0; i < 5; i++)
+	len += (vv[i] ? strlen(vv[i]) : 0) + 1;
 
-    next = 0;
+    data = malloc(len);
+    if (!data)
+	return;
 
-    signal(SIGUSR1, sigusr1_handler);
-    
-    while (autologout_time > 0)
+    for (dp = data, i = 0; i < 5; i++)
     {
-	if (debug > 1)
-	    fprintf(stderr, "AUTOLOGOUT_THREAD: Checking\n");
-    
+	len = vv[i] ? strlen(vv[i]) : 0;
+	memcpy(dp, vv[i] ? vv[i] : "", len+1);
+	vv[i] = vv[i] ? dp : NULL;
+	dp += len+1;
+    }
+
+    free(cp->data);
+    cp->data = data;
+    cp->hash = h;
+    cp->kind = kind;
+    cp->found = (ep != NULL);
+    cp->expires = now + (ep ? USERS_CACHE_TTL : USERS_CACHE_NEG_TTL);
+
+    memset(&cp->ent, 0, sizeof(cp->ent));
+    cp->ent.name = vv[1];
+    cp->ent.pass = vv[2];
+    cp->ent.phone = vv[3];
+    cp->ent.acl = vv[4];
+    cp->ent.idx = ep ? ep->idx : -1;
+}
+
+
+/* Look up a user by name or phone, through the cache if enabled */
+static int
+user_lookup(int kind,
+	    const char *key,
+	    int exact,
+	    USERENT *ep)
+{
+    UCACHE *cp;
+    uint32_t h = 0;
+    time_t now = 0;
+    char pbuf[PHONE_MAX];
+    int rc;
+
+
+    if (!ubp || !key)
+	return -1;
+
+    if (kind == 'p' && phone_normalize(key, pbuf, sizeof(pbuf)) >= 0)
+	key = pbuf;
+
+    if (ubp->ops->cached)
+    {
+	h = cache_hash(kind, key);
 	time(&now);
-	
-	pthread_mutex_lock(&mtx);
-	for (i = 0; i < uc; i++)
+
+	cp = cache_get(kind, key, h, now);
+	if (cp && (!exact || !cp->found || strcmp(cp->ent.name, key) == 0))
 	{
-	    if (uv[i].expires)
-	    {
-		if (now >= uv[i].expires)
-		{
-		    if (uv[i].cphone)
-		    {
-			if (debug)
-			    fprintf(stderr, "AUTOLOGOUT_THREAD: Terminating %s\n",
-				    uv[i].cphone);
-			
-			logout_handler(&uv[i]);
-			free(uv[i].cphone);
-			uv[i].cphone = NULL;
-			uv[i].expires = 0;
-		    }
-		}
-		else
-		{
-		    if (!next || uv[i].expires < next)
-			next = uv[i].expires;
-		}
-	    }
+	    ++cache_hits;
+	    if (!cp->found)
+		return -1;
+	    *ep = cp->ent;
+	    return 0;
 	}
-	pthread_mutex_unlock(&mtx);
+	++cache_misses;
+    }
 
-	len = next-now;
-	if (len <= 0)
-	    len = autologout_time;
-	
-	if (debug > 1)
-	    fprintf(stderr, "AUTOLOGOUT_THREAD: Sleeping %d seconds\n",
-		    len);
+    if (kind == 'n')
+	rc = ubp->ops->byname(ubp, key, exact, ep);
+    else
+	rc = ubp->ops->byphone(ubp, key, ep);
+
+    /* Only cache case-insensitive name lookups, they cover exact ones too */
+    if (ubp->ops->cached && (kind != 'n' || !exact))
+	cache_put(kind, key, h, now, rc < 0 ? NULL : ep);
+
+    return rc;
+}
+
+
+static int
+str_equal(const char *a,
+	  const char *b)
+{
+    if (!a || !b)
+	return a == b;
+    return strcmp(a, b) == 0;
+}
+
+
+static int
+userent_equal(USERENT *a,
+	      USERENT *b)
+{
+    return (strcmp(a->name, b->name) == 0 &&
+	    str_equal(a->pass, b->pass) &&
+	    str_equal(a->phone, b->phone) &&
+	    str_equal(a->acl, b->acl));
+}
+
+
+/* Fill in a USER view of a backend entry */
+static USER *
+user_get(USERENT *ep,
+	 USER *up)
+{
+    int j;
+
+
+    up->name = (char *) ep->name;
+    up->pass = (char *) ep->pass;
+    up->acl = (char *) ep->acl;
+    up->pphone = (char *) ep->phone;
+    up->cphone = NULL;
+    up->expires = 0;
+
+    if (up->name && (j = session_byname(up->name)) >= 0)
+    {
+	up->cphone = sv[j].phone;
+	up->expires = sv[j].expires;
+    }
+
+    return up;
+}
+
+
+/*
+ * Log out the users whose sessions have expired. Returns the number
+ * of seconds until the next session expires (or the autologout time
+ * if none is active), or 0 if autologout is not enabled.
+ */
+int
+users_autologout_run(void)
+{
+    int i, len;
+    time_t now, next;
+    USER u;
+
+
+    if (autologout_time <= 0)
+	return 0;
+    
+    if (debug > 1)
+	fprintf(stderr, "USERS_AUTOLOGOUT: Checking\n");
+    
+    time(&now);
+    next = 0;
 	
-	sleep(len);
+    pthread_mutex_lock(&mtx);
+    for (i = 0; i < sc; )
+    {
+	if (sv[i].expires && now >= sv[i].expires)
+	{
+	    if (debug)
+		fprintf(stderr, "USERS_AUTOLOGOUT: Terminating %s\n",
+			sv[i].phone);
+
+	    memset(&u, 0, sizeof(u));
+	    u.name = sv[i].name;
+	    u.cphone = sv[i].phone;
+	    u.expires = sv[i].expires;
+
+	    if (autologout_handler)
+		autologout_handler(&u);
+	    session_remove(i);
+	    continue;
+	}
+
+	if (sv[i].expires && (!next || sv[i].expires < next))
+	    next = sv[i].expires;
+	++i;
     }
+    pthread_mutex_unlock(&mtx);
+
+    len = next-now;
+    if (len <= 0)
+	len = autologout_time;
+	
+    return len;
+}
+
+
+/*
+ * Switch to a new backend. Sessions are kept for users that are
+ * unchanged in the new backend and dropped for the others.
+ */
+static int
+users_set_backend(USERDB *nbp)
+{
+    USERDB *obp;
+    USERENT oe, ne;
+    int i;
+
+
+    pthread_mutex_lock(&mtx);
+    obp = ubp;
     
+    for (i = 0; i < sc; )
+    {
+	if (nbp->ops->byname(nbp, sv[i].name, 1, &ne) < 0 ||
+	    (obp && obp->ops->byname(obp, sv[i].name, 1, &oe) == 0 &&
+	     !userent_equal(&oe, &ne)))
+	{
+	    if (debug)
+		fprintf(stderr, "USERS_SET_BACKEND: Dropping session for %s\n", sv[i].name);
+	    session_remove(i);
+	}
+	else
+	    ++i;
+    }
+
+    ubp = nbp;
+    cache_flush();
+    gen++;
+
     if (debug)
-	fprintf(stderr, "AUTOLOGOUT_THREAD: Stop\n");
+	fprintf(stderr, "USERS_SET_BACKEND: Using %s backend (cache hits %lu, misses %lu)\n",
+		ubp->ops->type, cache_hits, cache_misses);
+    cache_hits = cache_misses = 0;
+    
+    pthread_mutex_unlock(&mtx);
+
+    if (obp)
+    {
+	obp->ops->close(obp);
+	free(obp);
+    }
     
-    return NULL;
+    return 0;
 }
 
 
+/* Install a compiled user database */
 int
-users_load(const char *path)
+users_load_db(DB *dbp)
 {
-    FILE *fp;
-    char buf[1024], *name, *pass, *phone, *acl;
+    USERDB *bp;
 
 
-    if (debug)
-	fprintf(stderr, "USERS_LOAD: Start\n");
+    if (!dbp)
+	return -1;
+
+    bp = calloc(1, sizeof(*bp));
+    if (!bp)
+    {
+	db_free(dbp);
+	return -1;
+    }
+
+    bp->ops = &db_ops;
+    bp->dbp = dbp;
+    users_set_backend(bp);
     
+    return db_count(dbp);
+}
+
+
+/*
+ * Changes whenever users_name2pphone() may give another answer, that
+ * is when a new backend is installed. Logins do not change it.
+ */
+unsigned int
+users_generation(void)
+{
+    unsigned int g;
+
     pthread_mutex_lock(&mtx);
-    if (uv)
-	free(uv);
+    g = gen;
+    pthread_mutex_unlock(&mtx);
+
+    return g;
+}
 
-    uc = 0;
-    uv = malloc(sizeof(*uv)*(us = 128));
-    if (!uv)
+
+/* The current compiled user database, if any. Only valid until the next load */
+DB *
+users_db(void)
+{
+    return ubp ? ubp->dbp : NULL;
+}
+
+
+/* Returns the backend type of a "[<type>:]<path>" specification */
+int
+users_backend(const char *spec,
+	      const char **pathp)
+{
+    if (strncmp(spec, "cdb:", 4) == 0)
     {
-	pthread_mutex_unlock(&mtx);
-	return -1;
+	*pathp = spec+4;
+	return USERS_BACKEND_CDB;
+    }
+
+    if (strncmp(spec, "file:", 5) == 0)
+    {
+	*pathp = spec+5;
+	return USERS_BACKEND_FILE;
+    }
+
+    *pathp = spec;
+    return USERS_BACKEND_FILE;
+}
+
+
+int
+users_load(const char *spec)
+{
+    const char *path;
+    USERDB *bp;
+    DB *dbp;
+
+
+    if (debug)
+	fprintf(stderr, "USERS_LOAD: Start\n");
+
+    switch (users_backend(spec, &path))
+    {
+      case USERS_BACKEND_CDB:
+	bp = calloc(1, sizeof(*bp));
+	if (!bp)
+	    return -1;
+
+	bp->ops = &cdb_ops;
+	bp->cdbp = cdb_open(path);
+	if (!bp->cdbp)
+	{
+	    free(bp);
+	    return -1;
+	}
+	users_set_backend(bp);
+	break;
+
+      default:
+	dbp = db_compile(DB_SECT_USERS, path);
+	if (!dbp)
+	    return -1;
+	users_load_db(dbp);
     }
     
-    fp = fopen(path, "r");
-    if (!fp)
+    if (debug)
+	fprintf(stderr, "USERS_LOAD: Stop\n");
+    
+    return 0;
+}
+
+
+/*
+ * Write a users text file as a CDB file for the cdb backend
+ */
+int
+users_make_cdb(const char *src,
+	       const char *path)
+{
+    DB *dbp;
+    CDBMAKE *cmp;
+    USERENT e;
+    char key[256], data[1024];
+    int i, j, n, len;
+
+
+    dbp = db_compile(DB_SECT_USERS, src);
+    if (!dbp)
+	return -1;
+
+    cmp = cdb_make_start(path);
+    if (!cmp)
     {
-	pthread_mutex_unlock(&mtx);
+	db_free(dbp);
 	return -1;
     }
-    
-    while (fgets(buf, sizeof(buf), fp))
+
+    n = db_count(dbp);
+    for (i = 0; i < n; i++)
     {
-	char *endp;
-	
-	name = strtok_r(buf, " \t\r\n", &endp);
-	if (!name || *name == '#')
+	if (dbent(dbp, i, &e) < 0 || !e.name || !e.phone || !e.pass)
 	    continue;
 
-	phone = strtok_r(NULL, " \t\n\r", &endp);
-	if (!phone)
-	    continue;
-	
-	pass = strtok_r(NULL, " \t\n\r", &endp);
-	if (!pass)
+	len = snprintf(data, sizeof(data), "%s\t%s\t%s\t%s",
+		       e.name, e.phone, e.pass, e.acl ? e.acl : "");
+	if (len >= sizeof(data))
 	    continue;
-	
-	acl = strtok_r(NULL, "\n\r", &endp);
 
-	if (acl)
-	    while (isspace(*acl))
-	    ++acl;
-	
-	if (uc == us)
-	    uv = realloc(uv, sizeof(*uv)*(us += 128));
+	for (j = 0; e.name[j] && j < sizeof(key)-3; j++)
+	    key[j+2] = tolower((unsigned char) e.name[j]);
+	key[0] = 'n';
+	key[1] = ':';
+	if (cdb_make_add(cmp, key, j+2, data, len) < 0)
+	    goto Fail;
 
-	if (debug > 1)
-	    fprintf(stderr,
-		    "USERS_LOAD: Name=%s, Phone=%s, Pass=%s, Acl=%s\n",
-		    name, phone, pass, acl ? acl : "<none>");
-	
-	uv[uc].name = s_dup(name);
-	uv[uc].pphone = s_dup(phone);
-	uv[uc].pass = s_dup(pass);
-	uv[uc].acl = s_dup(acl);
-	
-	uv[uc].cphone = NULL;
-	uv[uc].expires = 0;
-	
-	++uc;
+	j = snprintf(key, sizeof(key), "p:%s", e.phone);
+	if (j >= sizeof(key) || cdb_make_add(cmp, key, j, data, len) < 0)
+	    goto Fail;
     }
 
-    fclose(fp);
+    db_free(dbp);
+    return cdb_make_finish(cmp);
 
-    pthread_mutex_unlock(&mtx);
-    
-    if (debug)
-	fprintf(stderr, "USERS_LOAD: Stop\n");
-    
-    return uc;
+  Fail:
+    cdb_make_abort(cmp);
+    db_free(dbp);
+    return -1;
 }
 
+
 int
 users_login(UCRED *ucp,
 	    const char *name,
 	    const char *pass)
 {
-    int i, j, nm = 0;
-    time_t now;
+    int nm = 0;
+    time_t now, expires;
+    USERENT e;
+    char *nname;
     
     
     if (debug)
@@ -233,48 +921,32 @@ users_login(UCRED *ucp,
     
     pthread_mutex_lock(&mtx);
 
-    /* Scan the list of users currently logged in phones for a phone match */
-    for (j = 0; j < uc; j++)
-	if (uv[j].cphone && strcmp(uv[j].cphone, ucp->phone) == 0)
-	    break;
-
-    /* Scan the list of users for a user match */
-    for (i = 0; i < uc && strcasecmp(name, uv[i].name) != 0; i++)
-	;
-    if (i >= uc)
+    /* Look up the user */
+    if (user_lookup('n', name, 0, &e) < 0)
     {
 	pthread_mutex_unlock(&mtx);
 	return -1;
     }
     
-    if (strcasecmp(pass, uv[i].pass) == 0)
+    if (e.pass && strcasecmp(pass, e.pass) == 0)
     {
-	if (j < uc)
-	{
-	    /* Clear old logged in for this phone (possibly for someone else) */
-	    if (uv[j].cphone)
-	    {
-		free(uv[j].cphone);
-		uv[j].cphone = NULL;
-	    }
-	    uv[j].expires = 0;
-	}
+	/* Clear old logged in for this phone (possibly for someone else) */
+	session_remove(session_byphone(ucp->phone));
 	
 	/* Clear old logged in phone for this user */
-	if (uv[i].cphone)
-	{
-	    free(uv[i].cphone);
-	    uv[i].cphone = NULL;
-	}
-	
-	uv[i].cphone = s_dup(ucp->phone);
-	
+	session_remove(session_byname(e.name));
+
 	if (autologout_time)
-	    uv[i].expires = now+autologout_time;
+	    expires = now+autologout_time;
 	else
-	    uv[i].expires = 0;
+	    expires = 0;
 
-	ucp->name = s_dup(name);
+	session_add(e.name, ucp->phone, expires);
+
+	nname = arena_strdup(ucp->arena, name);
+	if (ucp->name)
+	    arena_free(ucp->arena, ucp->name);
+	ucp->name = nname;
 	ucp->level = 2;
 	nm++;
     }
@@ -295,18 +967,14 @@ users_logout(UCRED *ucp)
     pthread_mutex_lock(&mtx);
 
     /* Locate the user for the current phone */
-    for (i = 0; i < uc && !(uv[i].cphone && strcmp(ucp->phone, uv[i].cphone) == 0); i++)
-	;
-    
-    if (i >= uc)
+    i = session_byphone(ucp->phone);
+    if (i < 0)
     {
 	pthread_mutex_unlock(&mtx);
 	return 0;
     }
     
-    free(uv[i].cphone);
-    uv[i].cphone = NULL;
-    uv[i].expires = 0;
+    session_remove(i);
 
     pthread_mutex_unlock(&mtx);
     return 1;
@@ -322,31 +990,46 @@ users_free_creds(UCRED *ucp)
     if (ucp)
     {
 	if (ucp->acl)
-	    free(ucp->acl);
+	    arena_free(ucp->arena, ucp->acl);
 	if (ucp->name)
-	    free(ucp->name);
+	    arena_free(ucp->arena, ucp->name);
 	if (ucp->phone)
-	    free(ucp->phone);
-	free(ucp);
+	    arena_free(ucp->arena, ucp->phone);
+	arena_free(ucp->arena, ucp);
     }
 }
 
+
 UCRED *
 users_get_creds(const char *phone)
+{
+    return users_get_creds_arena(phone, NULL);
+}
+
+
+/* Credentials allocated from 'ap', still to be users_free_creds()ed */
+UCRED *
+users_get_creds_arena(const char *phone,
+		      ARENA *ap)
 {
     UCRED *ucp;
-    int i;
+    USERENT e;
+    char pbuf[PHONE_MAX];
+    int i, found = 0;
     time_t now;
 
     
     time(&now);
 
-    ucp = malloc(sizeof(*ucp));
+    ucp = arena_alloc(ap, sizeof(*ucp));
     if (!ucp)
 	return NULL;
     
     memset(ucp, 0, sizeof(*ucp));
-    ucp->phone = s_dup(phone);
+    ucp->arena = ap;
+    if (phone_normalize(phone, pbuf, sizeof(pbuf)) >= 0)
+	phone = pbuf;
+    ucp->phone = arena_strdup(ap, phone);
     ucp->name = NULL;
     ucp->acl = NULL;
     ucp->level = 0;
@@ -354,30 +1037,28 @@ users_get_creds(const char *phone)
     pthread_mutex_lock(&mtx);
 
     /* Check list of "logged in" phone numbers */
-    for (i = 0; i < uc; i++)
-	if (uv[i].cphone && strcmp(uv[i].cphone, phone) == 0)
-	{
-	    ucp->name = s_dup(uv[i].name);
-	    ucp->acl = s_dup(uv[i].acl);
-	    ucp->level = 2;
-	    if (autologout_time)
-		uv[i].expires = now+autologout_time;
-	    break;
-	}
+    i = session_byphone(phone);
+    if (i >= 0 && user_lookup('n', sv[i].name, 1, &e) == 0)
+    {
+	found = 1;
+	ucp->level = 2;
+	if (autologout_time)
+	    sv[i].expires = now+autologout_time;
+    }
 
-    if (i >= uc)
+    /* Check list of "home" phone numbers */
+    if (!found && user_lookup('p', phone, 0, &e) == 0)
     {
-	/* Check list of "home" phone numbers */
-	for (i = 0; i < uc; i++)
-	    if (uv[i].pphone && strcmp(uv[i].pphone, phone) == 0)
-	    {
-		ucp->name = s_dup(uv[i].name);
-		ucp->acl = s_dup(uv[i].acl);
-		ucp->level = 1;
-		if (autologout_time)
-		    uv[i].expires = now+autologout_time;
-		break;
-	    }
+	found = 1;
+	ucp->level = 1;
+	if (autologout_time && (i = session_byname(e.name)) >= 0)
+	    sv[i].expires = now+autologout_time;
+    }
+
+    if (found)
+    {
+	ucp->name = arena_strdup(ap, e.name);
+	ucp->acl = arena_strdup(ap, e.acl);
     }
     
     pthread_mutex_unlock(&mtx);
@@ -399,23 +1080,38 @@ users_name2phone(const char *name)
 {
     int i;
     char *phone = NULL;
-    time_t now;
+    USERENT e;
     
 
-    time(&now);
-    
     pthread_mutex_lock(&mtx);
 
-    for (i = 0; i < uc; i++)
-	if (strcmp(uv[i].name, name) == 0)
-	{
-	    /* Temporarily "logged in" phone number? */
-	    if (uv[i].cphone)
-		phone = s_dup(uv[i].cphone);
-	    else
-		phone = s_dup(uv[i].pphone);
-	    break;
-	}
+    if (user_lookup('n', name, 1, &e) == 0)
+    {
+	/* Temporarily "logged in" phone number? */
+	if ((i = session_byname(e.name)) >= 0)
+	    phone = s_dup(sv[i].phone);
+	else
+	    phone = s_dup(e.phone);
+    }
+    
+    pthread_mutex_unlock(&mtx);
+    
+    return phone;
+}
+
+
+/* The phone of a user in the directory, even if logged in from another */
+char *
+users_name2pphone(const char *name)
+{
+    char *phone = NULL;
+    USERENT e;
+    
+
+    pthread_mutex_lock(&mtx);
+    
+    if (user_lookup('n', name, 1, &e) == 0)
+	phone = s_dup(e.phone);
     
     pthread_mutex_unlock(&mtx);
     
@@ -423,42 +1119,62 @@ users_name2phone(const char *name)
 }
 
 
+static int
+acl_match(const char *acl,
+	  const char *command)
+{
+    char *buf, *cp, *endp;
+    int rc = 0;
+
+
+    if (strcmp(acl, "*") == 0)
+	return 1;
+
+    buf = s_dup(acl);
+    cp = strtok_r(buf, "|", &endp);
+    while (cp)
+    {
+	if (strcasecmp(cp, command) == 0)
+	{
+	    rc = 1;
+	    break;
+	}
+	
+	cp = strtok_r(NULL, "|", &endp);
+    }
+    free(buf);
+
+    return rc;
+}
+
+
 /* verify user access for a command */
 int
 users_valid_command(UCRED *ucp,
 		    const char *command)
 {
-    int rc = 0;
-    time_t now;
-    char *acl = NULL;
-    char *cp;
+    int rc = 0, found;
+    USERENT e;
     
 
-    time(&now);
-    
     if (!ucp->acl)
 	goto End;
 
-    if (strcmp(ucp->acl, "*") == 0)
-	rc = 1;
-    else
+    /* Use the current ACL (precompiled bitset if available) if the user is still known */
+    pthread_mutex_lock(&mtx);
+    found = (user_lookup('n', ucp->name, 0, &e) == 0);
+    if (found)
     {
-	char *endp;
-	
-	acl = s_dup(ucp->acl);
-	cp = strtok_r(acl, "|", &endp);
-	while (cp)
-	{
-	    if (strcasecmp(cp, command) == 0)
-	    {
-		rc = 1;
-		break;
-	    }
-	    
-	    cp = strtok_r(NULL, "|", &endp);
-	}
-	free(acl);
+	if (e.idx >= 0 && ubp->dbp)
+	    rc = db_user_acl(ubp->dbp, e.idx, command);
+	else
+	    rc = e.acl && acl_match(e.acl, command);
     }
+    pthread_mutex_unlock(&mtx);
+
+    if (!found)
+	rc = acl_match(ucp->acl, command);
+    
   End:
     if (debug)
 	fprintf(stderr, "USERS_VALID_COMMAND: Command=%s -> %d\n",
@@ -468,48 +1184,55 @@ users_valid_command(UCRED *ucp,
 }
 
 
+/* Enable autologout. The caller runs users_autologout_run() periodically */
 int
 users_autologout_start(int at,
 		       void (*handler)(USER *up))
 {
+    autologout_handler = handler;
     autologout_time = at;
-    
-    pthread_create(&autologout_tid, NULL, autologout_thread, (void *) handler);
     return 0;
 }
 
 int
 users_autologout_stop(void)
 {
-    void *status;
+    autologout_time = 0;
+    return 0;
+}
 
-    /* XXX: Write this better */
 
-    if (autologout_time > 0)
-    {
-	autologout_time = 0;
-	pthread_kill(autologout_tid, SIGUSR1);
-	
-	pthread_join(autologout_tid, &status);
-    }
+struct foreach_args
+{
+    int (*fcp)(USER *up, void *xp);
+    void *xp;
+};
 
-    return 0;
+
+static int
+foreach_ent(USERENT *ep,
+	    void *xp)
+{
+    struct foreach_args *ap = (struct foreach_args *) xp;
+    USER u;
+
+
+    return (*ap->fcp)(user_get(ep, &u), ap->xp);
 }
 
 
 int
 users_foreach(int (*fcp)(USER *up, void *xp), void *xp)
 {
-    int rc = 0, i;
+    struct foreach_args a;
 
 
+    a.fcp = fcp;
+    a.xp = xp;
+    
     pthread_mutex_lock(&mtx);
-    for (i = 0; i < uc; i++)
-    {
-	rc = (*fcp)(&uv[i], xp);
-	if (rc)
-	    break;
-    }
+    if (ubp)
+	ubp->ops->foreach(ubp, foreach_ent, &a);
     pthread_mutex_unlock(&mtx);
     
     return 0;
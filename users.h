@@ -34,6 +34,8 @@
 #ifndef USERS_H
 #define USERS_H
 
+#include "db.h"
+
 typedef struct user
 {
     char *name;
@@ -54,11 +56,36 @@ typedef struct ucred
     char *name;
     char *acl;
     int level; /* 0 = unknown, 1 = known, 2 = logged in */
+    struct arena *arena; /* Where the strings are from, NULL: malloc() */
 } UCRED;
 
 
+/* User directory backends, selected by a "<type>:" prefix on the path */
+#define USERS_BACKEND_FILE	0	/* Text file or compiled image */
+#define USERS_BACKEND_CDB	1	/* CDB key-value file */
+
+/* Lookup cache for the key-value backends */
+#define USERS_CACHE_SIZE	4096
+#define USERS_CACHE_TTL		60	/* Seconds to keep found users */
+#define USERS_CACHE_NEG_TTL	10	/* Seconds to remember unknown names/phones */
+
+
+extern int
+users_backend(const char *spec,
+	      const char **pathp);
+
+extern int
+users_load(const char *spec);
+
+extern int
+users_load_db(DB *dbp);
+
+extern DB *
+users_db(void);
+
 extern int
-users_load(const char *path);
+users_make_cdb(const char *src,
+	       const char *path);
 
 
 extern int
@@ -75,6 +102,10 @@ users_free_creds(UCRED *ucp);
 extern UCRED *
 users_get_creds(const char *phone);
 
+extern UCRED *
+users_get_creds_arena(const char *phone,
+		      struct arena *ap);
+
 extern int
 users_valid_command(UCRED *ucp,
 		    const char *command);
@@ -82,10 +113,19 @@ users_valid_command(UCRED *ucp,
 extern char *
 users_name2phone(const char *name);
 
+extern char *
+users_name2pphone(const char *name);
+
+extern unsigned int
+users_generation(void);
+
 extern int
 users_autologout_start(int logout_time,
 		       void (*logout_handler)(USER *up));
 
+extern int
+users_autologout_run(void);
+
 extern int
 users_autologout_stop(void);
 
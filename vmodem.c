@@ -0,0 +1,242 @@
+/*
+ * vmodem.c - Modeled GSM modem for simulations
+ *
+ * Copyright (c) 2016-2020 Peter Eriksson <pen@lysator.liu.se>
+ *
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "vmodem.h"
+
+
+VMODEM *
+vm_create(EVLOOP *lp,
+	  int cmd_ms,
+	  int send_ms,
+	  VMINPUT input,
+	  void *xp)
+{
+    VMODEM *vp;
+
+
+    vp = calloc(1, sizeof(*vp));
+    if (!vp)
+	return NULL;
+
+    vp->lp = lp;
+    vp->cmd_ms = cmd_ms;
+    vp->send_ms = send_ms;
+    vp->input = input;
+    vp->xp = xp;
+    
+    return vp;
+}
+
+
+void
+vm_destroy(VMODEM *vp)
+{
+    VMREPLY *rp;
+
+    
+    if (!vp)
+	return;
+
+    if (vp->timer)
+	ev_del_timer(vp->lp, vp->timer);
+    while ((rp = vp->head) != NULL)
+    {
+	vp->head = rp->next;
+	free(rp->buf);
+	free(rp);
+    }
+    free(vp);
+}
+
+
+static void vm_timer(EVLOOP *lp, void *xp);
+
+static void
+vm_arm(VMODEM *vp)
+{
+    long long now = ev_now(vp->lp);
+
+    
+    if (vp->timer || !vp->head)
+	return;
+    vp->timer = ev_add_timer(vp->lp, vp->head->due > now ? (int) (vp->head->due - now) : 0,
+			     vm_timer, vp);
+}
+
+
+/* Pass on the replies that are due, in order */
+static void
+vm_timer(EVLOOP *lp,
+	 void *xp)
+{
+    VMODEM *vp = (VMODEM *) xp;
+    VMREPLY *rp;
+
+
+    vp->timer = 0;
+    while ((rp = vp->head) != NULL && rp->due <= ev_now(lp))
+    {
+	vp->head = rp->next;
+	if (!vp->head)
+	    vp->tail = NULL;
+	
+	(*vp->input)(rp->buf, rp->len, vp->xp);
+	free(rp->buf);
+	free(rp);
+    }
+    vm_arm(vp);
+}
+
+
+/* Answer after 'ms', but not before earlier answers */
+static void
+vm_reply(VMODEM *vp,
+	 int ms,
+	 const char *buf)
+{
+    VMREPLY *rp;
+
+
+    rp = malloc(sizeof(*rp));
+    if (!rp)
+	return;
+    
+    rp->len = strlen(buf);
+    rp->buf = strdup(buf);
+    if (!rp->buf)
+    {
+	free(rp);
+	return;
+    }
+    
+    rp->due = ev_now(vp->lp) + ms;
+    if (vp->tail && vp->tail->due > rp->due)
+	rp->due = vp->tail->due;
+    rp->next = NULL;
+    if (vp->tail)
+	vp->tail->next = rp;
+    else
+	vp->head = rp;
+    vp->tail = rp;
+
+    vm_arm(vp);
+}
+
+
+static void
+vm_command(VMODEM *vp,
+	   char *cmd)
+{
+    char buf[256];
+
+    
+    if (strncasecmp(cmd, "AT", 2) != 0)
+	return;
+    cmd += 2;
+    vp->commands++;
+
+    if (strncasecmp(cmd, "+CMGS=", 6) == 0)
+    {
+	vp->text = 1;
+	vm_reply(vp, vp->cmd_ms, "\r\n> ");
+	return;
+    }
+
+    buf[0] = '\0';
+    if (strstr(cmd, "+CSQ"))
+	strcat(buf, "\r\n+CSQ: 20,99\r\n");
+    else if (strncasecmp(cmd, "+CPIN?", 6) == 0)
+	strcat(buf, "\r\n+CPIN: READY\r\n");
+    else if (strncasecmp(cmd, "+CPMS?", 6) == 0)
+	strcat(buf, "\r\n+CPMS: \"SM\",0,30,\"SM\",0,30,\"SM\",0,30\r\n");
+    else if (strncasecmp(cmd, "+CSMS=", 6) == 0)
+	strcat(buf, "\r\n+CSMS: 1,1,1\r\n");
+    strcat(buf, "\r\nOK\r\n");
+    vm_reply(vp, vp->cmd_ms, buf);
+}
+
+
+/* What psmsd writes to the modem */
+void
+vm_writev(VMODEM *vp,
+	  const struct iovec *iov,
+	  int iovcnt)
+{
+    char buf[64];
+    int i, k;
+
+
+    for (k = 0; k < iovcnt; k++)
+	for (i = 0; i < (int) iov[k].iov_len; i++)
+	{
+	    char c = ((const char *) iov[k].iov_base)[i];
+
+	    switch (c)
+	    {
+	      case '\033':
+		/* Cancels a message being written */
+		vp->text = 0;
+		vp->len = 0;
+		break;
+
+	      case '\032':
+		if (vp->text)
+		{
+		    vp->text = 0;
+		    vp->sent++;
+		    snprintf(buf, sizeof(buf), "\r\n+CMGS: %u\r\n\r\nOK\r\n", ++vp->mr % 256);
+		    vm_reply(vp, vp->send_ms, buf);
+		}
+		vp->len = 0;
+		break;
+
+	      case '\r':
+		if (!vp->text)
+		{
+		    vp->line[vp->len] = '\0';
+		    vm_command(vp, vp->line);
+		    vp->len = 0;
+		    break;
+		}
+		/* Fall through */
+	      default:
+		if (vp->len < (int) sizeof(vp->line)-1)
+		    vp->line[vp->len++] = c;
+	    }
+	}
+}
@@ -0,0 +1,99 @@
+/*
+ * vmodem.h - Modeled GSM modem for simulations
+ *
+ * Copyright (c) 2016-2020 Peter Eriksson <pen@lysator.liu.se>
+ *
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef VMODEM_H
+#define VMODEM_H
+
+#include <sys/uio.h>
+
+#include "evloop.h"
+
+/*
+ * A model of a modem in the process, answering the AT commands psmsd
+ * sends on timers of the event loop: after 'cmd_ms' for commands and
+ * the "> " prompt, and after 'send_ms' for a message to be sent. With
+ * the virtual clock of the loop this runs a day of traffic in seconds.
+ * Answers are enough to bring psmsd up (+CSQ, +CPIN: READY, +CPMS with
+ * an empty storage, +CSMS) and to send messages; nothing is received.
+ */
+#define VM_CMD_MS	100	/* Default latency of commands */
+#define VM_SEND_MS	2500	/* ... and of sending a message */
+
+typedef void (*VMINPUT)(const char *buf, int len, void *xp);
+
+typedef struct vmreply
+{
+    long long due;
+    char *buf;
+    int len;
+    struct vmreply *next;
+} VMREPLY;
+
+typedef struct vmodem
+{
+    EVLOOP *lp;
+    VMINPUT input;
+    void *xp;
+    int cmd_ms;
+    int send_ms;
+
+    char line[1024];	/* Command or message text being written */
+    int len;
+    int text;		/* Writing the text of a message */
+
+    VMREPLY *head;	/* In the order they are due */
+    VMREPLY *tail;
+    int timer;
+
+    unsigned int mr;	/* Message reference */
+    unsigned long commands;
+    unsigned long sent;
+} VMODEM;
+
+
+extern VMODEM *
+vm_create(EVLOOP *lp,
+	  int cmd_ms,
+	  int send_ms,
+	  VMINPUT input,
+	  void *xp);
+
+extern void
+vm_destroy(VMODEM *vp);
+
+extern void
+vm_writev(VMODEM *vp,
+	  const struct iovec *iov,
+	  int iovcnt);
+
+#endif
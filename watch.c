@@ -0,0 +1,285 @@
+/*
+ * watch.c - Configuration file change notification
+ *
+ * Copyright (c) 2016-2020 Peter Eriksson <pen@lysator.liu.se>
+ *
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+
+#if HAVE_INOTIFY
+#include <sys/inotify.h>
+#endif
+
+#include "watch.h"
+#include "strmisc.h"
+
+extern int debug;
+
+
+#if HAVE_INOTIFY
+
+#define WATCH_MAX 8
+
+static struct
+{
+    int wd;
+    char *base;
+} wv[WATCH_MAX];
+
+static int wc = 0;
+static int watch_fd = -1;
+static int stop_pipe[2] = { -1, -1 };
+static int debounce_time = 0;
+static pthread_t watch_tid;
+static void (*watch_handler)(int changed, void *misc) = NULL;
+static void *watch_misc = NULL;
+
+
+/* Returns a bitmask of the watched paths an event buffer refers to */
+static int
+watch_events(const char *buf,
+	     ssize_t len)
+{
+    const struct inotify_event *ep;
+    int i, changed = 0;
+
+
+    while (len >= (ssize_t) sizeof(*ep))
+    {
+	ep = (const struct inotify_event *) buf;
+
+	for (i = 0; i < wc; i++)
+	    if (ep->wd == wv[i].wd && ep->len > 0 && strcmp(ep->name, wv[i].base) == 0)
+		changed |= (1 << i);
+
+	buf += sizeof(*ep) + ep->len;
+	len -= sizeof(*ep) + ep->len;
+    }
+
+    return changed;
+}
+
+
+static void *
+watch_thread(void *misc)
+{
+    struct pollfd pfd[2];
+    char buf[4096];
+    ssize_t len;
+    int rc, pending = 0;
+
+
+    if (debug)
+	fprintf(stderr, "WATCH_THREAD: Starting\n");
+
+    pfd[0].fd = watch_fd;
+    pfd[0].events = POLLIN;
+    pfd[1].fd = stop_pipe[0];
+    pfd[1].events = POLLIN;
+
+    for (;;)
+    {
+	/* Wait until a burst of changes has quiesced before acting on it */
+	rc = poll(pfd, 2, pending ? debounce_time : -1);
+	if (rc < 0)
+	{
+	    if (errno == EINTR)
+		continue;
+	    break;
+	}
+
+	if (pfd[1].revents)
+	    break;
+
+	if (rc == 0)
+	{
+	    if (debug)
+		fprintf(stderr, "WATCH_THREAD: Changed: 0x%x\n", pending);
+
+	    watch_handler(pending, watch_misc);
+	    pending = 0;
+	    continue;
+	}
+
+	while ((len = read(watch_fd, buf, sizeof(buf))) < 0 && errno == EINTR)
+	    ;
+	if (len <= 0)
+	    break;
+
+	pending |= watch_events(buf, len);
+    }
+
+    if (debug)
+	fprintf(stderr, "WATCH_THREAD: Stopping\n");
+
+    return NULL;
+}
+
+
+/*
+ * Watch a set of files for changes. The handler is called with a
+ * bitmask of the paths that changed once no further changes have
+ * been seen for 'debounce' milliseconds. The containing directories
+ * are watched so files replaced by rename are noticed too.
+ */
+int
+watch_start(char **paths,
+	    int npaths,
+	    int debounce,
+	    void (*handler)(int changed, void *misc),
+	    void *misc)
+{
+    char *dir, *cp;
+    int i;
+
+
+    if (watch_fd >= 0 || npaths > WATCH_MAX)
+    {
+	errno = EINVAL;
+	return -1;
+    }
+
+    watch_fd = inotify_init();
+    if (watch_fd < 0)
+	return -1;
+
+    if (pipe(stop_pipe) < 0)
+	goto Fail;
+
+    for (wc = 0; wc < npaths; wc++)
+    {
+	dir = s_dup(paths[wc]);
+	if (!dir)
+	    goto Fail;
+
+	cp = strrchr(dir, '/');
+	if (cp)
+	{
+	    wv[wc].base = s_dup(cp+1);
+	    if (cp == dir)
+		++cp;
+	    *cp = '\0';
+	}
+	else
+	{
+	    wv[wc].base = s_dup(dir);
+	    strcpy(dir, ".");
+	}
+
+	wv[wc].wd = inotify_add_watch(watch_fd, dir,
+				      IN_CLOSE_WRITE|IN_MOVED_TO|IN_CREATE|IN_DELETE);
+	free(dir);
+
+	if (wv[wc].wd < 0)
+	{
+	    free(wv[wc].base);
+	    goto Fail;
+	}
+
+	if (debug)
+	    fprintf(stderr, "WATCH_START: Watching %s\n", paths[wc]);
+    }
+
+    debounce_time = debounce;
+    watch_handler = handler;
+    watch_misc = misc;
+
+    if (pthread_create(&watch_tid, NULL, watch_thread, NULL) != 0)
+	goto Fail;
+
+    return 0;
+
+  Fail:
+    for (i = 0; i < wc; i++)
+	free(wv[i].base);
+    wc = 0;
+    close(watch_fd);
+    watch_fd = -1;
+    if (stop_pipe[0] >= 0)
+    {
+	close(stop_pipe[0]);
+	close(stop_pipe[1]);
+	stop_pipe[0] = stop_pipe[1] = -1;
+    }
+    return -1;
+}
+
+
+void
+watch_stop(void)
+{
+    void *status;
+    int i;
+
+
+    if (watch_fd < 0)
+	return;
+
+    while (write(stop_pipe[1], "", 1) < 0 && errno == EINTR)
+	;
+    pthread_join(watch_tid, &status);
+
+    for (i = 0; i < wc; i++)
+	free(wv[i].base);
+    wc = 0;
+
+    close(watch_fd);
+    close(stop_pipe[0]);
+    close(stop_pipe[1]);
+    watch_fd = stop_pipe[0] = stop_pipe[1] = -1;
+}
+
+#else
+
+int
+watch_start(char **paths,
+	    int npaths,
+	    int debounce,
+	    void (*handler)(int changed, void *misc),
+	    void *misc)
+{
+    errno = ENOSYS;
+    return -1;
+}
+
+
+void
+watch_stop(void)
+{
+}
+
+#endif